@@ -0,0 +1,294 @@
+/*
+ * File:   Benchmark.h
+ * Author: Daniel Princ
+ *
+ * Timing harness for the benchmark suite: warmup, repetitions,
+ * latency percentiles, text and JSON output.
+ *
+ */
+
+#ifndef BENCHMARK_H
+#define	BENCHMARK_H
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <ctime>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Settings shared by all benchmarks of one run
+ */
+struct BenchConfig {
+    /** seed of the data and query generators */
+    unsigned seed;
+    /** untimed passes before the measurement */
+    int warmup;
+    /** timed passes */
+    int repetitions;
+
+    BenchConfig() : seed(1), warmup(1), repetitions(5) {}
+};
+
+/**
+ * Result of one benchmark, latencies are in nanoseconds per operation
+ */
+struct BenchResult {
+    /** operation, e.g. "nn" */
+    string name;
+    /** data distribution */
+    string distribution;
+    int dim;
+    size_t size;
+    /** operation parameter (k, radius), 0 if there is none */
+    double param;
+    /** number of timed operations over all repetitions */
+    size_t count;
+    double min;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+    /** operations per second */
+    double throughput;
+    /** memory of the tree and the points per point, 0 if it isn't measured */
+    double bytesPerPoint;
+};
+
+/**
+ * Runs and collects the benchmarks.
+ *
+ * measureOps times every operation on its own, so the percentiles are
+ * per query latencies (including about 20ns of clock overhead).
+ * measureRuns times whole runs (construction, loading), one sample
+ * per repetition.
+ */
+class Benchmark {
+
+    typedef chrono::steady_clock clock;
+
+    struct NoPrepare {
+	void operator()() const {}
+    };
+
+    BenchConfig config;
+    vector<BenchResult> results;
+    /** results of the operations go here, so they can't be optimized out */
+    volatile size_t sink;
+
+    static double ns(clock::time_point start, clock::time_point end) {
+	return chrono::duration<double, nano>(end - start).count();
+    }
+
+    /**
+     * Nearest rank percentile
+     * @param sorted sorted samples
+     * @param q percentile in <0, 1>
+     */
+    static double percentile(const vector<double> &sorted, double q) {
+	size_t i = (size_t) (q * sorted.size());
+	return sorted[min(i, sorted.size() - 1)];
+    }
+
+    BenchResult &add(const string &name, const string &distribution, int dim, size_t size,
+	    double param, vector<double> &samples, double opsPerSample) {
+	BenchResult r;
+	r.name = name;
+	r.distribution = distribution;
+	r.dim = dim;
+	r.size = size;
+	r.param = param;
+	r.count = samples.size();
+	r.min = r.mean = r.p50 = r.p90 = r.p99 = r.max = r.throughput = r.bytesPerPoint = 0;
+	if(!samples.empty()) {
+	    sort(samples.begin(), samples.end());
+	    double sum = 0;
+	    for(vector<double>::iterator it = samples.begin(); it != samples.end(); ++it) {
+		sum += *it;
+	    }
+	    r.min = samples.front();
+	    r.max = samples.back();
+	    r.mean = sum / samples.size();
+	    r.p50 = percentile(samples, 0.5);
+	    r.p90 = percentile(samples, 0.9);
+	    r.p99 = percentile(samples, 0.99);
+	    if(r.mean > 0)
+		r.throughput = opsPerSample * 1e9 / r.mean;
+	}
+	results.push_back(r);
+	return results.back();
+    }
+
+    /**
+     * Writes the string as a JSON string, quoted and escaped
+     */
+    static void writeString(ostream &out, const string &s) {
+	out << '"';
+	for(string::const_iterator it = s.begin(); it != s.end(); ++it) {
+	    const unsigned char c = *it;
+	    if(c == '"' || c == '\\') out << '\\' << c;
+	    else if(c == '\n') out << "\\n";
+	    else if(c == '\t') out << "\\t";
+	    else if(c == '\r') out << "\\r";
+	    else if(c < 0x20) {
+		const char *hex = "0123456789abcdef";
+		out << "\\u00" << hex[c >> 4] << hex[c & 15];
+	    }
+	    else out << c;
+	}
+	out << '"';
+    }
+
+    static void printTime(ostream &out, double ns) {
+	if(ns < 1e4) out << setw(9) << ns << "ns ";
+	else if(ns < 1e7) out << setw(9) << ns / 1e3 << "us ";
+	else out << setw(9) << ns / 1e6 << "ms ";
+    }
+
+public:
+
+    Benchmark(const BenchConfig &config) : config(config), sink(0) {
+    }
+
+    const BenchConfig &getConfig() const {
+	return config;
+    }
+
+    const vector<BenchResult> &getResults() const {
+	return results;
+    }
+
+    /**
+     * Times count operations one by one, warmup + repetitions passes
+     * @param prepare untimed, called before every pass (e.g. empties the tree)
+     * @param op called with the operation index 0..count-1, returns anything
+     *	      derived from the result (e.g. address of the found point)
+     * @return the stored result
+     */
+    template<typename Prepare, typename Op>
+    BenchResult &measureOps(const string &name, const string &distribution, int dim, size_t size,
+	    double param, size_t count, Prepare prepare, Op op) {
+	size_t s = 0;
+	for(int w = 0; w < config.warmup; w++) {
+	    prepare();
+	    for(size_t i = 0; i < count; i++) {
+		s += op(i);
+	    }
+	}
+	vector<double> samples;
+	samples.reserve(count * config.repetitions);
+	for(int r = 0; r < config.repetitions; r++) {
+	    prepare();
+	    for(size_t i = 0; i < count; i++) {
+		clock::time_point start = clock::now();
+		s += op(i);
+		samples.push_back(ns(start, clock::now()));
+	    }
+	}
+	sink += s;
+	return add(name, distribution, dim, size, param, samples, 1);
+    }
+
+    /**
+     * Times count operations one by one, without preparation between passes
+     */
+    template<typename Op>
+    BenchResult &measureOps(const string &name, const string &distribution, int dim, size_t size,
+	    double param, size_t count, Op op) {
+	return measureOps(name, distribution, dim, size, param, count, NoPrepare(), op);
+    }
+
+    /**
+     * Times whole runs, warmup + repetitions times
+     * @param prepare untimed, called before every run (e.g. frees the previous tree)
+     * @param run the timed run, returns anything derived from the result
+     * @param ops number of operations in one run, for the throughput
+     * @return the stored result
+     */
+    template<typename Prepare, typename Run>
+    BenchResult &measureRuns(const string &name, const string &distribution, int dim, size_t size,
+	    double param, size_t ops, Prepare prepare, Run run) {
+	size_t s = 0;
+	vector<double> samples;
+	for(int r = 0; r < config.warmup + config.repetitions; r++) {
+	    prepare();
+	    clock::time_point start = clock::now();
+	    s += run();
+	    double time = ns(start, clock::now());
+	    if(r >= config.warmup)
+		samples.push_back(time);
+	}
+	sink += s;
+	return add(name, distribution, dim, size, param, samples, ops);
+    }
+
+    /**
+     * Prints one result as a table row
+     */
+    static void printRow(ostream &out, const BenchResult &r) {
+	ios::fmtflags flags = out.flags();
+	streamsize precision = out.precision();
+	out << fixed << setprecision(1);
+	out << left << setw(18) << r.name << setw(12) << r.distribution << right
+		<< setw(4) << r.dim << setw(10) << r.size << " ";
+	printTime(out, r.p50);
+	printTime(out, r.p90);
+	printTime(out, r.p99);
+	out << setw(14) << setprecision(0) << r.throughput << "/s";
+	if(r.bytesPerPoint > 0)
+	    out << setw(12) << setprecision(1) << r.bytesPerPoint;
+	out << "\n";
+	out.flags(flags);
+	out.precision(precision);
+    }
+
+    /**
+     * Prints the header of the table
+     */
+    static void printHeader(ostream &out) {
+	out << left << setw(18) << "op" << setw(12) << "data" << right << setw(4) << "D"
+		<< setw(10) << "size" << setw(13) << "p50" << setw(13) << "p90"
+		<< setw(13) << "p99" << setw(16) << "throughput" << setw(12) << "bytes/point" << "\n";
+    }
+
+    /**
+     * Writes the configuration and all results as JSON
+     */
+    void writeJson(ostream &out) const {
+	streamsize precision = out.precision();
+	out << setprecision(10);
+	out << "{\n";
+	out << "  \"suite\": \"kdtree\",\n";
+	out << "  \"timestamp\": " << (long) time(0) << ",\n";
+	out << "  \"machine\": {\"compiler\": ";
+	writeString(out, __VERSION__);
+	out << ", \"threads\": " << thread::hardware_concurrency() << "},\n";
+	out << "  \"config\": {\"seed\": " << config.seed << ", \"warmup\": " << config.warmup
+		<< ", \"repetitions\": " << config.repetitions << "},\n";
+	out << "  \"results\": [";
+	for(size_t i = 0; i < results.size(); i++) {
+	    const BenchResult &r = results[i];
+	    out << (i ? ",\n" : "\n");
+	    out << "    {\"op\": ";
+	    writeString(out, r.name);
+	    out << ", \"distribution\": ";
+	    writeString(out, r.distribution);
+	    out << ", \"dim\": " << r.dim << ", \"size\": " << r.size
+		    << ", \"param\": " << r.param << ", \"count\": " << r.count
+		    << ", \"unit\": \"ns\", \"min\": " << r.min << ", \"mean\": " << r.mean
+		    << ", \"p50\": " << r.p50 << ", \"p90\": " << r.p90 << ", \"p99\": " << r.p99
+		    << ", \"max\": " << r.max << ", \"throughput\": " << r.throughput
+		    << ", \"bytes_per_point\": " << r.bytesPerPoint << "}";
+	}
+	out << "\n  ]\n}\n";
+	out.precision(precision);
+    }
+};
+
+#endif	/* BENCHMARK_H */
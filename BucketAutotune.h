@@ -0,0 +1,201 @@
+/*
+ * File:   BucketAutotune.h
+ * Author: Daniel Princ
+ *
+ * Chooses the bucket size of the KDTree for given data.
+ *
+ */
+
+#ifndef BUCKETAUTOTUNE_H
+#define	BUCKETAUTOTUNE_H
+
+#include <vector>
+#include <random>
+#include <iostream>
+#include <algorithm>
+#include "KDTree.h"
+#include "Benchmark.h"
+
+using namespace std;
+
+/**
+ * Times of one bucket size, medians of the repetitions in milliseconds
+ */
+struct BucketTiming {
+    int bucketSize;
+    double build;
+    double nn;
+    double knn;
+    double radius;
+};
+
+/**
+ * Builds trees with several bucket sizes on a sample of the data
+ * and measures construction, NN, kNN and radius queries. Every 
+ * measurement is a whole run (the construction, all queries of a type)
+ * repeated as in the benchmark suite, after untimed warmup runs.
+ *
+ * The bucket size is a template parameter of the KDTree, so the
+ * candidates are template arguments of run(), e.g.
+ * BucketAutotune<3>::run<4, 8, 16, 32>(&data).
+ */
+template<const int D = 3, typename P = Point<D> >
+class BucketAutotune {
+
+    typedef typename DistanceType<typename P::value_type>::type dist_t;
+
+    /**
+     * Median of the runs in milliseconds
+     */
+    static double median(const BenchResult &r) {
+	return r.p50 / 1e6;
+    }
+
+    /**
+     * Measures one bucket size
+     */
+    template<const int B>
+    static BucketTiming measure(Benchmark &bench, vector< P > * sample, const vector<int> &queries, int k, dist_t radius) {
+	BucketTiming t;
+	t.bucketSize = B;
+	KDTree<D, P, false, false, B> tree;
+	auto none = []() {};
+
+	t.build = median(bench.measureRuns("build", "sample", D, sample->size(), B, sample->size(), none, 
+	    [&]() -> size_t {
+		tree.construct(sample);
+		return tree.size();
+	    }));
+
+	t.nn = median(bench.measureRuns("nn", "sample", D, sample->size(), B, queries.size(), none, 
+	    [&]() -> size_t {
+		size_t s = 0;
+		for(vector<int>::const_iterator it = queries.begin(); it != queries.end(); ++it) {
+		    s += (size_t) tree.nearestNeighbor(&(*sample)[*it]);
+		}
+		return s;
+	    }));
+
+	t.knn = median(bench.measureRuns("knn", "sample", D, sample->size(), B, queries.size(), none, 
+	    [&]() -> size_t {
+		size_t s = 0;
+		for(vector<int>::const_iterator it = queries.begin(); it != queries.end(); ++it) {
+		    s += tree.kNearestNeighbors(&(*sample)[*it], k).size();
+		}
+		return s;
+	    }));
+
+	t.radius = median(bench.measureRuns("radius", "sample", D, sample->size(), B, queries.size(), none, 
+	    [&]() -> size_t {
+		size_t s = 0;
+		for(vector<int>::const_iterator it = queries.begin(); it != queries.end(); ++it) {
+		    s += tree.circularQuery(&(*sample)[*it], radius).size();
+		}
+		return s;
+	    }));
+	return t;
+    }
+
+    /**
+     * Radius with roughly k points inside, estimated from the kNN of a few queries
+     */
+    static dist_t estimateRadius(vector< P > * sample, const vector<int> &queries, int k) {
+	KDTree<D, P> tree;
+	tree.construct(sample);
+	dist_t sum = 0;
+	int count = min((int) queries.size(), 100);
+	for(int i = 0; i < count; i++) {
+	    const P * q = &(*sample)[queries[i]];
+	    vector<P *> knn = tree.kNearestNeighbors(q, k);
+	    if(knn.empty()) continue;
+	    dist_t dist = 0;
+	    for(int d = 0; d < D; d++) {
+		dist_t tmp = (dist_t) (*knn.back())[d] - (*q)[d];
+		dist += tmp*tmp;
+	    }
+	    sum += sqrt(dist);
+	}
+	return count > 0 ? sum / count : 0;
+    }
+
+public:
+
+    /**
+     * Measures all candidate bucket sizes
+     * @param data the user's data, only a sample is used
+     * @param sampleSize number of points in the sample
+     * @param queryCount number of queries of each type
+     * @param k k for kNN queries
+     * @param radius radius of circular queries, if <= 0 it's chosen so
+     *	      there are about k points inside
+     * @param config seed of the sampling, warmup runs and repetitions
+     * @return times for every candidate
+     */
+    template<const int... Bs>
+    static vector<BucketTiming> run(vector< P > * data, int sampleSize = 100000,
+	    int queryCount = 10000, int k = 10, dist_t radius = 0, const BenchConfig &config = BenchConfig()) {
+	static_assert(sizeof...(Bs) > 0, "no bucket size to measure");
+	mt19937 engine(config.seed);
+	vector< P > sample;
+	if((int) data->size() <= sampleSize) {
+	    sample = *data;
+	}
+	else {
+	    uniform_int_distribution<size_t> pick(0, data->size() - 1);
+	    sample.reserve(sampleSize);
+	    for(int i = 0; i < sampleSize; i++) {
+		sample.push_back((*data)[pick(engine)]);
+	    }
+	}
+
+	vector<BucketTiming> result;
+	if(sample.empty())
+	    return result;
+
+	vector<int> queries;
+	uniform_int_distribution<int> pick(0, sample.size() - 1);
+	for(int i = 0; i < queryCount; i++) {
+	    queries.push_back(pick(engine));
+	}
+	if(radius <= 0)
+	    radius = estimateRadius(&sample, queries, k);
+
+	//measure<B> for every candidate, in order
+	Benchmark bench(config);
+	int expand[] = {(result.push_back(measure<Bs>(bench, &sample, queries, k, radius)), 0)...};
+	(void) expand;
+	return result;
+    }
+
+    /**
+     * Measures the default set of bucket sizes: 4, 6, 8, 10, 12, 16, 24, 32, 48, 64
+     */
+    static vector<BucketTiming> run(vector< P > * data, int sampleSize = 100000,
+	    int queryCount = 10000, int k = 10, dist_t radius = 0, const BenchConfig &config = BenchConfig()) {
+	return run<4, 6, 8, 10, 12, 16, 24, 32, 48, 64>(data, sampleSize, queryCount, k, radius, config);
+    }
+
+    /**
+     * Prints the table of times and the fastest bucket size for every query type
+     * @param out output stream
+     * @param timings result of run
+     */
+    static void report(ostream &out, const vector<BucketTiming> &timings) {
+	if(timings.empty())
+	    return;
+	out << "bucket\tbuild\tNN\tkNN\tradius [ms]\n";
+	const BucketTiming *best[4] = {&timings[0], &timings[0], &timings[0], &timings[0]};
+	for(vector<BucketTiming>::const_iterator it = timings.begin(); it != timings.end(); ++it) {
+	    out << it->bucketSize << "\t" << it->build << "\t" << it->nn << "\t"
+		    << it->knn << "\t" << it->radius << "\n";
+	    if(it->build < best[0]->build) best[0] = &(*it);
+	    if(it->nn < best[1]->nn) best[1] = &(*it);
+	    if(it->knn < best[2]->knn) best[2] = &(*it);
+	    if(it->radius < best[3]->radius) best[3] = &(*it);
+	}
+	out << "fastest: build " << best[0]->bucketSize << ", NN " << best[1]->bucketSize
+		<< ", kNN " << best[2]->bucketSize << ", radius " << best[3]->bucketSize << "\n";
+    }
+};
+
+#endif	/* BUCKETAUTOTUNE_H */
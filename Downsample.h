@@ -0,0 +1,415 @@
+/*
+ * File:   Downsample.h
+ * Author: Daniel Princ
+ *
+ * Reduction of dense point clouds before indexing: voxel grid,
+ * Poisson-disk sampling and merging of points within a radius, all on
+ * the leaf partition of a built tree.
+ *
+ */
+
+#ifndef DOWNSAMPLE_H
+#define	DOWNSAMPLE_H
+
+#include <stdint.h>
+#include <vector>
+#include <stack>
+#include <thread>
+#include <atomic>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <math.h>
+#include "Point.h"
+#include "KDTreeNodes.h"
+#include "Metric.h"
+
+using namespace std;
+
+/**
+ * Reduced point sets of all points of a tree, the colors of the points
+ * a result point stands for are averaged (if P is a Point, Coords have none).
+ *
+ *	voxelGrid	one point per occupied cube of the grid, the average
+ *			of the points inside
+ *	radiusMerge	the points within the radius of a seed merged into
+ *			their average
+ *	poissonDisk	seeds no closer than the radius to each other, every
+ *			point at most twice the radius from its seed
+ *
+ * The leaves are taken in depth first order in chunks of neighboring
+ * leaves, the chunks run in parallel and the tree is only read. The
+ * points of a leaf are close, so a leaf often lies in one voxel and is
+ * summed without a key per point; the seeds of a chunk only search the
+ * leaves of the chunk whose bounding box is in the radius.
+ *
+ * radiusMerge and poissonDisk are greedy: the first point not merged yet
+ * is a seed, it takes all other points of its chunk in the radius. The
+ * seeds of neighboring chunks can be closer than the radius, they are
+ * merged in a second, serial pass over the seeds (with a tree of them),
+ * so a merged point stands for points at most twice the radius apart.
+ * The chunks don't depend on the number of threads, the results do not
+ * either. Distances are the ones of the metric of the tree, the voxels
+ * are cubes in the coordinates.
+ *
+ * Usage:
+ *	vector< Point<3> > reduced = Downsample< KDTree<3> >::voxelGrid(tree, 0.01);
+ *	KDTree<3> smaller;
+ *	smaller.construct(&reduced);
+ */
+template<typename Tree>
+class Downsample {
+    typedef typename Tree::point P;
+    typedef typename Tree::scalar scalar;
+    typedef typename Tree::dist_t dist_t;
+    typedef typename Tree::node_t node_t;
+    typedef typename Tree::inner_t inner_t;
+    typedef typename Tree::leaf_t leaf_t;
+    typedef typename Tree::metric_t metric_t;
+    static const int D = Tree::dimensions;
+    /** leaves of one parallel task */
+    static const size_t chunk = 64;
+
+    template<typename Q>
+    static void addColor(double *, const Q &) {}
+
+    template<const int E, typename T>
+    static void addColor(double *sum, const Point<E, T> &p) {
+	for(int c = 0; c < 3; c++) sum[c] += p.color[c];
+    }
+
+    template<typename Q>
+    static void setColor(Q &, const double *, uint32_t) {}
+
+    template<const int E, typename T>
+    static void setColor(Point<E, T> &p, const double *sum, uint32_t count) {
+	for(int c = 0; c < 3; c++) p.color[c] = (int) floor(sum[c] / count + 0.5);
+    }
+
+    /**
+     * Sums of the points one result point stands for
+     */
+    struct Sum {
+	double coords[D];
+	double color[3];
+	uint32_t count;
+	/** the first point, the seed of radiusMerge and poissonDisk */
+	const P *seed;
+
+	void reset(const P *seed) {
+	    fill(coords, coords + D, 0.0);
+	    fill(color, color + 3, 0.0);
+	    count = 0;
+	    this->seed = seed;
+	}
+
+	void add(const P &p) {
+	    for(int d = 0; d < D; d++) coords[d] += p[d];
+	    addColor(color, p);
+	    count++;
+	}
+
+	void add(const Sum &other) {
+	    for(int d = 0; d < D; d++) coords[d] += other.coords[d];
+	    for(int c = 0; c < 3; c++) color[c] += other.color[c];
+	    count += other.count;
+	}
+
+	/** the seed with the average color */
+	P sample() const {
+	    P p = *seed;
+	    setColor(p, color, count);
+	    return p;
+	}
+
+	/** the average of the points and of their colors */
+	P average() const {
+	    P p = sample();
+	    for(int d = 0; d < D; d++) p[d] = (scalar) (coords[d] / count);
+	    return p;
+	}
+    };
+
+    /**
+     * Cube of the grid, coordinates in voxels from the corner of the bounding box
+     */
+    struct Voxel {
+	int64_t cell[D];
+
+	bool operator<(const Voxel &other) const {
+	    return lexicographical_compare(cell, cell + D, other.cell, other.cell + D);
+	}
+
+	bool operator==(const Voxel &other) const {
+	    return equal(cell, cell + D, other.cell);
+	}
+    };
+
+    typedef pair<Voxel, Sum> voxel_t;
+
+    static vector<const leaf_t *> leaves(const Tree &tree) {
+	vector<const leaf_t *> result;
+	stack<const node_t *> stack;
+	stack.push(tree.getRoot());
+	while(!stack.empty()) {
+	    const node_t *node = stack.top();
+	    stack.pop();
+	    if(node->isLeaf()) {
+		result.push_back((const leaf_t *) node);
+		continue;
+	    }
+	    const inner_t *inner = (const inner_t *) node;
+	    if(inner->right) stack.push(inner->right);
+	    if(inner->left) stack.push(inner->left);
+	}
+	return result;
+    }
+
+    /**
+     * Runs task(from, to, result) for the chunks of the leaves in parallel
+     * @return results of the chunks in the order of the leaves
+     */
+    template<typename Result, typename Task>
+    static vector<Result> chunks(const vector<const leaf_t *> &all, unsigned threads, Task task) {
+	vector<Result> results((all.size() + chunk - 1) / chunk);
+	if(threads == 0)
+	    threads = max(1u, thread::hardware_concurrency());
+	threads = (unsigned) min((size_t) threads, results.size());
+	atomic<size_t> next(0);
+	auto work = [&]() {
+	    for(size_t c = next++; c < results.size(); c = next++) {
+		task(c * chunk, min(all.size(), (c + 1) * chunk), results[c]);
+	    }
+	};
+	vector<thread> workers;
+	for(unsigned t = 1; t < threads; t++) workers.push_back(thread(work));
+	work();
+	for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+	return results;
+    }
+
+    static Voxel voxel(const P &p, const scalar *box, double size) {
+	Voxel v;
+	for(int d = 0; d < D; d++) v.cell[d] = (int64_t) floor(((double) p[d] - box[2*d]) / size);
+	return v;
+    }
+
+    /**
+     * Voxels of the points of the leaves <from, to), sorted
+     */
+    static void voxelChunk(const Tree &tree, const vector<const leaf_t *> &all, double size,
+	    size_t from, size_t to, vector<voxel_t> &result) {
+	const scalar *box = tree.getBoundingBox();
+	/** voxel of a point of a leaf, or of the whole leaf (all) */
+	struct Keyed {
+	    Voxel voxel;
+	    const leaf_t *leaf;
+	    uint32_t i;
+	};
+	const uint32_t all_points = numeric_limits<uint32_t>::max();
+	vector<Keyed> keyed;
+	for(size_t l = from; l < to; l++) {
+	    const leaf_t *leaf = all[l];
+	    if(leaf->bucket.empty())
+		continue;
+	    P low, high;
+	    for(int d = 0; d < D; d++) {
+		low[d] = leaf->min[d];
+		high[d] = leaf->max[d];
+	    }
+	    const Keyed whole = {voxel(low, box, size), leaf, all_points};
+	    if(whole.voxel == voxel(high, box, size)) { //the whole leaf in one voxel
+		keyed.push_back(whole);
+		continue;
+	    }
+	    for(uint32_t i = 0; i < leaf->bucket.size(); i++) {
+		const Keyed point = {voxel(*tree.getPoint(leaf->bucket[i]), box, size), leaf, i};
+		keyed.push_back(point);
+	    }
+	}
+	sort(keyed.begin(), keyed.end(), [](const Keyed &a, const Keyed &b) -> bool { return a.voxel < b.voxel; });
+	for(size_t k = 0; k < keyed.size(); k++) {
+	    const leaf_t *leaf = keyed[k].leaf;
+	    const uint32_t first = keyed[k].i == all_points ? 0 : keyed[k].i;
+	    const uint32_t last = keyed[k].i == all_points ? (uint32_t) leaf->bucket.size() : first + 1;
+	    if(k == 0 || !(keyed[k].voxel == keyed[k - 1].voxel)) {
+		Sum s;
+		s.reset(tree.getPoint(leaf->bucket[first]));
+		result.push_back(voxel_t(keyed[k].voxel, s));
+	    }
+	    for(uint32_t i = first; i < last; i++) result.back().second.add(*tree.getPoint(leaf->bucket[i]));
+	}
+    }
+
+    /**
+     * Greedy merge of the points of the leaves <from, to) within the radius
+     * of a seed, only the leaves of the chunk are searched
+     * @param r the radius in the form of the metric (see Euclidean::reduce)
+     */
+    static void mergeChunk(const Tree &tree, const vector<const leaf_t *> &all, dist_t r,
+	    size_t from, size_t to, vector<Sum> &result) {
+	const metric_t &metric = tree.getMetric();
+	vector<const P *> points;
+	/** first point of every leaf of the chunk, and the end */
+	vector<size_t> starts;
+	for(size_t l = from; l < to; l++) {
+	    starts.push_back(points.size());
+	    for(size_t i = 0; i < all[l]->bucket.size(); i++) points.push_back(tree.getPoint(all[l]->bucket[i]));
+	}
+	starts.push_back(points.size());
+	vector<char> merged(points.size(), 0);
+	for(size_t i = 0; i < points.size(); i++) {
+	    if(merged[i])
+		continue;
+	    const P &seed = *points[i];
+	    Sum s;
+	    s.reset(&seed);
+	    s.add(seed);
+	    merged[i] = 1;
+	    for(size_t l = from; l < to; l++) {
+		const leaf_t *leaf = all[l];
+		if(metricBoxDistance<dist_t, D>(metric, seed, leaf->min, leaf->max) >= r)
+		    continue;
+		for(size_t j = starts[l - from]; j < starts[l - from + 1]; j++) {
+		    if(!merged[j] && metricDistance<dist_t, D>(metric, seed, *points[j]) < r) {
+			merged[j] = 1;
+			s.add(*points[j]);
+		    }
+		}
+	    }
+	    result.push_back(s);
+	}
+    }
+
+    /**
+     * Seeds of all chunks, the ones closer than the radius to an earlier
+     * seed merged into it (serial, seeds of one chunk are never that close)
+     */
+    static vector<Sum> merge(const Tree &tree, dist_t radius, unsigned threads) {
+	vector<const leaf_t *> all = leaves(tree);
+	const dist_t r = tree.getMetric().reduce(radius);
+	vector< vector<Sum> > parts = chunks< vector<Sum> >(all, threads,
+	    [&](size_t from, size_t to, vector<Sum> &result) { mergeChunk(tree, all, r, from, to, result); });
+	vector<Sum> sums;
+	for(size_t c = 0; c < parts.size(); c++) sums.insert(sums.end(), parts[c].begin(), parts[c].end());
+
+	vector<P> seeds;
+	seeds.reserve(sums.size());
+	for(size_t i = 0; i < sums.size(); i++) seeds.push_back(*sums[i].seed);
+	Tree seedTree;
+	seedTree.setMetric(tree.getMetric());
+	seedTree.construct(&seeds);
+	vector<char> merged(sums.size(), 0);
+	vector<Sum> result;
+	for(size_t i = 0; i < sums.size(); i++) {
+	    if(merged[i])
+		continue;
+	    Sum s = sums[i];
+	    vector<typename Tree::ref> inside = seedTree.circularQuery(&seeds[i], radius);
+	    for(size_t j = 0; j < inside.size(); j++) {
+		size_t other = seedTree.getPoint(inside[j]) - &seeds[0];
+		if(other > i && !merged[other]) {
+		    merged[other] = 1;
+		    s.add(sums[other]);
+		}
+	    }
+	    result.push_back(s);
+	}
+	return result;
+    }
+
+public:
+
+    /**
+     * One point per occupied cube of the grid: the average of the points
+     * inside and of their colors. The grid starts at the corner of the
+     * bounding box of the tree.
+     * @param tree built tree, it's only read
+     * @param size edge of the cubes
+     * @param threads number of threads, 0 = all cores
+     * @return the averages, sorted by the voxel
+     */
+    static vector<P> voxelGrid(const Tree &tree, double size, unsigned threads = 0) {
+	vector<P> result;
+	if(tree.size() == 0 || size <= 0)
+	    return result;
+	vector<const leaf_t *> all = leaves(tree);
+	vector< vector<voxel_t> > parts = chunks< vector<voxel_t> >(all, threads,
+	    [&](size_t from, size_t to, vector<voxel_t> &result) { voxelChunk(tree, all, size, from, to, result); });
+
+	//voxels on the border of chunks are in more of them, summed in the order of the chunks
+	//the sorted voxels of the chunks merged, a heap of the next voxel of every chunk
+	typedef pair<size_t, size_t> position; //chunk, voxel
+	auto after = [&parts](const position &a, const position &b) -> bool {
+	    const Voxel &va = parts[a.first][a.second].first, &vb = parts[b.first][b.second].first;
+	    return vb < va || (va == vb && b.first < a.first);
+	};
+	vector<position> heap;
+	for(size_t c = 0; c < parts.size(); c++) {
+	    if(!parts[c].empty()) heap.push_back(position(c, 0));
+	}
+	make_heap(heap.begin(), heap.end(), after);
+	const Voxel *current = NULL;
+	Sum s;
+	while(!heap.empty()) {
+	    pop_heap(heap.begin(), heap.end(), after);
+	    const position p = heap.back();
+	    const voxel_t &v = parts[p.first][p.second];
+	    if(current && *current == v.first) {
+		s.add(v.second);
+	    }
+	    else {
+		if(current) result.push_back(s.average());
+		current = &v.first;
+		s = v.second;
+	    }
+	    if(p.second + 1 < parts[p.first].size()) {
+		heap.back().second++;
+		push_heap(heap.begin(), heap.end(), after);
+	    }
+	    else {
+		heap.pop_back();
+	    }
+	}
+	if(current) result.push_back(s.average());
+	return result;
+    }
+
+    /**
+     * Greedy clustering: a seed and the points within the radius of it
+     * are merged into their average, with the average color
+     * @param tree built tree, it's only read
+     * @param radius radius of the clusters (see Downsample)
+     * @param threads number of threads, 0 = all cores
+     */
+    static vector<P> radiusMerge(const Tree &tree, dist_t radius, unsigned threads = 0) {
+	vector<P> result;
+	if(tree.size() == 0)
+	    return result;
+	vector<Sum> sums = merge(tree, radius, threads);
+	result.reserve(sums.size());
+	for(size_t i = 0; i < sums.size(); i++) result.push_back(sums[i].average());
+	return result;
+    }
+
+    /**
+     * Poisson-disk sample of the points: no two samples are closer than
+     * the radius, every point is at most twice the radius from a sample.
+     * The samples are points of the tree with the average color of the
+     * points they stand for.
+     * @param tree built tree, it's only read
+     * @param radius smallest distance of the samples
+     * @param threads number of threads, 0 = all cores
+     */
+    static vector<P> poissonDisk(const Tree &tree, dist_t radius, unsigned threads = 0) {
+	vector<P> result;
+	if(tree.size() == 0)
+	    return result;
+	vector<Sum> sums = merge(tree, radius, threads);
+	result.reserve(sums.size());
+	for(size_t i = 0; i < sums.size(); i++) result.push_back(sums[i].sample());
+	return result;
+    }
+};
+
+#endif	/* DOWNSAMPLE_H */
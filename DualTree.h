@@ -0,0 +1,532 @@
+/*
+ * File:   DualTree.h
+ * Author: Daniel Princ
+ *
+ * Dual-tree joins of two kd-trees: nearest neighbor, k nearest neighbors
+ * and all pairs within a radius, for every point of a query tree in a
+ * reference tree (scan to map matching, ICP correspondences, change
+ * detection).
+ *
+ */
+
+#ifndef DUALTREE_H
+#define	DUALTREE_H
+
+#include <stdint.h>
+#include <vector>
+#include <stack>
+#include <thread>
+#include <atomic>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include "KDTreeNodes.h"
+#include "Metric.h"
+
+using namespace std;
+
+/**
+ * Joins of all points of the query tree with the reference tree.
+ *
+ * The query tree is walked leaf by leaf in depth first order, every leaf
+ * is joined with the reference tree at once: a pair of the leaf and
+ * a reference node is skipped when the distance of their bounding boxes
+ * is not below the bound of the leaf, the largest kNN distance found so
+ * far of its points (or the radius). The points of a leaf start with the
+ * neighbors of the previous leaf as candidates, so the bound is mostly
+ * tight before the traversal starts. The boxes of the reference nodes
+ * are the tight boxes of their points, not the cells of the splits.
+ *
+ * A full recursion over pairs of query and reference subtrees was
+ * slower on 3D scans: with small buckets the bound of an inner query
+ * node (the worst of its points) prunes little.
+ *
+ * The trees may differ in the types of the points, buckets or indexing,
+ * they only have to have the same number of dimensions. The distances
+ * are the ones of the metric of the reference tree. The results use
+ * indices into the arrays the trees are built on, in the compressed
+ * sparse row format (see Result). Unlike the queries of one tree, points
+ * at zero distance are included, they are the best matches of two
+ * different point sets; use KNNGraph for a self join.
+ *
+ * Runs of neighboring query leaves are joined in parallel, the trees are
+ * only read. The kNN of the points of a leaf are kept by the thread and
+ * written to the result once, when the leaf is done: the query points
+ * are accessed in the order of the tree, not in the order of the array.
+ *
+ * Usage:
+ *	DualTree< KDTree<3> >::Result nn = DualTree< KDTree<3> >::nearest(scan, &scanPoints[0], map, &mapPoints[0]);
+ *	uint32_t match = nn.degree(i) ? nn.neighbors[nn.offsets[i]] : none;
+ */
+template<typename QueryTree, typename RefTree = QueryTree>
+class DualTree {
+public:
+    typedef typename QueryTree::dist_t dist_t;
+
+    /**
+     * Neighbors of every query point: reference points
+     * neighbors[offsets[i]] .. neighbors[offsets[i + 1] - 1], sorted by
+     * the distance, distances holds their distances (squared for Euclidean)
+     */
+    struct Result {
+	vector<uint32_t> offsets;
+	vector<uint32_t> neighbors;
+	vector<dist_t> distances;
+
+	/** number of query points */
+	size_t size() const {
+	    return offsets.empty() ? 0 : offsets.size() - 1;
+	}
+
+	/** number of neighbors of the query point */
+	uint32_t degree(size_t i) const {
+	    return offsets[i + 1] - offsets[i];
+	}
+    };
+
+private:
+    typedef typename QueryTree::point QP;
+    typedef typename RefTree::point RP;
+    typedef typename QueryTree::leaf_t qleaf_t;
+    typedef typename RefTree::leaf_t rleaf_t;
+    typedef typename RefTree::metric_t metric_t;
+    typedef pair<dist_t, uint32_t> neighbor;
+    static const int D = QueryTree::dimensions;
+
+    /**
+     * Nodes of a tree with the bounding boxes of their points, in preorder
+     */
+    template<typename Tree>
+    struct Flat {
+	typedef typename Tree::scalar scalar;
+	typedef typename Tree::node_t node_t;
+	typedef typename Tree::inner_t inner_t;
+	typedef typename Tree::leaf_t leaf_t;
+
+	struct Item {
+	    scalar min[D];
+	    scalar max[D];
+	    /** -1 if there is no child */
+	    int child[2];
+	    /** NULL for inner nodes */
+	    const leaf_t *leaf;
+	};
+	vector<Item> nodes;
+
+	Flat(const Tree &tree) {
+	    stack< pair<const node_t *, int> > stack; //node, index of the parent
+	    stack.push(make_pair((const node_t *) tree.getRoot(), -1));
+	    while(!stack.empty()) {
+		pair<const node_t *, int> top = stack.top();
+		stack.pop();
+		Item item;
+		item.child[0] = item.child[1] = -1;
+		item.leaf = top.first->isLeaf() ? (const leaf_t *) top.first : NULL;
+		int index = (int) nodes.size();
+		if(top.second >= 0) {
+		    Item &parent = nodes[top.second];
+		    parent.child[parent.child[0] < 0 ? 0 : 1] = index;
+		}
+		nodes.push_back(item);
+		if(item.leaf) continue;
+		const inner_t *inner = (const inner_t *) top.first;
+		if(inner->right) stack.push(make_pair((const node_t *) inner->right, index));
+		if(inner->left) stack.push(make_pair((const node_t *) inner->left, index));
+	    }
+	    //boxes from the leaves up, children follow their parent
+	    for(size_t i = nodes.size(); i-- > 0;) {
+		Item &item = nodes[i];
+		if(item.leaf) {
+		    copy(item.leaf->min, item.leaf->min + D, item.min);
+		    copy(item.leaf->max, item.leaf->max + D, item.max);
+		}
+		else {
+		    for(int d = 0; d < D; d++) {
+			item.min[d] = numeric_limits<scalar>::max();
+			item.max[d] = numeric_limits<scalar>::lowest();
+		    }
+		    for(int c = 0; c < 2 && item.child[c] >= 0; c++) {
+			const Item &child = nodes[item.child[c]];
+			for(int d = 0; d < D; d++) {
+			    item.min[d] = std::min(item.min[d], child.min[d]);
+			    item.max[d] = std::max(item.max[d], child.max[d]);
+			}
+		    }
+		}
+	    }
+	}
+    };
+    typedef Flat<QueryTree> qflat_t;
+    typedef Flat<RefTree> rflat_t;
+
+    /** reference node to join with the query leaf */
+    struct Pair {
+	int r;
+	/** squared distance of the boxes */
+	dist_t dist;
+    };
+
+    template<typename A, typename B>
+    static dist_t boxDistance(const metric_t &metric, const A &a, const B &b) {
+	return metricBoxDistance<dist_t, D>(metric, a.min, a.max, b.min, b.max);
+    }
+
+    template<typename B>
+    static dist_t pointDistance(const metric_t &metric, const QP &p, const B &b) {
+	return metricBoxDistance<dist_t, D>(metric, p, b.min, b.max);
+    }
+
+    static dist_t distance(const metric_t &metric, const QP &a, const RP &b) {
+	return metricDistance<dist_t, D>(metric, a, b);
+    }
+
+    /**
+     * Everything the joins share
+     */
+    struct Join {
+	const QueryTree &queryTree;
+	const QP *queryPoints;
+	const RefTree &refTree;
+	const RP *refPoints;
+	const metric_t &metric;
+	qflat_t query;
+	rflat_t reference;
+	/** number of query points (the largest index + 1) */
+	size_t count;
+
+	Join(const QueryTree &queryTree, const QP *queryPoints, const RefTree &refTree, const RP *refPoints)
+		: queryTree(queryTree), queryPoints(queryPoints), refTree(refTree), refPoints(refPoints),
+		metric(refTree.getMetric()), query(queryTree), reference(refTree), count(0) {
+	    for(size_t i = 0; i < query.nodes.size(); i++) {
+		const qleaf_t *leaf = query.nodes[i].leaf;
+		for(size_t j = 0; leaf && j < leaf->bucket.size(); j++) {
+		    count = max(count, (size_t) (queryTree.getPoint(leaf->bucket[j]) - queryPoints) + 1);
+		}
+	    }
+	}
+
+	uint32_t queryIndex(const qleaf_t *leaf, size_t j) const {
+	    return (uint32_t) (queryTree.getPoint(leaf->bucket[j]) - queryPoints);
+	}
+
+	const RP &refPoint(const rleaf_t *leaf, size_t j) const {
+	    return *refTree.getPoint(leaf->bucket[j]);
+	}
+
+	uint32_t refIndex(const rleaf_t *leaf, size_t j) const {
+	    return (uint32_t) (refTree.getPoint(leaf->bucket[j]) - refPoints);
+	}
+    };
+
+    /**
+     * kNN of the query points. Every thread has its own, the points of
+     * the current leaf have their max-heaps of k slots here and go to the
+     * shared result (at the indices of the points) when the leaf is done.
+     */
+    struct KNearest {
+	const Join &join;
+	int k;
+	/** k slots of every query point, the result */
+	neighbor *slots;
+	int *degrees;
+	
+	/** points of the current leaf */
+	vector<const QP *> points;
+	vector<uint32_t> indices;
+	vector<neighbor> heaps;
+	vector<int> sizes;
+	/** kNN distance of every point of the leaf, max() until it has k neighbors */
+	vector<dist_t> bounds;
+	/** the largest of the bounds */
+	dist_t leafBound;
+	/** neighbors of the previous leaf */
+	vector<uint32_t> candidates;
+
+	KNearest(const Join &join, int k, neighbor *slots, int *degrees)
+		: join(join), k(k), slots(slots), degrees(degrees) {}
+
+	/**
+	 * Adds a neighbor closer than the bound of the i-th point, unless it is already there
+	 */
+	void push(size_t i, dist_t dist, uint32_t index) {
+	    neighbor *heap = &heaps[i * k];
+	    int &size = sizes[i];
+	    for(int j = 0; j < size; j++) {
+		if(heap[j].second == index) return;
+	    }
+	    if(size == k)
+		pop_heap(heap, heap + size--);
+	    heap[size++] = neighbor(dist, index);
+	    push_heap(heap, heap + size);
+	    if(size == k)
+		bounds[i] = heap[0].first;
+	}
+
+	void updateBound() {
+	    leafBound = 0;
+	    for(size_t i = 0; i < bounds.size(); i++) leafBound = max(leafBound, bounds[i]);
+	}
+
+	/**
+	 * Seeds the points of the leaf with the neighbors of the previous one
+	 */
+	void begin(const qleaf_t *leaf) {
+	    const size_t m = leaf->bucket.size();
+	    points.resize(m);
+	    indices.resize(m);
+	    heaps.resize(m * k);
+	    sizes.assign(m, 0);
+	    bounds.assign(m, numeric_limits<dist_t>::max());
+	    for(size_t i = 0; i < m; i++) {
+		points[i] = join.queryTree.getPoint(leaf->bucket[i]);
+		indices[i] = join.queryIndex(leaf, i);
+		for(size_t c = 0; c < candidates.size(); c++) {
+		    dist_t dist = distance(join.metric, *points[i], join.refPoints[candidates[c]]);
+		    if(dist < bounds[i])
+			push(i, dist, candidates[c]);
+		}
+	    }
+	    updateBound();
+	}
+
+	dist_t bound() const {
+	    return leafBound;
+	}
+
+	void base(const qleaf_t *, const rleaf_t *reference) {
+	    for(size_t i = 0; i < points.size(); i++) {
+		const QP &query = *points[i];
+		if(pointDistance(join.metric, query, *reference) >= bounds[i])
+		    continue;
+		for(size_t j = 0; j < reference->bucket.size(); j++) {
+		    dist_t dist = distance(join.metric, query, join.refPoint(reference, j));
+		    if(dist < bounds[i])
+			push(i, dist, join.refIndex(reference, j));
+		}
+	    }
+	    updateBound();
+	}
+
+	void end(const qleaf_t *) {
+	    candidates.clear();
+	    for(size_t i = 0; i < points.size(); i++) {
+		neighbor *heap = &heaps[i * k];
+		sort_heap(heap, heap + sizes[i]);
+		copy(heap, heap + sizes[i], slots + (size_t) indices[i] * k);
+		degrees[indices[i]] = sizes[i];
+		for(int j = 0; j < sizes[i]; j++) candidates.push_back(heap[j].second);
+	    }
+	    sort(candidates.begin(), candidates.end());
+	    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+	}
+    };
+
+    /**
+     * Pairs within the radius, collected by every thread
+     */
+    struct Radius {
+	const Join &join;
+	dist_t r;
+	/** query point, squared distance, reference point */
+	vector< pair<uint32_t, neighbor> > pairs;
+
+	Radius(const Join &join, dist_t r) : join(join), r(r) {}
+
+	/** points of the current leaf */
+	vector<const QP *> points;
+	vector<uint32_t> indices;
+
+	void begin(const qleaf_t *leaf) {
+	    points.resize(leaf->bucket.size());
+	    indices.resize(leaf->bucket.size());
+	    for(size_t i = 0; i < points.size(); i++) {
+		points[i] = join.queryTree.getPoint(leaf->bucket[i]);
+		indices[i] = join.queryIndex(leaf, i);
+	    }
+	}
+
+	dist_t bound() const {
+	    return r;
+	}
+
+	void base(const qleaf_t *, const rleaf_t *reference) {
+	    for(size_t i = 0; i < points.size(); i++) {
+		const QP &query = *points[i];
+		if(pointDistance(join.metric, query, *reference) >= r)
+		    continue;
+		for(size_t j = 0; j < reference->bucket.size(); j++) {
+		    dist_t dist = distance(join.metric, query, join.refPoint(reference, j));
+		    if(dist < r)
+			pairs.push_back(make_pair(indices[i], neighbor(dist, join.refIndex(reference, j))));
+		}
+	    }
+	}
+
+	void end(const qleaf_t *) {}
+    };
+
+    /**
+     * Joins one query leaf with the reference tree. Reference nodes
+     * farther from the leaf than mode.bound() are skipped, the nearer
+     * child goes first, pairs of leaves are passed to mode.base.
+     */
+    template<typename Mode>
+    static void traverse(const Join &join, int leaf, Mode &mode, vector<Pair> &stack) {
+	const typename qflat_t::Item &q = join.query.nodes[leaf];
+	const vector<typename rflat_t::Item> &rn = join.reference.nodes;
+	mode.begin(q.leaf);
+	stack.clear();
+	Pair first = {0, boxDistance(join.metric, q, rn[0])};
+	stack.push_back(first);
+	while(!stack.empty()) {
+	    const Pair p = stack.back();
+	    stack.pop_back();
+	    if(p.dist >= mode.bound())
+		continue;
+	    const typename rflat_t::Item &r = rn[p.r];
+	    if(r.leaf) {
+		mode.base(q.leaf, r.leaf);
+		continue;
+	    }
+	    Pair c[2];
+	    int n = 0;
+	    for(int i = 0; i < 2 && r.child[i] >= 0; i++, n++) {
+		c[n].r = r.child[i];
+		c[n].dist = boxDistance(join.metric, q, rn[r.child[i]]);
+	    }
+	    if(n == 2 && c[0].dist < c[1].dist) swap(c[0], c[1]);
+	    for(int i = 0; i < n; i++) {
+		if(c[i].dist < mode.bound()) stack.push_back(c[i]);
+	    }
+	}
+	mode.end(q.leaf);
+    }
+
+    static unsigned threadCount(unsigned threads) {
+	return threads == 0 ? max(1u, thread::hardware_concurrency()) : threads;
+    }
+
+    /**
+     * Joins the query leaves in depth first order, on one thread per mode.
+     * The threads take runs of neighboring leaves, so the seeds stay close.
+     */
+    template<typename Mode>
+    static void run(const Join &join, const vector<Mode *> &modes) {
+	vector<int> leaves;
+	for(size_t i = 0; i < join.query.nodes.size(); i++) {
+	    if(join.query.nodes[i].leaf) leaves.push_back((int) i);
+	}
+	const size_t chunk = 256;
+	atomic<size_t> next(0);
+	auto work = [&](Mode *mode) {
+	    vector<Pair> stack;
+	    for(size_t from = chunk * next++; from < leaves.size(); from = chunk * next++) {
+		for(size_t i = from; i < min(leaves.size(), from + chunk); i++) {
+		    traverse(join, leaves[i], *mode, stack);
+		}
+	    }
+	};
+	vector<thread> workers;
+	for(size_t t = 1; t < modes.size(); t++) workers.push_back(thread(work, modes[t]));
+	work(modes[0]);
+	for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+    }
+
+    static bool empty(const QueryTree &queries, const RefTree &reference) {
+	return queries.size() == 0 || reference.size() == 0;
+    }
+
+public:
+
+    /**
+     * k nearest reference points of every query point
+     * @param queries tree of the query points
+     * @param queryPoints the array the query tree refers to
+     * @param reference tree of the reference points
+     * @param refPoints the array the reference tree refers to
+     * @param k number of neighbors
+     * @param threads number of threads, 0 = all cores
+     */
+    static Result kNearest(const QueryTree &queries, const QP *queryPoints, const RefTree &reference,
+	    const RP *refPoints, int k, unsigned threads = 0) {
+	Result result;
+	if(empty(queries, reference) || k <= 0) {
+	    result.offsets.assign(1, 0);
+	    return result;
+	}
+	Join join(queries, queryPoints, reference, refPoints);
+	vector<neighbor> slots(join.count * k);
+	vector<int> degrees(join.count, 0);
+	vector<KNearest> nearest(threadCount(threads), KNearest(join, k, &slots[0], &degrees[0]));
+	vector<KNearest *> modes;
+	for(size_t t = 0; t < nearest.size(); t++) modes.push_back(&nearest[t]);
+	run(join, modes);
+
+	result.offsets.assign(join.count + 1, 0);
+	for(size_t i = 0; i < join.count; i++) {
+	    result.offsets[i + 1] = result.offsets[i] + degrees[i];
+	}
+	result.neighbors.resize(result.offsets[join.count]);
+	result.distances.resize(result.offsets[join.count]);
+	for(size_t i = 0; i < join.count; i++) {
+	    for(int j = 0; j < degrees[i]; j++) {
+		result.neighbors[result.offsets[i] + j] = slots[i * k + j].second;
+		result.distances[result.offsets[i] + j] = slots[i * k + j].first;
+	    }
+	}
+	return result;
+    }
+
+    /**
+     * Nearest reference point of every query point, see kNearest
+     */
+    static Result nearest(const QueryTree &queries, const QP *queryPoints, const RefTree &reference,
+	    const RP *refPoints, unsigned threads = 0) {
+	return kNearest(queries, queryPoints, reference, refPoints, 1, threads);
+    }
+
+    /**
+     * All pairs of query and reference points closer than the radius
+     * @param radius the distance of the pairs is < radius
+     * @see kNearest
+     */
+    static Result radius(const QueryTree &queries, const QP *queryPoints, const RefTree &reference,
+	    const RP *refPoints, dist_t radius, unsigned threads = 0) {
+	Result result;
+	if(empty(queries, reference)) {
+	    result.offsets.assign(1, 0);
+	    return result;
+	}
+	Join join(queries, queryPoints, reference, refPoints);
+	const dist_t r = join.metric.reduce(radius);
+	vector<Radius> pairs(threadCount(threads), Radius(join, r));
+	vector<Radius *> modes;
+	for(size_t t = 0; t < pairs.size(); t++) modes.push_back(&pairs[t]);
+	run(join, modes);
+
+	result.offsets.assign(join.count + 1, 0);
+	for(size_t t = 0; t < modes.size(); t++) {
+	    for(size_t i = 0; i < modes[t]->pairs.size(); i++) result.offsets[modes[t]->pairs[i].first + 1]++;
+	}
+	for(size_t i = 0; i < join.count; i++) result.offsets[i + 1] += result.offsets[i];
+	vector<uint32_t> fill(result.offsets.begin(), result.offsets.end() - 1);
+	vector<neighbor> sorted(result.offsets[join.count]);
+	for(size_t t = 0; t < modes.size(); t++) {
+	    for(size_t i = 0; i < modes[t]->pairs.size(); i++) {
+		sorted[fill[modes[t]->pairs[i].first]++] = modes[t]->pairs[i].second;
+	    }
+	}
+	result.neighbors.resize(sorted.size());
+	result.distances.resize(sorted.size());
+	for(size_t i = 0; i < join.count; i++) {
+	    sort(sorted.begin() + result.offsets[i], sorted.begin() + result.offsets[i + 1]);
+	    for(uint32_t j = result.offsets[i]; j < result.offsets[i + 1]; j++) {
+		result.neighbors[j] = sorted[j].second;
+		result.distances[j] = sorted[j].first;
+	    }
+	}
+	return result;
+    }
+};
+
+#endif	/* DUALTREE_H */
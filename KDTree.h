@@ -14,71 +14,150 @@
 #include <stack>
 #include <queue>
 #include <limits>
+#include <algorithm>
+#include <new>
 #include <math.h>
 
 using namespace std;
 #include "Point.h"
 #include "KDTreeNodes.h"
+#include "QueryStats.h"
+#include "NodeArena.h"
 #include "PlyHandler.h"
+#include "Metric.h"
 
 /**
  * kd-tree!
+ * 
+ * P is the type of indexed points, anything with operator[] returning 
+ * the coordinates: Point<D> (with color) or the compact Coords<D>.
+ * The type of the coordinates (P::value_type) is used for the splits and 
+ * bounds as well, so the tree works with float, double or integer 
+ * (quantized) coordinates.
+ * 
+ * By default the tree stores pointers to the points. With Indexed = true
+ * it stores 32-bit indices into a caller-owned array of points instead,
+ * and all the queries return indices. The array can then be relocated
+ * (see rebase), mmapped or shared across processes.
+ * 
+ * With Quantized = true the leaves also keep 8-bit coordinates relative 
+ * to the leaf bounds (D bytes per point), the bucket scans read them first 
+ * and skip the points that can't be closer than the current result without 
+ * touching them.
+ * 
+ * B is the maximal number of points in a bucket, see BucketAutotune 
+ * for choosing it for given data. Only a bucket of the same points 
+ * can't be split and grows beyond B.
+ * 
+ * Metric is the distance of all queries (see Metric.h): Euclidean, 
+ * Manhattan, Chebyshev or Weighted<D>, set the weights by setMetric. 
+ * The distances of the queries are in the form of the metric (squared 
+ * for Euclidean), the radii are true distances.
+ * 
+ * The nodes come from an arena owned by the tree (NodeArena), the whole 
+ * tree is freed at once and a new construction reuses the memory.
+ * For large static trees call layout() after the construction, it moves 
+ * all nodes into one huge page aligned block in van Emde Boas order, so 
+ * the descent to a bucket misses the cache and TLB less often.
  */
-template<const int D = 3>
+template<const int D = 3, typename P = Point<D>, bool Indexed = false, bool Quantized = false, const int B = 10,
+	typename Metric = Euclidean>
 class KDTree {
-        
-    typedef vector< Point<D> *> points;
-    typedef typename vector< Point<D> *>::iterator points_it;
-    typedef pair<Inner *, Visited> exInner; //DEPRECATED, only in simple method
+public:
+    /** type of the points */
+    typedef P point;
+    /** reference to a point: P* or uint32_t index */
+    typedef typename PointRef<P, Indexed>::type ref;
+    /** type of the coordinates */
+    typedef typename P::value_type scalar;
+    /** type of the (squared) distances */
+    typedef typename DistanceType<scalar>::type dist_t;
+    /** distance of the queries */
+    typedef Metric metric_t;
+    
+    /** number of dimensions */
+    static const int dimensions = D;
+    /** true if the tree stores indices instead of pointers */
+    static const bool indexed = Indexed;
+    
+    typedef Node<scalar> node_t;
+    typedef Inner<scalar> inner_t;
+    typedef Leaf<D, P, Indexed, Quantized> leaf_t;
+    /** scratch memory of the root-down queries */
+    typedef DescentStack<D, scalar> descent_t;
+    /** state of a stream of nearby NN queries */
+    typedef QueryCursor<D, scalar, ref> cursor_t;
+    
+private:
+    typedef vector< ref > points;
+    typedef typename vector< ref >::iterator points_it;
+    typedef pair<inner_t *, Visited> exInner; //DEPRECATED, only in simple method
     
     /** Size of the bucket*/
-    const static int bucketSize = 10;
+    const static int bucketSize = B;
     
     /** root of the tree */
-    Inner * root;
+    inner_t * root;
+    
+    /** array of points the indices refer to, only for Indexed trees */
+    P * base;
     
     /** number of points inside the tree */
     int sizep;
     
     /** bounding box of the tree, format: xmin, xmax, ymin, ymax, ...*/
-    float boundingBox[2*D];
+    scalar boundingBox[2*D];
     
-    /** number of visited nodes during NN searches*/
+    /** number of points tested during the last query */
     int visitedNodes;  
     
+    /** memory of all nodes */
+    NodeArena nodes;
+    /** current order of the nodes */
+    NodeLayout nodeLayout;
+    /** changes with the nodes or the references to the points, see cursor_t */
+    uint64_t revision;
+    /** distance of the queries */
+    Metric metric;
+    
+#ifdef KDTREE_STATS
+    /** traversal statistics of all queries */
+    QueryStats stats;
+#endif
+    
     /**
      * Find in which bucket does given point belong
      * @param point point in question
      * @return bucket in which the point belongs
      */
-    Leaf<D> * findBucket(const Point<D> *point) const {
-	Inner* node = root;
+    leaf_t * findBucket(const P *point) const {
+	inner_t* node = root;
 	while(true) {
 	    if((*point)[node->dimension] <= node->split) {
 		if(!node->left) {
 		    if(node->right->isLeaf())
-			return (Leaf<D> *) node->right;
+			return (leaf_t *) node->right;
 		    else {
-			node = (Inner *) node->right;
+			node = (inner_t *) node->right;
 			continue;
 		    }
 		}
 		if(node->left->isLeaf())
-		    return (Leaf<D> *) node->left;
-		node = (Inner *) node->left;
+		    return (leaf_t *) node->left;
+		node = (inner_t *) node->left;
 	    }
 	    else {
 		if(!node->right) {
 		    if(node->left->isLeaf())
-			return (Leaf<D> *) node->left;
+			return (leaf_t *) node->left;
 		    else {
-			node = (Inner *) node->left;
+			node = (inner_t *) node->left;
 			continue;
 		    }
 		}
 		if(node->right->isLeaf())
-		    return (Leaf<D> *) node->right;
-		node = (Inner *) node->right;
+		    return (leaf_t *) node->right;
+		node = (inner_t *) node->right;
 	    }
 	}
     }
@@ -90,14 +169,10 @@ class KDTree {
      * @param sqrtb if false, the returned distance is squared
      * @return distance between points
      */
-    inline const float distance(const Point<D> * p1, const Point<D> * p2, bool sqrtb = false) {
-	float dist = 0;
-	for(int d = 0; d < D; d++) {
-	    float tmp = fabs((*p1)[d] - (*p2)[d]);
-	    dist += tmp*tmp;
-	}
+    inline const dist_t distance(const P * p1, const P * p2, bool sqrtb = false) {
+	dist_t dist = metricDistance<dist_t, D>(metric, *p1, *p2);
 	if(sqrtb)
-	    return sqrt(dist);
+	    return metric.root(dist);
 	else
 	    return dist;
     }
@@ -109,330 +184,155 @@ class KDTree {
      * @param max max coords of a hyper reectangle
      * @return squared distance
      */
-    inline const float minBoundsDistance(const Point<D> * point, const float * min, const float * max) {
-	float dist = 0;
-	for(int d = 0; d < D; d++) {
-	    if ((*point)[d] < min[d]) {
-		const float tmp = min[d] - (*point)[d];
-		dist += tmp*tmp;
-	    } 
-	    else if ((*point)[d] > max[d]) {
-		const float tmp = max[d] - (*point)[d];
-		dist += tmp*tmp;
-	    }
-	}
-	return dist;
+    inline const dist_t minBoundsDistance(const P * point, const scalar * min, const scalar * max) {
+	return metricBoxDistance<dist_t, D>(metric, *point, min, max);
     }
     
     
-public:
-
-    /**
-     * Creates empty kd-tree
-     */
-    KDTree() {
-	root = new Inner(NULL);
-	sizep = 0;
-    }
-    
     /**
-     * Destructor
+     * Tests i-th point of the bucket for NN, 
+     * points the exclusion E skips are skipped
+     * @param query query point
+     * @param leaf leaf to search
+     * @param i index in the bucket
+     * @param dist squared distance of the current NN, updated
+     * @param result current NN, updated
      */
-    ~KDTree() {
-	delete root;
+    template<Exclusion E>
+    inline void testPoint(const P * query, const leaf_t * leaf, const size_t i, dist_t &dist, Nearest<ref, E> &result) {
+	visitedNodes++;
+	KDTREE_STAT(stats.point());
+	if(Quantized && leaf->template lowerBound<P, dist_t>(i, query, leaf->min, leaf->max, metric) >= dist)
+	    return; //can't be nearer, the point is not even loaded
+	dist_t tmp = distance(query, getPoint(leaf->bucket[i]));
+	if(tmp < dist && result.accepts(leaf->bucket[i], tmp)) { //ie not the excluded point
+	    dist = tmp;
+	    result.nearest = leaf->bucket[i];
+	}
     }
     
-    
     /**
-     * Returns the root of the tree
-     * @return pointer to the root node
+     * Adds i-th point of the bucket to data if it's closer than r
+     * @param query query point
+     * @param leaf leaf to search
+     * @param i index in the bucket
+     * @param r squared radius
+     * @param data result
      */
-    const Inner *getRoot() const {
-	return root;
+    inline void testPoint(const P * query, const leaf_t * leaf, const size_t i, const dist_t r, vector< ref > &data) {
+	visitedNodes++;
+	KDTREE_STAT(stats.point());
+	if(Quantized && leaf->template lowerBound<P, dist_t>(i, query, leaf->min, leaf->max, metric) >= r)
+	    return;
+	if(distance(query, getPoint(leaf->bucket[i])) < r) {
+	    data.push_back(leaf->bucket[i]);
+	}
     }
     
     /**
-     * Returns the number of visited nodes during last search
-     * @return number of visited nodes
+     * Counts the point for kNN if it's closer than r, see Candidates
      */
-    const int getVisitedNodes() const {
-	return visitedNodes;
+    inline void testPoint(const P * query, const leaf_t * leaf, const size_t i, const dist_t r, Candidates< ref > &data) {
+	const size_t before = data.refs.size();
+	testPoint(query, leaf, i, r, data.refs);
+	data.count += data.refs.size() - before;
     }
     
     /**
-     * Bounding box of the tree
-     * @return array of size 2D, format: xmin, xmax, ymin, ymax, ...
+     * Tests the points of a bucket above its first B. They are all the same
+     * point (see insert), so only until none of them can be the NN.
      */
-    const float *getBoundingBox() const {
-	return &boundingBox[0];
+    template<Exclusion E>
+    inline void scanSame(const P * query, const leaf_t * leaf, dist_t &dist, Nearest<ref, E> &result) {
+	const dist_t same = distance(query, getPoint(leaf->bucket[0]));
+	for(size_t i = B; i < leaf->bucket.size() && same < dist && (E != EXCLUDE_ZERO || same > 0); i++) {
+	    testPoint(query, leaf, i, dist, result);
+	}
     }
     
     /**
-     * Returns number of points in the tree
-     * @return number of points in the tree
+     * The points above the first B are inside if the first one is, see scanSame
      */
-    const int size() const {
-	return sizep;
+    inline void scanSame(const P * query, const leaf_t * leaf, const dist_t r, vector< ref > &data) {
+	if(distance(query, getPoint(leaf->bucket[0])) < r)
+	    data.insert(data.end(), leaf->bucket.begin() + B, leaf->bucket.end());
     }
     
     /**
-     *  Builds the KD-Tree on a given set of unordered points
-     * 
-     * @param[in] data vector of unordered points
-     * @param[in] bounds array with bounds of the coordinates \
-     *		  expects array like this - 2D: [xmin, xmax, ymin, ymax]
+     * The points above the first B inside are counted, a few of them kept
      */
-    void construct(vector< Point<D> > * data, float * bounds = NULL) {
-	vector< Point<D>* > pointers;
-	for(typename vector< Point<D> >::iterator it = data->begin(); it != data->end(); ++it) {
-	    pointers.push_back(&(*it));
-	}
-	construct(&pointers, bounds);
+    inline void scanSame(const P * query, const leaf_t * leaf, const dist_t r, Candidates< ref > &data) {
+	if(distance(query, getPoint(leaf->bucket[0])) >= r)
+	    return;
+	const size_t above = leaf->bucket.size() - B;
+	data.count += above;
+	data.refs.insert(data.refs.end(), leaf->bucket.begin() + B, leaf->bucket.begin() + B + min(above, data.limit));
     }
     
     /**
-     *  Builds the KD-Tree on a given set of points with unknown bounds
+     * Tests all points of the bucket, see testPoint
      * 
-     * @param[in] data vector of pointers to unordered points
-     * @param[in] bounds array with bounds of the coordinates \
-     *		  expects array like this - 2D: [xmin, xmax, ymin, ymax]
+     * Buckets have at most B points (except leaves with duplicate points), 
+     * the first loop has constant trip count, so it can be unrolled 
+     * for every bucket size. The points of a bigger bucket are all 
+     * the same (see insert), the rest of them is decided at once (see scanSame).
      */
-    void construct(points * adata, float * abounds = NULL) {
-	if(!abounds) { //calculate the bounds if not specified
-	    for(int d = 0; d < D; d++) {
-		boundingBox[2*d] = numeric_limits<float>::max();
-		boundingBox[2*d + 1] = numeric_limits<float>::min();
-	    }
-	    for(points_it it = adata->begin(); it != adata->end(); ++it) {
-		Point<D> *p = *it;
-		for(int d = 0; d < D; d++) {
-		    if((*p)[d] < boundingBox[2*d]) boundingBox[2*d] = (*p)[d];
-		    if((*p)[d] > boundingBox[2*d + 1]) boundingBox[2*d + 1] = (*p)[d];
-		}
-	    }
-	}
-	else {
-	    copy(abounds, abounds + 2*D, boundingBox);
-	}
-	sizep = adata->size();
-	if(root != NULL) {
-	    delete root;
-	    root = new Inner(NULL);
-	}
-
-	//construct the tree
-	stack<Constr<D>> stack;
-	stack.push(Constr<D>(*adata, boundingBox, root));
-
-	while(!stack.empty()) {
-
-	    Constr<D> curr = stack.top();
-	    stack.pop();
-	    points * data = &curr.data;
-	    float* bounds = &curr.bounds[0];
-	    Inner *parent = curr.parent;
-
-	    int dim = -1; //dimension to split
-	    float size = 0;
-	    for(int i = 0; i < D; i++) {
-		if(bounds[2*i + 1] - bounds[2*i] > size) {
-		    size = bounds[2*i + 1] - bounds[2*i];
-		    dim = i;
-		}
-	    }
-	    float split = bounds[2*dim] + size / 2.0f; //split value
-
-	    points left, right;
-	    float lmax = -1000000, rmin = 1000000; //TODO
-
-	    for(points_it it = data->begin(); it != data->end(); ++it) {
-		Point<D> *p = (*it);
-		if((*p)[dim] <= split) { //NOTE: points exactly on split line belong to left node!
-		    left.push_back(*it);
-		    float tmp = (*p)[dim];
-		    if(tmp > lmax)
-			lmax = tmp;
-		}
-		if((*p)[dim] > split) {
-		    right.push_back(*it);
-		    float tmp = (*p)[dim];
-		    if(tmp < rmin)
-			rmin = tmp;
-		}
-	    }
-	    //sliding midpoint split
-	    if(right.size() == 0)
-		split = lmax;
-	    if(left.size() == 0)
-		split = rmin;
-
-	    //set split to node
-	    parent->dimension = dim;
-	    parent->split = split;
-
-	    //create nodes
-	    if(left.size() > 0) {
-		if(left.size() > bucketSize) {
-		    Inner *node = new Inner(parent);
-		    parent->left = node;
-
-		    float b[2*D];
-		    std::copy(bounds, bounds + 2*D, &b[0]);
-		    b[2*dim + 1] = split;
-		    stack.push(Constr<D>(left, &b[0], node));
-		}
-		else {
-		    Leaf<D> * leaf = new Leaf<D>(parent, left);
-		    parent->left = leaf;
-		}
-	    }
-
-	    if(right.size() > 0) {
-		if(right.size() > bucketSize) {
-		    Inner *node = new Inner(parent);
-		    parent->right = node;
-
-		    float b[2*D];
-		    std::copy(bounds, bounds + 2*D, &b[0]);
-		    b[2*dim] = split;
-		    stack.push(Constr<D>(right, &b[0], node));
-		}
-		else {
-		    Leaf<D> * leaf = new Leaf<D>(parent, right);
-		    parent->right = leaf;
-		}
-	    }
+    template<typename Bound, typename Result>
+    inline void scanBucket(const P * query, const leaf_t * leaf, Bound &bound, Result &result) {
+	KDTREE_STAT(stats.leaf());
+	const size_t size = leaf->bucket.size();
+	for(int i = 0; i < B; i++) {
+	    if((size_t) i == size) return;
+	    testPoint(query, leaf, i, bound, result);
 	}
+	if(size > (size_t) B)
+	    scanSame(query, leaf, bound, result);
     }
     
     /**
-     * Inserts point into the tree
-     * @param point point to insert
-     */
-    void insert(Point<D> *point) {
-	if(sizep == 0) {
-	    points tmp;
-	    tmp.push_back(point);
-	    construct(&tmp);
-	    return;
-	}
-	sizep++;
-	Leaf<D> * leaf = findBucket(point);
-	if(leaf->bucket.size() < bucketSize) {
-	    leaf->add(point);
-	    return; //OK, bucket is not full yet
-	}
-	else { //split the bucket into 2 new leaves
-	    points data(leaf->bucket);
-	    data.push_back(point); //add the point to bucket
-	    //create new inner node
-	    Inner * node = new Inner(leaf->parent);
-	    if((Leaf<D> *)leaf->parent->left == leaf) {
-		leaf->parent->left = node;
-	    }
-	    else if((Leaf<D> *)leaf->parent->right == leaf) {
-		leaf->parent->right = node;
-	    }
-	    else {
-		cerr << "somethig is very wrong! Point not inserted.\n";
-		return;
-	    }
-	    delete leaf; //no longer necessary
-	    
-	    //split the nodes along the dimension with greatest local variance
-	    Point<D> min = *(data[0]);
-	    Point<D> max = *(data[0]);
-	    for(points_it it = data.begin(); it != data.end(); ++it) {
-		Point<D> p = *(*it);
-		for(int d = 0; d < D; d++) {
-		    if(p[d] < min[d]) {
-			min[d] = p[d];
-			continue;
-		    }
-		    if(p[d] > max[d]) {
-			max[d] = p[d];
-		    }
-		}
-	    }
-	    int dim;
-	    float dist = 0;
-	    for(int d = 0; d < D; d++) {
-		if(max[d] - min[d] > dist) {
-		    dist = max[d] - min[d];
-		    dim = d;
-		}
-	    }
-	    node->split = min[dim] + dist / 2.0f;
-	    
-	    points l, r; //split the data
-	    for(points_it it = data.begin(); it != data.end(); ++it) {
-		Point<D> p = *(*it);
-		if(p[dim] <= node->split) {
-		    l.push_back(*it);
-		}
-		if(p[dim] > node->split) {
-		    r.push_back(*it);
-		}
-	    }
-	    
-	    //create two new leafs
-	    Leaf<D> * left = new Leaf<D>(node, l);
-	    node->left = left;
-	    
-	    Leaf<D> * right = new Leaf<D>(node, r);
-	    node->right = right;
-	    
-	}
-    }
-        
-    /**
-     * Returns the exact nearest neighbor (NN).
-     * If there are more NNs, method retuns one random.
+     * NN search, see nearestNeighbor
      * @param query the point whose NN we search
-     * @return nearest neigbor
+     * @param dist squared distance of the NN, bound if there is none
+     * @param self the point EXCLUDE_SELF skips
+     * @param bound only points nearer than bound are searched, see searchBound
      */
-    Point<D> * nearestNeighbor(const Point<D> *query) {
-	visitedNodes = 0;
-	Leaf<D> *leaf = findBucket(query);
+    template<Exclusion E>
+    ref findNearest(const P *query, dist_t &dist, ref self = none(), 
+	    dist_t bound = numeric_limits<dist_t>::max()) {
+	leaf_t *leaf = findBucket(query);
 	/** squared distance of the current nearest neigbor */
-	float dist = numeric_limits<float>::max();
+	dist = bound;
 	/** current best NN */
-	Point<D> * nearest;
+	Nearest<ref, E> nearest(self, none());
 	
 	//find nearest point in the bucket
-	for(points_it it = leaf->bucket.begin(); it != leaf->bucket.end(); ++it) {
-	    visitedNodes++;
-	    //(*it)->setColor(0, 255, 0); //debug
-	    float tmp = distance(query, *it);
-	    if(tmp < dist && tmp > 0) { //ie points are not the same!
-		dist = tmp;
-		nearest = *it;
-	    }
-	}
+	scanBucket(query, leaf, dist, nearest);
 		
-	ExtendedNode<D> firstNode(leaf->parent);
-	if((Leaf<D> *)leaf->parent->left == leaf)
+	ExtendedNode<D, scalar> firstNode(leaf->parent);
+	if((leaf_t *)leaf->parent->left == leaf)
 	    firstNode.status = LEFT;
 	else
 	    firstNode.status = RIGHT;
 	
-	stack< ExtendedNode<D> > stack; //avoid recursion
+	stack< ExtendedNode<D, scalar> > stack; //avoid recursion
 	stack.push(firstNode);
+	KDTREE_STAT(stats.depth(1));
 	
 	// check possible nodes for NN
 	while(!stack.empty()) { 
-	    ExtendedNode<D> exNode = stack.top();
+	    ExtendedNode<D, scalar> exNode = stack.top();
 	    stack.pop();
+	    KDTREE_STAT(stats.innerNode());
 	    	    
-	    Node * nleft = NULL;
-	    Node * nright = NULL;
-	    float ldiff = 0, rdiff = 0, ladd = 0, radd = 0;
+	    node_t * nleft = NULL;
+	    node_t * nright = NULL;
+	    dist_t ldiff = 0, rdiff = 0, ladd = 0, radd = 0;
 	    
 	    /// if right child exist && it has not been searchd yet
 	    if(exNode.node->right && (exNode.status != RIGHT || exNode.status == NONE)) {
-		radd = exNode.node->split - (*query)[exNode.node->dimension];
+		radd = (dist_t) exNode.node->split - (*query)[exNode.node->dimension];
 		if(radd > 0) // only if I'm "crossing line from left to right"
-		    rdiff = exNode.tn.getUpdatedLength(exNode.node->dimension, radd);
+		    rdiff = exNode.tn.getUpdatedLength(exNode.node->dimension, radd, metric);
 		else
 		    rdiff = exNode.tn.getLengthSquare();
 		
@@ -442,9 +342,9 @@ public:
 	    }
 	    /// if left child exist && it has not been searchd yet
 	    if(exNode.node->left && (exNode.status != LEFT || exNode.status == NONE)) {
-		ladd = (*query)[exNode.node->dimension] - exNode.node->split;
+		ladd = (dist_t) (*query)[exNode.node->dimension] - exNode.node->split;
 		if(ladd > 0)
-		    ldiff = exNode.tn.getUpdatedLength(exNode.node->dimension, ladd);
+		    ldiff = exNode.tn.getUpdatedLength(exNode.node->dimension, ladd, metric);
 		else
 		    ldiff = exNode.tn.getLengthSquare();
 		
@@ -455,22 +355,23 @@ public:
 	    
 	    //on my way up && not in root
 	    if(exNode.status != NONE && exNode.node->parent) {
-		ExtendedNode<D> add(exNode.node->parent);
+		ExtendedNode<D, scalar> add(exNode.node->parent);
 		add.tn = exNode.tn;
-		if((Inner *) exNode.node->parent->right == exNode.node) 
+		if((inner_t *) exNode.node->parent->right == exNode.node) 
 		    add.status = RIGHT;
 		else
 		    add.status = LEFT;
 
 		stack.push(add);
+		KDTREE_STAT(stats.depth(stack.size()));
 	    }
 	    
 	    // this iterates over 2 children
 	    // a bit mess, but there are too many variables and it does not look
 	    // nice as a method.
 	    for(int c = 0; c <= 1; c++) { 
-		Node * node;
-		float add;
+		node_t * node;
+		dist_t add;
 		//path ordering, choose the worse first so
 		//the better will be first to pop of the stack
 		if(c == 0) { 
@@ -484,129 +385,120 @@ public:
 		
 		if(node) {
 		    if(node->isLeaf()) { // if node is leaf we search the bucket
-			Leaf<D> * leaf = (Leaf<D> *) node;
+			leaf_t * leaf = (leaf_t *) node;
 			///BOB test
 			if(minBoundsDistance(query, leaf->min, leaf->max) < dist) {
-			    points *bucket = &leaf->bucket;
-			    for(points_it it = bucket->begin(); it != bucket->end(); ++it) {
-				visitedNodes++;
-				//(*it)->setColor(255, 255, 0); //debug
-				float tmp = distance(query, *it);
-				if(tmp < dist && tmp > 0) { //ie points are not the same!
-				    dist = tmp;
-				    nearest = *it;
-				}
-			    }
+			    scanBucket(query, leaf, dist, nearest);
 			}
 		    }
 		    else { //Not leaf, add node to the stack with correct tracking node
-			ExtendedNode<D> newN((Inner *) node);
+			ExtendedNode<D, scalar> newN((inner_t *) node);
 			newN.tn = exNode.tn;
 			if(add > 0) {
-			    newN.tn.set(exNode.node->dimension, add);
+			    newN.tn.set(exNode.node->dimension, add, metric);
 			}
 			newN.status = NONE; 
 			if(newN.tn.getLengthSquare() < dist) { //check if the dist hasn't changed
 			    stack.push(newN);
+			    KDTREE_STAT(stats.depth(stack.size()));
 			}
 		    }
 		}
 	    }
 	}
 	
-	return nearest;
+	return nearest.nearest;
     }
     
     /**
-     * Returns exact k-nearest neighbors (kNN).
-     * @param query the point whose kNN we search
-     * @param k the number of points we look for
-     * @return vector of kNN
+     * Initial NN distance of a query with the largest distance maxDist, 
+     * the pruning starts with it instead of max()
+     * @param maxDist true distance, max() for unbounded queries
      */
-    vector< Point<D> * > kNearestNeighbors(const Point<D> *query, const int k) {
-	visitedNodes = 0;
-	Point<D> *n = nearestNeighbor(query);
-	float r = distance(n, query, true) * (1 + 2 / (float)D);
-	
-	vector< Point<D> * > knn;
-	
-	//TODO: this is certainly not the most efficient solution
-	//however all "clever" solutions I tried failed in hight dimension or on
-	//various data. So I'll leave this, usually returns result <5 iterations.
-	for(int i = 100; i > 1; i--) { 
-	    knn = circularQuery(query, r);
-	    if(knn.size() > k + 1 || knn.size() == sizep) {
-		break;
+    dist_t searchBound(dist_t maxDist) const {
+	return maxDist == numeric_limits<dist_t>::max() ? maxDist : metric.reduce(maxDist);
+    }
+    
+    /**
+     * Leaf of the query for the cursor: walks up from the leaf of the 
+     * last query until the cell contains the query (only the ancestors 
+     * it has left are visited), then down like findBucket.
+     * The cursor starts at the root if it belongs to another tree or revision.
+     */
+    const leaf_t *locate(const P *query, cursor_t &cursor) const {
+	const node_t *node;
+	if(cursor.leaf && cursor.tree == this && cursor.revision == revision) {
+	    node = cursor.leaf;
+	    while(!cursor.contains(query)) node = cursor.up();
+	}
+	else {
+	    cursor.reset();
+	    cursor.tree = this;
+	    cursor.revision = revision;
+	    node = root;
+	}
+	while(!node->isLeaf()) {
+	    const inner_t *inner = (const inner_t *) node;
+	    if(!inner->left || !inner->right) { //the cell stays the same, see findBucket
+		cursor.down(inner, -1, false);
+		node = inner->left ? inner->left : inner->right;
+	    }
+	    else if((*query)[inner->dimension] <= inner->split) {
+		cursor.down(inner, inner->dimension, true);
+		node = inner->left;
 	    }
 	    else {
-		r *= 1 + (1 / (float) D);
+		cursor.down(inner, inner->dimension, false);
+		node = inner->right;
 	    }
 	}
-	
-	//C++11, I guess it's OK to use it
-	sort(knn.begin(), knn.end(), 
-	    [query, this](const Point<D> * a, const Point<D> * b) -> bool { 
-		return distance(a, query) < distance(b, query); 
-	    });
-	    
-	vector< Point<D> * > result;
-	int size =  (k + 1 < knn.size()) ? k + 1 : knn.size();
-	result.insert(result.end(), knn.begin() + 1, knn.begin() + size);
-	
-	return result;
+	cursor.leaf = node;
+	return (const leaf_t *) node;
     }
     
     /**
-     * Returns all points in a hypersphere around given point
+     * Radius search, see circularQuery
      * 
      * Basicaly similar implementation to NN, except there is a fixed radius,
      * so no distance revisions
      * 
      * TODO: most parts are very simliar to NN search, consider refactoring 
      *	     to avoid code duplicity
-     * 
-     * @param query center of the sphere
-     * @param radius radius of the sphere
-     * @return list of points inside
+     * @param data points inside, a vector or Candidates of kNN
      */
-    vector< Point<D> * > circularQuery(const Point<D> *query, const float radius) {
-	//visitedNodes = 0; //comment for kNN
-	Leaf<D> *leaf = findBucket(query);
-	vector< Point<D> * > data;
-	float r = radius * radius;
+    template<typename Result>
+    void findInRadius(const P *query, const dist_t radius, Result &data) {
+	leaf_t *leaf = findBucket(query);
+	dist_t r = metric.reduce(radius);
 	
 	//find nearest point in the bucket
-	for(points_it it = leaf->bucket.begin(); it != leaf->bucket.end(); ++it) {
-	    visitedNodes++;
-	    float tmp = distance(query, *it, false);
-	    if(tmp < r) { //ie points are not the same!
-		data.push_back(*it);
-	    }
-	}
+	scanBucket(query, leaf, r, data);
 	
-	ExtendedNode<D> firstNode(leaf->parent);
-	if((Leaf<D> *)leaf->parent->left == leaf)
+	ExtendedNode<D, scalar> firstNode(leaf->parent);
+	if((leaf_t *)leaf->parent->left == leaf)
 	    firstNode.status = LEFT;
 	else
 	    firstNode.status = RIGHT;
 	
-	stack< ExtendedNode<D> > stack; //avoid recursion
+	stack< ExtendedNode<D, scalar> > stack; //avoid recursion
 	stack.push(firstNode);
+	KDTREE_STAT(stats.depth(1));
 	
 	// check possible nodes for NN
 	while(!stack.empty()) { 
-	    ExtendedNode<D> exNode = stack.top();
+	    ExtendedNode<D, scalar> exNode = stack.top();
 	    stack.pop();
+	    KDTREE_STAT(stats.innerNode());
 	    	    
-	    Node * nleft = NULL;
-	    Node * nright = NULL;
-	    float ldiff, rdiff, ladd, radd;
+	    node_t * nleft = NULL;
+	    node_t * nright = NULL;
+	    dist_t ldiff = 0, rdiff = 0, ladd = 0, radd = 0;
 	    
 	    /// if right child exist && it has not been searchd yet
 	    if(exNode.node->right && (exNode.status != RIGHT || exNode.status == NONE)) {
-		radd = exNode.node->split - (*query)[exNode.node->dimension];
+		radd = (dist_t) exNode.node->split - (*query)[exNode.node->dimension];
 		if(radd > 0) // only if I'm "crossing line from left to right"
-		    rdiff = exNode.tn.getUpdatedLength(exNode.node->dimension, radd);
+		    rdiff = exNode.tn.getUpdatedLength(exNode.node->dimension, radd, metric);
 		else
 		    rdiff = exNode.tn.getLengthSquare();
 		
@@ -616,9 +508,9 @@ public:
 	    }
 	    /// if left child exist && it has not been searchd yet
 	    if(exNode.node->left && (exNode.status != LEFT || exNode.status == NONE)) {
-		ladd = (*query)[exNode.node->dimension] - exNode.node->split;
+		ladd = (dist_t) (*query)[exNode.node->dimension] - exNode.node->split;
 		if(ladd > 0)
-		    ldiff = exNode.tn.getUpdatedLength(exNode.node->dimension, ladd);
+		    ldiff = exNode.tn.getUpdatedLength(exNode.node->dimension, ladd, metric);
 		else
 		    ldiff = exNode.tn.getLengthSquare();
 		
@@ -629,22 +521,23 @@ public:
 	    
 	    //on my way up && not in root
 	    if(exNode.status != NONE && exNode.node->parent) {
-		ExtendedNode<D> add(exNode.node->parent);
+		ExtendedNode<D, scalar> add(exNode.node->parent);
 		add.tn = exNode.tn;
-		if((Inner *) exNode.node->parent->right == exNode.node) 
+		if((inner_t *) exNode.node->parent->right == exNode.node) 
 		    add.status = RIGHT;
 		else
 		    add.status = LEFT;
 
 		stack.push(add);
+		KDTREE_STAT(stats.depth(stack.size()));
 	    }
 	    
 	    // this iterates over 2 children
 	    // a bit mess, but there are too many variables and it does not look
 	    // nice as a method.
 	    for(int c = 0; c <= 1; c++) { 
-		Node * node;
-		float add;
+		node_t * node;
+		dist_t add;
 		//path ordering, choose the worse first so
 		//the better will be first to pop of the stack
 		if(c == 0) { 
@@ -658,87 +551,894 @@ public:
 		
 		if(node) {
 		    if(node->isLeaf()) { // if node is leaf we search the bucket
-			Leaf<D> * leaf = (Leaf<D> *) node;
+			leaf_t * leaf = (leaf_t *) node;
 			///BOB test
 			if(minBoundsDistance(query, leaf->min, leaf->max) < r) {
-			    visitedNodes++;
-			    points *bucket = &leaf->bucket;
-			    for(points_it it = bucket->begin(); it != bucket->end(); ++it) {
-				float tmp = distance(query, *it, false);
-				if(tmp < r) { //ie points are not the same!
-				    data.push_back(*it);
-				}
-			    }
+			    scanBucket(query, leaf, r, data);
 			}
 		    }
 		    else { //Not leaf, add Node to the stack with correct tracking node
-			ExtendedNode<D> newN((Inner *) node);
+			ExtendedNode<D, scalar> newN((inner_t *) node);
 			newN.tn = exNode.tn;
 			if(add > 0)
-			    newN.tn.set(exNode.node->dimension, add);
+			    newN.tn.set(exNode.node->dimension, add, metric);
 			newN.status = NONE; 
 			if(newN.tn.getLengthSquare() < r) { //check if the dist hasn't changed
 			    stack.push(newN);
+			    KDTREE_STAT(stats.depth(stack.size()));
 			}
 		    }
 		}
 	    }
 	}
-    
-	return data;
     }
     
-
     /**
-     * !! This is just to compare the performance with the better version !!
+     * Root-down search used by NN and radius queries with a DescentStack.
      * 
-     * Returns the exact nearest neighbor (NN).
-     * If there are more NNs, method retuns one random.
-     * @param query the point whose NN we search
-     * @return nearest neigbor
+     * Goes to the child on the side of the query first and postpones the 
+     * other one with the distance of its cell, which differs from the 
+     * current cell only in the dimension of the split. No parent pointers 
+     * and no allocation once the scratch has grown to the tree height.
+     * @param bound squared distance of the current NN (updated), or the squared radius
+     * @param result NN (Nearest) or points inside (vector of refs), see testPoint
      */
-    Point<D> * simpleNearestNeighbor(const Point<D> *query) {
-	visitedNodes = 0;
-	Leaf<D> *leaf = findBucket(query);
-	float dist = numeric_limits<float>::max();
-	Point<D> * nearest;
-	
-	//find nearest point in the bucket
-	for(points_it it = leaf->bucket.begin(); it != leaf->bucket.end(); ++it) {
-	    //(*it)->setColor(0, 255, 0); //debug only
-	    float tmp = distance(query, *it, true);
-	    if(tmp < dist && tmp > 0) { //ie points are not the same!
+    template<typename Result>
+    void descend(const P *query, dist_t &bound, Result &result, descent_t &scratch) {
+	scratch.clear();
+	descend(query, root, 0, bound, result, scratch);
+    }
+    
+    /**
+     * Root-down search of the subtree of node, see descend
+     * @param cell squared distance of the query to the cell of node, \
+     *	      the offsets of the scratch are the offsets of the cell
+     */
+    template<typename Result>
+    void descend(const P *query, const node_t *node, dist_t cell, dist_t &bound, Result &result, descent_t &scratch) {
+	while(true) {
+	    if(!node->isLeaf()) {
+		KDTREE_STAT(stats.innerNode());
+		const inner_t *inner = (const inner_t *) node;
+		if(!inner->left || !inner->right) {
+		    //one child has all the points of the node, whatever the split (see findBucket)
+		    node = inner->left ? inner->left : inner->right;
+		    continue;
+		}
+		const int d = inner->dimension;
+		const dist_t diff = (dist_t) (*query)[d] - (dist_t) inner->split;
+		const node_t *farther = diff <= 0 ? inner->right : inner->left;
+		const dist_t offset = metric.term(diff, d);
+		const dist_t far = metric.update(cell, scratch.offsets[d], offset);
+		if(far < bound) {
+		    scratch.push(farther, far, d, offset);
+		    KDTREE_STAT(stats.depth(scratch.entries.size()));
+		}
+		node = diff <= 0 ? inner->left : inner->right;
+		continue;
+	    }
+	    const leaf_t *leaf = (const leaf_t *) node;
+	    if(minBoundsDistance(query, leaf->min, leaf->max) < bound)
+		scanBucket(query, leaf, bound, result);
+	    
+	    //continue with the last postponed subtree that can still be closer
+	    node = NULL;
+	    while(!scratch.entries.empty()) {
+		const typename descent_t::Entry e = scratch.entries.back();
+		scratch.entries.pop_back();
+		if(e.bound < bound) {
+		    scratch.enter(e);
+		    cell = e.bound;
+		    node = e.node;
+		    break;
+		}
+	    }
+	    if(!node)
+		return;
+	}
+    }
+    
+    inner_t *newInner(inner_t *parent) {
+	return new (nodes.allocate(sizeof(inner_t), alignof(inner_t))) inner_t(parent);
+    }
+    
+    leaf_t *newLeaf(inner_t *parent, const points &bucket) {
+	return new (nodes.allocate(sizeof(leaf_t), alignof(leaf_t))) leaf_t(parent, bucket, base);
+    }
+    
+    /**
+     * Frees a leaf, its memory is reused by the next leaf
+     */
+    void freeLeaf(leaf_t *leaf) {
+	leaf->~leaf_t();
+	nodes.recycle(leaf, sizeof(leaf_t));
+    }
+    
+    /**
+     * Frees all nodes, the root as well, without recursion.
+     * Only the buckets are freed one by one, the arena keeps its blocks.
+     */
+    void freeNodes() {
+	revision = nextRevision();
+	if(!root)
+	    return;
+	stack<node_t *> stack;
+	stack.push(root);
+	while(!stack.empty()) {
+	    node_t *node = stack.top();
+	    stack.pop();
+	    if(node->isLeaf()) {
+		((leaf_t *) node)->~leaf_t();
+		continue;
+	    }
+	    inner_t *inner = (inner_t *) node;
+	    if(inner->left) stack.push(inner->left);
+	    if(inner->right) stack.push(inner->right);
+	    inner->~inner_t();
+	}
+	nodes.reset();
+	nodeLayout = LAYOUT_BUILD;
+	root = NULL;
+    }
+    
+public:
+
+    /**
+     * Creates empty kd-tree
+     */
+    KDTree() {
+	root = newInner(NULL);
+	base = NULL;
+	sizep = 0;
+	nodeLayout = LAYOUT_BUILD;
+	revision = nextRevision();
+    }
+    
+    /**
+     * Destructor
+     */
+    ~KDTree() {
+	freeNodes();
+    }
+    
+    
+    /**
+     * Returns the root of the tree
+     * @return pointer to the root node
+     */
+    const inner_t *getRoot() const {
+	return root;
+    }
+    
+    /**
+     * Returns the number of points tested during the last query 
+     * (for kNN including its NN and radius searches)
+     * @return number of tested points
+     */
+    const int getVisitedNodes() const {
+	return visitedNodes;
+    }
+    
+#ifdef KDTREE_STATS
+    /**
+     * Statistics of all queries since the construction or the last reset,
+     * only with -DKDTREE_STATS
+     */
+    QueryStats &getStats() {
+	return stats;
+    }
+#endif
+    
+    /**
+     * The reference the NN queries return if there is no neighbor (in range):
+     * NULL, or the largest index for indexed trees, index 0 is a point
+     */
+    static ref none() {
+	return PointRef<P, Indexed>::none();
+    }
+    
+    /**
+     * Returns the point for given reference
+     * @param r pointer or index returned by a query, not none()
+     * @return the point
+     */
+    P * getPoint(ref r) const {
+	return PointRef<P, Indexed>::get(base, r);
+    }
+    
+    /**
+     * Indexed trees only: the array of points has moved (or has been 
+     * reallocated), all the indices now refer to the new array.
+     * @param data new location of the points
+     */
+    void rebase(P * data) {
+	revision = nextRevision();
+	base = data;
+    }
+    
+    /**
+     * The points were reordered (see PointOrder), updates the references 
+     * of all buckets. The tree stays the same otherwise.
+     * @param data the array of the points after reordering, the tree has \
+     *	      to refer to the same array (pointers) or to its old version (indices)
+     * @param inverse new index of every old index
+     */
+    void permute(P * data, const vector<uint32_t> &inverse) {
+	revision = nextRevision();
+	stack<node_t *> stack;
+	stack.push(root);
+	while(!stack.empty()) {
+	    node_t *node = stack.top();
+	    stack.pop();
+	    if(!node->isLeaf()) {
+		inner_t *inner = (inner_t *) node;
+		if(inner->left) stack.push(inner->left);
+		if(inner->right) stack.push(inner->right);
+		continue;
+	    }
+	    leaf_t *leaf = (leaf_t *) node;
+	    for(size_t i = 0; i < leaf->bucket.size(); i++) {
+		size_t old = Indexed ? (size_t) leaf->bucket[i] : (size_t) (getPoint(leaf->bucket[i]) - data);
+		leaf->bucket[i] = PointRef<P, Indexed>::make(data, inverse[old]);
+	    }
+	}
+	if(Indexed)
+	    base = data;
+    }
+    
+    /**
+     * Distance of the queries
+     */
+    const Metric &getMetric() const {
+	return metric;
+    }
+    
+    /**
+     * Changes the distance of the queries (the weights of Weighted),
+     * the tree stays the same, the cursors start over
+     */
+    void setMetric(const Metric &metric) {
+	revision = nextRevision();
+	this->metric = metric;
+    }
+    
+    /**
+     * Bounding box of the tree
+     * @return array of size 2D, format: xmin, xmax, ymin, ymax, ...
+     */
+    const scalar *getBoundingBox() const {
+	return &boundingBox[0];
+    }
+    
+    /**
+     * Maximal number of points in a bucket (B)
+     */
+    static int getBucketSize() {
+	return bucketSize;
+    }
+    
+    /**
+     * Moves all nodes into one block aligned to huge pages, in the given order.
+     * Parents always precede their children. The queries stay the same,
+     * insert still works (new nodes go after the block).
+     * Call it again after many inserts or after construct.
+     * @param order LAYOUT_VEB (van Emde Boas), LAYOUT_DFS (preorder) \
+     *	      or LAYOUT_BUILD (leaves the nodes where they are)
+     * @return false if the block could not be allocated, the tree is unchanged
+     */
+    bool layout(NodeLayout order = LAYOUT_VEB) {
+	if(order == LAYOUT_BUILD)
+	    return true;
+	vector<node_t *> ordered;
+	if(order == LAYOUT_VEB)
+	    NodeOrder<node_t, inner_t>::vanEmdeBoas(root, NodeOrder<node_t, inner_t>::height(root), ordered);
+	else
+	    NodeOrder<node_t, inner_t>::depthFirst(root, ordered);
+	
+	size_t bytes = 0;
+	for(size_t i = 0; i < ordered.size(); i++) {
+	    size_t align = ordered[i]->isLeaf() ? alignof(leaf_t) : alignof(inner_t);
+	    bytes = (bytes + align - 1) / align * align;
+	    bytes += ordered[i]->isLeaf() ? sizeof(leaf_t) : sizeof(inner_t);
+	}
+	NodeArena arena;
+	if(!arena.reserve(bytes)) {
+	    cerr << "layout: can't allocate " << bytes << " B for the nodes\n";
+	    return false;
+	}
+	
+	//move the nodes, parents first; parent of an old inner node points to 
+	//its new copy afterwards (the old node is not used any more)
+	for(size_t i = 0; i < ordered.size(); i++) {
+	    node_t *old = ordered[i];
+	    node_t *moved;
+	    if(old->isLeaf())
+		moved = new (arena.allocate(sizeof(leaf_t), alignof(leaf_t))) leaf_t(std::move(*(leaf_t *) old));
+	    else
+		moved = new (arena.allocate(sizeof(inner_t), alignof(inner_t))) inner_t(*(inner_t *) old);
+	    if(old->parent) {
+		inner_t *parent = old->parent->parent; //already moved
+		moved->parent = parent;
+		if(parent->left == old) parent->left = moved;
+		else parent->right = moved;
+	    }
+	    if(!old->isLeaf())
+		old->parent = (inner_t *) moved;
+	}
+	
+	//free the old nodes, they still point to their old children
+	inner_t *moved = (inner_t *) root->parent;
+	root->parent = NULL;
+	freeNodes();
+	root = moved;
+	nodes.swap(arena); //the old blocks are released with arena
+	nodeLayout = order;
+	return true;
+    }
+    
+    /**
+     * Bytes of the live nodes and of all blocks of the node arena
+     */
+    pair<size_t, size_t> getNodeMemory() const {
+	return make_pair(nodes.allocated(), nodes.capacity());
+    }
+    
+    /**
+     * Current order of the nodes, see layout()
+     */
+    NodeLayout getLayout() const {
+	return nodeLayout;
+    }
+    
+    /**
+     * Returns number of points in the tree
+     * @return number of points in the tree
+     */
+    const int size() const {
+	return sizep;
+    }
+    
+    /**
+     *  Builds the KD-Tree on a given set of unordered points
+     * 
+     * @param[in] data vector of unordered points
+     * @param[in] bounds array with bounds of the coordinates \
+     *		  expects array like this - 2D: [xmin, xmax, ymin, ymax]
+     */
+    void construct(vector< P > * data, scalar * bounds = NULL) {
+	construct(data->empty() ? NULL : &(*data)[0], data->size(), bounds);
+    }
+    
+    /**
+     *  Builds the KD-Tree on a given array of unordered points
+     *  (Indexed trees keep the indices to this array)
+     * 
+     * @param[in] data array of unordered points
+     * @param[in] count number of points in the array
+     * @param[in] bounds array with bounds of the coordinates \
+     *		  expects array like this - 2D: [xmin, xmax, ymin, ymax]
+     */
+    void construct(P * data, uint32_t count, scalar * bounds = NULL) {
+	if(Indexed)
+	    base = data;
+	points refs;
+	refs.reserve(count);
+	for(uint32_t i = 0; i < count; i++) {
+	    refs.push_back(PointRef<P, Indexed>::make(data, i));
+	}
+	construct(&refs, bounds);
+    }
+    
+    /**
+     *  Builds the KD-Tree on a given set of points with unknown bounds
+     * 
+     * @param[in] data vector of references to unordered points \
+     *		  (for Indexed trees the indices refer to the current base)
+     * @param[in] bounds array with bounds of the coordinates \
+     *		  expects array like this - 2D: [xmin, xmax, ymin, ymax]
+     */
+    void construct(points * adata, scalar * abounds = NULL) {
+	if(!abounds) { //calculate the bounds if not specified
+	    for(int d = 0; d < D; d++) {
+		boundingBox[2*d] = numeric_limits<scalar>::max();
+		boundingBox[2*d + 1] = numeric_limits<scalar>::lowest();
+	    }
+	    for(points_it it = adata->begin(); it != adata->end(); ++it) {
+		P *p = getPoint(*it);
+		for(int d = 0; d < D; d++) {
+		    if((*p)[d] < boundingBox[2*d]) boundingBox[2*d] = (*p)[d];
+		    if((*p)[d] > boundingBox[2*d + 1]) boundingBox[2*d + 1] = (*p)[d];
+		}
+	    }
+	}
+	else {
+	    copy(abounds, abounds + 2*D, boundingBox);
+	}
+	sizep = adata->size();
+	freeNodes();
+	root = newInner(NULL);
+
+	//construct the tree
+	stack<Constr<D, P, Indexed>> stack;
+	stack.push(Constr<D, P, Indexed>(*adata, boundingBox, root));
+
+	while(!stack.empty()) {
+
+	    Constr<D, P, Indexed> curr = stack.top();
+	    stack.pop();
+	    points * data = &curr.data;
+	    scalar* bounds = &curr.bounds[0];
+	    inner_t *parent = curr.parent;
+
+	    int dim = -1; //dimension to split
+	    dist_t size = 0;
+	    for(int i = 0; i < D; i++) {
+		if((dist_t) bounds[2*i + 1] - bounds[2*i] > size) {
+		    size = (dist_t) bounds[2*i + 1] - bounds[2*i];
+		    dim = i;
+		}
+	    }
+	    if(dim == -1) { //all points are the same, can't be split
+		parent->dimension = 0;
+		parent->split = bounds[0];
+		parent->left = newLeaf(parent, *data);
+		continue;
+	    }
+	    scalar split = bounds[2*dim] + (scalar) (size / 2); //split value
+	    if(split >= bounds[2*dim + 1]) //rounding, the upper bound has to go right
+		split = bounds[2*dim];
+
+	    points left, right;
+	    scalar lmax = numeric_limits<scalar>::lowest(), rmin = numeric_limits<scalar>::max();
+
+	    for(points_it it = data->begin(); it != data->end(); ++it) {
+		P *p = getPoint(*it);
+		if((*p)[dim] <= split) { //NOTE: points exactly on split line belong to left node!
+		    left.push_back(*it);
+		    scalar tmp = (*p)[dim];
+		    if(tmp > lmax)
+			lmax = tmp;
+		}
+		if((*p)[dim] > split) {
+		    right.push_back(*it);
+		    scalar tmp = (*p)[dim];
+		    if(tmp < rmin)
+			rmin = tmp;
+		}
+	    }
+	    //sliding midpoint split
+	    if(right.size() == 0)
+		split = lmax;
+	    if(left.size() == 0)
+		split = rmin;
+
+	    //set split to node
+	    parent->dimension = dim;
+	    parent->split = split;
+
+	    //create nodes
+	    if(left.size() > 0) {
+		if(left.size() > bucketSize) {
+		    inner_t *node = newInner(parent);
+		    parent->left = node;
+
+		    scalar b[2*D];
+		    std::copy(bounds, bounds + 2*D, &b[0]);
+		    b[2*dim + 1] = split;
+		    stack.push(Constr<D, P, Indexed>(left, &b[0], node));
+		}
+		else {
+		    leaf_t * leaf = newLeaf(parent, left);
+		    parent->left = leaf;
+		}
+	    }
+
+	    if(right.size() > 0) {
+		if(right.size() > bucketSize) {
+		    inner_t *node = newInner(parent);
+		    parent->right = node;
+
+		    scalar b[2*D];
+		    std::copy(bounds, bounds + 2*D, &b[0]);
+		    b[2*dim] = split;
+		    stack.push(Constr<D, P, Indexed>(right, &b[0], node));
+		}
+		else {
+		    leaf_t * leaf = newLeaf(parent, right);
+		    parent->right = leaf;
+		}
+	    }
+	}
+    }
+    
+    /**
+     * Inserts point into the tree
+     * @param point point to insert, for Indexed trees index into the \
+     *	      current base (call rebase first if the array has moved)
+     */
+    void insert(ref point) {
+	if(sizep == 0) {
+	    points tmp;
+	    tmp.push_back(point);
+	    construct(&tmp);
+	    return;
+	}
+	sizep++;
+	revision = nextRevision();
+	const P &inserted = *getPoint(point);
+	for(int d = 0; d < D; d++) { //keep the bounding box up to date
+	    if(inserted[d] < boundingBox[2*d]) boundingBox[2*d] = inserted[d];
+	    if(inserted[d] > boundingBox[2*d + 1]) boundingBox[2*d + 1] = inserted[d];
+	}
+	leaf_t * leaf = findBucket(getPoint(point));
+	if(leaf->bucket.size() < bucketSize) {
+	    leaf->add(point, base);
+	    return; //OK, bucket is not full yet
+	}
+	else { //split the bucket into 2 new leaves
+	    //split the nodes along the dimension with greatest local variance,
+	    //the leaf bounds are the bounds of its points
+	    scalar min[D], max[D];
+	    for(int d = 0; d < D; d++) {
+		min[d] = std::min(leaf->min[d], inserted[d]);
+		max[d] = std::max(leaf->max[d], inserted[d]);
+	    }
+	    int dim = 0;
+	    dist_t dist = 0;
+	    for(int d = 0; d < D; d++) {
+		if((dist_t) max[d] - min[d] > dist) {
+		    dist = (dist_t) max[d] - min[d];
+		    dim = d;
+		}
+	    }
+	    if(dist == 0) { //all points are the same, the bucket grows
+		leaf->add(point, base);
+		return;
+	    }
+	    points data(leaf->bucket);
+	    data.push_back(point); //add the point to bucket
+	    
+	    //create new inner node
+	    inner_t * node = newInner(leaf->parent);
+	    if((leaf_t *)leaf->parent->left == leaf) {
+		leaf->parent->left = node;
+	    }
+	    else if((leaf_t *)leaf->parent->right == leaf) {
+		leaf->parent->right = node;
+	    }
+	    else {
+		cerr << "somethig is very wrong! Point not inserted.\n";
+		return;
+	    }
+	    freeLeaf(leaf); //no longer necessary
+	    
+	    node->dimension = dim;
+	    node->split = min[dim] + (scalar) (dist / 2);
+	    if(node->split >= max[dim]) //rounding, max has to go right
+		node->split = min[dim];
+	    
+	    points l, r; //split the data
+	    for(points_it it = data.begin(); it != data.end(); ++it) {
+		const P &p = *getPoint(*it);
+		if(p[dim] <= node->split) {
+		    l.push_back(*it);
+		}
+		if(p[dim] > node->split) {
+		    r.push_back(*it);
+		}
+	    }
+	    
+	    //create two new leafs
+	    leaf_t * left = newLeaf(node, l);
+	    node->left = left;
+	    
+	    leaf_t * right = newLeaf(node, r);
+	    node->right = right;
+	    
+	}
+    }
+        
+    /**
+     * Returns the exact nearest neighbor (NN).
+     * If there are more NNs, method retuns one random.
+     * E selects the points that are skipped, by default the points at 
+     * zero distance from the query (see Exclusion):
+     *	tree.nearestNeighbor(&query);
+     *	tree.nearestNeighbor<EXCLUDE_SELF>(&points[i], &points[i]);
+     * 
+     * With maxDist only points nearer than maxDist are searched, the cells
+     * farther away are pruned from the start, so a query far from all 
+     * points (an outlier) costs about as much as one with a near NN:
+     *	tree.nearestNeighbor(&query, KDTree<3>::none(), 0.05f);
+     * @param query the point whose NN we search
+     * @param self the point EXCLUDE_SELF skips
+     * @param maxDist largest distance of the NN (true distance, like the radius of circularQuery)
+     * @return nearest neigbor, none() if there is none (in range)
+     */
+    template<Exclusion E = EXCLUDE_ZERO>
+    ref nearestNeighbor(const P *query, ref self = none(), dist_t maxDist = numeric_limits<dist_t>::max()) {
+	visitedNodes = 0;
+	if(sizep == 0)
+	    return none();
+	KDTREE_STAT(stats.begin(QUERY_NN));
+	dist_t dist;
+	ref nearest = findNearest<E>(query, dist, self, searchBound(maxDist));
+	KDTREE_STAT(stats.end());
+	return nearest;
+    }
+    
+    /**
+     * Returns exact k-nearest neighbors (kNN).
+     * Like NN, the points E excludes are skipped (see Exclusion), and 
+     * only points nearer than maxDist are returned, fewer than k if there 
+     * are not enough in range (see nearestNeighbor).
+     * @param query the point whose kNN we search
+     * @param k the number of points we look for
+     * @param self the point EXCLUDE_SELF skips
+     * @param maxDist largest distance of the neighbors
+     * @return vector of kNN, sorted by the distance
+     */
+    template<Exclusion E = EXCLUDE_ZERO>
+    vector< ref > kNearestNeighbors(const P *query, const int k, ref self = none(), 
+	    dist_t maxDist = numeric_limits<dist_t>::max()) {
+	visitedNodes = 0;
+	vector< ref > result;
+	if(sizep == 0 || k <= 0)
+	    return result;
+	KDTREE_STAT(stats.begin(QUERY_KNN));
+	//the first radius from the nearest point not at the query
+	const dist_t bound = searchBound(maxDist);
+	dist_t dist;
+	findNearest<EXCLUDE_ZERO>(query, dist, none(), bound);
+	if(dist == bound && E == EXCLUDE_ZERO) { //all points (in range) are at the query
+	    KDTREE_STAT(stats.end());
+	    return result;
+	}
+	//all points in range are at the query, any radius has them all
+	dist_t r = dist == bound ? 1 : metric.root(dist) * (1 + 2 / (dist_t)D);
+	r = min(r, maxDist);
+	
+	vector< pair<dist_t, ref> > knn;
+	const Nearest<ref, E> excluded(self, none());
+	//k of the same points and the excluded one
+	Candidates< ref > inside(k + 1);
+	
+	//TODO: this is certainly not the most efficient solution
+	//however all "clever" solutions I tried failed in hight dimension or on
+	//various data. So I'll leave this, usually returns result <5 iterations.
+	while(true) { 
+	    inside.clear();
+	    findInRadius(query, r, inside);
+	    knn.clear();
+	    for(points_it it = inside.refs.begin(); it != inside.refs.end(); ++it) {
+		dist_t tmp = distance(getPoint(*it), query);
+		if(excluded.accepts(*it, tmp)) //ie not the excluded point
+		    knn.push_back(make_pair(tmp, *it));
+	    }
+	    if(knn.size() >= (size_t) k || inside.count == (size_t) sizep 
+		    || r == numeric_limits<dist_t>::infinity() || r >= maxDist) {
+		break;
+	    }
+	    r = min(r * (1 + (1 / (dist_t) D)), maxDist);
+	}
+	
+	//all points within r are known, so the k nearest of them are the kNN
+	size_t size = min((size_t) k, knn.size());
+	partial_sort(knn.begin(), knn.begin() + size, knn.end(), 
+	    [](const pair<dist_t, ref> &a, const pair<dist_t, ref> &b) -> bool { 
+		return a.first < b.first; 
+	    });
+	result.reserve(size);
+	for(size_t i = 0; i < size; i++) {
+	    result.push_back(knn[i].second);
+	}
+	
+	KDTREE_STAT(stats.end());
+	return result;
+    }
+    
+    /**
+     * Returns the exact nearest neighbor (NN), like nearestNeighbor(query), 
+     * but searches from the root down with a caller owned scratch stack 
+     * instead of walking up from the bucket of the query.
+     * @param query the point whose NN we search
+     * @param scratch reused by the queries of one thread, see threadScratch
+     * @param self the point EXCLUDE_SELF skips
+     * @param maxDist largest distance of the NN
+     * @return nearest neigbor, none() if there is none (in range)
+     */
+    template<Exclusion E = EXCLUDE_ZERO>
+    ref nearestNeighbor(const P *query, descent_t &scratch, ref self = none(), 
+	    dist_t maxDist = numeric_limits<dist_t>::max()) {
+	visitedNodes = 0;
+	if(sizep == 0)
+	    return none();
+	KDTREE_STAT(stats.begin(QUERY_NN));
+	dist_t dist = searchBound(maxDist);
+	Nearest<ref, E> nearest(self, none());
+	descend(query, dist, nearest, scratch);
+	KDTREE_STAT(stats.end());
+	return nearest.nearest;
+    }
+    
+    /**
+     * Returns the exact nearest neighbor (NN), like nearestNeighbor(query),
+     * for streams of queries close to each other (see cursor_t).
+     * 
+     * The search starts in the leaf of the last query, the last NN is the
+     * first candidate: the bound is its distance, at most the last NN
+     * distance plus the displacement of the query. Then it walks up the
+     * path and searches the other child of every node from the root down,
+     * but only until the sphere of the bound lies inside the cell, nothing
+     * outside of it can be closer. So a query that has moved a little
+     * touches a few nodes around its leaf, not the whole path to the root.
+     * @param query the point whose NN we search
+     * @param cursor state of the stream, one per stream
+     * @param self the point EXCLUDE_SELF skips
+     * @param maxDist largest distance of the NN
+     * @return nearest neigbor, none() if there is none (in range)
+     */
+    template<Exclusion E = EXCLUDE_ZERO>
+    ref nearestNeighbor(const P *query, cursor_t &cursor, ref self = none(), 
+	    dist_t maxDist = numeric_limits<dist_t>::max()) {
+	visitedNodes = 0;
+	if(sizep == 0)
+	    return none();
+	KDTREE_STAT(stats.begin(QUERY_NN));
+	const bool valid = cursor.found && cursor.tree == this && cursor.revision == revision;
+	const leaf_t *leaf = locate(query, cursor);
+	const dist_t bound = searchBound(maxDist);
+	dist_t dist = bound;
+	Nearest<ref, E> nearest(self, none());
+	if(valid) {
+	    dist_t last = distance(query, getPoint(cursor.nearest));
+	    if(last < bound && nearest.accepts(cursor.nearest, last)) { //in range, not the excluded point
+		dist = last;
+		nearest.nearest = cursor.nearest;
+	    }
+	}
+	scanBucket(query, leaf, dist, nearest);
+	
+	//the cells of the path from the leaf up, restored level by level
+	dist_t low[D], high[D];
+	copy(cursor.low, cursor.low + D, low);
+	copy(cursor.high, cursor.high + D, high);
+	for(size_t i = cursor.path.size(); i-- > 0; ) {
+	    dist_t margin = numeric_limits<dist_t>::infinity();
+	    for(int d = 0; d < D; d++) {
+		margin = min(margin, metric.term(min((dist_t) (*query)[d] - low[d], high[d] - (dist_t) (*query)[d]), d));
+	    }
+	    if(margin >= dist)
+		break; //the sphere is inside the cell
+	    const typename cursor_t::Level &level = cursor.path[i];
+	    if(level.dimension < 0)
+		continue; //one child, the same cell
+	    KDTREE_STAT(stats.innerNode());
+	    const int d = level.dimension;
+	    const dist_t diff = (dist_t) (*query)[d] - (dist_t) level.node->split;
+	    const dist_t offset = metric.term(diff, d);
+	    if(offset < dist) {
+		descent_t &scratch = cursor.scratch;
+		scratch.clear();
+		const typename descent_t::Entry e = {level.upper ? level.node->right : level.node->left, offset, offset, d, 0};
+		scratch.enter(e);
+		descend(query, e.node, offset, dist, nearest, scratch);
+	    }
+	    (level.upper ? high : low)[d] = level.old;
+	}
+	cursor.found = dist < bound;
+	cursor.nearest = nearest.nearest;
+	KDTREE_STAT(stats.end());
+	return nearest.nearest;
+    }
+    
+    /**
+     * Returns all points in a hypersphere around given point
+     * @param query center of the sphere
+     * @param radius radius of the sphere
+     * @return list of points inside
+     */
+    vector< ref > circularQuery(const P *query, const dist_t radius) {
+	visitedNodes = 0;
+	if(sizep == 0)
+	    return vector< ref >();
+	KDTREE_STAT(stats.begin(QUERY_RADIUS));
+	vector< ref > data;
+	findInRadius(query, radius, data);
+	KDTREE_STAT(stats.end());
+	return data;
+    }
+    
+    /**
+     * Radius query from the root down, see nearestNeighbor(query, scratch)
+     * @param query center of the sphere
+     * @param radius radius of the sphere
+     * @param scratch reused by the queries of one thread, see threadScratch
+     * @return list of points inside
+     */
+    vector< ref > circularQuery(const P *query, const dist_t radius, descent_t &scratch) {
+	visitedNodes = 0;
+	vector< ref > data;
+	if(sizep == 0)
+	    return data;
+	KDTREE_STAT(stats.begin(QUERY_RADIUS));
+	dist_t r = metric.reduce(radius);
+	descend(query, r, data, scratch);
+	KDTREE_STAT(stats.end());
+	return data;
+    }
+    
+    /**
+     * Scratch stack of the calling thread, for the root-down queries
+     * when the caller does not keep its own
+     */
+    static descent_t &threadScratch() {
+	static thread_local descent_t scratch;
+	return scratch;
+    }
+    
+
+    /**
+     * !! This is just to compare the performance with the better version !!
+     * 
+     * Returns the exact nearest neighbor (NN).
+     * If there are more NNs, method retuns one random.
+     * @param query the point whose NN we search
+     * @param self the point EXCLUDE_SELF skips (see Exclusion)
+     * @return nearest neigbor, none() if there is none
+     */
+    template<Exclusion E = EXCLUDE_ZERO>
+    ref simpleNearestNeighbor(const P *query, ref self = none()) {
+	visitedNodes = 0;
+	if(sizep == 0)
+	    return none();
+	KDTREE_STAT(stats.begin(QUERY_SIMPLE_NN));
+	KDTREE_STAT(stats.leaf());
+	leaf_t *leaf = findBucket(query);
+	dist_t dist = numeric_limits<dist_t>::max();
+	ref nearest = none();
+	const Nearest<ref, E> excluded(self, none());
+	
+	//find nearest point in the bucket
+	for(points_it it = leaf->bucket.begin(); it != leaf->bucket.end(); ++it) {
+	    //(*it)->setColor(0, 255, 0); //debug only
+	    visitedNodes++;
+	    KDTREE_STAT(stats.point());
+	    dist_t tmp = distance(query, getPoint(*it));
+	    if(tmp < dist && excluded.accepts(*it, tmp)) { //ie not the excluded point
 		dist = tmp;
 		nearest = *it;
 	    }
 	}
 	
 	//create initial window
-	float window[2*D];
+	dist_t window[2*D];
 	for(int d = 0; d < D; d++) {
-	    window[2*d] = (*query)[d] - dist;
-	    window[2*d + 1] = (*query)[d] + dist;
+	    window[2*d] = (*query)[d] - metric.extent(dist, d);
+	    window[2*d + 1] = (*query)[d] + metric.extent(dist, d);
 	}	
 	//cout << window[0] << " " << window[1]<< " " << window[2]<< " " << window[3] << "\n";
 	//PlyHandler::saveWindow<D>(window);
 	
 	exInner n;
 	n.first = leaf->parent;
-	if((Leaf<D> *)leaf->parent->left == leaf)
+	if((leaf_t *)leaf->parent->left == leaf)
 	    n.second = LEFT;
 	else
 	    n.second = RIGHT;
 	
 	stack<exInner> stack; //avoid recursion
 	stack.push(n);
+	KDTREE_STAT(stats.depth(1));
 	
 	while(!stack.empty()) { //check possible nodes
 	    exInner exNode = stack.top();
 	    stack.pop();
-	    Inner* node = exNode.first;
+	    KDTREE_STAT(stats.innerNode());
+	    inner_t* node = exNode.first;
 	    Visited status = exNode.second;
 	    
-	    Node *nodes[2]; //left and right child
+	    node_t *nodes[2]; //left and right child
 	    nodes[0] = nodes[1] = NULL;
 	    
 	    if(node->right && (status != RIGHT || status == NONE)) {
@@ -756,25 +1456,28 @@ public:
 	    for(int i = 0; i < 2; i++) {
 		if(nodes[i]) { //check node 
 		    if((nodes[i])->isLeaf()) {
-			points *bucket = &((Leaf<D> *)(nodes[i]))->bucket;
+			KDTREE_STAT(stats.leaf());
+			points *bucket = &((leaf_t *)(nodes[i]))->bucket;
 			for(points_it it = bucket->begin(); it != bucket->end(); ++it) {
 			    //(*it)->setColor(255, 255, 0);
 			    visitedNodes++;
-			    float tmp = distance(query, *it, true);
-			    if(tmp < dist && tmp > 0) { //ie points are not the same!
+			    KDTREE_STAT(stats.point());
+			    dist_t tmp = distance(query, getPoint(*it));
+			    if(tmp < dist && excluded.accepts(*it, tmp)) { //ie not the excluded point
 				dist = tmp;
 				nearest = *it;
 				for(int d = 0; d < D; d++) {
-				    window[2*d] = (*query)[d] - dist;
-				    window[2*d + 1] = (*query)[d] + dist;
+				    window[2*d] = (*query)[d] - metric.extent(dist, d);
+				    window[2*d + 1] = (*query)[d] + metric.extent(dist, d);
 				}
 			    }
 			}
 		    }
 		    else {
 			//Not leaf, add Node to the stack
-			exInner add((Inner *) nodes[i], NONE);
+			exInner add((inner_t *) nodes[i], NONE);
 			stack.push(add);
+			KDTREE_STAT(stats.depth(stack.size()));
 		    }
 		}
 	    }
@@ -782,15 +1485,17 @@ public:
 	    //on my way up && not in root
 	    if(status != NONE && node->parent) {
 		exInner add;
-		add.first = (Inner *) node->parent;
-		if((Inner *) node->parent->right == node) 
+		add.first = (inner_t *) node->parent;
+		if((inner_t *) node->parent->right == node) 
 		    add.second = RIGHT;
 		else
 		    add.second = LEFT;
 
 		stack.push(add);	
+		KDTREE_STAT(stats.depth(stack.size()));
 	    }
 	}
+	KDTREE_STAT(stats.end());
 	return nearest;
     }
     
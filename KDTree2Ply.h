@@ -77,12 +77,12 @@ private:
      * @param paint if true, every bucket is given random color
      * @return 
      */
-    static vector< Point<D> > debugBuckets(const Inner* node, bool paint) {
+    static vector< Point<D> > debugBuckets(const Inner<>* node, bool paint) {
 	vector< Point<D> > data;
 	if(node->left) {
 	    
 	    if(!node->left->isLeaf()) {
-		vector< Point<D> > d = debugBuckets((Inner *) node->left, paint);
+		vector< Point<D> > d = debugBuckets((Inner<> *) node->left, paint);
 		data.insert(data.end(), d.begin(), d.end());
 	    }
 	    else {
@@ -103,7 +103,7 @@ private:
 	}
 	if(node->right) {
 	    if(!node->right->isLeaf()) {
-		vector< Point<D> > d = debugBuckets((Inner *) node->right, paint);
+		vector< Point<D> > d = debugBuckets((Inner<> *) node->right, paint);
 		data.insert(data.end(), d.begin(), d.end());
 	    }
 	    else {
@@ -131,7 +131,7 @@ private:
      * @param bound
      * @return 
      */
-    static vector< Point<D> > debugTree(const Inner* node, const float* bound) {
+    static vector< Point<D> > debugTree(const Inner<>* node, const float* bound) {
 	vector< Point<D> > data;
 	if(D != 2) return data;
 	
@@ -151,7 +151,7 @@ private:
 	    float b[4];
 	    std::copy(bound, bound + 4, &b[0]);
 	    b[2*node->dimension + 1] = node->split;
-	    vector< Point<D> > d = debugTree((Inner *) node->left, &b[0]);
+	    vector< Point<D> > d = debugTree((Inner<> *) node->left, &b[0]);
 	    data.insert(data.end(), d.begin(), d.end());
 	}
 	
@@ -159,7 +159,7 @@ private:
 	    float b[4];
 	    std::copy(bound, bound + 4, &b[0]);
 	    b[2*node->dimension] = node->split;
-	    vector< Point<D> > d = debugTree((Inner *) node->right, &b[0]);
+	    vector< Point<D> > d = debugTree((Inner<> *) node->right, &b[0]);
 	    data.insert(data.end(), d.begin(), d.end());
 	}
 	return data;
@@ -13,18 +13,132 @@
 #include <vector>
 #include <limits>
 #include <math.h>
+#include <stdint.h>
+#include <atomic>
+#include "Point.h"
 
 
-struct Inner;
+template<typename T = float> struct Inner;
+
+/**
+ * Type of (squared) distances between coordinates of type T.
+ * Floating point coordinates use their own type, integer (quantized)
+ * coordinates use double, squared int32 differences would overflow.
+ */
+template<typename T>
+struct DistanceType {
+    typedef double type;
+};
+
+template<>
+struct DistanceType<float> {
+    typedef float type;
+};
+
+/**
+ * How the tree refers to the points of type P (Point, Coords, ...).
+ * Either raw pointers, or 32-bit indices into a caller-owned array
+ * of points (base), which can then be relocated or shared.
+ * none() is the reference of no point: NULL, or the largest index
+ * (an indexed tree holds fewer points).
+ */
+template<typename P, bool Indexed>
+struct PointRef;
+
+template<typename P>
+struct PointRef<P, false> {
+    typedef P * type;
+    
+    static P * get(P * base, type r) {
+	return r;
+    }
+    static type make(P * base, uint32_t idx) {
+	return base + idx;
+    }
+    static type none() {
+	return NULL;
+    }
+};
+
+template<typename P>
+struct PointRef<P, true> {
+    typedef uint32_t type;
+    
+    static P * get(P * base, type r) {
+	return base + r;
+    }
+    static type make(P * base, uint32_t idx) {
+	return idx;
+    }
+    static type none() {
+	return std::numeric_limits<uint32_t>::max();
+    }
+};
+
+/**
+ * Which points the NN and kNN queries skip. It is a template parameter
+ * of the queries, the test in the bucket scans is compiled for it.
+ */
+enum Exclusion {
+    /** points at zero distance from the query: the query itself if it 
+     *  is in the tree, and all its duplicates (the default) */
+    EXCLUDE_ZERO,
+    /** one given point (pointer or index), its duplicates are found */
+    EXCLUDE_SELF,
+    /** nothing, a point at the query is its nearest neighbor */
+    EXCLUDE_NONE
+};
+
+/**
+ * NN found so far, with the point the query skips (EXCLUDE_SELF)
+ */
+template<typename Ref, Exclusion E>
+struct Nearest {
+    Ref nearest;
+    Ref self;
+    
+    /** none is the nearest until a point is accepted (see PointRef::none) */
+    Nearest(Ref self, Ref none) : nearest(none), self(self) {}
+    
+    /** can the point at the distance be the result */
+    template<typename Dist>
+    bool accepts(Ref r, Dist dist) const {
+	if(E == EXCLUDE_ZERO) return dist > 0;
+	if(E == EXCLUDE_SELF) return r != self;
+	return true;
+    }
+};
+
+/**
+ * Points inside the radius of a kNN query. A bucket with more than B
+ * points holds the same point (see KDTree::insert), only the first limit
+ * of its points above B are kept, the rest is only counted.
+ */
+template<typename Ref>
+struct Candidates {
+    std::vector<Ref> refs;
+    /** number of points inside, kept or not */
+    size_t count;
+    /** points kept of one bucket above its first B */
+    size_t limit;
+    
+    Candidates(size_t limit) : count(0), limit(limit) {}
+    
+    void clear() {
+	refs.clear();
+	count = 0;
+    }
+};
 
 /**
  * Parent of nodes, can't be instantiated
- *  
+ * T is the type of the coordinates
  */
+template<typename T = float>
 struct Node {
     
     /** Pointer to parent node */
-    Inner * parent;
+    Inner<T> * parent;
     
     /** Returns true if node is leaf */
     const bool isLeaf() const {
@@ -35,7 +149,7 @@ struct Node {
     
 protected:
     /** Constructor for child classes */
-    Node(const bool leaf, Inner* parent) : leaf(leaf), parent(parent) {}
+    Node(const bool leaf, Inner<T>* parent) : parent(parent), leaf(leaf) {}
 
 private:
     const bool leaf;
@@ -47,64 +161,186 @@ private:
  * information about dimension split
  * 
  */
-struct Inner : Node {
+template<typename T>
+struct Inner : Node<T> {
     /** index of dimension that is split by this node */
     unsigned int dimension;
     /** value where the dimesion is split*/
-    float split;
+    T split;
+    
+    Node<T>* left;
+    Node<T>* right;
     
-    Node* left;
-    Node* right;
+    /** the children are not freed with it, the owner of the nodes frees them all */
+    Inner(Inner *parent) : Node<T>(false, parent), left(NULL), right(NULL) {}
+};
+
+/**
+ * Coordinates of the points in a leaf quantized to 8 bits relative 
+ * to the leaf bounds. The bucket scan reads these small contiguous codes
+ * first and touches the real point only if it can be closer than 
+ * the current best. The codes take D bytes per point, the quantization
+ * step follows from the bounds and is not stored.
+ * The unquantized version is empty and costs nothing.
+ */
+template<const int D, typename T, bool Quantized>
+struct LeafCodes {
+    template<bool Indexed, typename Ref, typename P>
+    void quantize(const std::vector<Ref> &, P *, const T *, const T *) {}
     
-    Inner(Inner *parent) : Node(false, parent), left(NULL), right(NULL) {}
-    ~Inner() {
-	if(left) delete left;
-	if(right) delete right;
+    template<typename P>
+    void quantize(const P &, const T *, const T *) {}
+    
+    template<typename P, typename Dist, typename Metric>
+    Dist lowerBound(size_t, const P *, const T *, const T *, const Metric &) const {
+	return 0;
+    }
+    
+    size_t codeBytes() const {
+	return 0;
+    }
+};
+
+template<const int D, typename T>
+struct LeafCodes<D, T, true> {
+    typedef typename DistanceType<T>::type dist;
+    
+    /** D codes per point, in the bucket order */
+    std::vector<uint8_t> codes;
+    
+    /**
+     * Size of one quantization step in dimension d
+     */
+    template<typename Dist>
+    static Dist step(const T * min, const T * max, int d) {
+	return ((Dist) max[d] - (Dist) min[d]) * (Dist) (1.0 / 255);
+    }
+    
+    /**
+     * Appends the codes of a point inside the bounds
+     * @param p the point
+     * @param min lower bounds of the leaf
+     * @param max upper bounds of the leaf
+     */
+    template<typename P>
+    void quantize(const P &p, const T * min, const T * max) {
+	for(int d = 0; d < D; d++) {
+	    const dist s = step<dist>(min, max, d);
+	    codes.push_back((s > 0) ? (uint8_t) std::min((dist) 255, ((dist) p[d] - (dist) min[d]) / s + (dist) 0.5) : 0);
+	}
+    }
+    
+    /**
+     * Recomputes the codes of all points
+     * @param bucket references to the points of the leaf
+     * @param base array the indices refer to
+     * @param min lower bounds of the leaf
+     * @param max upper bounds of the leaf
+     */
+    template<bool Indexed, typename Ref, typename P>
+    void quantize(const std::vector<Ref> &bucket, P * base, const T * min, const T * max) {
+	codes.clear();
+	codes.reserve(bucket.size() * D);
+	for(size_t i = 0; i < bucket.size(); i++) {
+	    quantize(*PointRef<P, Indexed>::get(base, bucket[i]), min, max);
+	}
+    }
+    
+    /**
+     * Memory allocated for the codes
+     */
+    size_t codeBytes() const {
+	return codes.capacity() * sizeof(uint8_t);
+    }
+    
+    /**
+     * Lower bound of the distance from the query to i-th point in the
+     * metric of the tree (see Metric.h), computed only from the codes
+     */
+    template<typename P, typename Dist, typename Metric>
+    Dist lowerBound(size_t i, const P * query, const T * min, const T * max, const Metric &metric) const {
+	Dist dist = 0;
+	const uint8_t * c = &codes[i*D];
+	for(int d = 0; d < D; d++) {
+	    const Dist s = step<Dist>(min, max, d);
+	    Dist tmp = fabs((Dist) min[d] + c[d] * s - (Dist) (*query)[d]) - s;
+	    if(tmp > 0)
+		dist = metric.add(dist, metric.term(tmp, d));
+	}
+	return dist;
     }
 };
 
 /**
  * Leaf (bucket) in the tree.
- * Contains only list of pointers to points
+ * Contains only list of references (pointers or indices) to points
+ * and optionally their quantized coordinates (see LeafCodes)
  * 
  */
-template<const int D = 3>
-struct Leaf : Node {
-    std::vector< Point<D> * > bucket;
+template<const int D = 3, typename P = Point<D>, bool Indexed = false, bool Quantized = false>
+struct Leaf : Node<typename P::value_type>, LeafCodes<D, typename P::value_type, Quantized> {
+    typedef typename P::value_type T;
+    typedef typename PointRef<P, Indexed>::type ref;
+    
+    std::vector< ref > bucket;
     /** lower bound, BOB test */
-    float min[D]; 
+    T min[D]; 
     /** upper bound, BOB test */
-    float max[D]; 
+    T max[D]; 
     
-    Leaf(Inner *parent, std::vector< Point<D>* > bucket) : Node(true, parent), bucket(bucket) {
+    /**
+     * @param parent parent node
+     * @param bucket references to points
+     * @param base array the indices refer to, not used with pointers
+     */
+    Leaf(Inner<T> *parent, std::vector< ref > bucket, P * base = NULL) : Node<T>(true, parent), bucket(bucket) {
 	for(int d = 0; d < D; d++) {
-	    min[d] = std::numeric_limits<float>::max();
-	    max[d] = 0;
+	    min[d] = std::numeric_limits<T>::max();
+	    max[d] = std::numeric_limits<T>::lowest();
 	}
-	for(typename std::vector< Point<D> * >::iterator it = bucket.begin(); it!= bucket.end(); ++it) {
-	    Point<D> * p = *it;
+	for(typename std::vector< ref >::iterator it = this->bucket.begin(); it!= this->bucket.end(); ++it) {
+	    P * p = PointRef<P, Indexed>::get(base, *it);
 	    for(int d = 0; d < D; d++) {
 		if((*p)[d] > max[d]) max[d] = (*p)[d];
 		if((*p)[d] < min[d]) min[d] = (*p)[d];
 	    }
 	}
+	this->template quantize<Indexed>(this->bucket, base, min, max);
     }
+    /** moves the bucket, used when the nodes are laid out again */
+    Leaf(Leaf &&) = default;
     ~Leaf() {}
     
-    void add(Point<D> * p) {
-	bucket.push_back(p);
+    /**
+     * Adds the point, only its codes are computed unless it extends 
+     * the bounds (then the bucket has less than B points, see KDTree::insert)
+     */
+    void add(ref r, P * base = NULL) {
+	bucket.push_back(r);
+	P * p = PointRef<P, Indexed>::get(base, r);
+	bool inside = true;
 	for(int d = 0; d < D; d++) {
-	    if((*p)[d] > max[d]) max[d] = (*p)[d];
-	    if((*p)[d] < min[d]) min[d] = (*p)[d];
+	    if((*p)[d] > max[d]) {
+		max[d] = (*p)[d];
+		inside = false;
+	    }
+	    if((*p)[d] < min[d]) {
+		min[d] = (*p)[d];
+		inside = false;
+	    }
 	}
+	if(inside)
+	    this->quantize(*p, min, max);
+	else
+	    this->template quantize<Indexed>(bucket, base, min, max);
     }
     
-    const float getDensity() const {
-	float vol = 1;
+    const double getDensity() const {
+	double vol = 1;
 	for(int d = 0; d < D; d++) {
-	    vol *= max[d] - min[d];
+	    vol *= (double) max[d] - (double) min[d];
 	}
-	return vol / (float)bucket.size();
+	return vol / (double)bucket.size();
     }
 
 };
@@ -112,12 +348,15 @@ struct Leaf : Node {
 /**
  * Object that keeps track of the distance coverd
  * from NN query.
+ * Dist is the type of the distances (see DistanceType), the tracker 
+ * keeps the terms of the metric of the tree (see Metric.h), they only 
+ * grow on the way down, so the length is updated incrementally.
  */
-template<const int D = 3>
+template<const int D = 3, typename Dist = float>
 struct TrackingNode {
 private:
-    float tracker[D];
-    float length;
+    Dist tracker[D];
+    Dist length;
     
 public:
     /**
@@ -132,7 +371,7 @@ public:
     ~TrackingNode() {}
     
     //read only
-    const float& operator[](int idx) const {
+    const Dist& operator[](int idx) const {
 	return tracker[idx];
     }
     
@@ -140,11 +379,13 @@ public:
      * Sets value in given dimension to given length
      * @param d dimension
      * @param val length
+     * @param metric metric of the tree
      */
-    void set(int d, float val) {
-	length -= tracker[d];
-	tracker[d] = val*val;
-	length += tracker[d];
+    template<typename Metric>
+    void set(int d, Dist val, const Metric &metric) {
+	const Dist term = metric.term(val, d);
+	length = metric.update(length, tracker[d], term);
+	tracker[d] = term;
     }
     
     /**
@@ -153,19 +394,19 @@ public:
      * on stack if it's not necessary.
      * @param d dimension
      * @param val value to change
+     * @param metric metric of the tree
      * @return squared length
      */
-    float getUpdatedLength(int d, float val) const {
-	float temp =  length - tracker[d];
-	temp += val * val;
-	return temp;
+    template<typename Metric>
+    Dist getUpdatedLength(int d, Dist val, const Metric &metric) const {
+	return metric.update(length, tracker[d], metric.term(val, d));
     }
   
     /**
      * Returns the length from the query
      * @return length
      */
-    float getLength() const {
+    Dist getLength() const {
 	return sqrt(length);
     }
     
@@ -173,7 +414,7 @@ public:
      * Returns the sqared length from the query
      * @return length square
      */
-    float getLengthSquare() const {
+    Dist getLengthSquare() const {
 	return length;
     }
 
@@ -194,26 +435,209 @@ enum Visited {
 /**
  * Structure on the stack for NN search
  */
-template<const int D = 3>
+template<const int D = 3, typename T = float>
 struct ExtendedNode {
-    Inner * node;
+    Inner<T> * node;
     Visited status;
-    TrackingNode<D> tn;
+    TrackingNode<D, typename DistanceType<T>::type> tn;
     
     ExtendedNode() : node(NULL) {}
-    ExtendedNode(Inner * node) : node(node) {}
+    ExtendedNode(Inner<T> * node) : node(node) {}
+};
+
+/**
+ * Scratch memory of the root-down queries, reused by all queries of 
+ * one thread (see KDTree::nearestNeighbor(query, scratch)).
+ * 
+ * The query keeps one array of the squared offsets of the query from 
+ * the current cell, per dimension (the terms of the metric, see Metric.h). An entry of a postponed (far) child 
+ * stores only the offset it changes, the offsets it overwrites go to 
+ * an undo log and are restored when the search returns above it.
+ * Both arrays are never longer than the height of the tree, they grow 
+ * to it once and are not reallocated after that.
+ */
+template<const int D = 3, typename T = float>
+struct DescentStack {
+    typedef typename DistanceType<T>::type Dist;
+    
+    /** postponed subtree */
+    struct Entry {
+	const Node<T> * node;
+	/** squared distance of the query to the cell of the node */
+	Dist bound;
+	/** squared offset of the cell in dimension */
+	Dist offset;
+	int dimension;
+	/** size of the undo log when the entry was pushed */
+	uint32_t undo;
+    };
+    
+    /** overwritten offset */
+    struct Undo {
+	int dimension;
+	Dist offset;
+    };
+    
+    std::vector<Entry> entries;
+    std::vector<Undo> undo;
+    /** squared offsets of the current cell */
+    Dist offsets[D];
+    
+    /**
+     * @param capacity expected height of the trees
+     */
+    DescentStack(size_t capacity = 64) {
+	entries.reserve(capacity);
+	undo.reserve(capacity);
+	clear();
+    }
+    
+    void clear() {
+	entries.clear();
+	undo.clear();
+	for(int d = 0; d < D; d++) offsets[d] = 0;
+    }
+    
+    /**
+     * Postpones a subtree whose cell differs from the current one in dimension d
+     */
+    void push(const Node<T> * node, Dist bound, int d, Dist offset) {
+	Entry e = {node, bound, offset, d, (uint32_t) undo.size()};
+	entries.push_back(e);
+    }
+    
+    /**
+     * Restores the offsets of the cell of the entry, call it on the popped entry
+     */
+    void enter(const Entry &e) {
+	while(undo.size() > e.undo) {
+	    offsets[undo.back().dimension] = undo.back().offset;
+	    undo.pop_back();
+	}
+	Undo u = {e.dimension, offsets[e.dimension]};
+	undo.push_back(u);
+	offsets[e.dimension] = e.offset;
+    }
+};
+
+/**
+ * Revision numbers of the trees, unique across all trees, so a cursor
+ * can't take a new tree at the address of a destroyed one for its own
+ */
+inline uint64_t nextRevision() {
+    static std::atomic<uint64_t> revision(0);
+    return ++revision;
+}
+
+/**
+ * Cursor of a stream of NN queries that move only a little between the
+ * calls (tracking, trajectories), see KDTree::nearestNeighbor(query, cursor).
+ *
+ * Keeps the leaf of the last query with the path to it and its cell,
+ * and the last NN. The next query walks up only until the cell contains
+ * it and starts with the distance to the last NN as the bound, which
+ * mostly ends the search a few levels above the leaf.
+ * A cursor belongs to one tree, it starts over when the tree changes.
+ * Ref is the reference to a point of the tree (KDTree::ref).
+ */
+template<const int D, typename T, typename Ref>
+struct QueryCursor {
+    typedef typename DistanceType<T>::type Dist;
+
+    /** inner node on the path and the bound of the cell it has overwritten */
+    struct Level {
+	const Inner<T> * node;
+	/** -1 if the node has one child, the cell is the same */
+	int dimension;
+	/** true if the upper bound was overwritten */
+	bool upper;
+	Dist old;
+    };
+
+    /** path from the root to the leaf */
+    std::vector<Level> path;
+    /** leaf of the last query, NULL if there is none */
+    const Node<T> * leaf;
+    /** cell of the leaf, lower bounds are exclusive, upper inclusive */
+    Dist low[D];
+    Dist high[D];
+    /** NN of the last query */
+    Ref nearest;
+    bool found;
+    /** tree and its revision the leaf belongs to */
+    const void * tree;
+    uint64_t revision;
+    /** scratch of the searches of the other children on the path */
+    DescentStack<D, T> scratch;
+
+    QueryCursor(size_t capacity = 64) {
+	path.reserve(capacity);
+	reset();
+    }
+
+    /**
+     * Forgets the leaf and the NN, the next query starts at the root
+     */
+    void reset() {
+	path.clear();
+	leaf = NULL;
+	found = false;
+	tree = NULL;
+	revision = 0;
+	for(int d = 0; d < D; d++) {
+	    low[d] = -std::numeric_limits<Dist>::infinity();
+	    high[d] = std::numeric_limits<Dist>::infinity();
+	}
+    }
+
+    template<typename P>
+    bool contains(const P * query) const {
+	for(int d = 0; d < D; d++) {
+	    if(!(low[d] < (*query)[d] && (*query)[d] <= high[d]))
+		return false;
+	}
+	return true;
+    }
+
+    /**
+     * Goes from the node to its child: the cell is cut by the split,
+     * or stays the same (dimension -1)
+     */
+    void down(const Inner<T> * node, int dimension, bool upper) {
+	Level l = {node, dimension, upper, 0};
+	if(dimension >= 0) {
+	    Dist &bound = upper ? high[dimension] : low[dimension];
+	    l.old = bound;
+	    bound = (Dist) node->split;
+	}
+	path.push_back(l);
+    }
+
+    /**
+     * Goes to the parent of the current node, its cell is restored
+     * @return the parent
+     */
+    const Inner<T> * up() {
+	const Level l = path.back();
+	path.pop_back();
+	if(l.dimension >= 0)
+	    (l.upper ? high : low)[l.dimension] = l.old;
+	return l.node;
+    }
 };
 
 /**
  * Structure on the stack tree construction
  */
-template<const int D = 3>
+template<const int D = 3, typename P = Point<D>, bool Indexed = false>
 struct Constr {
-    std::vector< Point<D> *> data;
-    float bounds[2*D];
-    Inner *parent;
+    typedef typename P::value_type T;
+    
+    std::vector< typename PointRef<P, Indexed>::type > data;
+    T bounds[2*D];
+    Inner<T> *parent;
 
-    Constr(std::vector< Point<D> *> data, float * bounds, Inner *parent) 
+    Constr(std::vector< typename PointRef<P, Indexed>::type > data, T * bounds, Inner<T> *parent) 
 	    : data(data), parent(parent) {
 
 	std::copy(bounds, bounds + 2*D, &this->bounds[0]);
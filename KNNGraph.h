@@ -0,0 +1,335 @@
+/*
+ * File:   KNNGraph.h
+ * Author: Daniel Princ
+ *
+ * kNN graph of all points of a tree (self join), the neighborhoods for
+ * normal estimation, clustering and similar per point computations.
+ *
+ */
+
+#ifndef KNNGRAPH_H
+#define	KNNGRAPH_H
+
+#include <stdint.h>
+#include <vector>
+#include <stack>
+#include <thread>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include "KDTreeNodes.h"
+#include "Metric.h"
+
+using namespace std;
+
+/**
+ * k nearest neighbors of every point of a tree, in the compressed sparse
+ * row format: neighbors of the point i are
+ * neighbors[offsets[i]] .. neighbors[offsets[i + 1] - 1], sorted by the
+ * distance, distances holds their squared distances. Points are the
+ * indices into the array the tree is built on. Like kNearestNeighbors,
+ * points at zero distance from a point are not its neighbors, so a point
+ * has less than k neighbors only if there are not enough other points.
+ *
+ * build() goes leaf by leaf instead of point by point. All points of a
+ * leaf start with the points of the leaf and of the previous leaf and
+ * their neighbors as candidates (the leaves are in depth first order,
+ * so the previous one is close), which mostly gives bounds near the
+ * final kNN distances. Then one root-down traversal for the whole leaf
+ * visits only the leaves closer to its bounding box than the largest
+ * bound. Ranges of leaves run in parallel, the tree is only read.
+ *
+ * Usage:
+ *	KNNGraph< KDTree<3> > graph = KNNGraph< KDTree<3> >::build(tree, &points[0], 10);
+ *	for(uint32_t j = graph.offsets[i]; j < graph.offsets[i + 1]; j++) ... graph.neighbors[j]
+ */
+template<typename Tree>
+class KNNGraph {
+    typedef typename Tree::point P;
+    typedef typename Tree::scalar scalar;
+    typedef typename Tree::dist_t dist_t;
+    typedef typename Tree::node_t node_t;
+    typedef typename Tree::inner_t inner_t;
+    typedef typename Tree::leaf_t leaf_t;
+    typedef typename Tree::descent_t descent_t;
+    typedef typename Tree::metric_t metric_t;
+    typedef pair<dist_t, uint32_t> neighbor;
+    static const int D = Tree::dimensions;
+
+    /**
+     * The k nearest neighbors of one point, a max-heap by the distance
+     */
+    struct Heap {
+	neighbor *items;
+	int size;
+	int k;
+	/** squared distance the neighbors have to beat */
+	dist_t bound;
+
+	void reset(neighbor *memory, int k) {
+	    items = memory;
+	    size = 0;
+	    this->k = k;
+	    bound = numeric_limits<dist_t>::max();
+	}
+
+	/**
+	 * Adds a point closer than bound, unless it is already there
+	 */
+	void push(dist_t dist, uint32_t point) {
+	    for(int i = 0; i < size; i++) {
+		if(items[i].second == point) return;
+	    }
+	    if(size == k)
+		pop_heap(items, items + size--);
+	    items[size++] = neighbor(dist, point);
+	    push_heap(items, items + size);
+	    if(size == k)
+		bound = items[0].first;
+	}
+    };
+
+    /**
+     * State of one thread, reused by all its leaves
+     */
+    struct Worker {
+	vector<neighbor> memory;
+	vector<Heap> heaps;
+	vector<uint32_t> indices;
+	/** points of the previous leaf and their neighbors */
+	vector<uint32_t> candidates;
+	descent_t scratch;
+    };
+
+    static dist_t distance(const metric_t &metric, const P &a, const P &b) {
+	return metricDistance<dist_t, D>(metric, a, b);
+    }
+
+    /**
+     * Distance of a point to a box
+     */
+    static dist_t boxDistance(const metric_t &metric, const P &p, const scalar *min, const scalar *max) {
+	return metricBoxDistance<dist_t, D>(metric, p, min, max);
+    }
+
+    /**
+     * Distance of two boxes
+     */
+    static dist_t boxDistance(const metric_t &metric, const leaf_t *a, const leaf_t *b) {
+	return metricBoxDistance<dist_t, D>(metric, a->min, a->max, b->min, b->max);
+    }
+
+    static vector<const leaf_t *> leaves(const Tree &tree) {
+	vector<const leaf_t *> result;
+	stack<const node_t *> stack;
+	stack.push(tree.getRoot());
+	while(!stack.empty()) {
+	    const node_t *node = stack.top();
+	    stack.pop();
+	    if(node->isLeaf()) {
+		result.push_back((const leaf_t *) node);
+		continue;
+	    }
+	    const inner_t *inner = (const inner_t *) node;
+	    if(inner->right) stack.push(inner->right);
+	    if(inner->left) stack.push(inner->left);
+	}
+	return result;
+    }
+
+    /** largest bound of the heaps of the leaf */
+    static dist_t leafBound(const Worker &w) {
+	dist_t bound = 0;
+	for(size_t i = 0; i < w.heaps.size(); i++) bound = max(bound, w.heaps[i].bound);
+	return bound;
+    }
+
+    /**
+     * Tests the points of another leaf for all points of the leaf
+     */
+    static void scan(const Tree &tree, const P *points, Worker &w, const leaf_t *other) {
+	for(size_t i = 0; i < w.heaps.size(); i++) {
+	    Heap &heap = w.heaps[i];
+	    const P &query = points[w.indices[i]];
+	    if(boxDistance(tree.getMetric(), query, other->min, other->max) >= heap.bound)
+		continue;
+	    for(size_t j = 0; j < other->bucket.size(); j++) {
+		const P *p = tree.getPoint(other->bucket[j]);
+		dist_t dist = distance(tree.getMetric(), query, *p);
+		if(dist < heap.bound && dist > 0)
+		    heap.push(dist, (uint32_t) (p - points));
+	    }
+	}
+    }
+
+    /**
+     * kNN of all points of the leaf, the same descent as the root-down
+     * queries of the tree, with the bounding box of the leaf instead
+     * of a point and with the largest bound of its points
+     */
+    static void search(const Tree &tree, const P *points, Worker &w, const leaf_t *leaf) {
+	descent_t &scratch = w.scratch;
+	scratch.clear();
+	dist_t bound = leafBound(w);
+	const node_t *node = tree.getRoot();
+	dist_t cell = 0; //squared distance of the leaf to the cell of node
+	while(true) {
+	    if(!node->isLeaf()) {
+		const inner_t *inner = (const inner_t *) node;
+		if(!inner->left || !inner->right) {
+		    node = inner->left ? inner->left : inner->right;
+		    continue;
+		}
+		//the box is on the side of at least one child
+		const int d = inner->dimension;
+		const dist_t left = leaf->min[d] > inner->split ? (dist_t) leaf->min[d] - (dist_t) inner->split : 0;
+		const dist_t right = leaf->max[d] < inner->split ? (dist_t) inner->split - (dist_t) leaf->max[d] : 0;
+		const node_t *farther = left == 0 ? inner->right : inner->left;
+		const dist_t gap = left == 0 ? right : left;
+		const dist_t offset = max(scratch.offsets[d], tree.getMetric().term(gap, d));
+		const dist_t far = tree.getMetric().update(cell, scratch.offsets[d], offset);
+		if(far < bound)
+		    scratch.push(farther, far, d, offset);
+		node = left == 0 ? inner->left : inner->right;
+		continue;
+	    }
+	    const leaf_t *other = (const leaf_t *) node;
+	    if(other != leaf && boxDistance(tree.getMetric(), leaf, other) < bound) {
+		scan(tree, points, w, other);
+		bound = leafBound(w);
+	    }
+
+	    node = NULL;
+	    while(!scratch.entries.empty()) {
+		const typename descent_t::Entry e = scratch.entries.back();
+		scratch.entries.pop_back();
+		if(e.bound < bound) {
+		    scratch.enter(e);
+		    cell = e.bound;
+		    node = e.node;
+		    break;
+		}
+	    }
+	    if(!node)
+		return;
+	}
+    }
+
+    /**
+     * Neighbors of the points of the leaves <from, to), written to the
+     * k slots of every point
+     */
+    static void buildRange(const Tree &tree, const P *points, int k, const vector<const leaf_t *> &leaves,
+	    size_t from, size_t to, uint32_t *slots, dist_t *slotDistances, uint32_t *degrees) {
+	Worker w;
+	for(size_t l = from; l < to; l++) {
+	    const leaf_t *leaf = leaves[l];
+	    const size_t m = leaf->bucket.size();
+	    w.indices.resize(m);
+	    w.heaps.resize(m);
+	    w.memory.resize(m * k);
+	    for(size_t i = 0; i < m; i++) {
+		w.indices[i] = (uint32_t) (tree.getPoint(leaf->bucket[i]) - points);
+		w.heaps[i].reset(&w.memory[i * k], k);
+	    }
+
+	    //seed the bounds with the leaf itself and the previous leaf
+	    w.candidates.insert(w.candidates.end(), w.indices.begin(), w.indices.end());
+	    sort(w.candidates.begin(), w.candidates.end());
+	    w.candidates.erase(unique(w.candidates.begin(), w.candidates.end()), w.candidates.end());
+	    for(size_t i = 0; i < m; i++) {
+		Heap &heap = w.heaps[i];
+		const P &query = points[w.indices[i]];
+		for(size_t c = 0; c < w.candidates.size(); c++) {
+		    dist_t dist = distance(tree.getMetric(), query, points[w.candidates[c]]);
+		    if(dist < heap.bound && dist > 0)
+			heap.push(dist, w.candidates[c]);
+		}
+	    }
+
+	    search(tree, points, w, leaf);
+
+	    w.candidates.assign(w.indices.begin(), w.indices.end());
+	    for(size_t i = 0; i < m; i++) {
+		Heap &heap = w.heaps[i];
+		sort_heap(heap.items, heap.items + heap.size);
+		uint32_t p = w.indices[i];
+		degrees[p] = heap.size;
+		for(int j = 0; j < heap.size; j++) {
+		    slots[(size_t) p * k + j] = heap.items[j].second;
+		    slotDistances[(size_t) p * k + j] = heap.items[j].first;
+		    w.candidates.push_back(heap.items[j].second);
+		}
+	    }
+	}
+    }
+
+public:
+    /** start of the neighbors of every point, size() + 1 items */
+    vector<uint32_t> offsets;
+    /** neighbors of all points */
+    vector<uint32_t> neighbors;
+    /** squared distances of the neighbors */
+    vector<dist_t> distances;
+
+    /** number of points */
+    size_t size() const {
+	return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    /** number of neighbors of the point */
+    uint32_t degree(size_t i) const {
+	return offsets[i + 1] - offsets[i];
+    }
+
+    /**
+     * Builds the kNN graph of all points of the tree
+     * @param tree built tree, it's only read
+     * @param points the array the tree refers to, the graph uses indices into it
+     * @param k number of neighbors of every point
+     * @param threads number of threads, 0 = all cores
+     */
+    static KNNGraph build(const Tree &tree, const P *points, int k, unsigned threads = 0) {
+	KNNGraph graph;
+	vector<const leaf_t *> all = leaves(tree);
+	size_t count = 0;
+	for(size_t l = 0; l < all.size(); l++) {
+	    for(size_t i = 0; i < all[l]->bucket.size(); i++) {
+		count = max(count, (size_t) (tree.getPoint(all[l]->bucket[i]) - points) + 1);
+	    }
+	}
+	graph.offsets.assign(count + 1, 0);
+	if(count == 0 || k <= 0)
+	    return graph;
+
+	vector<uint32_t> slots((size_t) count * k);
+	vector<dist_t> slotDistances((size_t) count * k);
+	vector<uint32_t> degrees(count, 0);
+	if(threads == 0)
+	    threads = max(1u, thread::hardware_concurrency());
+	threads = (unsigned) min((size_t) threads, all.size() / 64 + 1);
+	vector<thread> workers;
+	size_t step = all.size() / threads + 1;
+	for(unsigned t = 1; t < threads; t++) {
+	    size_t from = min(all.size(), t * step);
+	    workers.push_back(thread(buildRange, cref(tree), points, k, cref(all), from,
+		    min(all.size(), from + step), &slots[0], &slotDistances[0], &degrees[0]));
+	}
+	buildRange(tree, points, k, all, 0, min(all.size(), step), &slots[0], &slotDistances[0], &degrees[0]);
+	for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+
+	for(size_t i = 0; i < count; i++) {
+	    graph.offsets[i + 1] = graph.offsets[i] + degrees[i];
+	}
+	graph.neighbors.resize(graph.offsets[count]);
+	graph.distances.resize(graph.offsets[count]);
+	for(size_t i = 0; i < count; i++) {
+	    copy(slots.begin() + i * k, slots.begin() + i * k + degrees[i], graph.neighbors.begin() + graph.offsets[i]);
+	    copy(slotDistances.begin() + i * k, slotDistances.begin() + i * k + degrees[i],
+		    graph.distances.begin() + graph.offsets[i]);
+	}
+	return graph;
+    }
+};
+
+#endif	/* KNNGRAPH_H */
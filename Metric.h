@@ -0,0 +1,239 @@
+/*
+ * File:   Metric.h
+ * Author: Daniel Princ
+ *
+ * Distance metrics of the KDTree (its Metric parameter): Euclidean,
+ * Manhattan, Chebyshev and per axis weighted Euclidean.
+ *
+ */
+
+#ifndef METRIC_H
+#define	METRIC_H
+
+#include <math.h>
+#include <algorithm>
+
+/**
+ * Squared Euclidean distance, the default.
+ *
+ * The queries never compare true distances, only a monotonic form of
+ * them, which is the squared distance here (the dist_t of the tree).
+ * A metric is a sum (or max) of terms, one per dimension, so the
+ * distance of a query to a cell can be updated from the term of one
+ * dimension when the search crosses a split. A metric policy has:
+ *	term(diff, d)		term of the difference diff in dimension d
+ *	add(dist, term)		dist with another term (sum or max)
+ *	update(dist, old, term)	dist with the term old of one dimension
+ *				replaced by term >= old (a cell farther away)
+ *	reduce(radius)		radius in the form of the distances
+ *	root(dist)		the true distance
+ *	extent(dist, d)		half size of the ball of dist in dimension d
+ *
+ * The functions are inlined, an empty policy costs nothing.
+ */
+struct Euclidean {
+    template<typename Dist>
+    Dist term(Dist diff, int) const {
+	return diff * diff;
+    }
+
+    template<typename Dist>
+    Dist add(Dist dist, Dist term) const {
+	return dist + term;
+    }
+
+    template<typename Dist>
+    Dist update(Dist dist, Dist old, Dist term) const {
+	return dist - old + term;
+    }
+
+    template<typename Dist>
+    Dist reduce(Dist radius) const {
+	return radius * radius;
+    }
+
+    template<typename Dist>
+    Dist root(Dist dist) const {
+	return sqrt(dist);
+    }
+
+    template<typename Dist>
+    Dist extent(Dist dist, int) const {
+	return sqrt(dist);
+    }
+};
+
+/**
+ * L1, sum of the absolute differences (grid distances)
+ */
+struct Manhattan {
+    template<typename Dist>
+    Dist term(Dist diff, int) const {
+	return diff < 0 ? -diff : diff;
+    }
+
+    template<typename Dist>
+    Dist add(Dist dist, Dist term) const {
+	return dist + term;
+    }
+
+    template<typename Dist>
+    Dist update(Dist dist, Dist old, Dist term) const {
+	return dist - old + term;
+    }
+
+    template<typename Dist>
+    Dist reduce(Dist radius) const {
+	return radius;
+    }
+
+    template<typename Dist>
+    Dist root(Dist dist) const {
+	return dist;
+    }
+
+    template<typename Dist>
+    Dist extent(Dist dist, int) const {
+	return dist;
+    }
+};
+
+/**
+ * L-infinity, the largest absolute difference. The radius queries
+ * return boxes. Terms are combined by max, which can't be undone, but
+ * the update only ever gets a larger term, so the max stays exact.
+ */
+struct Chebyshev {
+    template<typename Dist>
+    Dist term(Dist diff, int) const {
+	return diff < 0 ? -diff : diff;
+    }
+
+    template<typename Dist>
+    Dist add(Dist dist, Dist term) const {
+	return std::max(dist, term);
+    }
+
+    template<typename Dist>
+    Dist update(Dist dist, Dist, Dist term) const {
+	return std::max(dist, term);
+    }
+
+    template<typename Dist>
+    Dist reduce(Dist radius) const {
+	return radius;
+    }
+
+    template<typename Dist>
+    Dist root(Dist dist) const {
+	return dist;
+    }
+
+    template<typename Dist>
+    Dist extent(Dist dist, int) const {
+	return dist;
+    }
+};
+
+/**
+ * Squared Euclidean distance with a weight per dimension, for features
+ * of different scales. With the weights 1 / variance of every dimension
+ * it is the Mahalanobis distance of a diagonal covariance (see mahalanobis).
+ * The weights must be positive.
+ */
+template<const int D>
+struct Weighted {
+    double weights[D];
+
+    Weighted() {
+	std::fill(weights, weights + D, 1.0);
+    }
+
+    Weighted(const double *weights) {
+	std::copy(weights, weights + D, this->weights);
+    }
+
+    /**
+     * Mahalanobis distance of a diagonal covariance
+     * @param variances variance of every dimension
+     */
+    static Weighted mahalanobis(const double *variances) {
+	Weighted metric;
+	for(int d = 0; d < D; d++) metric.weights[d] = 1 / variances[d];
+	return metric;
+    }
+
+    template<typename Dist>
+    Dist term(Dist diff, int d) const {
+	return (Dist) weights[d] * diff * diff;
+    }
+
+    template<typename Dist>
+    Dist add(Dist dist, Dist term) const {
+	return dist + term;
+    }
+
+    template<typename Dist>
+    Dist update(Dist dist, Dist old, Dist term) const {
+	return dist - old + term;
+    }
+
+    template<typename Dist>
+    Dist reduce(Dist radius) const {
+	return radius * radius;
+    }
+
+    template<typename Dist>
+    Dist root(Dist dist) const {
+	return sqrt(dist);
+    }
+
+    template<typename Dist>
+    Dist extent(Dist dist, int d) const {
+	return sqrt(dist / (Dist) weights[d]);
+    }
+};
+
+/**
+ * Distance of two points in the form of the metric (see Euclidean)
+ */
+template<typename Dist, const int D, typename Metric, typename A, typename B>
+inline Dist metricDistance(const Metric &metric, const A &a, const B &b) {
+    Dist dist = 0;
+    for(int d = 0; d < D; d++) {
+	dist = metric.add(dist, metric.term((Dist) a[d] - (Dist) b[d], d));
+    }
+    return dist;
+}
+
+/**
+ * Distance of a point to a box, 0 inside
+ */
+template<typename Dist, const int D, typename Metric, typename A, typename T>
+inline Dist metricBoxDistance(const Metric &metric, const A &p, const T *min, const T *max) {
+    Dist dist = 0;
+    for(int d = 0; d < D; d++) {
+	if(p[d] < min[d])
+	    dist = metric.add(dist, metric.term((Dist) min[d] - (Dist) p[d], d));
+	else if(p[d] > max[d])
+	    dist = metric.add(dist, metric.term((Dist) p[d] - (Dist) max[d], d));
+    }
+    return dist;
+}
+
+/**
+ * Distance of two boxes, 0 if they overlap
+ */
+template<typename Dist, const int D, typename Metric, typename T, typename U>
+inline Dist metricBoxDistance(const Metric &metric, const T *amin, const T *amax, const U *bmin, const U *bmax) {
+    Dist dist = 0;
+    for(int d = 0; d < D; d++) {
+	if((Dist) amax[d] < (Dist) bmin[d])
+	    dist = metric.add(dist, metric.term((Dist) bmin[d] - (Dist) amax[d], d));
+	else if((Dist) bmax[d] < (Dist) amin[d])
+	    dist = metric.add(dist, metric.term((Dist) amin[d] - (Dist) bmax[d], d));
+    }
+    return dist;
+}
+
+#endif	/* METRIC_H */
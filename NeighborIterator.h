@@ -0,0 +1,239 @@
+/*
+ * File:   NeighborIterator.h
+ * Author: Daniel Princ
+ *
+ * Incremental nearest neighbor search (distance browsing): the points of
+ * a tree one by one in the order of their distance from a query, for
+ * consumers that don't know k in advance.
+ *
+ */
+
+#ifndef NEIGHBORITERATOR_H
+#define	NEIGHBORITERATOR_H
+
+#include <stdint.h>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "KDTreeNodes.h"
+#include "Metric.h"
+
+using namespace std;
+
+/**
+ * Lazy iterator over the points of a tree sorted by the distance from
+ * the query. Like kNearestNeighbors, points at zero distance from the
+ * query are skipped, unless asked for (like in circularQuery).
+ * The distances are the ones of the metric of the tree (squared for Euclidean).
+ *
+ * One priority queue holds nodes, keyed by the distance of the query to
+ * their cell (leaves to their bounding box), and points, keyed by their
+ * distance. The smallest item is taken: a node puts its children (a leaf
+ * its points) into the queue, a point is the next neighbor, as nothing
+ * left in the queue can be closer. Nodes are only opened when the next
+ * point is pulled, so the first neighbors cost about as much as NN and
+ * every next one a little more, there is no radius to guess.
+ *
+ * The cells are kept as offsets per dimension like in the root-down
+ * search (see DescentStack), the child on the side of the query shares
+ * the offsets of its parent, the other one gets a copy with the offset
+ * of the split.
+ *
+ * The tree must not change while the iterator is used. One iterator can
+ * be reused for other queries (reset), its memory stays.
+ *
+ * Usage:
+ *	NeighborIterator< KDTree<3> > it(tree, &query);
+ *	Point<3> *p;
+ *	float dist;
+ *	while(it.next(p, dist) && !enough(p, dist)) ...
+ */
+template<typename Tree>
+class NeighborIterator {
+public:
+    typedef typename Tree::point P;
+    typedef typename Tree::ref ref;
+    typedef typename Tree::dist_t dist_t;
+
+private:
+    typedef typename Tree::scalar scalar;
+    typedef typename Tree::node_t node_t;
+    typedef typename Tree::inner_t inner_t;
+    typedef typename Tree::leaf_t leaf_t;
+    static const int D = Tree::dimensions;
+
+    /**
+     * Node or point in the queue
+     */
+    struct Item {
+	/** squared distance of the point, or of the query to the cell of the node */
+	dist_t dist;
+	/** NULL for points */
+	const node_t *node;
+	ref point;
+	/** first of the D offsets of the cell of the node */
+	uint32_t offsets;
+
+	/** the queue is a max-heap, so the nearest item is on top */
+	bool operator<(const Item &other) const {
+	    return dist > other.dist;
+	}
+    };
+
+    const Tree *tree;
+    const P *query;
+    vector<Item> queue;
+    /** squared offsets (terms of the metric) of the cells of the queued nodes, D per cell */
+    vector<dist_t> cells;
+    /** number of points whose distance was computed */
+    size_t tested;
+    /** return the points at zero distance too */
+    bool zero;
+
+    dist_t distance(const P &a, const P &b) const {
+	return metricDistance<dist_t, D>(tree->getMetric(), a, b);
+    }
+
+    dist_t boxDistance(const P &p, const scalar *min, const scalar *max) const {
+	return metricBoxDistance<dist_t, D>(tree->getMetric(), p, min, max);
+    }
+
+    void push(const Item &item) {
+	queue.push_back(item);
+	push_heap(queue.begin(), queue.end());
+    }
+
+    /**
+     * Queues a child of a node, leaves with the distance to their bounding box
+     */
+    void pushNode(const node_t *node, dist_t cell, uint32_t offsets) {
+	if(node->isLeaf()) {
+	    const leaf_t *leaf = (const leaf_t *) node;
+	    cell = max(cell, boxDistance(*query, leaf->min, leaf->max));
+	}
+	Item item = {cell, node, ref(), offsets};
+	push(item);
+    }
+
+    /**
+     * Replaces the node by its children, or the leaf by its points.
+     * The child on the side of the query is as near as the node, so it
+     * is opened right away, down to the leaf, only the others are queued.
+     */
+    void open(Item item) {
+	while(!item.node->isLeaf()) {
+	    const inner_t *inner = (const inner_t *) item.node;
+	    if(!inner->left || !inner->right) { //one child has all the points, the same cell
+		item.node = inner->left ? inner->left : inner->right;
+		if(!item.node)
+		    return;
+		continue;
+	    }
+	    const int d = inner->dimension;
+	    const dist_t diff = (dist_t) (*query)[d] - (dist_t) inner->split;
+
+	    //the other child, its cell differs in dimension d
+	    const uint32_t offsets = (uint32_t) cells.size();
+	    cells.resize(offsets + D);
+	    for(int i = 0; i < D; i++) cells[offsets + i] = cells[item.offsets + i];
+	    const dist_t offset = tree->getMetric().term(diff, d);
+	    const dist_t far = tree->getMetric().update(item.dist, cells[offsets + d], offset);
+	    cells[offsets + d] = offset;
+	    pushNode(diff <= 0 ? inner->right : inner->left, far, offsets);
+
+	    item.node = diff <= 0 ? inner->left : inner->right;
+	}
+	const leaf_t *leaf = (const leaf_t *) item.node;
+	const dist_t box = boxDistance(*query, leaf->min, leaf->max);
+	if(!queue.empty() && box > queue.front().dist) { //something else is nearer
+	    item.dist = max(item.dist, box);
+	    push(item);
+	    return;
+	}
+	for(size_t i = 0; i < leaf->bucket.size(); i++) {
+	    dist_t dist = distance(*query, *tree->getPoint(leaf->bucket[i]));
+	    tested++;
+	    if(dist > 0 || zero) { //ie points are not the same!
+		Item point = {dist, NULL, leaf->bucket[i], 0};
+		push(point);
+	    }
+	}
+    }
+
+    /**
+     * Opens the nodes until the nearest item is a point
+     * @return false if there are no points left
+     */
+    bool advance() {
+	while(!queue.empty() && queue.front().node) {
+	    const Item item = queue.front();
+	    pop_heap(queue.begin(), queue.end());
+	    queue.pop_back();
+	    open(item);
+	}
+	return !queue.empty();
+    }
+
+public:
+
+    NeighborIterator() : tree(NULL), query(NULL), tested(0), zero(false) {}
+
+    NeighborIterator(const Tree &tree, const P *query, bool zero = false) {
+	reset(tree, query, zero);
+    }
+
+    /**
+     * Starts over with another query (or tree), the memory is kept
+     * @param zero true to return the points at zero distance as well
+     */
+    void reset(const Tree &tree, const P *query, bool zero = false) {
+	this->tree = &tree;
+	this->query = query;
+	this->zero = zero;
+	queue.clear();
+	cells.assign(D, 0);
+	tested = 0;
+	if(tree.size() == 0)
+	    return;
+	Item root = {0, tree.getRoot(), ref(), 0};
+	push(root);
+    }
+
+    /**
+     * The next nearest point
+     * @param point the point, set if there is one
+     * @param dist its squared distance
+     * @return false if all points have been returned
+     */
+    bool next(ref &point, dist_t &dist) {
+	if(!advance())
+	    return false;
+	point = queue.front().point;
+	dist = queue.front().dist;
+	pop_heap(queue.begin(), queue.end());
+	queue.pop_back();
+	return true;
+    }
+
+    bool next(ref &point) {
+	dist_t dist;
+	return next(point, dist);
+    }
+
+    /**
+     * Squared distance of the point next() will return, without taking it
+     * @return max() if all points have been returned
+     */
+    dist_t nextDistance() {
+	return advance() ? queue.front().dist : numeric_limits<dist_t>::max();
+    }
+
+    /**
+     * Number of points whose distance has been computed so far
+     */
+    size_t getTested() const {
+	return tested;
+    }
+};
+
+#endif	/* NEIGHBORITERATOR_H */
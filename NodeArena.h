@@ -0,0 +1,184 @@
+/*
+ * File:   NodeArena.h
+ * Author: Daniel Princ
+ *
+ * Arena for the nodes of the KDTree.
+ *
+ */
+
+#ifndef NODEARENA_H
+#define	NODEARENA_H
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <new>
+#include <utility>
+#include "NodeLayout.h"
+
+using namespace std;
+
+/**
+ * Bump allocator for the tree nodes.
+ *
+ * Memory comes from blocks that double in size (from 16kB), blocks of
+ * 2MB and more are aligned to huge pages (see HugePageBuffer).
+ * Nothing is freed one by one: freed nodes go to a free list of their
+ * size and are used by the next allocation of the same size, reset()
+ * makes all blocks free again but keeps them for the next construction
+ * and the destructor returns them to the system.
+ *
+ * The arena does not call destructors, the owner does.
+ */
+class NodeArena {
+    static const size_t firstBlock = 16 << 10;
+    static const size_t lastBlock = 8 << 20;
+    /** free lists for up to this number of node sizes */
+    static const int freeLists = 4;
+
+    vector< unique_ptr<HugePageBuffer> > blocks;
+    /** block the allocations come from */
+    size_t current;
+    /** used bytes of the current block */
+    size_t used;
+    /** bytes of the live nodes */
+    size_t allocatedBytes;
+
+    struct FreeList {
+	size_t size;
+	void *head;
+    };
+    FreeList freed[freeLists];
+
+    NodeArena(const NodeArena &);
+    NodeArena &operator=(const NodeArena &);
+
+    void clearFreeLists() {
+	for(int i = 0; i < freeLists; i++) {
+	    freed[i].size = 0;
+	    freed[i].head = NULL;
+	}
+    }
+
+    /**
+     * Moves to the next block with at least size bytes, allocates it if needed
+     */
+    bool nextBlock(size_t size) {
+	while(current + 1 < blocks.size()) {
+	    current++;
+	    used = 0;
+	    if(blocks[current]->size() >= size)
+		return true;
+	}
+	size_t bytes = blocks.empty() ? firstBlock : min(blocks.back()->size() * 2, (size_t) lastBlock);
+	if(bytes < size)
+	    bytes = size;
+	unique_ptr<HugePageBuffer> block(new HugePageBuffer());
+	if(!block->allocate(bytes))
+	    return false;
+	blocks.push_back(std::move(block));
+	current = blocks.size() - 1;
+	used = 0;
+	return true;
+    }
+
+public:
+
+    NodeArena() : current(0), used(0), allocatedBytes(0) {
+	clearFreeLists();
+    }
+
+    /**
+     * Memory for one node
+     * @param size sizeof the node
+     * @param align alignof the node
+     * @throws bad_alloc if there is no memory left, like new
+     */
+    void *allocate(size_t size, size_t align) {
+	for(int i = 0; i < freeLists; i++) {
+	    if(freed[i].size == size && freed[i].head) {
+		void *p = freed[i].head;
+		freed[i].head = *(void **) p;
+		allocatedBytes += size;
+		return p;
+	    }
+	}
+	size_t offset = (used + align - 1) / align * align;
+	if(blocks.empty() || offset + size > blocks[current]->size()) {
+	    if(!nextBlock(size + align))
+		throw bad_alloc();
+	    offset = 0;
+	}
+	used = offset + size;
+	allocatedBytes += size;
+	return blocks[current]->get() + offset;
+    }
+
+    /**
+     * Returns the memory of one (destroyed) node for reuse
+     * @param p the node
+     * @param size sizeof the node, at least the size of a pointer
+     */
+    void recycle(void *p, size_t size) {
+	for(int i = 0; i < freeLists; i++) {
+	    if(freed[i].size == 0)
+		freed[i].size = size;
+	    if(freed[i].size == size) {
+		*(void **) p = freed[i].head;
+		freed[i].head = p;
+		allocatedBytes -= size;
+		return;
+	    }
+	}
+    }
+
+    /**
+     * Makes sure the following allocations of the given number of
+     * bytes come from one contiguous block
+     */
+    bool reserve(size_t bytes) {
+	if(!blocks.empty() && blocks[current]->size() - used >= bytes)
+	    return true;
+	return nextBlock(bytes);
+    }
+
+    /**
+     * Frees all nodes at once, the blocks are kept for reuse
+     */
+    void reset() {
+	current = 0;
+	used = 0;
+	allocatedBytes = 0;
+	clearFreeLists();
+    }
+
+    /**
+     * Returns all blocks to the system
+     */
+    void release() {
+	blocks.clear();
+	reset();
+    }
+
+    void swap(NodeArena &other) {
+	blocks.swap(other.blocks);
+	std::swap(current, other.current);
+	std::swap(used, other.used);
+	std::swap(allocatedBytes, other.allocatedBytes);
+	for(int i = 0; i < freeLists; i++) std::swap(freed[i], other.freed[i]);
+    }
+
+    /** bytes of the live nodes (without padding) */
+    size_t allocated() const {
+	return allocatedBytes;
+    }
+
+    /** bytes of all blocks */
+    size_t capacity() const {
+	size_t bytes = 0;
+	for(size_t i = 0; i < blocks.size(); i++) bytes += blocks[i]->size();
+	return bytes;
+    }
+};
+
+#endif	/* NODEARENA_H */
@@ -0,0 +1,225 @@
+/*
+ * File:   NodeLayout.h
+ * Author: Daniel Princ
+ *
+ * Memory layout of the tree nodes: orders of the nodes (depth first,
+ * van Emde Boas) and a huge page aware buffer to place them in.
+ *
+ */
+
+#ifndef NODELAYOUT_H
+#define	NODELAYOUT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+#include <stack>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+/**
+ * Order of the nodes in memory, see KDTree::layout
+ */
+enum NodeLayout {
+    /** the order of allocation by construct and insert */
+    LAYOUT_BUILD,
+    /** preorder, left child first, in one buffer */
+    LAYOUT_DFS,
+    /** van Emde Boas order in one buffer */
+    LAYOUT_VEB
+};
+
+/**
+ * Memory for the nodes, one block aligned to huge pages (2MB).
+ * On Linux it's mmapped and advised to use transparent huge pages,
+ * so the top levels of a large tree share a few TLB entries.
+ * Blocks smaller than a huge page are simply malloc'd.
+ */
+class HugePageBuffer {
+    char *data;
+    size_t bytes;
+    /** false for the small malloc'd blocks */
+    bool huge;
+
+    HugePageBuffer(const HugePageBuffer &);
+    HugePageBuffer &operator=(const HugePageBuffer &);
+
+public:
+    static const size_t hugePage = 2 << 20;
+
+    HugePageBuffer() : data(NULL), bytes(0), huge(false) {}
+
+    ~HugePageBuffer() {
+	release();
+    }
+
+    /**
+     * Allocates a new block, the old one is released
+     * @param size number of bytes
+     * @return false if there is not enough memory
+     */
+    bool allocate(size_t size) {
+	release();
+	if(size == 0)
+	    return true;
+	if(size < hugePage) {
+	    data = (char *) malloc(size);
+	    bytes = data ? size : 0;
+	    huge = false;
+	    return data != NULL;
+	}
+	size = (size + hugePage - 1) / hugePage * hugePage;
+#ifdef __linux__
+	//map one huge page more and cut the block to the alignment
+	char *mapped = (char *) mmap(NULL, size + hugePage, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mapped == MAP_FAILED)
+	    return false;
+	char *aligned = (char *) (((uintptr_t) mapped + hugePage - 1) / hugePage * hugePage);
+	if(aligned > mapped)
+	    munmap(mapped, aligned - mapped);
+	if(aligned + size < mapped + size + hugePage)
+	    munmap(aligned + size, mapped + size + hugePage - (aligned + size));
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	data = aligned;
+#else
+	if(posix_memalign((void **) &data, hugePage, size) != 0) {
+	    data = NULL;
+	    return false;
+	}
+#endif
+	bytes = size;
+	huge = true;
+	return true;
+    }
+
+    void release() {
+	if(!data)
+	    return;
+#ifdef __linux__
+	if(huge)
+	    munmap(data, bytes);
+	else
+	    free(data);
+#else
+	free(data);
+#endif
+	data = NULL;
+	bytes = 0;
+    }
+
+    char *get() const {
+	return data;
+    }
+
+    void swap(HugePageBuffer &other) {
+	std::swap(data, other.data);
+	std::swap(bytes, other.bytes);
+	std::swap(huge, other.huge);
+    }
+
+    size_t size() const {
+	return bytes;
+    }
+
+    /** true if the pointer points into the block */
+    bool contains(const void *p) const {
+	return data && (const char *) p >= data && (const char *) p < data + bytes;
+    }
+};
+
+/**
+ * Orders of the nodes of a tree, used by KDTree::layout.
+ * Node is the base node type with isLeaf(), Inner the inner node with left and right.
+ * Recursion depth is O(log height), the walks themselves use stacks.
+ */
+template<typename Node, typename Inner>
+struct NodeOrder {
+
+    /**
+     * Height of the tree, a single node has height 1
+     */
+    static int height(const Node *root) {
+	int h = 0;
+	stack< pair<const Node *, int> > stack;
+	stack.push(make_pair(root, 1));
+	while(!stack.empty()) {
+	    pair<const Node *, int> top = stack.top();
+	    stack.pop();
+	    if(top.second > h) h = top.second;
+	    if(top.first->isLeaf()) continue;
+	    const Inner *inner = (const Inner *) top.first;
+	    if(inner->right) stack.push(make_pair((const Node *) inner->right, top.second + 1));
+	    if(inner->left) stack.push(make_pair((const Node *) inner->left, top.second + 1));
+	}
+	return h;
+    }
+
+    /**
+     * Preorder, left child first
+     */
+    static void depthFirst(Node *root, vector<Node *> &order) {
+	stack<Node *> stack;
+	stack.push(root);
+	while(!stack.empty()) {
+	    Node *node = stack.top();
+	    stack.pop();
+	    order.push_back(node);
+	    if(node->isLeaf()) continue;
+	    Inner *inner = (Inner *) node;
+	    if(inner->right) stack.push(inner->right);
+	    if(inner->left) stack.push(inner->left);
+	}
+    }
+
+    /**
+     * Nodes of the subtree in depth < levels (relative to node), in
+     * preorder. Nodes in depth == levels are collected to frontier.
+     */
+    static void levels(Node *node, int levels, vector<Node *> *order, vector<Node *> *frontier) {
+	stack< pair<Node *, int> > stack;
+	stack.push(make_pair(node, 0));
+	while(!stack.empty()) {
+	    pair<Node *, int> top = stack.top();
+	    stack.pop();
+	    if(top.second == levels) {
+		if(frontier) frontier->push_back(top.first);
+		continue;
+	    }
+	    if(order) order->push_back(top.first);
+	    if(top.first->isLeaf()) continue;
+	    Inner *inner = (Inner *) top.first;
+	    if(inner->right) stack.push(make_pair((Node *) inner->right, top.second + 1));
+	    if(inner->left) stack.push(make_pair((Node *) inner->left, top.second + 1));
+	}
+    }
+
+    /**
+     * van Emde Boas order of the subtree in depth < h: the top half of
+     * the levels first, then every subtree below it, both recursively.
+     * Any path of k levels then touches O(k / log B) blocks of B bytes,
+     * for every cache level and page size at once.
+     */
+    static void vanEmdeBoas(Node *node, int h, vector<Node *> &order) {
+	if(h <= 2) { //too small to split, a node and its children
+	    levels(node, h, &order, NULL);
+	    return;
+	}
+	int top = h / 2;
+	vanEmdeBoas(node, top, order);
+	vector<Node *> bottoms;
+	levels(node, top, NULL, &bottoms);
+	for(size_t i = 0; i < bottoms.size(); i++) {
+	    vanEmdeBoas(bottoms[i], h - top, order);
+	}
+    }
+};
+
+#endif	/* NODELAYOUT_H */
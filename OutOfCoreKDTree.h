@@ -0,0 +1,930 @@
+/*
+ * File:   OutOfCoreKDTree.h
+ * Author: Daniel Princ
+ *
+ * Out-of-core kd-tree. The top of the tree (inner nodes and leaf bounds)
+ * stays in memory, the points of every leaf are stored as a fixed size
+ * block in a file and paged in on demand through a bounded LRU cache.
+ *
+ */
+
+#ifndef OUTOFCOREKDTREE_H
+#define	OUTOFCOREKDTREE_H
+
+#include <vector>
+#include <stack>
+#include <list>
+#include <string>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <unordered_map>
+#include <stdio.h>
+#include <math.h>
+
+using namespace std;
+#include "Point.h"
+#include "KDTreeNodes.h"
+
+/**
+ * Hit and miss counters of the block cache
+ */
+struct CacheStats {
+    /** number of block requests served from memory */
+    long hits;
+    /** number of block requests that had to be read from the file */
+    long misses;
+    /** number of blocks that could not be read, their points are missing in the results */
+    long errors;
+
+    CacheStats() : hits(0), misses(0), errors(0) {}
+};
+
+/**
+ * Leaf of the out-of-core tree.
+ * Keeps only the position of its block in the file and the BOB bounds,
+ * the points themselves are loaded through the BlockCache.
+ */
+template<const int D = 3>
+struct BlockLeaf : Node<> {
+    /** index of the block in the file */
+    int block;
+    /** number of points in the block */
+    int count;
+    /** lower bound, BOB test */
+    float min[D];
+    /** upper bound, BOB test */
+    float max[D];
+
+    BlockLeaf(Inner<> *parent, int block, const std::vector< Point<D>* > &bucket)
+	    : Node<>(true, parent), block(block), count(bucket.size()) {
+	for(int d = 0; d < D; d++) {
+	    min[d] = std::numeric_limits<float>::max();
+	    max[d] = -std::numeric_limits<float>::max();
+	}
+	for(typename std::vector< Point<D> * >::const_iterator it = bucket.begin(); it != bucket.end(); ++it) {
+	    const Point<D> * p = *it;
+	    for(int d = 0; d < D; d++) {
+		if((*p)[d] > max[d]) max[d] = (*p)[d];
+		if((*p)[d] < min[d]) min[d] = (*p)[d];
+	    }
+	}
+    }
+    ~BlockLeaf() {}
+};
+
+/**
+ * Bounded LRU cache of point blocks read from the tree file
+ */
+template<const int D = 3>
+class BlockCache {
+
+    typedef list<int>::iterator lru_it;
+    typedef pair< vector< Point<D> >, lru_it > entry;
+
+    /** maximal number of blocks kept in memory */
+    size_t capacity;
+    /** block ids, most recently used first */
+    list<int> lru;
+    /** cached blocks */
+    unordered_map<int, entry> blocks;
+    /** statistics since creation (or last reset) */
+    CacheStats stats;
+
+public:
+
+    /**
+     * Creates empty cache
+     * @param capacity maximal number of blocks in memory
+     */
+    BlockCache(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+    /**
+     * Changes the capacity, evicts least recently used blocks if necessary
+     * @param capacity maximal number of blocks in memory
+     */
+    void setCapacity(size_t capacity) {
+	this->capacity = capacity > 0 ? capacity : 1;
+	while(blocks.size() > this->capacity)
+	    evict();
+    }
+
+    /**
+     * Returns the block, reads it from the file if it's not cached
+     * @param file file with blocks
+     * @param blockBytes size of one block in the file
+     * @param block index of the block
+     * @param count number of points in the block
+     * @return points of the block, empty if it could not be read
+     */
+    const vector< Point<D> > &get(ifstream &file, size_t blockBytes, int block, int count) {
+	typename unordered_map<int, entry>::iterator it = blocks.find(block);
+	if(it != blocks.end()) {
+	    stats.hits++;
+	    lru.splice(lru.begin(), lru, it->second.second);
+	    return it->second.first;
+	}
+	stats.misses++;
+	if(blocks.size() >= capacity)
+	    evict();
+
+	lru.push_front(block);
+	entry &e = blocks[block];
+	e.second = lru.begin();
+	e.first.resize(count);
+	file.clear();
+	file.seekg((streamoff) block * blockBytes);
+	if(!file.read((char *) &e.first[0], count * sizeof(Point<D>))) {
+	    cerr << "cannot read block " << block << " of the tree file\n";
+	    stats.errors++;
+	    blocks.erase(block);
+	    lru.pop_front();
+	    static const vector< Point<D> > none;
+	    return none;
+	}
+	return e.first;
+    }
+
+    /**
+     * Drops all cached blocks, keeps the statistics
+     */
+    void clear() {
+	blocks.clear();
+	lru.clear();
+    }
+
+    const CacheStats &getStats() const {
+	return stats;
+    }
+
+    void resetStats() {
+	stats = CacheStats();
+    }
+
+    size_t size() const {
+	return blocks.size();
+    }
+
+private:
+    void evict() {
+	blocks.erase(lru.back());
+	lru.pop_back();
+    }
+};
+
+/**
+ * kd-tree for point clouds that don't fit into memory.
+ *
+ * Inner nodes are the same as in KDTree, leaves are BlockLeaf stubs.
+ * Results are returned by value, because the block that holds the point
+ * can be evicted by the next query.
+ */
+template<const int D = 3>
+class OutOfCoreKDTree {
+
+    typedef vector< Point<D> *> points;
+    typedef typename vector< Point<D> *>::iterator points_it;
+
+    /** Structure on the stack for the queries */
+    typedef pair<Node<> *, float> dNode;
+
+    /** maximal number of points in one leaf block */
+    const size_t blockSize;
+
+    /** maximal number of points partitioned in memory during the construction */
+    size_t buildPoints;
+
+    /** number of points read or written at once during the construction */
+    static const size_t ioPoints = 1 << 16;
+
+    /**
+     * Points of one subtree during the construction, stored in a file
+     */
+    struct Part {
+	string file;
+	size_t count;
+	float bounds[2*D];
+	Inner<> *node;
+    };
+
+    /** root of the tree */
+    Inner<> * root;
+
+    /** number of points inside the tree */
+    int sizep;
+
+    /** number of blocks written to the file */
+    int blocks;
+
+    /** bounding box of the tree, format: xmin, xmax, ymin, ymax, ...*/
+    float boundingBox[2*D];
+
+    /** file with the leaf blocks */
+    string path;
+    ifstream file;
+
+    BlockCache<D> cache;
+
+    /** cache statistics of the last query */
+    CacheStats lastQuery;
+
+    OutOfCoreKDTree(const OutOfCoreKDTree &);
+    OutOfCoreKDTree &operator=(const OutOfCoreKDTree &);
+
+    inline const float distance(const Point<D> * p1, const Point<D> * p2) const {
+	float dist = 0;
+	for(int d = 0; d < D; d++) {
+	    float tmp = (*p1)[d] - (*p2)[d];
+	    dist += tmp*tmp;
+	}
+	return dist;
+    }
+
+    inline const float minBoundsDistance(const Point<D> * point, const float * min, const float * max) const {
+	float dist = 0;
+	for(int d = 0; d < D; d++) {
+	    if ((*point)[d] < min[d]) {
+		const float tmp = min[d] - (*point)[d];
+		dist += tmp*tmp;
+	    }
+	    else if ((*point)[d] > max[d]) {
+		const float tmp = max[d] - (*point)[d];
+		dist += tmp*tmp;
+	    }
+	}
+	return dist;
+    }
+
+    size_t blockBytes() const {
+	return blockSize * sizeof(Point<D>);
+    }
+
+    /**
+     * Deletes all nodes, the root as well, without recursion
+     */
+    void freeNodes() {
+	if(!root)
+	    return;
+	stack< Node<> * > stack;
+	stack.push(root);
+	while(!stack.empty()) {
+	    Node<> *node = stack.top();
+	    stack.pop();
+	    if(!node->isLeaf()) {
+		Inner<> *inner = (Inner<> *) node;
+		if(inner->left) stack.push(inner->left);
+		if(inner->right) stack.push(inner->right);
+	    }
+	    delete node;
+	}
+	root = NULL;
+    }
+
+    /**
+     * Writes the bucket as a new block and creates the leaf for it
+     */
+    BlockLeaf<D> *writeLeaf(ofstream &out, Inner<> *parent, points &bucket) {
+	vector< Point<D> > block;
+	block.reserve(blockSize);
+	for(points_it it = bucket.begin(); it != bucket.end(); ++it) {
+	    block.push_back(*(*it));
+	}
+	block.resize(blockSize);
+	out.write((const char *) &block[0], blockBytes());
+	return new BlockLeaf<D>(parent, blocks++, bucket);
+    }
+
+    /**
+     * Loads the points of the leaf, updates statistics of the last query
+     */
+    const vector< Point<D> > &load(const BlockLeaf<D> *leaf) {
+	CacheStats before = cache.getStats();
+	const vector< Point<D> > &data = cache.get(file, blockBytes(), leaf->block, leaf->count);
+	lastQuery.hits += cache.getStats().hits - before.hits;
+	lastQuery.misses += cache.getStats().misses - before.misses;
+	lastQuery.errors += cache.getStats().errors - before.errors;
+	return data;
+    }
+
+    /**
+     * Calls visit(chunk) for the points of the file, ioPoints at once
+     * @param count number of points in the file
+     * @return false if the file could not be read
+     */
+    template<typename Visit>
+    static bool scan(const string &input, size_t count, Visit visit) {
+	ifstream in(input.c_str(), ios::binary);
+	vector< Point<D> > chunk(std::min(count, ioPoints));
+	for(size_t done = 0; done < count; done += chunk.size()) {
+	    chunk.resize(std::min(count - done, ioPoints));
+	    if(!in.read((char *) &chunk[0], chunk.size() * sizeof(Point<D>))) {
+		cerr << "cannot read " << input << "\n";
+		return false;
+	    }
+	    visit(chunk);
+	}
+	return true;
+    }
+
+    /**
+     * Dimension with the longest side of the bounds
+     */
+    static int longest(const float *bounds, float &size) {
+	int dim = 0;
+	size = 0;
+	for(int i = 0; i < D; i++) {
+	    if(bounds[2*i + 1] - bounds[2*i] > size) {
+		size = bounds[2*i + 1] - bounds[2*i];
+		dim = i;
+	    }
+	}
+	return dim;
+    }
+
+    /**
+     * Writes points that can't be separated any more as a chain of full
+     * blocks under the parent, next(part, n) gives the next n points
+     * @return false if next failed
+     */
+    template<typename Next>
+    bool writeChain(ofstream &out, Inner<> *parent, size_t count, Next next) {
+	points part;
+	for(size_t i = 0; i < count; i += blockSize) {
+	    if(!next(part, std::min(count - i, blockSize)))
+		return false;
+	    if(!parent->left) {
+		parent->left = writeLeaf(out, parent, part);
+	    }
+	    else if(i + blockSize >= count) {
+		parent->right = writeLeaf(out, parent, part);
+	    }
+	    else {
+		Inner<> *node = new Inner<>(parent);
+		node->dimension = parent->dimension;
+		node->split = parent->split;
+		parent->right = node;
+		parent = node;
+		parent->left = writeLeaf(out, parent, part);
+	    }
+	}
+	return true;
+    }
+
+    /**
+     * Builds the subtree of the points in memory, the same sliding midpoint
+     * construction as in KDTree, only the leaves differ
+     */
+    void buildInMemory(ofstream &out, points &all, float *abounds, Inner<> *root) {
+	stack< Constr<D> > stack;
+	stack.push(Constr<D>(all, abounds, root));
+	all.clear();
+
+	while(!stack.empty()) {
+	    Constr<D> curr = stack.top();
+	    stack.pop();
+	    points * data = &curr.data;
+	    float* bounds = &curr.bounds[0];
+	    Inner<> *parent = curr.parent;
+
+	    float size;
+	    int dim = longest(bounds, size);
+	    float split = bounds[2*dim] + size / 2.0f;
+
+	    points left, right;
+	    float lmax = -numeric_limits<float>::max(), rmin = numeric_limits<float>::max();
+	    for(points_it it = data->begin(); it != data->end(); ++it) {
+		float tmp = (*(*it))[dim];
+		if(tmp <= split) {
+		    left.push_back(*it);
+		    if(tmp > lmax) lmax = tmp;
+		}
+		else {
+		    right.push_back(*it);
+		    if(tmp < rmin) rmin = tmp;
+		}
+	    }
+	    if(right.size() == 0)
+		split = lmax;
+	    if(left.size() == 0)
+		split = rmin;
+
+	    parent->dimension = dim;
+	    parent->split = split;
+
+	    //points that can't be separated any more end in one (full) block
+	    if(size == 0 && data->size() > blockSize) {
+		points_it from = data->begin();
+		writeChain(out, parent, data->size(), [&](points &part, size_t n) -> bool {
+		    part.assign(from, from + n);
+		    from += n;
+		    return true;
+		});
+		continue;
+	    }
+
+	    if(left.size() > 0) {
+		if(left.size() > blockSize) {
+		    Inner<> *node = new Inner<>(parent);
+		    parent->left = node;
+		    float b[2*D];
+		    std::copy(bounds, bounds + 2*D, &b[0]);
+		    b[2*dim + 1] = split;
+		    stack.push(Constr<D>(left, &b[0], node));
+		}
+		else {
+		    parent->left = writeLeaf(out, parent, left);
+		}
+	    }
+	    if(right.size() > 0) {
+		if(right.size() > blockSize) {
+		    Inner<> *node = new Inner<>(parent);
+		    parent->right = node;
+		    float b[2*D];
+		    std::copy(bounds, bounds + 2*D, &b[0]);
+		    b[2*dim] = split;
+		    stack.push(Constr<D>(right, &b[0], node));
+		}
+		else {
+		    parent->right = writeLeaf(out, parent, right);
+		}
+	    }
+	}
+    }
+
+    /**
+     * Reads the points of the part and builds its subtree in memory
+     */
+    bool buildPart(ofstream &out, Part &part) {
+	vector< Point<D> > data;
+	data.reserve(part.count);
+	if(!scan(part.file, part.count, [&](const vector< Point<D> > &chunk) {
+	    data.insert(data.end(), chunk.begin(), chunk.end());
+	}))
+	    return false;
+	points all;
+	all.reserve(data.size());
+	for(typename vector< Point<D> >::iterator it = data.begin(); it != data.end(); ++it) {
+	    all.push_back(&(*it));
+	}
+	buildInMemory(out, all, part.bounds, part.node);
+	return true;
+    }
+
+    /**
+     * Splits the part that doesn't fit into memory by the sliding midpoint
+     * rule into two files, pushes the halves with more than one block of
+     * points, writes the smaller ones as leaves
+     */
+    bool splitPart(ofstream &out, Part &part, stack<Part> &parts, int &temps) {
+	Inner<> *parent = part.node;
+	float size;
+	int dim = longest(part.bounds, size);
+	float split = part.bounds[2*dim] + size / 2.0f;
+	parent->dimension = dim;
+	parent->split = split;
+
+	//all points are the same, no reason to read them twice
+	if(size == 0) {
+	    ifstream in(part.file.c_str(), ios::binary);
+	    vector< Point<D> > block(blockSize);
+	    return writeChain(out, parent, part.count, [&](points &chunk, size_t n) -> bool {
+		if(!in.read((char *) &block[0], n * sizeof(Point<D>))) {
+		    cerr << "cannot read " << part.file << "\n";
+		    return false;
+		}
+		chunk.clear();
+		for(size_t i = 0; i < n; i++) chunk.push_back(&block[i]);
+		return true;
+	    });
+	}
+
+	Part halves[2];
+	ofstream files[2];
+	vector< Point<D> > buffers[2];
+	for(int h = 0; h < 2; h++) {
+	    halves[h] = part;
+	    halves[h].file = path + ".part" + to_string(temps++);
+	    halves[h].count = 0;
+	    files[h].open(halves[h].file.c_str(), ios::binary | ios::trunc);
+	    buffers[h].reserve(ioPoints);
+	}
+	auto flush = [&](int h) {
+	    if(!buffers[h].empty())
+		files[h].write((const char *) &buffers[h][0], buffers[h].size() * sizeof(Point<D>));
+	    halves[h].count += buffers[h].size();
+	    buffers[h].clear();
+	};
+	float lmax = -numeric_limits<float>::max(), rmin = numeric_limits<float>::max();
+	bool read = scan(part.file, part.count, [&](const vector< Point<D> > &chunk) {
+	    for(size_t i = 0; i < chunk.size(); i++) {
+		float tmp = chunk[i][dim];
+		const int h = (tmp <= split) ? 0 : 1;
+		if(h == 0 && tmp > lmax) lmax = tmp;
+		if(h == 1 && tmp < rmin) rmin = tmp;
+		buffers[h].push_back(chunk[i]);
+		if(buffers[h].size() == ioPoints)
+		    flush(h);
+	    }
+	});
+	bool ok = read;
+	for(int h = 0; h < 2; h++) {
+	    flush(h);
+	    files[h].close();
+	    if(!files[h]) {
+		cerr << "cannot write " << halves[h].file << "\n";
+		ok = false;
+	    }
+	}
+	if(ok) {
+	    if(halves[1].count == 0)
+		split = lmax;
+	    if(halves[0].count == 0)
+		split = rmin;
+	    parent->split = split;
+	}
+
+	for(int h = 0; h < 2; h++) {
+	    if(!ok || halves[h].count == 0) {
+		remove(halves[h].file.c_str());
+		continue;
+	    }
+	    halves[h].bounds[2*dim + 1 - h] = split;
+	    if(halves[h].count > blockSize) {
+		Inner<> *node = new Inner<>(parent);
+		(h == 0 ? parent->left : parent->right) = node;
+		halves[h].node = node;
+		parts.push(halves[h]);
+		continue;
+	    }
+	    vector< Point<D> > data;
+	    ok = scan(halves[h].file, halves[h].count, [&](const vector< Point<D> > &chunk) {
+		data.insert(data.end(), chunk.begin(), chunk.end());
+	    });
+	    remove(halves[h].file.c_str());
+	    if(!ok)
+		continue;
+	    points leaf;
+	    for(size_t i = 0; i < data.size(); i++) leaf.push_back(&data[i]);
+	    (h == 0 ? parent->left : parent->right) = writeLeaf(out, parent, leaf);
+	}
+	return ok;
+    }
+
+    /**
+     * Lower bound of the squared distance to the far child
+     * @param rd lower bound of the parent node
+     * @param diff distance of the query from the split plane
+     */
+    inline float farDistance(float rd, float diff) const {
+	diff *= diff;
+	return (diff > rd) ? diff : rd;
+    }
+
+public:
+
+    /**
+     * Creates empty out-of-core tree
+     * @param cacheBlocks maximal number of blocks kept in memory
+     * @param blockSize maximal number of points in one leaf block
+     */
+    OutOfCoreKDTree(int cacheBlocks = 1024, int blockSize = 256)
+	    : blockSize(blockSize), buildPoints(std::max<size_t>(1 << 20, blockSize)), cache(cacheBlocks) {
+	root = new Inner<>(NULL);
+	sizep = 0;
+	blocks = 0;
+    }
+
+    ~OutOfCoreKDTree() {
+	freeNodes();
+    }
+
+    /**
+     * Changes the number of blocks kept in memory
+     * @param cacheBlocks maximal number of cached blocks
+     */
+    void setCacheSize(int cacheBlocks) {
+	cache.setCapacity(cacheBlocks);
+    }
+
+    /**
+     * Cache statistics since construction (or last reset)
+     */
+    const CacheStats &getCacheStats() const {
+	return cache.getStats();
+    }
+
+    /**
+     * Cache statistics of the last query
+     */
+    const CacheStats &getLastQueryStats() const {
+	return lastQuery;
+    }
+
+    void resetCacheStats() {
+	cache.resetStats();
+    }
+
+    /**
+     * Returns number of points in the tree
+     */
+    const int size() const {
+	return sizep;
+    }
+
+    /**
+     * Returns number of blocks in the file
+     */
+    const int getBlockCount() const {
+	return blocks;
+    }
+
+    /**
+     * Sets how many points the construction partitions in memory, bigger
+     * parts are split through temporary files next to the tree file
+     * @param points maximal number of points in memory, at least one block
+     */
+    void setBuildPoints(size_t points) {
+	buildPoints = std::max(points, blockSize);
+    }
+
+    /**
+     * Writes the points in the input format of construct (raw points),
+     * a cloud larger than the memory can be written in parts with append
+     * @return false if the file could not be written
+     */
+    static bool writePoints(const vector< Point<D> > &data, const string &input, bool append = false) {
+	ofstream out(input.c_str(), ios::binary | (append ? ios::app : ios::trunc));
+	if(!data.empty())
+	    out.write((const char *) &data[0], data.size() * sizeof(Point<D>));
+	if(!out) {
+	    cerr << "cannot write " << input << "\n";
+	    return false;
+	}
+	return true;
+    }
+
+    /**
+     * Builds the tree from the file of points (see writePoints) and writes
+     * the leaf blocks to the tree file. The points are streamed: parts with
+     * more points than setBuildPoints are split by the sliding midpoint rule
+     * into temporary files, smaller parts are built in memory the same way
+     * as in KDTree. The input is only read.
+     *
+     * @param input file with the points
+     * @param path file for the leaf blocks, it's overwritten
+     * @param abounds array with bounds of the coordinates \
+     *		  expects array like this - 2D: [xmin, xmax, ymin, ymax]
+     * @return false if a file could not be read or written
+     */
+    bool construct(const string &input, string path, float * abounds = NULL) {
+	ifstream in(input.c_str(), ios::binary | ios::ate);
+	if(!in) {
+	    cerr << "cannot read " << input << "\n";
+	    return false;
+	}
+	const streamoff bytes = in.tellg();
+	in.close();
+	if(bytes % sizeof(Point<D>) != 0) {
+	    cerr << input << " is not a file of " << D << "D points\n";
+	    return false;
+	}
+	const size_t count = bytes / sizeof(Point<D>);
+
+	if(!abounds) {
+	    for(int d = 0; d < D; d++) {
+		boundingBox[2*d] = numeric_limits<float>::max();
+		boundingBox[2*d + 1] = -numeric_limits<float>::max();
+	    }
+	    if(!scan(input, count, [&](const vector< Point<D> > &chunk) {
+		for(size_t i = 0; i < chunk.size(); i++) {
+		    for(int d = 0; d < D; d++) {
+			if(chunk[i][d] < boundingBox[2*d]) boundingBox[2*d] = chunk[i][d];
+			if(chunk[i][d] > boundingBox[2*d + 1]) boundingBox[2*d + 1] = chunk[i][d];
+		    }
+		}
+	    }))
+		return false;
+	}
+	else {
+	    copy(abounds, abounds + 2*D, boundingBox);
+	}
+
+	this->path = path;
+	file.close();
+	cache.clear();
+	ofstream out(path.c_str(), ios::binary | ios::trunc);
+	if(!out) {
+	    cerr << "cannot write " << path << "\n";
+	    return false;
+	}
+
+	sizep = count;
+	blocks = 0;
+	freeNodes();
+	root = new Inner<>(NULL);
+
+	stack<Part> parts;
+	Part all;
+	all.file = input;
+	all.count = count;
+	copy(boundingBox, boundingBox + 2*D, all.bounds);
+	all.node = root;
+	parts.push(all);
+	int temps = 0;
+	bool ok = true;
+	while(!parts.empty()) {
+	    Part curr = parts.top();
+	    parts.pop();
+	    if(ok)
+		ok = (curr.count <= buildPoints) ? buildPart(out, curr) : splitPart(out, curr, parts, temps);
+	    if(curr.file != input)
+		remove(curr.file.c_str());
+	}
+	out.close();
+	if(!ok || !out) {
+	    if(ok) cerr << "cannot write " << path << "\n";
+	    return false;
+	}
+
+	file.open(path.c_str(), ios::binary);
+	return file.good();
+    }
+
+    /**
+     * Returns the exact nearest neighbor (NN), points with zero distance
+     * from the query are skipped (same as KDTree::nearestNeighbor), with
+     * EXCLUDE_NONE they are not. The points are copies, EXCLUDE_SELF
+     * has nothing to compare.
+     * @param query the point whose NN we search
+     * @param found set to false if the tree has no other point
+     * @return nearest neigbor
+     */
+    template<Exclusion E = EXCLUDE_ZERO>
+    Point<D> nearestNeighbor(const Point<D> *query, bool *found = NULL) {
+	static_assert(E != EXCLUDE_SELF, "points of the out-of-core tree have no identity");
+	lastQuery = CacheStats();
+	float dist = numeric_limits<float>::max();
+	Point<D> nearest;
+	bool any = false;
+	if(found) *found = false;
+	if(sizep == 0)
+	    return nearest;
+
+	stack<dNode> stack;
+	stack.push(dNode(root, 0.f));
+	while(!stack.empty()) {
+	    dNode curr = stack.top();
+	    stack.pop();
+	    if(curr.second >= dist)
+		continue;
+
+	    if(curr.first->isLeaf()) {
+		BlockLeaf<D> *leaf = (BlockLeaf<D> *) curr.first;
+		if(minBoundsDistance(query, leaf->min, leaf->max) >= dist)
+		    continue; //BOB test, the block is not even loaded
+		const vector< Point<D> > &block = load(leaf);
+		for(size_t i = 0; i < block.size(); i++) {
+		    float tmp = distance(query, &block[i]);
+		    if(tmp < dist && (E == EXCLUDE_NONE || tmp > 0)) {
+			dist = tmp;
+			nearest = block[i];
+			any = true;
+		    }
+		}
+		continue;
+	    }
+
+	    Inner<> *node = (Inner<> *) curr.first;
+	    float diff = (*query)[node->dimension] - node->split;
+	    Node<> *nearer = (diff <= 0) ? node->left : node->right;
+	    Node<> *further = (diff <= 0) ? node->right : node->left;
+	    //further first, so the nearer is popped first
+	    if(further)
+		stack.push(dNode(further, farDistance(curr.second, diff)));
+	    if(nearer)
+		stack.push(dNode(nearer, curr.second));
+	}
+	if(found) *found = any;
+	return nearest;
+    }
+
+    /**
+     * Returns all points in a hypersphere around given point
+     * @param query center of the sphere
+     * @param radius radius of the sphere
+     * @return list of points inside
+     */
+    vector< Point<D> > circularQuery(const Point<D> *query, const float radius) {
+	lastQuery = CacheStats();
+	vector< Point<D> > data;
+	const float r = radius * radius;
+	if(sizep == 0)
+	    return data;
+
+	stack<dNode> stack;
+	stack.push(dNode(root, 0.f));
+	while(!stack.empty()) {
+	    dNode curr = stack.top();
+	    stack.pop();
+
+	    if(curr.first->isLeaf()) {
+		BlockLeaf<D> *leaf = (BlockLeaf<D> *) curr.first;
+		if(minBoundsDistance(query, leaf->min, leaf->max) >= r)
+		    continue;
+		const vector< Point<D> > &block = load(leaf);
+		for(size_t i = 0; i < block.size(); i++) {
+		    if(distance(query, &block[i]) < r)
+			data.push_back(block[i]);
+		}
+		continue;
+	    }
+
+	    Inner<> *node = (Inner<> *) curr.first;
+	    float diff = (*query)[node->dimension] - node->split;
+	    Node<> *nearer = (diff <= 0) ? node->left : node->right;
+	    Node<> *further = (diff <= 0) ? node->right : node->left;
+	    float fd = farDistance(curr.second, diff);
+	    if(further && fd < r)
+		stack.push(dNode(further, fd));
+	    if(nearer)
+		stack.push(dNode(nearer, curr.second));
+	}
+	return data;
+    }
+
+    /**
+     * Returns exact k-nearest neighbors (kNN). As in KDTree, the points at
+     * zero distance from the query are not part of the result, with
+     * EXCLUDE_NONE they are (see nearestNeighbor).
+     * @param query the point whose kNN we search
+     * @param k the number of points we look for
+     * @return vector of kNN, sorted by distance
+     */
+    template<Exclusion E = EXCLUDE_ZERO>
+    vector< Point<D> > kNearestNeighbors(const Point<D> *query, const int k) {
+	static_assert(E != EXCLUDE_SELF, "points of the out-of-core tree have no identity");
+	lastQuery = CacheStats();
+	typedef pair<float, Point<D> > candidate;
+	vector< Point<D> > result;
+	if(k <= 0)
+	    return result;
+	const size_t count = k;
+
+	//max-heap of the best candidates
+	vector<candidate> heap;
+	heap.reserve(count + 1);
+	auto cmp = [](const candidate &a, const candidate &b) -> bool { return a.first < b.first; };
+	float dist = numeric_limits<float>::max();
+
+	stack<dNode> stack;
+	if(sizep > 0)
+	    stack.push(dNode(root, 0.f));
+	while(!stack.empty()) {
+	    dNode curr = stack.top();
+	    stack.pop();
+	    if(curr.second >= dist)
+		continue;
+
+	    if(curr.first->isLeaf()) {
+		BlockLeaf<D> *leaf = (BlockLeaf<D> *) curr.first;
+		if(minBoundsDistance(query, leaf->min, leaf->max) >= dist)
+		    continue;
+		const vector< Point<D> > &block = load(leaf);
+		for(size_t i = 0; i < block.size(); i++) {
+		    float tmp = distance(query, &block[i]);
+		    if(tmp < dist && (E == EXCLUDE_NONE || tmp > 0)) {
+			heap.push_back(candidate(tmp, block[i]));
+			push_heap(heap.begin(), heap.end(), cmp);
+			if(heap.size() > count) {
+			    pop_heap(heap.begin(), heap.end(), cmp);
+			    heap.pop_back();
+			}
+			if(heap.size() == count)
+			    dist = heap.front().first;
+		    }
+		}
+		continue;
+	    }
+
+	    Inner<> *node = (Inner<> *) curr.first;
+	    float diff = (*query)[node->dimension] - node->split;
+	    Node<> *nearer = (diff <= 0) ? node->left : node->right;
+	    Node<> *further = (diff <= 0) ? node->right : node->left;
+	    if(further)
+		stack.push(dNode(further, farDistance(curr.second, diff)));
+	    if(nearer)
+		stack.push(dNode(nearer, curr.second));
+	}
+
+	sort_heap(heap.begin(), heap.end(), cmp);
+	for(size_t i = 0; i < heap.size(); i++) {
+	    result.push_back(heap[i].second);
+	}
+	return result;
+    }
+};
+
+template<const int D>
+const size_t OutOfCoreKDTree<D>::ioPoints;
+
+#endif	/* OUTOFCOREKDTREE_H */
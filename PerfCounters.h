@@ -0,0 +1,216 @@
+/*
+ * File:   PerfCounters.h
+ * Author: Daniel Princ
+ *
+ * Hardware performance counters of the CPU (Linux perf_event_open):
+ * cycles, instructions, L1 data and last level cache misses and
+ * branch misses. On other systems, or when the kernel does not allow
+ * the counters (see /proc/sys/kernel/perf_event_paranoid), open()
+ * returns false and nothing is counted.
+ *
+ */
+
+#ifndef PERFCOUNTERS_H
+#define	PERFCOUNTERS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace std;
+
+/**
+ * Counted events
+ */
+enum PerfEvent {
+    PERF_CYCLES, PERF_INSTRUCTIONS, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_EVENTS
+};
+
+/**
+ * Counter values of one measured section
+ */
+struct PerfSample {
+    uint64_t values[PERF_EVENTS];
+    /** false if the event could not be opened */
+    bool valid[PERF_EVENTS];
+
+    PerfSample() {
+	for(int e = 0; e < PERF_EVENTS; e++) {
+	    values[e] = 0;
+	    valid[e] = false;
+	}
+    }
+};
+
+/**
+ * Counts the events of this thread (user space only) between start() and stop().
+ *
+ * Every event has its own counter, so an event the CPU does not support
+ * does not disable the others. When the kernel multiplexes the counters,
+ * the values are scaled by the time they were really counting.
+ *
+ * Usage:
+ *	PerfCounters perf;
+ *	if(perf.open()) { perf.start(); ...; PerfSample s = perf.stop(); }
+ */
+class PerfCounters {
+    int fds[PERF_EVENTS];
+
+    PerfCounters(const PerfCounters &);
+    PerfCounters &operator=(const PerfCounters &);
+
+#ifdef __linux__
+    static int openEvent(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+
+public:
+
+    PerfCounters() {
+	for(int e = 0; e < PERF_EVENTS; e++) fds[e] = -1;
+    }
+
+    ~PerfCounters() {
+	close();
+    }
+
+    /**
+     * Opens the counters
+     * @return true if at least one event can be counted
+     */
+    bool open() {
+	close();
+	bool any = false;
+#ifdef __linux__
+	const uint64_t l1dMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	fds[PERF_CYCLES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	fds[PERF_INSTRUCTIONS] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	fds[PERF_L1D_MISSES] = openEvent(PERF_TYPE_HW_CACHE, l1dMiss);
+	fds[PERF_LLC_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	fds[PERF_BRANCH_MISSES] = openEvent(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+	for(int e = 0; e < PERF_EVENTS; e++) {
+	    if(fds[e] >= 0) any = true;
+	}
+#endif
+	return any;
+    }
+
+    void close() {
+	for(int e = 0; e < PERF_EVENTS; e++) {
+#ifdef __linux__
+	    if(fds[e] >= 0) ::close(fds[e]);
+#endif
+	    fds[e] = -1;
+	}
+    }
+
+    bool available(PerfEvent e) const {
+	return fds[e] >= 0;
+    }
+
+    /**
+     * Resets and starts all opened counters
+     */
+    void start() {
+#ifdef __linux__
+	for(int e = 0; e < PERF_EVENTS; e++) {
+	    if(fds[e] < 0) continue;
+	    ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+    }
+
+    /**
+     * Stops the counters
+     * @return values since start()
+     */
+    PerfSample stop() {
+	PerfSample s;
+#ifdef __linux__
+	for(int e = 0; e < PERF_EVENTS; e++) {
+	    if(fds[e] >= 0) ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+	}
+	for(int e = 0; e < PERF_EVENTS; e++) {
+	    if(fds[e] < 0) continue;
+	    uint64_t data[3]; //value, time enabled, time running
+	    if(read(fds[e], data, sizeof(data)) != (ssize_t) sizeof(data)) continue;
+	    s.values[e] = data[0];
+	    if(data[2] > 0 && data[2] < data[1])
+		s.values[e] = (uint64_t) (data[0] * ((double) data[1] / data[2]));
+	    s.valid[e] = data[2] > 0;
+	}
+#endif
+	return s;
+    }
+
+    static const char *name(PerfEvent e) {
+	static const char *names[PERF_EVENTS] = {"cycles", "instructions", "L1d misses", "LLC misses", "branch misses"};
+	return names[e];
+    }
+
+    /**
+     * Prints the header of the per query table
+     */
+    static void printHeader(ostream &out) {
+	out << left << setw(18) << "op" << setw(12) << "data" << right << setw(4) << "D"
+		<< setw(10) << "size" << setw(9) << "points" << setw(10) << "cycles"
+		<< setw(10) << "instr" << setw(6) << "IPC" << setw(9) << "L1d miss"
+		<< setw(9) << "LLC miss" << setw(9) << "br miss" << "\n";
+    }
+
+    /**
+     * Prints a sample as a table row of per query values
+     * @param queries number of queries in the sample
+     * @param points number of points tested by all the queries
+     */
+    static void printRow(ostream &out, const string &op, const string &distribution, int dim,
+	    size_t size, const PerfSample &s, size_t queries, uint64_t points) {
+	ios::fmtflags flags = out.flags();
+	streamsize precision = out.precision();
+	out << fixed << setprecision(1);
+	out << left << setw(18) << op << setw(12) << distribution << right
+		<< setw(4) << dim << setw(10) << size << setw(9) << points / (double) queries;
+	const int widths[PERF_EVENTS] = {10, 10, 9, 9, 9};
+	for(int e = 0; e < PERF_EVENTS; e++) {
+	    if(e == PERF_L1D_MISSES) { //IPC goes between instructions and misses
+		out << setprecision(2) << setw(6);
+		if(s.valid[PERF_CYCLES] && s.valid[PERF_INSTRUCTIONS] && s.values[PERF_CYCLES])
+		    out << s.values[PERF_INSTRUCTIONS] / (double) s.values[PERF_CYCLES];
+		else
+		    out << "-";
+		out << setprecision(1);
+	    }
+	    out << setw(widths[e]);
+	    if(s.valid[e])
+		out << s.values[e] / (double) queries;
+	    else
+		out << "-";
+	}
+	out << "\n";
+	out.flags(flags);
+	out.precision(precision);
+    }
+};
+
+#endif	/* PERFCOUNTERS_H */
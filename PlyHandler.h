@@ -20,6 +20,7 @@
 #include <locale>
 
 #include "Point.h"
+#include "PointCloud.h"
 
 using namespace std;
 
@@ -50,10 +51,11 @@ public:
      * Loads set of point from ply file
      * Note that this is not very general and handles files with points
      * @param file path to file
+     * @param verbose print the number of loaded points
      * @return vector of points
      */
     template<const int D>
-    static vector< Point<D> > load(string file) {
+    static vector< Point<D> > load(string file, bool verbose = true) {
 	vector< Point<D> > data;
 	ifstream infile(file.c_str());
 	string line;
@@ -115,22 +117,176 @@ public:
 	}
 	infile.close();
 	
-	cout << "loaded " << data.size() << " points from " << file << "\n";
+	if(verbose)
+	    cout << "loaded " << data.size() << " points from " << file << "\n";
 	
 	return data;
     }
     
+    /**
+     * Loads point cloud from ply file, the attributes go directly 
+     * to the channels of the cloud.
+     * Recognized vertex properties: x, y, z, nx, ny, nz, red, green, blue
+     * (also diffuse_red, ...) and intensity (also scalar_intensity), 
+     * other properties are skipped.
+     * @param file path to file
+     * @return point cloud, channels not present in the file are empty
+     */
+    template<const int D>
+    static PointCloud<D> loadCloud(string file) {
+	PointCloud<D> cloud;
+	ifstream infile(file.c_str());
+	string line;
+	if(!getline(infile, line) || trim(line) != "ply") 
+	    return cloud;
+	if(!getline(infile, line) || trim(line) != "format ascii 1.0") 
+	    return cloud;
+	
+	//position of each channel in the vertex line, -1 if not present
+	int coord[3] = {-1, -1, -1};
+	int normal[3] = {-1, -1, -1};
+	int color[3] = {-1, -1, -1};
+	int intensity = -1;
+	int properties = 0;
+	int vertices = -1;
+	bool inVertex = false;
+	while (getline(infile, line)) {
+	    istringstream iss(line);
+	    string s;
+	    if(!(iss >> s)) continue;
+	    if(s == "end_header") break;
+	    if(s == "element") {
+		iss >> s;
+		inVertex = (s == "vertex");
+		if(inVertex) iss >> vertices;
+		continue;
+	    }
+	    if(s != "property" || !inVertex) continue;
+	    
+	    string type, name;
+	    iss >> type >> name;
+	    if(name == "x") coord[0] = properties;
+	    else if(name == "y") coord[1] = properties;
+	    else if(name == "z") coord[2] = properties;
+	    else if(name == "nx") normal[0] = properties;
+	    else if(name == "ny") normal[1] = properties;
+	    else if(name == "nz") normal[2] = properties;
+	    else if(name == "red" || name == "diffuse_red") color[0] = properties;
+	    else if(name == "green" || name == "diffuse_green") color[1] = properties;
+	    else if(name == "blue" || name == "diffuse_blue") color[2] = properties;
+	    else if(name == "intensity" || name == "scalar_intensity") intensity = properties;
+	    properties++;
+	}
+	if(vertices < 0) return cloud;
+	for(int d = 0; d < D && d < 3; d++) {
+	    if(coord[d] < 0) return cloud;
+	}
+	
+	const bool hasNormals = normal[0] >= 0 && normal[1] >= 0 && normal[2] >= 0;
+	const bool hasColors = color[0] >= 0 && color[1] >= 0 && color[2] >= 0;
+	cloud.points.reserve(vertices);
+	if(hasNormals) cloud.normals.reserve(vertices);
+	if(hasColors) cloud.colors.reserve(vertices);
+	if(intensity >= 0) cloud.intensity.reserve(vertices);
+	
+	vector<float> values(properties);
+	for(int i = 0; i < vertices; i++) {
+	    if(!getline(infile, line)) break;
+	    istringstream iss(line);
+	    int read = 0;
+	    while(read < properties && iss >> values[read]) read++;
+	    if(read < properties) break;
+	    
+	    Coords<D> p;
+	    for(int d = 0; d < D; d++) {
+		p[d] = (d < 3) ? values[coord[d]] : 0;
+	    }
+	    cloud.points.push_back(p);
+	    if(hasNormals) {
+		Coords<3> n;
+		for(int d = 0; d < 3; d++) n[d] = values[normal[d]];
+		cloud.normals.push_back(n);
+	    }
+	    if(hasColors) 
+		cloud.colors.push_back(Rgb(values[color[0]], values[color[1]], values[color[2]]));
+	    if(intensity >= 0) 
+		cloud.intensity.push_back(values[intensity]);
+	}
+	infile.close();
+	
+	cout << "loaded " << cloud.size() << " points from " << file << "\n";
+	return cloud;
+    }
+    
+    /**
+     * Saves point cloud to PLY file, writes all present channels
+     * @param file file name
+     * @param cloud point cloud
+     */
+    template<const int D>
+    static void saveCloud(string file, const PointCloud<D> &cloud) {
+	if(D > 3 || D < 2) 
+	    return;
+	
+	cout << "saving " << cloud.size() << " points to " << file << "\n";
+	
+	ofstream myfile;
+	myfile.open(file.c_str());
+	
+	myfile << "ply\nformat ascii 1.0\n";
+	myfile << "element vertex " << cloud.size() << "\n";
+	myfile << "property float x\n";
+	myfile << "property float y\n";
+	myfile << "property float z\n";
+	if(cloud.hasNormals()) {
+	    myfile << "property float nx\n";
+	    myfile << "property float ny\n";
+	    myfile << "property float nz\n";
+	}
+	if(cloud.hasColors()) {
+	    myfile << "property uchar diffuse_red\n";
+	    myfile << "property uchar diffuse_green\n";
+	    myfile << "property uchar diffuse_blue\n";
+	}
+	if(cloud.hasIntensity()) 
+	    myfile << "property float intensity\n";
+	myfile << "end_header\n";
+	
+	for(size_t i = 0; i < cloud.size(); i++) {
+	    const Coords<D> &p = cloud.points[i];
+	    myfile << p[0] << " " << p[1];
+	    if(D == 3) myfile << " " << p[2];
+	    else myfile << " 0";
+	    
+	    if(cloud.hasNormals()) {
+		const Coords<3> &n = cloud.normals[i];
+		myfile << " " << n[0] << " " << n[1] << " " << n[2];
+	    }
+	    if(cloud.hasColors()) {
+		const Rgb &c = cloud.colors[i];
+		myfile << " " << (int) c.r << " " << (int) c.g << " " << (int) c.b;
+	    }
+	    if(cloud.hasIntensity())
+		myfile << " " << cloud.intensity[i];
+	    myfile << "\n";
+	}
+	
+	myfile.close();
+    }
+    
     /**
      * Saves points to PLY file
      * @param file file name
      * @param data points
+     * @param verbose print the number of saved points
      */
     template<const int D>
-    static void savePoints(string file, vector< Point<D> > data) {
+    static void savePoints(string file, vector< Point<D> > data, bool verbose = true) {
 	if(D > 3 || D < 2) 
 	    return;
 	
-	cout << "saving " << data.size() << " points to " << file << "\n";
+	if(verbose)
+	    cout << "saving " << data.size() << " points to " << file << "\n";
 	
 	ofstream myfile;
 	myfile.open(file.c_str());
@@ -202,7 +358,7 @@ public:
 	    myfile << " " << p.color[0] << " "<< p.color[1] << " "<< p.color[2] << "\n";
 	}
 	
-	for(int i = 0; i < data.size(); i+=2) {
+	for(size_t i = 0; i < data.size(); i+=2) {
 	    myfile << i << " " << i+1 << " ";
 	    myfile << "255 255 255\n";
 	}
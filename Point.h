@@ -8,13 +8,70 @@
 #define	POINT_H
 
 #include <iostream>
+#include <algorithm>
+
+/**
+ * Coordinates only, the compact type for indexing.
+ * Other attributes are kept in parallel arrays, see PointCloud.
+ * T is the type of the coordinates: float, double or integer 
+ * for quantized data.
+ */
+template<const int D = 3, typename T = float>
+struct Coords {
+    typedef T value_type;
+    
+    T coords[D];
+    
+    /**
+     * Creates point with no coordinates
+     */
+    Coords() {}
+    
+    /**
+     * Creates the point with given coordinates
+     * @param co array of coordinates
+     */
+    Coords(const T* co) {
+	std::copy(co, co + D, coords);
+    }
+    
+    /**
+     * Access to point coordinates
+     * @param idx dimension
+     * @return coordinate
+     */
+    T& operator[](int idx) {
+	return coords[idx];
+    }
+    
+    /**
+     * Access to point coordinates
+     * @param idx dimension
+     * @return coordinate
+     */
+    const T& operator[](int idx) const {
+	return coords[idx];
+    }
+    
+    /**
+     * Debug
+     */
+    friend std::ostream& operator<<(std::ostream& out, const Coords& p) // output
+    {
+	out << "Coords[" << D << "]: ";
+	for(int i = 0; i < D; i++) {
+	    out << p[i] << ", ";
+	}
+	return out;
+    }
+};
 
 /**
  * Simple point with coordinates and color
  */
-template<const int D = 3>
-struct Point {
-    float coords[D];
+template<const int D = 3, typename T = float>
+struct Point : Coords<D, T> {
+    using Coords<D, T>::coords;
     int color[3];
     
     /**
@@ -28,10 +85,7 @@ struct Point {
      * Creates the point with given coordinates
      * @param co array of coordinates
      */
-    Point(float* co) {
-	for(int i = 0; i < D; i++) {
-	    coords[i] = co[i];
-	}
+    Point(T* co) : Coords<D, T>(co) {
 	color[0] = color[1] = color[2] = 0;
     }
     
@@ -39,8 +93,7 @@ struct Point {
      * Copy constructor
      * @param point original object
      */
-    Point(const Point<D> & point) {
-	std::copy(point.coords, point.coords + D, coords);
+    Point(const Point & point) : Coords<D, T>(point) {
 	std::copy(point.color, point.color + 3, color);
     }
     
@@ -56,31 +109,13 @@ struct Point {
 	color[2] = b;
     }
     
-    Point& operator= (const Point<D> & point) {
+    Point& operator= (const Point & point) {
 	Point tmp(point);
 	std::swap(coords, tmp.coords);
 	std::swap(color, tmp.color);
 	return *this;
     }
     
-    /**
-     * Access to point coordinates
-     * @param idx dimension
-     * @return coordinate
-     */
-    float& operator[](int idx) {
-	return coords[idx];
-    }
-    
-    /**
-     * Access to point coordinates
-     * @param idx dimension
-     * @return coordinate
-     */
-    const float& operator[](int idx) const {
-	return coords[idx];
-    }
-    
     /**
      * Debug
      */
@@ -0,0 +1,122 @@
+/*
+ * File:   PointCloud.h
+ * Author: Daniel Princ
+ *
+ * Split point layout: coordinates for indexing and optional
+ * attribute channels in parallel arrays.
+ *
+ */
+
+#ifndef POINTCLOUD_H
+#define	POINTCLOUD_H
+
+#include <vector>
+#include <stdint.h>
+#include "Point.h"
+
+/**
+ * 8-bit color
+ */
+struct Rgb {
+    uint8_t r, g, b;
+
+    Rgb() : r(0), g(0), b(0) {}
+    Rgb(uint8_t r, uint8_t g, uint8_t b) : r(r), g(g), b(b) {}
+};
+
+/**
+ * Point cloud with coordinates and optional attribute channels.
+ *
+ * Only the coordinates are needed for the kd-tree
+ * (KDTree<D, Coords<D> >), so the search doesn't read the attributes.
+ * Each channel is either empty (not present) or has one value per point,
+ * channel[i] belongs to points[i].
+ */
+template<const int D = 3>
+struct PointCloud {
+    /** coordinates, the only channel the tree reads */
+    std::vector< Coords<D> > points;
+    /** colors, optional */
+    std::vector< Rgb > colors;
+    /** normals, optional */
+    std::vector< Coords<3> > normals;
+    /** intensity, optional */
+    std::vector< float > intensity;
+
+    /**
+     * Number of points
+     */
+    size_t size() const {
+	return points.size();
+    }
+
+    bool hasColors() const {
+	return !colors.empty();
+    }
+
+    bool hasNormals() const {
+	return !normals.empty();
+    }
+
+    bool hasIntensity() const {
+	return !intensity.empty();
+    }
+
+    /**
+     * Memory used per point by all present channels
+     * @return bytes per point
+     */
+    size_t bytesPerPoint() const {
+	size_t bytes = sizeof(Coords<D>);
+	if(hasColors()) bytes += sizeof(Rgb);
+	if(hasNormals()) bytes += sizeof(Coords<3>);
+	if(hasIntensity()) bytes += sizeof(float);
+	return bytes;
+    }
+
+    /**
+     * Reserves memory in the coordinates and all present channels
+     * @param count number of points
+     */
+    void reserve(size_t count) {
+	points.reserve(count);
+	if(hasColors()) colors.reserve(count);
+	if(hasNormals()) normals.reserve(count);
+	if(hasIntensity()) intensity.reserve(count);
+    }
+
+    /**
+     * Creates the cloud from points with colors
+     * @param data points
+     * @return cloud with coordinates and colors
+     */
+    static PointCloud fromPoints(const std::vector< Point<D> > &data) {
+	PointCloud cloud;
+	cloud.points.reserve(data.size());
+	cloud.colors.reserve(data.size());
+	for(typename std::vector< Point<D> >::const_iterator it = data.begin(); it != data.end(); ++it) {
+	    cloud.points.push_back(Coords<D>(it->coords));
+	    cloud.colors.push_back(Rgb(it->color[0], it->color[1], it->color[2]));
+	}
+	return cloud;
+    }
+
+    /**
+     * Converts the cloud back to points with colors (black if there are none)
+     * @return points
+     */
+    std::vector< Point<D> > toPoints() const {
+	std::vector< Point<D> > data;
+	data.reserve(size());
+	for(size_t i = 0; i < size(); i++) {
+	    Point<D> p;
+	    std::copy(points[i].coords, points[i].coords + D, p.coords);
+	    if(hasColors())
+		p.setColor(colors[i].r, colors[i].g, colors[i].b);
+	    data.push_back(p);
+	}
+	return data;
+    }
+};
+
+#endif	/* POINTCLOUD_H */
@@ -1,4 +1,4 @@
-/* 
+/*
  * File:   PointCloudGenerator.h
  * Author: Dan Princ
  *
@@ -7,92 +7,365 @@
 #ifndef POINTCLOUDGENERATOR_H
 #define	POINTCLOUDGENERATOR_H
 
-#include <cstdlib> 
+#include <stdint.h>
 #include <vector>
-#include <ctime> 
+#include <string>
+#include <thread>
+#include <iostream>
+#include <algorithm>
+#include <math.h>
 #include "Point.h"
 
+/**
+ * Counter based random generator (SplitMix64).
+ * The stream depends only on the seed, the index of the point and the
+ * stream number, so every point is the same for any number of threads
+ * and any part of the data can be generated alone.
+ */
+class PointRng {
+    uint64_t state;
+    /** second gaussian value of Box-Muller */
+    double spare;
+    bool hasSpare;
+
+    static uint64_t mix(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+    }
+
+public:
+
+    /**
+     * @param seed seed of the whole data set
+     * @param index index of the point (or of the shared object)
+     * @param stream different streams for points and shared objects
+     */
+    PointRng(uint64_t seed, uint64_t index, uint64_t stream = 0) : spare(0), hasSpare(false) {
+	state = mix(mix(seed + stream * 0xd1b54a32d192ed03ULL) + index);
+    }
+
+    uint64_t next() {
+	state += 0x9e3779b97f4a7c15ULL;
+	return mix(state);
+    }
+
+    /** uniform in <0, 1) */
+    double uniform() {
+	return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    /** uniform in <a, b) */
+    double uniform(double a, double b) {
+	return a + uniform() * (b - a);
+    }
+
+    /** N(0, 1), Box-Muller */
+    double gauss() {
+	if(hasSpare) {
+	    hasSpare = false;
+	    return spare;
+	}
+	double u1 = 1 - uniform(); //(0, 1>
+	double u2 = uniform();
+	double r = sqrt(-2 * log(u1));
+	spare = r * cos(2 * M_PI * u2);
+	hasSpare = true;
+	return r * sin(2 * M_PI * u2);
+    }
+
+    /** uniform integer in <0, n) */
+    size_t pick(size_t n) {
+	return (size_t) (next() % n);
+    }
+};
 
 /**
  * Generates point data
+ * P is the generated point type, Point<D> or the compact Coords<D>
+ *
+ * All methods are deterministic, the same seed gives the same points
+ * regardless of the number of threads. The points are generated in
+ * parallel chunks, threads = 0 uses all cores.
+ * Shared objects (cluster centers, planes, strips) come from their own
+ * stream of the seed.
  */
-template <const int D = 3>
+template <const int D = 3, typename P = Point<D> >
 class PointCloudGen {
-       
-    static constexpr float pi = 3.1415926f;
-    
-    static float randomFloat(float a, float b) {
-	float random = ((float) rand()) / (float) RAND_MAX;
-	return a + random * (b - a);
-    }
-    
+
+    /** stream of the shared objects */
+    static const uint64_t sceneStream = 1;
+    /** minimal number of points of one thread */
+    static const size_t minChunk = 1 << 16;
+
+    /**
+     * Calls fill(rng, point) for all points, in parallel chunks
+     */
+    template<typename F>
+    static void generate(std::vector<P> &points, uint64_t seed, unsigned threads, F fill) {
+	if(threads == 0)
+	    threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = (unsigned) std::min((size_t) threads, points.size() / minChunk + 1);
+
+	auto chunk = [&points, seed, &fill](size_t from, size_t to) {
+	    for(size_t i = from; i < to; i++) {
+		PointRng rng(seed, i);
+		fill(rng, points[i]);
+	    }
+	};
+
+	std::vector<std::thread> workers;
+	size_t step = points.size() / threads + 1;
+	for(unsigned t = 1; t < threads; t++) {
+	    size_t from = std::min(points.size(), t * step);
+	    size_t to = std::min(points.size(), from + step);
+	    workers.push_back(std::thread(chunk, from, to));
+	}
+	chunk(0, std::min(points.size(), step));
+	for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+    }
+
+    /**
+     * Random unit vector orthogonal to the given ones (Gram-Schmidt)
+     */
+    static std::vector<double> direction(PointRng &rng, const std::vector< std::vector<double> > &basis) {
+	std::vector<double> v(D);
+	while(true) {
+	    for(int d = 0; d < D; d++) v[d] = rng.gauss();
+	    for(size_t b = 0; b < basis.size(); b++) {
+		double dot = 0;
+		for(int d = 0; d < D; d++) dot += v[d] * basis[b][d];
+		for(int d = 0; d < D; d++) v[d] -= dot * basis[b][d];
+	    }
+	    double len = 0;
+	    for(int d = 0; d < D; d++) len += v[d] * v[d];
+	    len = sqrt(len);
+	    if(len > 1e-6 || (int) basis.size() >= D) { //all directions are taken in D < 3
+		for(int d = 0; d < D; d++) v[d] = len > 1e-6 ? v[d] / len : 0;
+		return v;
+	    }
+	}
+    }
+
+    /**
+     * Flat rectangular patch with noise
+     */
+    struct Plane {
+	double origin[D];
+	std::vector<double> u, v;
+	double width, height;
+    };
+
 public:
-    
+
     /**
      * Gfenerates set of random points within given bounds
      * @param count number of points
      * @param bounds array with bounds
-     * @return 
+     * @param seed seed of the generator
+     * @param threads number of threads, 0 = all cores
+     * @return
      */
-    static std::vector< Point<D> > genRandPoints(int count, float *bounds) {
-	srand((unsigned)std::time(0)); 
-	std::vector< Point<D> > points;
-	for(int i = 0; i < count; i++) {
-	    Point<D> p;
+    static std::vector< P > genRandPoints(size_t count, const float *bounds, uint64_t seed = 1, unsigned threads = 0) {
+	std::vector< P > points(count);
+	generate(points, seed, threads, [bounds](PointRng &rng, P &p) {
 	    for(int d = 0; d < D; d++) {
-		int min = bounds[d*2];
-		int max = bounds[d*2 + 1];
-		p[d] = randomFloat(min, max);
+		p[d] = rng.uniform(bounds[d*2], bounds[d*2 + 1]);
 	    }
-	    points.push_back(p);
+	});
+	return points;
+    }
+
+    /**
+     * Gfenerates set of random points in interval <0, 1>)
+     * @param count number of points
+     * @return
+     */
+    static std::vector< P > genRandPoints(size_t count, uint64_t seed = 1, unsigned threads = 0) {
+	std::vector< P > points(count);
+	generate(points, seed, threads, [](PointRng &rng, P &p) {
+	    for(int d = 0; d < D; d++) p[d] = rng.uniform();
+	});
+	return points;
+    }
+
+    /**
+     * Generates set of random points with normal distribution N(0, 1)
+     * @param count number of points
+     * @return
+     */
+    static std::vector< P > genGaussDistr(size_t count, uint64_t seed = 1, unsigned threads = 0) {
+	std::vector< P > points(count);
+	generate(points, seed, threads, [](PointRng &rng, P &p) {
+	    for(int d = 0; d < D; d++) p[d] = rng.gauss();
+	});
+	return points;
+    }
+
+    /**
+     * Gaussian clusters with centers in the unit cube
+     * @param count number of points
+     * @param clusters number of clusters
+     * @param sigma standard deviation of every cluster
+     */
+    static std::vector< P > genClusters(size_t count, int clusters = 20, double sigma = 0.01,
+	    uint64_t seed = 1, unsigned threads = 0) {
+	std::vector< std::vector<double> > centers(clusters, std::vector<double>(D));
+	for(int c = 0; c < clusters; c++) {
+	    PointRng rng(seed, c, sceneStream);
+	    for(int d = 0; d < D; d++) centers[c][d] = rng.uniform();
 	}
+	std::vector< P > points(count);
+	generate(points, seed, threads, [&centers, sigma](PointRng &rng, P &p) {
+	    const std::vector<double> &c = centers[rng.pick(centers.size())];
+	    for(int d = 0; d < D; d++) p[d] = c[d] + sigma * rng.gauss();
+	});
 	return points;
     }
-    
+
     /**
-     * Gfenerates set of random points in interval <0, 1>) 
+     * Points on flat rectangles in the unit cube, like scans of walls and floors
      * @param count number of points
-     * @return 
+     * @param planes number of rectangles, sides are 0.2 - 0.6
+     * @param noise standard deviation of the noise in all directions
      */
-    static std::vector< Point<D> > genRandPoints(int count) {
-	srand((unsigned)std::time(0)); 
-	std::vector< Point<D> > points;
-	for(int i = 0; i < count; i++) {
-	    Point<D> p;
+    static std::vector< P > genPlanes(size_t count, int planes = 5, double noise = 0.001,
+	    uint64_t seed = 1, unsigned threads = 0) {
+	std::vector<Plane> scene(planes);
+	for(int i = 0; i < planes; i++) {
+	    PointRng rng(seed, i, sceneStream);
+	    Plane &plane = scene[i];
+	    std::vector< std::vector<double> > basis;
+	    plane.u = direction(rng, basis);
+	    basis.push_back(plane.u);
+	    plane.v = direction(rng, basis);
+	    plane.width = rng.uniform(0.2, 0.6);
+	    plane.height = rng.uniform(0.2, 0.6);
 	    for(int d = 0; d < D; d++) {
-		p[d] = randomFloat(0, 1);
+		plane.origin[d] = rng.uniform(0.2, 0.8)
+			- 0.5 * (plane.width * plane.u[d] + plane.height * plane.v[d]);
 	    }
-	    points.push_back(p);
 	}
+	std::vector< P > points(count);
+	generate(points, seed, threads, [&scene, noise](PointRng &rng, P &p) {
+	    const Plane &plane = scene[rng.pick(scene.size())];
+	    double s = rng.uniform() * plane.width;
+	    double t = rng.uniform() * plane.height;
+	    for(int d = 0; d < D; d++) {
+		p[d] = plane.origin[d] + s * plane.u[d] + t * plane.v[d] + noise * rng.gauss();
+	    }
+	});
 	return points;
     }
-    
+
     /**
-     * Generates set of random points with normal distribution
-     * @param count number of points, always returns even number of points
-     * @return 
+     * Points on a sphere (center 0.5, radius 0.4), a curved closed surface
+     * @param count number of points
+     * @param noise standard deviation of the noise in all directions
      */
-    static std::vector< Point<D> > genGaussDistr(int count) {
-	srand((unsigned)std::time(0)); 
-	std::vector< Point<D> > points;
-	
-	for(int i = 0; i < count; i+=2) {
-	    Point<D> p1;
-	    Point<D> p2;
-	    for(int d = 0; d < D; d++) {
-		float u1 = ((float) rand()) / (float) RAND_MAX;
-		float u2 = ((float) rand()) / (float) RAND_MAX;
+    static std::vector< P > genSphere(size_t count, double noise = 0.001,
+	    uint64_t seed = 1, unsigned threads = 0) {
+	std::vector< P > points(count);
+	generate(points, seed, threads, [noise](PointRng &rng, P &p) {
+	    double v[D];
+	    double len = 0;
+	    while(len < 1e-12) {
+		len = 0;
+		for(int d = 0; d < D; d++) {
+		    v[d] = rng.gauss();
+		    len += v[d] * v[d];
+		}
+	    }
+	    len = sqrt(len);
+	    for(int d = 0; d < D; d++) p[d] = 0.5 + 0.4 * v[d] / len + noise * rng.gauss();
+	});
+	return points;
+    }
 
-		p1[d] = sqrt(-2 * log(u1)) * sin(2 * pi * u2);
-		p2[d] = sqrt(-2 * log(u1)) * cos(2 * pi * u2);
+    /**
+     * Points on polylines (random walks in the unit cube), like scans of
+     * cables or trajectories
+     * @param count number of points
+     * @param strips number of polylines
+     * @param vertices number of vertices of every polyline
+     * @param noise standard deviation of the noise in all directions
+     */
+    static std::vector< P > genLineStrips(size_t count, int strips = 10, int vertices = 20,
+	    double noise = 0.001, uint64_t seed = 1, unsigned threads = 0) {
+	vertices = std::max(2, vertices);
+	std::vector< std::vector<double> > scene(strips, std::vector<double>(vertices * D));
+	for(int s = 0; s < strips; s++) {
+	    PointRng rng(seed, s, sceneStream);
+	    double *v = &scene[s][0];
+	    for(int d = 0; d < D; d++) v[d] = rng.uniform();
+	    for(int i = 1; i < vertices; i++) {
+		for(int d = 0; d < D; d++) {
+		    double x = v[(i - 1) * D + d] + 0.05 * rng.gauss();
+		    v[i * D + d] = std::min(1.0, std::max(0.0, x));
+		}
 	    }
-	    points.push_back(p1);
-	    points.push_back(p2);
 	}
+	std::vector< P > points(count);
+	generate(points, seed, threads, [&scene, vertices, noise](PointRng &rng, P &p) {
+	    const double *v = &scene[rng.pick(scene.size())][0];
+	    size_t i = rng.pick(vertices - 1);
+	    double t = rng.uniform();
+	    for(int d = 0; d < D; d++) {
+		p[d] = v[i * D + d] + t * (v[(i + 1) * D + d] - v[i * D + d]) + noise * rng.gauss();
+	    }
+	});
+	return points;
+    }
 
+    /**
+     * Uniform points in the unit cube, every one repeated about
+     * count / distinct times, like overlapping scans
+     * @param count number of points
+     * @param distinct number of different points, 0 = count / 100
+     */
+    static std::vector< P > genDuplicates(size_t count, size_t distinct = 0,
+	    uint64_t seed = 1, unsigned threads = 0) {
+	if(distinct == 0)
+	    distinct = std::max((size_t) 1, count / 100);
+	std::vector< P > points(count);
+	generate(points, seed, threads, [distinct, seed](PointRng &rng, P &p) {
+	    //the distinct point is generated again from its own stream
+	    PointRng original(seed, rng.pick(distinct), sceneStream);
+	    for(int d = 0; d < D; d++) p[d] = original.uniform();
+	});
 	return points;
     }
-    
+
+    /**
+     * Names of the distributions generate() knows
+     */
+    static std::vector<std::string> distributions() {
+	const char *names[] = {"uniform", "gauss", "clustered", "planes", "sphere", "strips", "duplicates"};
+	return std::vector<std::string>(names, names + 7);
+    }
+
+    /**
+     * Generates a data set with the default parameters
+     * @param distribution uniform in <0, 1>, gauss N(0, 1), clustered, planes,
+     *	      sphere, strips or duplicates
+     * @param count number of points
+     * @param seed seed of the generator
+     * @param threads number of threads, 0 = all cores
+     * @return the points, empty for an unknown distribution
+     */
+    static std::vector< P > generate(const std::string &distribution, size_t count,
+	    uint64_t seed = 1, unsigned threads = 0) {
+	if(distribution == "uniform")	 return genRandPoints(count, seed, threads);
+	if(distribution == "gauss")	 return genGaussDistr(count, seed, threads);
+	if(distribution == "clustered")	 return genClusters(count, 20, 0.01, seed, threads);
+	if(distribution == "planes")	 return genPlanes(count, 5, 0.001, seed, threads);
+	if(distribution == "sphere")	 return genSphere(count, 0.001, seed, threads);
+	if(distribution == "strips")	 return genLineStrips(count, 10, 20, 0.001, seed, threads);
+	if(distribution == "duplicates") return genDuplicates(count, 0, seed, threads);
+	std::cerr << "unknown distribution " << distribution << "\n";
+	return std::vector< P >();
+    }
+
 };
 
 #endif	/* POINTCLOUDGENERATOR_H */
@@ -0,0 +1,279 @@
+/*
+ * File:   PointOrder.h
+ * Author: Daniel Princ
+ *
+ * Reordering of the points for memory locality: along the Z-order
+ * (Morton) or Hilbert curve before the construction, or in the order
+ * of the leaves after it.
+ *
+ */
+
+#ifndef POINTORDER_H
+#define	POINTORDER_H
+
+#include <stdint.h>
+#include <vector>
+#include <stack>
+#include <thread>
+#include <limits>
+#include <utility>
+#include <iostream>
+#include <algorithm>
+#include "Point.h"
+
+using namespace std;
+
+/**
+ * Computes permutations of points, perm[i] is the old index of the point
+ * that goes to the position i. apply() reorders the points or any array
+ * of their attributes (colors, normals, ids) with the same permutation.
+ *
+ * The keys are computed and sorted in parallel, threads = 0 uses all cores.
+ *
+ * Usage, before the construction:
+ *	vector<uint32_t> perm = PointOrder<3>::hilbert(&points[0], points.size());
+ *	PointOrder<3>::apply(points, perm);
+ *	PointOrder<3>::apply(colors, perm);
+ *	tree.construct(&points);
+ *
+ * or after it (buckets then refer to contiguous runs of points):
+ *	vector<uint32_t> perm = PointOrder<3>::sortByLeaves(tree, points);
+ */
+template<const int D = 3, typename P = Point<D> >
+class PointOrder {
+    typedef typename P::value_type scalar;
+    typedef pair<uint64_t, uint32_t> keyed;
+
+    /** bits of every coordinate in a 64-bit key */
+    static const int bits = (64 / D) > 32 ? 32 : ((64 / D) < 1 ? 1 : (64 / D));
+
+    static unsigned threadCount(unsigned threads, size_t count) {
+	if(threads == 0)
+	    threads = max(1u, thread::hardware_concurrency());
+	return (unsigned) min((size_t) threads, count / (1 << 14) + 1);
+    }
+
+    /**
+     * Calls f(from, to) on threads chunks of <0, count)
+     */
+    template<typename F>
+    static void parallel(size_t count, unsigned threads, F f) {
+	vector<thread> workers;
+	size_t step = count / threads + 1;
+	for(unsigned t = 1; t < threads; t++) {
+	    size_t from = min(count, t * step);
+	    workers.push_back(thread(f, from, min(count, from + step)));
+	}
+	f(0, min(count, step));
+	for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+    }
+
+    /**
+     * Coordinates quantized to the bits of the key inside the bounding box
+     */
+    static void quantize(const P &p, const double *min, const double *scale, uint32_t *q) {
+	const double top = (double) ((((uint64_t) 1) << bits) - 1);
+	for(int d = 0; d < D && d < 64; d++) {
+	    double v = ((double) p[d] - min[d]) * scale[d];
+	    q[d] = (uint32_t) (v < 0 ? 0 : (v > top ? top : v));
+	}
+    }
+
+    /**
+     * Interleaves the bits, the highest bits of all coordinates first
+     */
+    static uint64_t interleave(const uint32_t *q) {
+	uint64_t key = 0;
+	for(int b = bits - 1; b >= 0; b--) {
+	    for(int d = 0; d < D && d < 64; d++) {
+		key = (key << 1) | ((q[d] >> b) & 1);
+	    }
+	}
+	return key;
+    }
+
+    /**
+     * Hilbert transform of the coordinates, in place (J. Skilling,
+     * Programming the Hilbert curve, 2004). Interleaving the result gives
+     * the Hilbert index.
+     */
+    static void hilbertTranspose(uint32_t *x) {
+	const int n = D < 64 ? D : 64;
+	const uint32_t m = 1u << (bits - 1);
+	for(uint32_t q = m; q > 1; q >>= 1) { //inverse undo
+	    uint32_t p = q - 1;
+	    for(int i = 0; i < n; i++) {
+		if(x[i] & q)
+		    x[0] ^= p;
+		else {
+		    uint32_t t = (x[0] ^ x[i]) & p;
+		    x[0] ^= t;
+		    x[i] ^= t;
+		}
+	    }
+	}
+	for(int i = 1; i < n; i++) x[i] ^= x[i - 1]; //Gray encode
+	uint32_t t = 0;
+	for(uint32_t q = m; q > 1; q >>= 1) {
+	    if(x[n - 1] & q) t ^= q - 1;
+	}
+	for(int i = 0; i < n; i++) x[i] ^= t;
+    }
+
+    /**
+     * Sorts the points by the keys of the curve
+     */
+    static vector<uint32_t> sortByCurve(const P *points, size_t count, bool hilbert, unsigned threads) {
+	vector<uint32_t> perm(count);
+	if(count == 0)
+	    return perm;
+	threads = threadCount(threads, count);
+
+	double min[D], scale[D];
+	for(int d = 0; d < D; d++) {
+	    double lo = numeric_limits<double>::max(), hi = numeric_limits<double>::lowest();
+	    for(size_t i = 0; i < count; i++) {
+		lo = std::min(lo, (double) points[i][d]);
+		hi = std::max(hi, (double) points[i][d]);
+	    }
+	    min[d] = lo;
+	    scale[d] = hi > lo ? ((((uint64_t) 1) << bits) - 1) / (hi - lo) : 0;
+	}
+
+	vector<keyed> keys(count);
+	parallel(count, threads, [&](size_t from, size_t to) {
+	    uint32_t q[D];
+	    for(size_t i = from; i < to; i++) {
+		quantize(points[i], min, scale, q);
+		if(hilbert)
+		    hilbertTranspose(q);
+		keys[i] = keyed(interleave(q), (uint32_t) i);
+	    }
+	});
+
+	//sort chunks in parallel, then merge them pairwise
+	size_t step = count / threads + 1;
+	parallel(count, threads, [&](size_t from, size_t to) {
+	    sort(keys.begin() + from, keys.begin() + to);
+	});
+	for(size_t width = step; width < count; width *= 2) {
+	    vector<thread> workers;
+	    for(size_t from = 0; from + width < count; from += 2 * width) {
+		size_t mid = from + width, to = std::min(count, from + 2 * width);
+		workers.push_back(thread([&keys, from, mid, to]() {
+		    inplace_merge(keys.begin() + from, keys.begin() + mid, keys.begin() + to);
+		}));
+	    }
+	    for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+	}
+
+	for(size_t i = 0; i < count; i++) perm[i] = keys[i].second;
+	return perm;
+    }
+
+public:
+
+    /**
+     * Permutation along the Z-order (Morton) curve
+     * @param points the points
+     * @param count number of points
+     * @param threads number of threads, 0 = all cores
+     */
+    static vector<uint32_t> morton(const P *points, size_t count, unsigned threads = 0) {
+	return sortByCurve(points, count, false, threads);
+    }
+
+    /**
+     * Permutation along the Hilbert curve, unlike the Z-order it has no
+     * long jumps, neighbors on the curve are neighbors in space
+     * @param points the points
+     * @param count number of points
+     * @param threads number of threads, 0 = all cores
+     */
+    static vector<uint32_t> hilbert(const P *points, size_t count, unsigned threads = 0) {
+	return sortByCurve(points, count, true, threads);
+    }
+
+    /**
+     * Permutation in the order of the leaves of a built tree (depth first),
+     * the points of every bucket become neighbors in memory
+     * @param tree the tree
+     * @param points the array the tree refers to
+     */
+    template<typename Tree>
+    static vector<uint32_t> leafOrder(const Tree &tree, const P *points) {
+	typedef typename Tree::node_t node_t;
+	typedef typename Tree::inner_t inner_t;
+	typedef typename Tree::leaf_t leaf_t;
+	vector<uint32_t> perm;
+	perm.reserve(tree.size());
+	stack<const node_t *> stack;
+	stack.push(tree.getRoot());
+	while(!stack.empty()) {
+	    const node_t *node = stack.top();
+	    stack.pop();
+	    if(!node->isLeaf()) {
+		const inner_t *inner = (const inner_t *) node;
+		if(inner->right) stack.push(inner->right);
+		if(inner->left) stack.push(inner->left);
+		continue;
+	    }
+	    const leaf_t *leaf = (const leaf_t *) node;
+	    for(size_t i = 0; i < leaf->bucket.size(); i++) {
+		perm.push_back((uint32_t) (tree.getPoint(leaf->bucket[i]) - points));
+	    }
+	}
+	return perm;
+    }
+
+    /**
+     * Reorders the array in place, data[i] = old data[perm[i]].
+     * The array keeps its memory, pointers into it stay valid
+     * (but point to other points).
+     * @param data points or their attributes
+     * @param perm permutation of the same size
+     */
+    template<typename T>
+    static void apply(vector<T> &data, const vector<uint32_t> &perm) {
+	vector<T> old(data);
+	for(size_t i = 0; i < perm.size(); i++) {
+	    data[i] = old[perm[i]];
+	}
+    }
+
+    /**
+     * Inverse permutation, inverse[old index] = new index
+     */
+    static vector<uint32_t> inverse(const vector<uint32_t> &perm) {
+	vector<uint32_t> inv(perm.size());
+	for(size_t i = 0; i < perm.size(); i++) {
+	    inv[perm[i]] = (uint32_t) i;
+	}
+	return inv;
+    }
+
+    /**
+     * Moves the points of a built tree to the order of its leaves and
+     * updates the tree, no rebuild is needed
+     * @param tree tree built on the points
+     * @param points the points, reordered in place
+     * @return the permutation, apply it to the attributes of the points; \
+     *	      empty if there are no points or the tree is not built on all
+     *	      of them (nothing is moved)
+     */
+    template<typename Tree>
+    static vector<uint32_t> sortByLeaves(Tree &tree, vector<P> &points) {
+	if(points.empty())
+	    return vector<uint32_t>();
+	vector<uint32_t> perm = leafOrder(tree, &points[0]);
+	if(perm.size() != points.size()) {
+	    cerr << "sortByLeaves: the tree has " << perm.size() << " of " << points.size() << " points\n";
+	    return vector<uint32_t>();
+	}
+	apply(points, perm);
+	tree.permute(&points[0], inverse(perm));
+	return perm;
+    }
+};
+
+#endif	/* POINTORDER_H */
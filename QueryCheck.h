@@ -0,0 +1,617 @@
+/*
+ * File:   QueryCheck.h
+ * Author: Daniel Princ
+ *
+ * Compares the queries of the KDTree with brute force search
+ * and times both.
+ *
+ */
+
+#ifndef QUERYCHECK_H
+#define	QUERYCHECK_H
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <math.h>
+#include "KDTree.h"
+#include "KNNGraph.h"
+#include "DualTree.h"
+#include "NeighborIterator.h"
+#include "ShardedTree.h"
+#include "Downsample.h"
+
+using namespace std;
+
+/**
+ * Result of one data set and one way of building the tree
+ */
+struct CheckResult {
+    /** e.g. "D=3 clustered insert" */
+    string name;
+    size_t queries;
+    /** queries with a different result than brute force */
+    size_t nnErrors;
+    size_t knnErrors;
+    size_t radiusErrors;
+    /** points with other neighbors in the kNN graph */
+    size_t graphErrors;
+    /** query points with other results of the dual-tree joins */
+    size_t joinErrors;
+    /** voxels and samples that differ from the serial downsampling */
+    size_t sampleErrors;
+    /** construct or all inserts */
+    double buildMs;
+    /** all queries in the tree */
+    double treeMs;
+    /** all queries by brute force */
+    double bruteMs;
+
+    bool ok() const {
+	return nnErrors == 0 && knnErrors == 0 && radiusErrors == 0 && graphErrors == 0 && joinErrors == 0
+		&& sampleErrors == 0;
+    }
+};
+
+/**
+ * Brute force reference for NN, kNN and radius queries.
+ *
+ * The semantics are the ones of the tree: NN and kNN skip points at zero
+ * distance from the query unless another Exclusion is asked for, radius
+ * queries return points with distance < r.
+ * Distances are compared with a small relative tolerance, so a result with
+ * equally distant points in a different order is still correct.
+ *
+ * run() checks trees built by construct and by repeated insert on
+ * uniform, clustered, duplicate, identical, collinear and axis aligned
+ * data; the queries are data points and points near them. Checked are:
+ *
+ *	traversals	NN and radius up from the bucket and from the root
+ *			down (DescentStack), kNN
+ *	cursor		NN with a QueryCursor over all the queries
+ *	iterator	the first 2k points of a NeighborIterator
+ *	exclusions	NN and kNN with EXCLUDE_SELF and EXCLUDE_NONE
+ *	bounds		NN and kNN bounded by maxDist, none() beyond the data
+ *	graph		KNNGraph of the data
+ *	shards		NN and kNN of a ShardedTree, single and batched
+ *	joins		DualTree joins of the queries with the data
+ *	downsampling	Downsample voxel grid against a serial one, spacing
+ *			and cover of the Poisson-disk samples
+ *
+ * A new query mode gets its brute force counterpart and a comparison
+ * in check().
+ * 
+ * Metric is the distance of the brute force, the checked trees get 
+ * the one passed to run() (see KDTree::setMetric).
+ */
+template<const int D, typename P = Point<D>, typename Metric = Euclidean>
+class QueryCheck {
+    typedef typename P::value_type scalar;
+    typedef typename DistanceType<scalar>::type dist_t;
+    typedef chrono::steady_clock clock;
+
+    static double ms(clock::time_point start, clock::time_point end) {
+	return chrono::duration<double, milli>(end - start).count();
+    }
+
+    /** metric of the brute force and of the checked trees */
+    static Metric &metric() {
+	static Metric metric;
+	return metric;
+    }
+
+    static dist_t distance(const P &a, const P &b) {
+	return metricDistance<dist_t, D>(metric(), a, b);
+    }
+
+    static bool same(dist_t a, dist_t b) {
+	return fabs(a - b) <= 1e-5 * max(fabs(a), fabs(b));
+    }
+
+    /** true if the exclusion skips the i-th point, self is the index EXCLUDE_SELF skips */
+    static bool excluded(Exclusion e, size_t i, size_t self, dist_t dist) {
+	return e == EXCLUDE_ZERO ? dist == 0 : e == EXCLUDE_SELF && i == self;
+    }
+
+    /** distance of NN by brute force, 0 if there is none */
+    static dist_t bruteNN(const vector<P> &data, const P &query, Exclusion e = EXCLUDE_ZERO, size_t self = 0) {
+	dist_t best = numeric_limits<dist_t>::max();
+	for(size_t i = 0; i < data.size(); i++) {
+	    dist_t tmp = distance(data[i], query);
+	    if(tmp < best && !excluded(e, i, self, tmp)) best = tmp;
+	}
+	return best == numeric_limits<dist_t>::max() ? 0 : best;
+    }
+
+    /**
+     * Sorted distances of kNN by brute force
+     * @param e points that are skipped, EXCLUDE_NONE for joins of two trees
+     * @param self index of the point EXCLUDE_SELF skips
+     */
+    static vector<dist_t> bruteKNN(const vector<P> &data, const P &query, int k,
+	    Exclusion e = EXCLUDE_ZERO, size_t self = 0) {
+	vector<dist_t> dists;
+	for(size_t i = 0; i < data.size(); i++) {
+	    dist_t tmp = distance(data[i], query);
+	    if(!excluded(e, i, self, tmp)) dists.push_back(tmp);
+	}
+	size_t size = min((size_t) k, dists.size());
+	partial_sort(dists.begin(), dists.begin() + size, dists.end());
+	dists.resize(size);
+	return dists;
+    }
+
+    /** indices of points inside the radius by brute force */
+    static vector<size_t> bruteRadius(const vector<P> &data, const P &query, dist_t radius) {
+	vector<size_t> inside;
+	dist_t r = metric().reduce(radius);
+	for(size_t i = 0; i < data.size(); i++) {
+	    if(distance(data[i], query) < r) inside.push_back(i);
+	}
+	return inside;
+    }
+
+    /** index of the point the tree returned */
+    template<typename Tree>
+    static size_t index(const Tree &tree, const vector<P> &data, typename Tree::ref r) {
+	return tree.getPoint(r) - &data[0];
+    }
+
+    /**
+     * Compares NN bounded by maxDist with the NN found by brute force,
+     * a NN right on the sphere may be found or not (see sameInside)
+     * @param bnn distance of the unbounded NN by brute force, 0 if there is none
+     */
+    template<typename Tree>
+    static bool sameBounded(const Tree &tree, typename Tree::ref nn, const P &query, dist_t maxDist, dist_t bnn) {
+	const dist_t r = metric().reduce(maxDist);
+	if(same(bnn, r))
+	    return true;
+	const dist_t tnn = nnDistance(tree, nn, query);
+	const bool found = nn != Tree::none();
+	if(bnn == 0 || bnn >= r)
+	    return !found;
+	return found && same(tnn, bnn);
+    }
+
+    /**
+     * Compares kNN bounded by maxDist with the kNN found by brute force,
+     * except neighbors right on the sphere
+     * @param bknn distances of the unbounded kNN by brute force
+     */
+    template<typename Tree>
+    static bool sameBoundedKNN(const Tree &tree, const vector<typename Tree::ref> &knn,
+	    const vector<dist_t> &bknn, const P &query, dist_t maxDist) {
+	const dist_t r = metric().reduce(maxDist);
+	for(size_t i = 0; i < max(knn.size(), bknn.size()); i++) {
+	    const bool inBrute = i < bknn.size() && bknn[i] < r;
+	    if(i < knn.size()) {
+		const dist_t dist = distance(*tree.getPoint(knn[i]), query);
+		if(!same(dist, inBrute ? bknn[i] : r))
+		    return false;
+	    }
+	    else if(inBrute && !same(bknn[i], r))
+		return false;
+	}
+	return true;
+    }
+
+    /** true if the kNN found by the tree have the distances found by brute force */
+    template<typename Tree>
+    static bool sameKNN(const Tree &tree, const vector<typename Tree::ref> &knn,
+	    const vector<dist_t> &bknn, const P &query) {
+	bool ok = knn.size() == bknn.size();
+	for(size_t i = 0; ok && i < knn.size(); i++) {
+	    ok = same(distance(*tree.getPoint(knn[i]), query), bknn[i]);
+	}
+	return ok;
+    }
+
+    /** distance of the NN found by the tree, 0 if there is none */
+    template<typename Tree>
+    static dist_t nnDistance(const Tree &tree, typename Tree::ref nn, const P &query) {
+	return nn == Tree::none() ? 0 : distance(*tree.getPoint(nn), query);
+    }
+
+    /**
+     * Compares the points inside the sphere, except those right on it
+     * @param binside sorted indices found by brute force
+     */
+    template<typename Tree>
+    static bool sameInside(const Tree &tree, const vector<P> &data, const vector<typename Tree::ref> &inside,
+	    const vector<size_t> &binside, const P &query, dist_t radius) {
+	vector<size_t> tinside;
+	for(size_t i = 0; i < inside.size(); i++) {
+	    tinside.push_back(index(tree, data, inside[i]));
+	}
+	return sameInside(data, tinside, binside, query, radius);
+    }
+
+    /**
+     * Compares indices of the points inside the sphere, see above
+     */
+    static bool sameInside(const vector<P> &data, vector<size_t> tinside, const vector<size_t> &binside,
+	    const P &query, dist_t radius) {
+	sort(tinside.begin(), tinside.end());
+	vector<size_t> diff;
+	set_symmetric_difference(tinside.begin(), tinside.end(), binside.begin(), binside.end(),
+		back_inserter(diff));
+	for(size_t i = 0; i < diff.size(); i++) {
+	    if(!same(distance(data[diff[i]], query), metric().reduce(radius)))
+		return false;
+	}
+	return true;
+    }
+
+public:
+
+    /**
+     * Names of the data sets generate() knows
+     */
+    static vector<string> dataSets() {
+	const char *names[] = {"uniform", "clustered", "duplicates", "identical", "collinear", "axis"};
+	return vector<string>(names, names + 6);
+    }
+
+    /**
+     * Generates a data set in the unit cube
+     * @param name uniform; clustered (10 gaussian clusters); duplicates (every
+     *	      point 20 times); identical (one point); collinear (on a random
+     *	      line); axis (on a line parallel to the first axis)
+     * @param size number of points
+     * @param seed seed of the generator
+     */
+    static vector<P> generate(const string &name, size_t size, unsigned seed) {
+	mt19937 engine(seed);
+	uniform_real_distribution<double> uniform(0, 1);
+	vector<P> data(size);
+	P a, b;
+	for(int d = 0; d < D; d++) {
+	    a[d] = uniform(engine);
+	    b[d] = uniform(engine) - 0.5;
+	}
+	if(name == "clustered") {
+	    normal_distribution<double> gauss(0, 0.01);
+	    vector<P> centers = generate("uniform", 10, seed + 1);
+	    for(size_t i = 0; i < size; i++) {
+		const P &c = centers[engine() % centers.size()];
+		for(int d = 0; d < D; d++) data[i][d] = c[d] + gauss(engine);
+	    }
+	}
+	else if(name == "duplicates") {
+	    vector<P> distinct = generate("uniform", size / 20 + 1, seed + 1);
+	    for(size_t i = 0; i < size; i++) {
+		data[i] = distinct[engine() % distinct.size()];
+	    }
+	}
+	else if(name == "identical") {
+	    for(size_t i = 0; i < size; i++) data[i] = a;
+	}
+	else if(name == "collinear" || name == "axis") {
+	    for(size_t i = 0; i < size; i++) {
+		double t = uniform(engine);
+		for(int d = 0; d < D; d++) {
+		    data[i][d] = (name == "axis" && d > 0) ? a[d] : a[d] + t * b[d];
+		}
+	    }
+	}
+	else {
+	    for(size_t i = 0; i < size; i++) {
+		for(int d = 0; d < D; d++) data[i][d] = uniform(engine);
+	    }
+	}
+	return data;
+    }
+
+    /**
+     * Checks one tree type on one data set
+     * @param data the points, the tree refers to them
+     * @param name name of the result
+     * @param insert build the tree by repeated insert instead of construct
+     * @param queries number of queries, half of them are data points, half near them
+     * @param k k of kNN queries, the radius is chosen so there are about k points inside
+     * @param seed seed of the queries
+     * @param layout node layout of the built tree
+     */
+    template<typename Tree>
+    static CheckResult check(vector<P> &data, const string &name, bool insert,
+	    int queries, int k, unsigned seed, NodeLayout layout = LAYOUT_BUILD) {
+	CheckResult result;
+	result.name = name;
+	result.queries = queries;
+	result.nnErrors = result.knnErrors = result.radiusErrors = result.graphErrors = result.joinErrors = result.sampleErrors = 0;
+	result.treeMs = result.bruteMs = 0;
+
+	clock::time_point start = clock::now();
+	Tree tree;
+	tree.setMetric(metric());
+	if(insert) {
+	    tree.rebase(&data[0]);
+	    for(uint32_t i = 0; i < data.size(); i++) {
+		tree.insert(PointRef<P, Tree::indexed>::make(&data[0], i));
+	    }
+	}
+	else {
+	    tree.construct(&data);
+	}
+	tree.layout(layout);
+	result.buildMs = ms(start, clock::now());
+
+	mt19937 engine(seed);
+	normal_distribution<double> noise(0, 0.001);
+	vector<P> qs(queries);
+	/** the data point of every query */
+	vector<size_t> sources(queries);
+	for(int q = 0; q < queries; q++) {
+	    sources[q] = engine() % data.size();
+	    qs[q] = data[sources[q]];
+	    if(q % 2) {
+		for(int d = 0; d < D; d++) qs[q][d] += noise(engine);
+	    }
+	}
+
+	//radius with about k points inside
+	vector<dist_t> radii;
+	for(int q = 0; q < min(queries, 10); q++) {
+	    vector<dist_t> knn = bruteKNN(data, qs[q], k);
+	    radii.push_back(knn.empty() ? 0.1 : metric().root(knn.back()));
+	}
+	sort(radii.begin(), radii.end());
+	dist_t radius = radii.empty() ? 0.1 : radii[radii.size() / 2];
+
+	typename Tree::descent_t scratch;
+	typename Tree::cursor_t cursor, boundedCursor, farCursor;
+	NeighborIterator<Tree> browse;
+	for(int q = 0; q < queries; q++) {
+	    const P &query = qs[q];
+	    const typename Tree::ref self = PointRef<P, Tree::indexed>::make(&data[0], sources[q]);
+
+	    start = clock::now();
+	    typename Tree::ref nn = tree.nearestNeighbor(&query);
+	    typename Tree::ref dnn = tree.nearestNeighbor(&query, scratch);
+	    typename Tree::ref cnn = tree.nearestNeighbor(&query, cursor);
+	    vector<typename Tree::ref> knn = tree.kNearestNeighbors(&query, k);
+	    typename Tree::ref selfNN = tree.template nearestNeighbor<EXCLUDE_SELF>(&query, self);
+	    typename Tree::ref selfDNN = tree.template nearestNeighbor<EXCLUDE_SELF>(&query, scratch, self);
+	    typename Tree::ref anyNN = tree.template nearestNeighbor<EXCLUDE_NONE>(&query);
+	    typename Tree::ref anySimple = tree.template simpleNearestNeighbor<EXCLUDE_NONE>(&query);
+	    vector<typename Tree::ref> selfKNN = tree.template kNearestNeighbors<EXCLUDE_SELF>(&query, k, self);
+	    vector<typename Tree::ref> anyKNN = tree.template kNearestNeighbors<EXCLUDE_NONE>(&query, k);
+	    const typename Tree::ref none = Tree::none();
+	    typename Tree::ref boundedNN = tree.nearestNeighbor(&query, none, radius);
+	    typename Tree::ref boundedDNN = tree.nearestNeighbor(&query, scratch, none, radius);
+	    typename Tree::ref boundedCNN = tree.nearestNeighbor(&query, boundedCursor, none, radius / 10);
+	    typename Tree::ref outlierNN = tree.nearestNeighbor(&query, none, radius / 10);
+	    vector<typename Tree::ref> boundedKNN = tree.kNearestNeighbors(&query, k, none, radius);
+	    //beyond the bounding box, nothing is in range
+	    P far = query;
+	    for(int d = 0; d < D; d++) far[d] = tree.getBoundingBox()[2*d + 1] + 10 * radius;
+	    typename Tree::ref farNN = tree.nearestNeighbor(&far, none, radius);
+	    typename Tree::ref farDNN = tree.nearestNeighbor(&far, scratch, none, radius);
+	    typename Tree::ref farCNN = tree.nearestNeighbor(&far, farCursor, none, radius);
+	    vector<typename Tree::ref> farKNN = tree.kNearestNeighbors(&far, k, none, radius);
+	    typename Tree::ref first = tree.template nearestNeighbor<EXCLUDE_NONE>(&data[0], none, radius);
+	    vector<dist_t> browsed; //the first 2k points of the iterator
+	    browse.reset(tree, &query);
+	    typename Tree::ref next;
+	    dist_t nextDist;
+	    while(browsed.size() < (size_t) 2 * k && browse.next(next, nextDist)) {
+		browsed.push_back(same(nextDist, distance(*tree.getPoint(next), query)) ? nextDist : -1);
+	    }
+	    vector<typename Tree::ref> inside = tree.circularQuery(&query, radius);
+	    vector<typename Tree::ref> dinside = tree.circularQuery(&query, radius, scratch);
+	    result.treeMs += ms(start, clock::now());
+
+	    start = clock::now();
+	    dist_t bnn = bruteNN(data, query);
+	    vector<dist_t> bknn = bruteKNN(data, query, k);
+	    dist_t bselfNN = bruteNN(data, query, EXCLUDE_SELF, sources[q]);
+	    dist_t banyNN = bruteNN(data, query, EXCLUDE_NONE);
+	    vector<dist_t> bselfKNN = bruteKNN(data, query, k, EXCLUDE_SELF, sources[q]);
+	    vector<dist_t> banyKNN = bruteKNN(data, query, k, EXCLUDE_NONE);
+	    vector<dist_t> bbrowsed = bruteKNN(data, query, 2 * k);
+	    vector<size_t> binside = bruteRadius(data, query, radius);
+	    result.bruteMs += ms(start, clock::now());
+
+	    //NN of all traversals, zero distance means there is none
+	    if(!same(nnDistance(tree, nn, query), bnn) || !same(nnDistance(tree, dnn, query), bnn)
+		    || !same(nnDistance(tree, cnn, query), bnn))
+		result.nnErrors++;
+	    //the other exclusions, the query point itself is never the NN without it
+	    if(!same(nnDistance(tree, selfNN, query), bselfNN) || !same(nnDistance(tree, selfDNN, query), bselfNN)
+		    || selfNN == self || selfDNN == self
+		    || !same(nnDistance(tree, anyNN, query), banyNN) || !same(nnDistance(tree, anySimple, query), banyNN))
+		result.nnErrors++;
+	    //bounded, none() if there is none in range
+	    if(!sameBounded(tree, boundedNN, query, radius, bnn) || !sameBounded(tree, boundedDNN, query, radius, bnn)
+		    || !sameBounded(tree, outlierNN, query, radius / 10, bnn)
+		    || !sameBounded(tree, boundedCNN, query, radius / 10, bnn))
+		result.nnErrors++;
+	    //a miss is none(), not the first point of an indexed tree, which is found
+	    if(farNN != none || farDNN != none || farCNN != none || !farKNN.empty() || first == none)
+		result.nnErrors++;
+
+	    //kNN, the same distances in the same order
+	    bool ok = sameKNN(tree, knn, bknn, query) && sameKNN(tree, selfKNN, bselfKNN, query)
+		    && sameKNN(tree, anyKNN, banyKNN, query) && sameBoundedKNN(tree, boundedKNN, bknn, query, radius)
+		    && find(selfKNN.begin(), selfKNN.end(), self) == selfKNN.end();
+	    ok = ok && browsed.size() == bbrowsed.size();
+	    for(size_t i = 0; ok && i < browsed.size(); i++) {
+		ok = same(browsed[i], bbrowsed[i]);
+	    }
+	    if(!ok)
+		result.knnErrors++;
+
+	    //radius, the same points except those right on the sphere
+	    if(!sameInside(tree, data, inside, binside, query, radius)
+		    || !sameInside(tree, data, dinside, binside, query, radius))
+		result.radiusErrors++;
+	}
+
+	//kNN graph, the neighbors of the points queries apart
+	KNNGraph<Tree> graph = KNNGraph<Tree>::build(tree, &data[0], k);
+	for(int q = 0; q < queries; q++) {
+	    size_t i = q * data.size() / queries;
+	    vector<dist_t> bknn = bruteKNN(data, data[i], k);
+	    bool ok = graph.size() == data.size() && graph.degree(i) == bknn.size();
+	    for(size_t j = 0; ok && j < bknn.size(); j++) {
+		ok = same(graph.distances[graph.offsets[i] + j], bknn[j]);
+	    }
+	    if(!ok)
+		result.graphErrors++;
+	}
+
+	//sharded index, batches by the workers of the shards and single queries
+	ShardedTree<Tree> sharded;
+	sharded.setMetric(metric());
+	sharded.build(&data[0], data.size(), 5, 3);
+	vector<typename Tree::ref> shardNN = sharded.nearestNeighbors(&qs[0], qs.size());
+	vector< vector<typename Tree::ref> > shardKNN = sharded.kNearestNeighbors(&qs[0], qs.size(), k);
+	for(int q = 0; q < queries; q++) {
+	    dist_t bnn = bruteNN(data, qs[q]);
+	    if(!same(nnDistance(tree, shardNN[q], qs[q]), bnn)
+		    || !same(nnDistance(tree, sharded.nearestNeighbor(&qs[q]), qs[q]), bnn))
+		result.nnErrors++;
+	    vector<dist_t> bknn = bruteKNN(data, qs[q], k);
+	    vector<typename Tree::ref> single = sharded.kNearestNeighbors(&qs[q], k);
+	    bool ok = shardKNN[q].size() == bknn.size() && single.size() == bknn.size();
+	    for(size_t i = 0; ok && i < bknn.size(); i++) {
+		ok = same(distance(*tree.getPoint(shardKNN[q][i]), qs[q]), bknn[i])
+			&& same(distance(*tree.getPoint(single[i]), qs[q]), bknn[i]);
+	    }
+	    if(!ok)
+		result.knnErrors++;
+	}
+
+	//dual-tree joins of the queries with the tree, points at zero distance included
+	Tree queryTree;
+	queryTree.setMetric(metric());
+	queryTree.construct(&qs);
+	typedef DualTree<Tree> join_t;
+	typename join_t::Result knnJoin = join_t::kNearest(queryTree, &qs[0], tree, &data[0], k);
+	typename join_t::Result radiusJoin = join_t::radius(queryTree, &qs[0], tree, &data[0], radius);
+	for(int q = 0; q < queries; q++) {
+	    vector<dist_t> bknn = bruteKNN(data, qs[q], k, EXCLUDE_NONE);
+	    bool ok = knnJoin.size() == qs.size() && knnJoin.degree(q) == bknn.size();
+	    for(size_t j = 0; ok && j < bknn.size(); j++) {
+		ok = same(knnJoin.distances[knnJoin.offsets[q] + j], bknn[j]);
+	    }
+	    vector<size_t> inside(radiusJoin.neighbors.begin() + radiusJoin.offsets[q],
+		    radiusJoin.neighbors.begin() + radiusJoin.offsets[q + 1]);
+	    ok = ok && sameInside(data, inside, bruteRadius(data, qs[q], radius), qs[q], radius);
+	    if(!ok)
+		result.joinErrors++;
+	}
+
+	checkDownsample(tree, data, radius, result);
+	return result;
+    }
+
+    /**
+     * Voxel grid of the tree against a serial grid of the data, Poisson-disk
+     * samples no closer than the radius and covering all points with twice
+     * the radius, radius merge with a point per sample
+     */
+    template<typename Tree>
+    static void checkDownsample(const Tree &tree, vector<P> &data, dist_t radius, CheckResult &result) {
+	typedef Downsample<Tree> sample_t;
+	const double size = radius;
+	const typename Tree::scalar *box = tree.getBoundingBox();
+	vector< pair<vector<int64_t>, size_t> > keyed;
+	for(size_t i = 0; i < data.size(); i++) {
+	    vector<int64_t> cell(D);
+	    for(int d = 0; d < D; d++) cell[d] = (int64_t) floor(((double) data[i][d] - box[2*d]) / size);
+	    keyed.push_back(make_pair(cell, i));
+	}
+	sort(keyed.begin(), keyed.end());
+	vector<P> grid = sample_t::voxelGrid(tree, size, 3);
+	size_t voxel = 0;
+	for(size_t i = 0; i < keyed.size(); voxel++) {
+	    vector<double> sum(D, 0.0);
+	    size_t j = i;
+	    for(; j < keyed.size() && keyed[j].first == keyed[i].first; j++) {
+		for(int d = 0; d < D; d++) sum[d] += data[keyed[j].second][d];
+	    }
+	    bool ok = voxel < grid.size();
+	    for(int d = 0; ok && d < D; d++) {
+		const double average = sum[d] / (j - i);
+		ok = fabs(grid[voxel][d] - average) <= 1e-5 * (1 + fabs(average));
+	    }
+	    if(!ok)
+		result.sampleErrors++;
+	    i = j;
+	}
+	if(voxel != grid.size())
+	    result.sampleErrors++;
+
+	vector<P> samples = sample_t::poissonDisk(tree, radius, 3);
+	if(sample_t::radiusMerge(tree, radius, 2).size() != samples.size())
+	    result.sampleErrors++;
+	Tree sampleTree;
+	sampleTree.setMetric(metric());
+	sampleTree.construct(&samples);
+	for(size_t i = 0; i < samples.size(); i++) {
+	    typename Tree::ref self = PointRef<P, Tree::indexed>::make(&samples[0], i);
+	    dist_t nearest = nnDistance(sampleTree, sampleTree.template nearestNeighbor<EXCLUDE_SELF>(&samples[i], self), samples[i]);
+	    if(samples.size() > 1 && nearest < metric().reduce(radius) && !same(nearest, metric().reduce(radius)))
+		result.sampleErrors++;
+	}
+	for(size_t i = 0; i < data.size(); i++) {
+	    dist_t nearest = nnDistance(sampleTree, sampleTree.template nearestNeighbor<EXCLUDE_NONE>(&data[i]), data[i]);
+	    if(nearest > metric().reduce(2 * radius) && !same(nearest, metric().reduce(2 * radius)))
+		result.sampleErrors++;
+	}
+    }
+
+    /**
+     * Checks the tree built by construct and by insert on all data sets
+     * @param size number of points of every data set
+     * @param queries number of queries of every type
+     * @param k k of kNN queries
+     * @param seed seed of data and queries
+     * @param layout node layout of the built trees
+     * @param metric metric of the trees and of the brute force
+     */
+    template<typename Tree = KDTree<D, P> >
+    static vector<CheckResult> run(size_t size = 5000, int queries = 200, int k = 10, unsigned seed = 1,
+	    NodeLayout layout = LAYOUT_BUILD, const Metric &metric = Metric()) {
+	QueryCheck::metric() = metric;
+	vector<CheckResult> results;
+	vector<string> sets = dataSets();
+	for(size_t s = 0; s < sets.size(); s++) {
+	    vector<P> data = generate(sets[s], size, seed);
+	    string name = "D=" + to_string(D) + " " + sets[s];
+	    results.push_back(check<Tree>(data, name + " construct", false, queries, k, seed, layout));
+	    results.push_back(check<Tree>(data, name + " insert", true, queries, k, seed, layout));
+	}
+	return results;
+    }
+
+    /**
+     * Prints the results as a table
+     * @return true if all results are correct
+     */
+    static bool report(ostream &out, const vector<CheckResult> &results) {
+	bool ok = true;
+	ios::fmtflags flags = out.flags();
+	streamsize precision = out.precision();
+	out << fixed << setprecision(2);
+	for(size_t i = 0; i < results.size(); i++) {
+	    const CheckResult &r = results[i];
+	    out << left << setw(30) << r.name << right << (r.ok() ? " OK   " : " FAIL ")
+		    << "errors NN " << r.nnErrors << ", kNN " << r.knnErrors << ", radius "
+		    << r.radiusErrors << ", graph " << r.graphErrors << ", join " << r.joinErrors << ", sample " << r.sampleErrors << " of " << r.queries << "; build " << r.buildMs
+		    << "ms, queries " << r.treeMs << "ms, brute force " << r.bruteMs << "ms\n";
+	    ok = ok && r.ok();
+	}
+	out.flags(flags);
+	out.precision(precision);
+	return ok;
+    }
+};
+
+#endif	/* QUERYCHECK_H */
@@ -0,0 +1,621 @@
+/*
+ * File:   QueryServer.h
+ * Author: Daniel Princ
+ *
+ * Local query service: one tree shared by the processes of a host,
+ * NN, kNN and radius requests over a Unix domain socket in a compact
+ * binary protocol, executed in batches by a thread pool.
+ *
+ */
+
+#ifndef QUERYSERVER_H
+#define	QUERYSERVER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+#include "NeighborIterator.h"
+#include "PointOrder.h"
+
+/** kinds of requests */
+enum RequestType {
+    /** size and bounding box of the tree */
+    REQUEST_INFO = 0,
+    REQUEST_NN = 1,
+    REQUEST_KNN = 2,
+    REQUEST_RADIUS = 3
+};
+
+/** flags of a request, none are set by default */
+enum RequestFlags {
+    /** the neighbors carry their coordinates, not only the indices */
+    REQUEST_POINTS = 1,
+    /** NN, kNN and radius return the points at zero distance from the query 
+     *  too (EXCLUDE_NONE), a query at a stored point gets it back; without 
+     *  it all three skip them (EXCLUDE_ZERO, the default of KDTree) */
+    REQUEST_ZERO = 2
+};
+
+enum ResponseStatus {
+    RESPONSE_OK = 0,
+    /** unknown type, another number of dimensions than the tree has,
+     *  a coordinate that is not finite or k over maxRequestK */
+    RESPONSE_BAD_REQUEST = 1
+};
+
+/**
+ * Request, followed by dims floats of the query point (none for INFO).
+ * The numbers are in the byte order of the host, the socket is local.
+ */
+struct RequestHeader {
+    /** chosen by the client, copied to the response */
+    uint32_t id;
+    uint8_t type;
+    uint8_t flags;
+    uint8_t dims;
+    uint8_t reserved;
+    /** k of kNN */
+    uint32_t k;
+    /** radius of radius queries */
+    float radius;
+};
+
+/**
+ * Response, followed by count neighbors sorted by the distance (see
+ * ResponseNeighbor), for INFO count is the number of points of the tree,
+ * followed by its bounding box (2 * dims floats: min, max, min, max, ...).
+ * Responses of one connection can come in another order than the requests.
+ */
+struct ResponseHeader {
+    uint32_t id;
+    uint8_t type;
+    uint8_t status;
+    uint8_t flags;
+    uint8_t dims;
+    uint32_t count;
+};
+
+/**
+ * Neighbor in a response, followed by dims floats of the point with REQUEST_POINTS
+ */
+struct ResponseNeighbor {
+    /** index of the point in the array the tree is built on */
+    uint32_t index;
+    /** distance in the metric of the tree, squared for Euclidean (see Metric.h) */
+    float dist;
+};
+
+/** the largest k the server accepts, a request can't make it allocate more */
+static const uint32_t maxRequestK = 1 << 16;
+
+/**
+ * Bytes that follow the header of a response
+ */
+inline size_t responsePayload(const ResponseHeader &h) {
+    if(h.type == REQUEST_INFO)
+	return h.status == RESPONSE_OK ? 2 * h.dims * sizeof(float) : 0;
+    return h.count * (sizeof(ResponseNeighbor) + ((h.flags & REQUEST_POINTS) ? h.dims * sizeof(float) : 0));
+}
+
+/**
+ * Writes all bytes, false if the connection is closed
+ */
+inline bool sendAll(int fd, const char *data, size_t size) {
+    while(size > 0) {
+	ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+	if(n < 0 && errno == EINTR)
+	    continue;
+	if(n <= 0)
+	    return false;
+	data += n;
+	size -= n;
+    }
+    return true;
+}
+
+/**
+ * Counters of the server
+ */
+struct ServerStats {
+    uint64_t requests;
+    uint64_t batches;
+    /** the largest batch */
+    uint64_t largest;
+    uint64_t connections;
+
+    double averageBatch() const {
+	return batches ? (double) requests / batches : 0;
+    }
+};
+
+/**
+ * Server of one tree. An I/O thread accepts the connections and reads
+ * the requests of all of them (poll), the complete requests go to one
+ * queue. Every worker takes all waiting requests at once (up to maxBatch),
+ * so the batches grow with the load by themselves, with delay > 0 a
+ * worker also waits that long for a fuller batch. A batch is sorted along
+ * the Z-order curve of the queries, so the queries close in space run one
+ * after another and find the same nodes in the cache. The responses of
+ * one connection in a batch are sent with one write.
+ *
+ * The queries use NeighborIterator, which only reads the tree, so the
+ * workers share it; the tree must not change while the server runs.
+ *
+ * Usage:
+ *	QueryServer< KDTree<3> > server(tree, &points[0]);
+ *	server.start("/tmp/kdtree.sock", 4);
+ *	...
+ *	server.stop();
+ */
+template<typename Tree>
+class QueryServer {
+    typedef typename Tree::point P;
+    typedef typename Tree::ref ref;
+    typedef typename Tree::dist_t dist_t;
+    static const int D = Tree::dimensions;
+
+    struct Connection {
+	int fd;
+	/** bytes read but not parsed yet */
+	vector<char> input;
+	/** whole responses are written under it */
+	mutex writing;
+
+	Connection(int fd) : fd(fd) {}
+	~Connection() {
+	    ::close(fd);
+	}
+    };
+
+    struct Job {
+	shared_ptr<Connection> connection;
+	RequestHeader request;
+	P query;
+    };
+
+    const Tree &tree;
+    /** array the tree is built on, the indices in the responses refer to it */
+    const P *base;
+    string path;
+    int listener;
+    /** the I/O thread waits on it too, stop() writes to it */
+    int wake[2];
+    thread io;
+    vector<thread> workers;
+
+    mutex pendingMutex;
+    condition_variable pendingReady;
+    deque<Job> pending;
+    bool stopping;
+    size_t maxBatch;
+    chrono::microseconds delay;
+
+    atomic<uint64_t> requests;
+    atomic<uint64_t> batches;
+    atomic<uint64_t> largest;
+    atomic<uint64_t> connections;
+
+    QueryServer(const QueryServer &);
+    QueryServer &operator=(const QueryServer &);
+
+    /**
+     * Parses the complete requests of the connection into jobs
+     * @return false on a broken request, the connection is closed
+     */
+    bool parse(const shared_ptr<Connection> &connection, vector<Job> &jobs) {
+	vector<char> &input = connection->input;
+	size_t at = 0;
+	while(input.size() - at >= sizeof(RequestHeader)) {
+	    Job job;
+	    memcpy(&job.request, &input[at], sizeof(RequestHeader));
+	    const uint8_t dims = job.request.type == REQUEST_INFO ? 0 : job.request.dims;
+	    if(dims > 64)
+		return false;
+	    const size_t size = sizeof(RequestHeader) + dims * sizeof(float);
+	    if(input.size() - at < size)
+		break;
+	    if(dims == D) {
+		for(int d = 0; d < D; d++) {
+		    float coordinate;
+		    memcpy(&coordinate, &input[at + sizeof(RequestHeader) + d * sizeof(float)], sizeof(float));
+		    job.query[d] = coordinate;
+		}
+	    }
+	    job.connection = connection;
+	    jobs.push_back(job);
+	    at += size;
+	}
+	input.erase(input.begin(), input.begin() + at);
+	return true;
+    }
+
+    /**
+     * Reads what the connection has sent
+     * @return false if it is closed
+     */
+    bool receive(const shared_ptr<Connection> &connection, vector<Job> &jobs) {
+	char buffer[1 << 16];
+	ssize_t n = recv(connection->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	    return true;
+	if(n <= 0)
+	    return false;
+	connection->input.insert(connection->input.end(), buffer, buffer + n);
+	return parse(connection, jobs);
+    }
+
+    /**
+     * The I/O thread: accepts connections and reads the requests
+     */
+    void serve() {
+	vector< shared_ptr<Connection> > open;
+	vector<pollfd> fds;
+	vector<Job> jobs;
+	while(true) {
+	    fds.clear();
+	    pollfd w = {wake[0], POLLIN, 0}, l = {listener, POLLIN, 0};
+	    fds.push_back(w);
+	    fds.push_back(l);
+	    for(size_t i = 0; i < open.size(); i++) {
+		pollfd c = {open[i]->fd, POLLIN, 0};
+		fds.push_back(c);
+	    }
+	    if(poll(&fds[0], fds.size(), -1) < 0) {
+		if(errno == EINTR)
+		    continue;
+		cerr << "poll failed: " << strerror(errno) << "\n";
+		return;
+	    }
+	    if(fds[0].revents)
+		return;
+	    for(size_t i = open.size(); i-- > 0; ) {
+		if(!fds[i + 2].revents)
+		    continue;
+		if(!receive(open[i], jobs)) {
+		    shutdown(open[i]->fd, SHUT_RDWR); //the workers may still hold it
+		    open.erase(open.begin() + i);
+		}
+	    }
+	    if(fds[1].revents & POLLIN) {
+		int fd = accept(listener, NULL, NULL);
+		if(fd >= 0) {
+		    open.push_back(make_shared<Connection>(fd));
+		    connections++;
+		}
+	    }
+	    if(!jobs.empty()) {
+		lock_guard<mutex> lock(pendingMutex);
+		pending.insert(pending.end(), jobs.begin(), jobs.end());
+		pendingReady.notify_all();
+	    }
+	    jobs.clear();
+	}
+    }
+
+    void appendNeighbor(vector<char> &out, ref r, dist_t dist, bool points) {
+	const P *p = tree.getPoint(r);
+	ResponseNeighbor n = {(uint32_t) (p - base), (float) dist};
+	out.insert(out.end(), (const char *) &n, (const char *) &n + sizeof(n));
+	for(int d = 0; points && d < D; d++) {
+	    float coordinate = (float) (*p)[d];
+	    out.insert(out.end(), (const char *) &coordinate, (const char *) &coordinate + sizeof(float));
+	}
+    }
+
+    /**
+     * Whether the job is a query the tree answers: not INFO, with D finite
+     * coordinates, a known type and k in the limit
+     */
+    static bool isQuery(const Job &job) {
+	const RequestHeader &request = job.request;
+	if(request.type == REQUEST_INFO || request.type > REQUEST_RADIUS || request.dims != D || request.k > maxRequestK)
+	    return false;
+	for(int d = 0; d < D; d++) {
+	    if(!isfinite(job.query[d]))
+		return false;
+	}
+	return true;
+    }
+
+    /**
+     * Appends the response of the job to out
+     */
+    void answer(const Job &job, NeighborIterator<Tree> &browse, vector<char> &out) {
+	const RequestHeader &request = job.request;
+	ResponseHeader response = {request.id, request.type, RESPONSE_OK, request.flags, (uint8_t) D, 0};
+	const size_t at = out.size();
+	out.resize(at + sizeof(ResponseHeader));
+	const bool points = (request.flags & REQUEST_POINTS) != 0;
+	const bool zero = (request.flags & REQUEST_ZERO) != 0;
+	ref r;
+	dist_t dist;
+	if(request.type == REQUEST_INFO) {
+	    response.count = tree.size();
+	    for(int i = 0; i < 2 * D; i++) {
+		float bound = (float) tree.getBoundingBox()[i];
+		out.insert(out.end(), (const char *) &bound, (const char *) &bound + sizeof(float));
+	    }
+	}
+	else if(!isQuery(job)) {
+	    response.status = RESPONSE_BAD_REQUEST;
+	}
+	else if(request.type == REQUEST_RADIUS) {
+	    const dist_t bound = tree.getMetric().reduce((dist_t) request.radius);
+	    browse.reset(tree, &job.query, zero);
+	    while(browse.nextDistance() < bound && browse.next(r, dist)) {
+		appendNeighbor(out, r, dist, points);
+		response.count++;
+	    }
+	}
+	else {
+	    const uint32_t k = request.type == REQUEST_NN ? 1 : request.k;
+	    browse.reset(tree, &job.query, zero);
+	    while(response.count < k && browse.next(r, dist)) {
+		appendNeighbor(out, r, dist, points);
+		response.count++;
+	    }
+	}
+	memcpy(&out[at], &response, sizeof(ResponseHeader));
+    }
+
+    /**
+     * Runs a batch in the Z-order of the queries, one write per connection.
+     * INFO and bad requests have no query point, they go first.
+     */
+    void execute(vector<Job> &batch, NeighborIterator<Tree> &browse) {
+	vector<uint32_t> order, jobs;
+	vector<P> queries;
+	for(size_t i = 0; i < batch.size(); i++) {
+	    if(!isQuery(batch[i])) {
+		order.push_back((uint32_t) i);
+		continue;
+	    }
+	    jobs.push_back((uint32_t) i);
+	    queries.push_back(batch[i].query);
+	}
+	if(!queries.empty()) {
+	    vector<uint32_t> curve = PointOrder<D, P>::morton(&queries[0], queries.size(), 1);
+	    for(size_t i = 0; i < curve.size(); i++) order.push_back(jobs[curve[i]]);
+	}
+
+	vector<Connection *> targets;
+	vector< vector<char> > outputs;
+	for(size_t i = 0; i < order.size(); i++) {
+	    const Job &job = batch[order[i]];
+	    size_t t = find(targets.begin(), targets.end(), job.connection.get()) - targets.begin();
+	    if(t == targets.size()) {
+		targets.push_back(job.connection.get());
+		outputs.push_back(vector<char>());
+	    }
+	    answer(job, browse, outputs[t]);
+	}
+	for(size_t t = 0; t < targets.size(); t++) {
+	    lock_guard<mutex> lock(targets[t]->writing);
+	    sendAll(targets[t]->fd, &outputs[t][0], outputs[t].size());
+	}
+    }
+
+    /**
+     * A worker: takes the waiting requests as one batch
+     */
+    void work() {
+	NeighborIterator<Tree> browse;
+	vector<Job> batch;
+	while(true) {
+	    {
+		unique_lock<mutex> lock(pendingMutex);
+		pendingReady.wait(lock, [this]() { return stopping || !pending.empty(); });
+		if(stopping)
+		    return;
+		if(delay.count() > 0 && pending.size() < maxBatch) {
+		    pendingReady.wait_for(lock, delay, [this]() { return stopping || pending.size() >= maxBatch; });
+		    if(stopping)
+			return;
+		}
+		const size_t n = min(pending.size(), maxBatch);
+		batch.assign(pending.begin(), pending.begin() + n);
+		pending.erase(pending.begin(), pending.begin() + n);
+	    }
+	    requests += batch.size();
+	    batches++;
+	    uint64_t top = largest;
+	    while(batch.size() > top && !largest.compare_exchange_weak(top, batch.size()));
+	    execute(batch, browse);
+	    batch.clear();
+	}
+    }
+
+public:
+
+    /**
+     * @param tree the tree, it must not change while the server runs
+     * @param base array the tree is built on, the responses have indices into it
+     */
+    QueryServer(const Tree &tree, const P *base) : tree(tree), base(base), listener(-1),
+	    stopping(false), maxBatch(256), delay(0), requests(0), batches(0), largest(0), connections(0) {
+	wake[0] = wake[1] = -1;
+    }
+
+    ~QueryServer() {
+	stop();
+    }
+
+    /**
+     * Listens on the socket and starts the threads
+     * @param path path of the socket, an old socket there is replaced
+     * @param threads number of workers, 0 = all cores
+     * @param maxBatch the largest batch a worker takes at once
+     * @param delayMicros how long a worker waits for a fuller batch, 0 = not at all
+     * @return false if the socket can't be created
+     */
+    bool start(const string &path, unsigned threads = 0, size_t maxBatch = 256, int delayMicros = 0) {
+	sockaddr_un address;
+	if(path.size() >= sizeof(address.sun_path)) {
+	    cerr << "socket path too long: " << path << "\n";
+	    return false;
+	}
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener < 0) {
+	    cerr << "can't create socket: " << strerror(errno) << "\n";
+	    return false;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	unlink(path.c_str());
+	if(bind(listener, (sockaddr *) &address, sizeof(address)) < 0 || listen(listener, 128) < 0
+		|| pipe(wake) < 0) {
+	    cerr << "can't listen on " << path << ": " << strerror(errno) << "\n";
+	    ::close(listener);
+	    listener = -1;
+	    return false;
+	}
+	this->path = path;
+	this->maxBatch = max((size_t) 1, maxBatch);
+	this->delay = chrono::microseconds(delayMicros);
+	stopping = false;
+	if(threads == 0)
+	    threads = max(1u, thread::hardware_concurrency());
+	io = thread(&QueryServer::serve, this);
+	for(unsigned t = 0; t < threads; t++) workers.push_back(thread(&QueryServer::work, this));
+	return true;
+    }
+
+    /**
+     * Stops the threads and closes the socket, the requests still waiting are dropped
+     */
+    void stop() {
+	if(listener < 0)
+	    return;
+	{
+	    lock_guard<mutex> lock(pendingMutex);
+	    stopping = true;
+	    pending.clear();
+	}
+	pendingReady.notify_all();
+	char c = 0;
+	if(write(wake[1], &c, 1) < 0)
+	    cerr << "can't wake the I/O thread\n";
+	io.join();
+	for(size_t t = 0; t < workers.size(); t++) workers[t].join();
+	workers.clear();
+	::close(listener);
+	::close(wake[0]);
+	::close(wake[1]);
+	listener = wake[0] = wake[1] = -1;
+	unlink(path.c_str());
+    }
+
+    ServerStats getStats() const {
+	ServerStats stats = {requests, batches, largest, connections};
+	return stats;
+    }
+};
+
+/**
+ * Blocking client of a QueryServer, requests can be pipelined (send
+ * several, then receive), the responses are matched by their ids.
+ */
+class QueryClient {
+    int fd;
+    vector<char> input;
+
+    QueryClient(const QueryClient &);
+    QueryClient &operator=(const QueryClient &);
+
+public:
+
+    QueryClient() : fd(-1) {}
+
+    ~QueryClient() {
+	close();
+    }
+
+    bool connect(const string &path) {
+	close();
+	sockaddr_un address;
+	if(path.size() >= sizeof(address.sun_path))
+	    return false;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path.c_str());
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || ::connect(fd, (sockaddr *) &address, sizeof(address)) < 0) {
+	    close();
+	    return false;
+	}
+	return true;
+    }
+
+    void close() {
+	if(fd >= 0)
+	    ::close(fd);
+	fd = -1;
+	input.clear();
+    }
+
+    /**
+     * Sends a request
+     * @param query request.dims coordinates, NULL for INFO
+     * @return false if the connection is closed or a query has no coordinates
+     */
+    bool send(const RequestHeader &request, const float *query) {
+	char buffer[sizeof(RequestHeader) + 64 * sizeof(float)];
+	const size_t dims = request.type == REQUEST_INFO ? 0 : min((int) request.dims, 64);
+	if(dims > 0 && query == NULL) {
+	    cerr << "QueryClient: request " << request.id << " has no query point\n";
+	    return false;
+	}
+	memcpy(buffer, &request, sizeof(RequestHeader));
+	if(query != NULL)
+	    memcpy(buffer + sizeof(RequestHeader), query, dims * sizeof(float));
+	return sendAll(fd, buffer, sizeof(RequestHeader) + dims * sizeof(float));
+    }
+
+    /**
+     * Waits for the next response
+     * @param payload the bytes after the header (see ResponseHeader)
+     * @return false if the connection is closed
+     */
+    bool receive(ResponseHeader &response, vector<char> &payload) {
+	size_t need = sizeof(ResponseHeader);
+	while(true) {
+	    if(input.size() >= sizeof(ResponseHeader)) {
+		memcpy(&response, &input[0], sizeof(ResponseHeader));
+		need = sizeof(ResponseHeader) + responsePayload(response);
+		if(input.size() >= need)
+		    break;
+	    }
+	    char buffer[1 << 16];
+	    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+	    if(n < 0 && errno == EINTR)
+		continue;
+	    if(n <= 0)
+		return false;
+	    input.insert(input.end(), buffer, buffer + n);
+	}
+	payload.assign(input.begin() + sizeof(ResponseHeader), input.begin() + need);
+	input.erase(input.begin(), input.begin() + need);
+	return true;
+    }
+};
+
+#endif	/* QUERYSERVER_H */
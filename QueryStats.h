@@ -0,0 +1,283 @@
+/*
+ * File:   QueryStats.h
+ * Author: Daniel Princ
+ *
+ * Per query traversal statistics of the KDTree.
+ * Collected only when compiled with -DKDTREE_STATS, otherwise
+ * the KDTREE_STAT macro removes all the counting.
+ *
+ */
+
+#ifndef QUERYSTATS_H
+#define	QUERYSTATS_H
+
+#include <stdint.h>
+#include <string>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace std;
+
+#ifdef KDTREE_STATS
+#define KDTREE_STAT(x) x
+#else
+#define KDTREE_STAT(x)
+#endif
+
+/**
+ * Types of queries with separate statistics
+ */
+enum QueryType {
+    QUERY_NN, QUERY_KNN, QUERY_RADIUS, QUERY_SIMPLE_NN, QUERY_TYPES
+};
+
+/**
+ * Histogram of non-negative integer values.
+ * Values below 8 have their own bins, larger values share bins with
+ * 8 bins per power of two, so the relative error of percentiles is
+ * at most 12.5%.
+ */
+class Histogram {
+    static const int sub = 8;
+    static const int bins = sub + 61 * sub;
+
+    uint64_t counts[bins];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t minv;
+    uint64_t maxv;
+
+    static int bin(uint64_t v) {
+	if(v < sub)
+	    return (int) v;
+	int e = 63 - __builtin_clzll(v); //>= 3
+	return sub + (e - 3) * sub + (int) ((v >> (e - 3)) & (sub - 1));
+    }
+
+    /** lowest value of the bin */
+    static uint64_t low(int b) {
+	if(b < sub)
+	    return b;
+	int e = (b - sub) / sub + 3;
+	return ((uint64_t) 1 << e) + ((uint64_t) ((b - sub) % sub) << (e - 3));
+    }
+
+public:
+
+    Histogram() {
+	reset();
+    }
+
+    void reset() {
+	fill(counts, counts + bins, 0);
+	count = sum = maxv = 0;
+	minv = UINT64_MAX;
+    }
+
+    void add(uint64_t v) {
+	counts[bin(v)]++;
+	count++;
+	sum += v;
+	if(v < minv) minv = v;
+	if(v > maxv) maxv = v;
+    }
+
+    uint64_t getCount() const {
+	return count;
+    }
+
+    uint64_t getMin() const {
+	return count ? minv : 0;
+    }
+
+    uint64_t getMax() const {
+	return maxv;
+    }
+
+    double getMean() const {
+	return count ? sum / (double) count : 0;
+    }
+
+    /**
+     * Approximate percentile, the lowest value of the bin containing it
+     * @param q percentile in <0, 1>
+     */
+    uint64_t percentile(double q) const {
+	if(count == 0)
+	    return 0;
+	uint64_t rank = (uint64_t) (q * (count - 1));
+	uint64_t seen = 0;
+	for(int b = 0; b < bins; b++) {
+	    seen += counts[b];
+	    if(seen > rank)
+		return max(low(b), getMin());
+	}
+	return maxv;
+    }
+
+    /**
+     * Prints mean, percentiles and max on one line
+     */
+    void printSummary(ostream &out) const {
+	ios::fmtflags flags = out.flags();
+	streamsize precision = out.precision();
+	out << fixed << setprecision(1);
+	out << "mean " << setw(10) << getMean() << "  p50 " << setw(8) << percentile(0.5)
+		<< "  p90 " << setw(8) << percentile(0.9) << "  p99 " << setw(8) << percentile(0.99)
+		<< "  max " << setw(8) << getMax() << "\n";
+	out.flags(flags);
+	out.precision(precision);
+    }
+
+    /**
+     * Prints the non-empty bins
+     */
+    void printBins(ostream &out) const {
+	for(int b = 0; b < bins; b++) {
+	    if(counts[b] == 0) continue;
+	    out << "    >= " << setw(10) << low(b) << ": " << counts[b] << "\n";
+	}
+    }
+};
+
+/**
+ * Counters of one running query
+ */
+struct QueryCounters {
+    /** inner nodes taken from the stack */
+    uint64_t innerNodes;
+    /** leaves whose bucket was scanned */
+    uint64_t leaves;
+    /** points whose distance was tested */
+    uint64_t points;
+    /** largest size of the traversal stack */
+    uint64_t depth;
+
+    void reset() {
+	innerNodes = leaves = points = depth = 0;
+    }
+};
+
+/**
+ * Histograms of all queries of one type
+ */
+struct QueryTypeStats {
+    Histogram innerNodes;
+    Histogram leaves;
+    Histogram points;
+    Histogram depth;
+    /** wall time in nanoseconds */
+    Histogram time;
+
+    void reset() {
+	innerNodes.reset();
+	leaves.reset();
+	points.reset();
+	depth.reset();
+	time.reset();
+    }
+};
+
+/**
+ * Statistics of the queries of one tree.
+ *
+ * Every query adds its counters to the histograms of its type, kNN
+ * includes the NN and radius searches it runs internally.
+ */
+class QueryStats {
+    typedef chrono::steady_clock clock;
+
+    QueryTypeStats types[QUERY_TYPES];
+    QueryCounters current;
+    QueryType type;
+    clock::time_point start;
+
+public:
+
+    QueryStats() : type(QUERY_NN) {
+	current.reset();
+    }
+
+    /**
+     * Starts a query, resets the counters
+     */
+    void begin(QueryType t) {
+	type = t;
+	current.reset();
+	start = clock::now();
+    }
+
+    /**
+     * Ends the query, adds its counters and time to the histograms
+     */
+    void end() {
+	uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(clock::now() - start).count();
+	QueryTypeStats &s = types[type];
+	s.innerNodes.add(current.innerNodes);
+	s.leaves.add(current.leaves);
+	s.points.add(current.points);
+	s.depth.add(current.depth);
+	s.time.add(ns);
+    }
+
+    void innerNode() {
+	current.innerNodes++;
+    }
+
+    void leaf() {
+	current.leaves++;
+    }
+
+    void point() {
+	current.points++;
+    }
+
+    void depth(size_t d) {
+	if(d > current.depth) current.depth = d;
+    }
+
+    /**
+     * Counters of the last (or running) query
+     */
+    const QueryCounters &last() const {
+	return current;
+    }
+
+    const QueryTypeStats &get(QueryType t) const {
+	return types[t];
+    }
+
+    void reset() {
+	for(int t = 0; t < QUERY_TYPES; t++) types[t].reset();
+	current.reset();
+    }
+
+    static const char *name(QueryType t) {
+	static const char *names[QUERY_TYPES] = {"NN", "kNN", "radius", "simple NN"};
+	return names[t];
+    }
+
+    /**
+     * Prints the histograms of all query types that were run
+     * @param out output stream
+     * @param bins print the bins as well, not only the summary
+     */
+    void print(ostream &out, bool bins = false) const {
+	const char *metrics[5] = {"inner nodes", "leaves", "points", "stack depth", "time [ns]"};
+	for(int t = 0; t < QUERY_TYPES; t++) {
+	    const QueryTypeStats &s = types[t];
+	    if(s.time.getCount() == 0) continue;
+	    out << name((QueryType) t) << " queries: " << s.time.getCount() << "\n";
+	    const Histogram *h[5] = {&s.innerNodes, &s.leaves, &s.points, &s.depth, &s.time};
+	    for(int m = 0; m < 5; m++) {
+		out << "  " << left << setw(12) << metrics[m] << right;
+		h[m]->printSummary(out);
+		if(bins) h[m]->printBins(out);
+	    }
+	}
+    }
+};
+
+#endif	/* QUERYSTATS_H */
@@ -0,0 +1,467 @@
+/*
+ * File:   ShardedTree.h
+ * Author: Daniel Princ
+ *
+ * Index split into shards by space, one kd-tree per shard, built in
+ * parallel and queried by the worker of the shard (multi-core, NUMA).
+ *
+ */
+
+#ifndef SHARDEDTREE_H
+#define	SHARDEDTREE_H
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <limits>
+#include <utility>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std;
+#include "KDTreeNodes.h"
+#include "Metric.h"
+
+/**
+ * Points split into P shards by the top levels of a kd-tree: the widest
+ * dimension is split at the point that divides the number of shards,
+ * down to P boxes with the same number of points. Every shard is a
+ * Tree of its own; the shards are built in parallel.
+ *
+ * A query goes to the shard owning its position, and to the other shards
+ * only when the NN or kNN distance found there reaches their bounding
+ * boxes. Near the middle of a shard nothing else is touched.
+ *
+ * Shard i belongs to worker i % W (W workers, at most P). With pinning
+ * the worker w runs on core w, the tree of a shard is built there, so
+ * its memory is on the NUMA node of that core (first touch, without
+ * libnuma). The batch queries then go by the shards. First every worker
+ * answers the queries its shards own. Then it answers the fan-out
+ * queries of its shards. So a shard is only ever read by its worker.
+ * This also makes the batches safe: the query methods of the Tree are
+ * not const (statistics), one tree can't serve two threads at once.
+ * The single query methods run on the caller's thread.
+ *
+ * Results are the refs of the trees: pointers, or for Indexed trees the
+ * indices into the array the index was built on.
+ *
+ * Usage:
+ *	ShardedTree< KDTree<3> > index;
+ *	index.build(&points[0], points.size(), 16);
+ *	vector< Point<3> * > nn = index.nearestNeighbors(&queries[0], queries.size());
+ */
+template<typename Tree>
+class ShardedTree {
+public:
+    typedef typename Tree::point P;
+    typedef typename Tree::ref ref;
+    typedef typename Tree::scalar scalar;
+    typedef typename Tree::dist_t dist_t;
+    typedef typename Tree::metric_t metric_t;
+    static const int D = Tree::dimensions;
+
+private:
+    /** neighbors of a query in a shard, sorted by the distance */
+    typedef vector< pair<dist_t, ref> > found_t;
+
+    /**
+     * Split of the top levels, a child is another split or a shard (~index)
+     */
+    struct Split {
+	int dimension;
+	scalar split;
+	int left;
+	int right;
+    };
+
+    struct Shard {
+	unique_ptr<Tree> tree;
+	/** bounding box of the points of the shard */
+	scalar min[D];
+	scalar max[D];
+	/** core of the worker, -1 if not pinned */
+	int cpu;
+    };
+
+    /** query sent to another shard */
+    struct Request {
+	uint32_t shard;
+	uint32_t query;
+    };
+
+    vector<Split> splits;
+    vector<Shard> shards;
+    /** array the points are in (for the indexed trees) */
+    P *base;
+    /** number of workers */
+    unsigned workers;
+    bool pinned;
+    int sizep;
+    /** metric of all shards */
+    metric_t metric;
+
+    ShardedTree(const ShardedTree &);
+    ShardedTree &operator=(const ShardedTree &);
+
+    dist_t distance(const P &a, const P &b) const {
+	return metricDistance<dist_t, D>(metric, a, b);
+    }
+
+    dist_t boxDistance(const P &p, const scalar *min, const scalar *max) const {
+	return metricBoxDistance<dist_t, D>(metric, p, min, max);
+    }
+
+    const P &point(ref r) const {
+	return *PointRef<P, Tree::indexed>::get(base, r);
+    }
+
+    /**
+     * Pins the calling thread to the core, does nothing elsewhere than on Linux
+     */
+    static void pin(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    int cpuOf(unsigned worker) const {
+	return pinned ? (int) (worker % max(1u, thread::hardware_concurrency())) : -1;
+    }
+
+    /**
+     * Runs work(w) on every worker, each on its own (pinned) thread
+     */
+    template<typename Work>
+    void parallel(Work work) const {
+	if(workers == 1 && !pinned) {
+	    work(0u);
+	    return;
+	}
+	vector<thread> threads;
+	for(unsigned w = 0; w < workers; w++) {
+	    threads.push_back(thread([this, w, &work]() {
+		if(pinned) pin(cpuOf(w));
+		work(w);
+	    }));
+	}
+	for(size_t t = 0; t < threads.size(); t++) threads[t].join();
+    }
+
+    /**
+     * Splits all[begin, end) for count shards, appends their ranges
+     * @return the split or ~shard of the range
+     */
+    int partition(vector<ref> &all, size_t begin, size_t end, int count, vector< pair<size_t, size_t> > &ranges) {
+	if(count == 1) {
+	    ranges.push_back(make_pair(begin, end));
+	    return ~(int) (ranges.size() - 1);
+	}
+	scalar min[D], max[D];
+	for(int d = 0; d < D; d++) {
+	    min[d] = numeric_limits<scalar>::max();
+	    max[d] = numeric_limits<scalar>::lowest();
+	}
+	for(size_t i = begin; i < end; i++) {
+	    const P &p = point(all[i]);
+	    for(int d = 0; d < D; d++) {
+		if(p[d] < min[d]) min[d] = p[d];
+		if(p[d] > max[d]) max[d] = p[d];
+	    }
+	}
+	int dim = 0;
+	for(int d = 1; d < D; d++) {
+	    if((dist_t) max[d] - min[d] > (dist_t) max[dim] - min[dim]) dim = d;
+	}
+	//every side gets a point per shard at least, count <= end - begin
+	const int left = count / 2;
+	const size_t mid = begin + (end - begin) * left / count;
+	nth_element(all.begin() + begin, all.begin() + mid, all.begin() + end,
+	    [this, dim](ref a, ref b) -> bool { return point(a)[dim] < point(b)[dim]; });
+	Split split;
+	split.dimension = dim;
+	split.split = point(all[begin])[dim];
+	for(size_t i = begin; i < mid; i++) split.split = std::max(split.split, point(all[i])[dim]);
+	const int index = (int) splits.size();
+	splits.push_back(split);
+	const int l = partition(all, begin, mid, left, ranges);
+	const int r = partition(all, mid, end, count - left, ranges);
+	splits[index].left = l;
+	splits[index].right = r;
+	return index;
+    }
+
+    /**
+     * Neighbors of the query in one shard, NN for k = 1
+     */
+    found_t search(size_t s, const P *query, int k) {
+	found_t found;
+	Tree &tree = *shards[s].tree;
+	if(k == 1) {
+	    ref nn = tree.nearestNeighbor(query);
+	    if(nn != Tree::none())
+		found.push_back(make_pair(distance(*query, *tree.getPoint(nn)), nn));
+	    return found;
+	}
+	vector<ref> knn = tree.kNearestNeighbors(query, k);
+	for(size_t i = 0; i < knn.size(); i++) {
+	    found.push_back(make_pair(distance(*query, *tree.getPoint(knn[i])), knn[i]));
+	}
+	return found;
+    }
+
+    /** distance the neighbors of other shards have to beat */
+    static dist_t bound(const found_t &found, int k) {
+	return found.size() < (size_t) k ? numeric_limits<dist_t>::max() : found.back().first;
+    }
+
+    static void merge(found_t &into, const found_t &other, int k) {
+	found_t merged(into.size() + other.size());
+	std::merge(into.begin(), into.end(), other.begin(), other.end(), merged.begin(),
+	    [](const pair<dist_t, ref> &a, const pair<dist_t, ref> &b) -> bool { return a.first < b.first; });
+	if(merged.size() > (size_t) k)
+	    merged.resize(k);
+	into.swap(merged);
+    }
+
+    /**
+     * Searches the other shards that can have nearer points
+     */
+    void fanOut(size_t owner, const P *query, int k, found_t &found) {
+	for(size_t s = 0; s < shards.size(); s++) {
+	    if(s != owner && boxDistance(*query, shards[s].min, shards[s].max) < bound(found, k))
+		merge(found, search(s, query, k), k);
+	}
+    }
+
+    static vector<ref> refs(const found_t &found) {
+	vector<ref> result(found.size());
+	for(size_t i = 0; i < found.size(); i++) result[i] = found[i].second;
+	return result;
+    }
+
+    /**
+     * kNN (NN for k = 1) of all queries by the workers of the shards:
+     * owners first, then the fan-out to the other shards
+     */
+    vector<found_t> batch(const P *queries, size_t count, int k) {
+	vector<found_t> found(count);
+	if(sizep == 0 || k <= 0)
+	    return found;
+
+	//queries of every shard
+	vector<uint32_t> owners(count);
+	parallel([&](unsigned w) {
+	    for(size_t q = count * w / workers; q < count * (w + 1) / workers; q++) {
+		owners[q] = owner(&queries[q]);
+	    }
+	});
+	vector<uint32_t> offsets(shards.size() + 1, 0), order(count);
+	for(size_t q = 0; q < count; q++) offsets[owners[q] + 1]++;
+	for(size_t s = 0; s < shards.size(); s++) offsets[s + 1] += offsets[s];
+	vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+	for(size_t q = 0; q < count; q++) order[next[owners[q]]++] = q;
+
+	//the owners, every worker collects the queries for other shards
+	vector< vector<Request> > requests(workers);
+	parallel([&](unsigned w) {
+	    for(size_t s = w; s < shards.size(); s += workers) {
+		for(uint32_t i = offsets[s]; i < offsets[s + 1]; i++) {
+		    const uint32_t q = order[i];
+		    found[q] = search(s, &queries[q], k);
+		    const dist_t b = bound(found[q], k);
+		    for(size_t o = 0; o < shards.size(); o++) {
+			if(o != s && boxDistance(queries[q], shards[o].min, shards[o].max) < b) {
+			    Request r = {(uint32_t) o, q};
+			    requests[w].push_back(r);
+			}
+		    }
+		}
+	    }
+	});
+
+	//the fan-out, by the workers of the other shards
+	vector<Request> all;
+	for(unsigned w = 0; w < workers; w++) all.insert(all.end(), requests[w].begin(), requests[w].end());
+	if(all.empty())
+	    return found;
+	sort(all.begin(), all.end(), [](const Request &a, const Request &b) -> bool { return a.shard < b.shard; });
+	vector<found_t> extra(all.size());
+	parallel([&](unsigned w) {
+	    for(size_t i = 0; i < all.size(); i++) {
+		if(all[i].shard % workers == w)
+		    extra[i] = search(all[i].shard, &queries[all[i].query], k);
+	    }
+	});
+	for(size_t i = 0; i < all.size(); i++) merge(found[all[i].query], extra[i], k);
+	return found;
+    }
+
+public:
+
+    ShardedTree() : base(NULL), workers(1), pinned(false), sizep(0) {}
+
+    /**
+     * Builds the shards in parallel
+     * @param data array of the points, it has to stay (the trees refer to it)
+     * @param count number of points
+     * @param shards number of shards (at most count)
+     * @param threads number of workers, 0 = all cores, at most shards
+     * @param pin pin the workers to cores (Linux), the shards stay on their NUMA nodes
+     */
+    void build(P *data, uint32_t count, int shards, unsigned threads = 0, bool pin = true) {
+	if(threads == 0)
+	    threads = max(1u, thread::hardware_concurrency());
+	shards = max(1, min(shards, (int) max(count, 1u)));
+	base = data;
+	sizep = count;
+	pinned = pin;
+	workers = min(threads, (unsigned) shards);
+	splits.clear();
+	this->shards.clear();
+	this->shards.resize(shards);
+
+	vector<ref> all(count);
+	for(uint32_t i = 0; i < count; i++) all[i] = PointRef<P, Tree::indexed>::make(data, i);
+	vector< pair<size_t, size_t> > ranges;
+	partition(all, 0, count, shards, ranges);
+
+	parallel([&](unsigned w) {
+	    for(size_t s = w; s < ranges.size(); s += workers) {
+		Shard &shard = this->shards[s];
+		shard.tree.reset(new Tree());
+		shard.tree->setMetric(metric);
+		shard.tree->rebase(data); //only indexed trees use it
+		vector<ref> points(all.begin() + ranges[s].first, all.begin() + ranges[s].second);
+		shard.tree->construct(&points);
+		const scalar *box = shard.tree->getBoundingBox();
+		for(int d = 0; d < D; d++) {
+		    shard.min[d] = box[2*d];
+		    shard.max[d] = box[2*d + 1];
+		}
+		shard.cpu = cpuOf(w);
+	    }
+	});
+    }
+
+    /**
+     * Shard owning the position of the query
+     */
+    uint32_t owner(const P *query) const {
+	if(splits.empty())
+	    return 0;
+	int node = 0;
+	while(node >= 0) {
+	    const Split &s = splits[node];
+	    node = (*query)[s.dimension] <= s.split ? s.left : s.right;
+	}
+	return ~node;
+    }
+
+    /**
+     * Exact NN, points at zero distance are skipped (see KDTree::nearestNeighbor)
+     */
+    ref nearestNeighbor(const P *query) {
+	if(sizep == 0)
+	    return Tree::none();
+	const uint32_t s = owner(query);
+	found_t found = search(s, query, 1);
+	fanOut(s, query, 1, found);
+	return found.empty() ? Tree::none() : found[0].second;
+    }
+
+    /**
+     * Exact kNN sorted by the distance (see KDTree::kNearestNeighbors)
+     */
+    vector<ref> kNearestNeighbors(const P *query, const int k) {
+	if(sizep == 0 || k <= 0)
+	    return vector<ref>();
+	const uint32_t s = owner(query);
+	found_t found = search(s, query, k);
+	fanOut(s, query, k, found);
+	return refs(found);
+    }
+
+    /**
+     * Points in the radius from all shards the sphere reaches
+     */
+    vector<ref> circularQuery(const P *query, const dist_t radius) {
+	vector<ref> result;
+	if(sizep == 0)
+	    return result;
+	for(size_t s = 0; s < shards.size(); s++) {
+	    if(shards[s].tree && boxDistance(*query, shards[s].min, shards[s].max) < metric.reduce(radius)) {
+		vector<ref> inside = shards[s].tree->circularQuery(query, radius);
+		result.insert(result.end(), inside.begin(), inside.end());
+	    }
+	}
+	return result;
+    }
+
+    /**
+     * NN of all queries, by the workers of the shards
+     * @return NN of every query, Tree::none() if there is none
+     */
+    vector<ref> nearestNeighbors(const P *queries, size_t count) {
+	vector<found_t> found = batch(queries, count, 1);
+	vector<ref> result(count, Tree::none());
+	for(size_t q = 0; q < count; q++) {
+	    if(!found[q].empty()) result[q] = found[q][0].second;
+	}
+	return result;
+    }
+
+    /**
+     * kNN of all queries, by the workers of the shards
+     */
+    vector< vector<ref> > kNearestNeighbors(const P *queries, size_t count, int k) {
+	vector<found_t> found = batch(queries, count, k);
+	vector< vector<ref> > result(count);
+	for(size_t q = 0; q < count; q++) result[q] = refs(found[q]);
+	return result;
+    }
+
+    const int size() const {
+	return sizep;
+    }
+
+    const metric_t &getMetric() const {
+	return metric;
+    }
+
+    /**
+     * Changes the metric of all shards (see KDTree::setMetric)
+     */
+    void setMetric(const metric_t &metric) {
+	this->metric = metric;
+	for(size_t s = 0; s < shards.size(); s++) {
+	    if(shards[s].tree) shards[s].tree->setMetric(metric);
+	}
+    }
+
+    size_t getShardCount() const {
+	return shards.size();
+    }
+
+    const Tree &getShard(size_t i) const {
+	return *shards[i].tree;
+    }
+
+    /** core the shard was built on, -1 if the workers are not pinned */
+    int getShardCpu(size_t i) const {
+	return shards[i].cpu;
+    }
+
+    unsigned getWorkers() const {
+	return workers;
+    }
+};
+
+#endif	/* SHARDEDTREE_H */
@@ -0,0 +1,323 @@
+/*
+ * File:   TreeReport.h
+ * Author: Daniel Princ
+ *
+ * Quality and memory report of a built KDTree.
+ *
+ */
+
+#ifndef TREEREPORT_H
+#define	TREEREPORT_H
+
+#include <vector>
+#include <stack>
+#include <limits>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+/**
+ * Summary of a set of values
+ */
+struct Distribution {
+    size_t count;
+    double min;
+    double mean;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+
+    /**
+     * @param values the values, sorted in place
+     */
+    static Distribution of(vector<double> &values) {
+	Distribution d;
+	d.count = values.size();
+	d.min = d.mean = d.p50 = d.p90 = d.p99 = d.max = 0;
+	if(values.empty())
+	    return d;
+	sort(values.begin(), values.end());
+	double sum = 0;
+	for(vector<double>::iterator it = values.begin(); it != values.end(); ++it) {
+	    sum += *it;
+	}
+	d.min = values.front();
+	d.max = values.back();
+	d.mean = sum / values.size();
+	d.p50 = values[(size_t) (0.5 * (values.size() - 1))];
+	d.p90 = values[(size_t) (0.9 * (values.size() - 1))];
+	d.p99 = values[(size_t) (0.99 * (values.size() - 1))];
+	return d;
+    }
+
+    void print(ostream &out) const {
+	out << "min " << min << ", mean " << mean << ", p50 " << p50 << ", p90 " << p90
+		<< ", p99 " << p99 << ", max " << max << "\n";
+    }
+
+    void writeJson(ostream &out) const {
+	out << "{\"count\": " << count << ", \"min\": " << min << ", \"mean\": " << mean
+		<< ", \"p50\": " << p50 << ", \"p90\": " << p90 << ", \"p99\": " << p99
+		<< ", \"max\": " << max << "}";
+    }
+};
+
+/**
+ * Structure of a KDTree: depths of leaves, bucket occupancy, empty child
+ * slots, leaf densities, shapes of leaf cells and memory.
+ *
+ * Works for trees built by construct and grown by insert, compare
+ * needsRebuild() of a grown tree to decide when to build it again.
+ *
+ * Usage: TreeReport::analyze(tree).print(cout);
+ */
+struct TreeReport {
+    /** number of points */
+    size_t points;
+    /** maximal number of points in a bucket */
+    int bucketSize;
+    size_t innerNodes;
+    size_t leaves;
+    /** leaves without points */
+    size_t emptyLeaves;
+    /** leaves with more than bucketSize (equal) points */
+    size_t oversizedLeaves;
+    /** missing children of inner nodes */
+    size_t emptySlots;
+
+    /** number of leaves in every depth, the root has depth 0 */
+    vector<size_t> depths;
+    int minDepth;
+    int maxDepth;
+    /** mean depth of leaves */
+    double meanDepth;
+    /** mean depth of a balanced tree with full buckets */
+    double idealDepth;
+
+    /** number of leaves with 0..bucketSize points, the last item counts oversized leaves */
+    vector<size_t> fill;
+    /** mean number of points in a leaf / bucketSize */
+    double meanFill;
+
+    /** volume per point of non-empty leaves (Leaf::getDensity) */
+    Distribution density;
+    /** longest / shortest side of leaf cells (given by the splits) */
+    Distribution aspect;
+    /** cells with a zero side, not included in aspect */
+    size_t degenerateCells;
+
+    size_t innerBytes;
+    /** leaf nodes without their buckets */
+    size_t leafBytes;
+    /** buckets (allocated capacity) */
+    size_t bucketBytes;
+    /** codes of quantized leaves */
+    size_t codeBytes;
+    /** the points themselves, owned by the caller */
+    size_t pointBytes;
+
+    /**
+     * Bytes of the tree, without the points
+     */
+    size_t treeBytes() const {
+	return innerBytes + leafBytes + bucketBytes + codeBytes;
+    }
+
+    /**
+     * Simple rebuild criterion for trees grown by insert
+     * @param depthFactor allowed mean depth compared to the balanced tree
+     * @param minFill minimal mean bucket occupancy
+     * @return true if the tree is too deep or the buckets too empty
+     */
+    bool needsRebuild(double depthFactor = 1.5, double minFill = 0.3) const {
+	return meanDepth > depthFactor * max(idealDepth, 1.0) || meanFill < minFill;
+    }
+
+    /**
+     * Walks the whole tree
+     * @param tree any KDTree
+     * @return the report
+     */
+    template<typename Tree>
+    static TreeReport analyze(const Tree &tree) {
+	typedef typename Tree::scalar T;
+	typedef typename Tree::node_t node_t;
+	typedef typename Tree::inner_t inner_t;
+	typedef typename Tree::leaf_t leaf_t;
+	const int D = Tree::dimensions;
+
+	TreeReport r;
+	r.points = tree.size();
+	r.bucketSize = Tree::getBucketSize();
+	r.innerNodes = r.leaves = r.emptyLeaves = r.oversizedLeaves = r.emptySlots = 0;
+	r.degenerateCells = 0;
+	r.fill.assign(r.bucketSize + 2, 0);
+	r.innerBytes = r.leafBytes = r.bucketBytes = r.codeBytes = 0;
+	r.pointBytes = r.points * sizeof(typename Tree::point);
+	double leavesFull = r.points / (double) r.bucketSize;
+	r.idealDepth = leavesFull > 1 ? log2(leavesFull) : 0;
+
+	vector<double> densities, aspects;
+	double depthSum = 0, fillSum = 0;
+	r.minDepth = numeric_limits<int>::max();
+	r.maxDepth = 0;
+
+	struct Cell {
+	    const node_t *node;
+	    int depth;
+	    T bounds[2*D];
+	};
+	stack<Cell> stack; //avoid recursion
+	Cell root;
+	root.node = tree.getRoot();
+	root.depth = 0;
+	copy(tree.getBoundingBox(), tree.getBoundingBox() + 2*D, root.bounds);
+	stack.push(root);
+
+	while(!stack.empty()) {
+	    Cell cell = stack.top();
+	    stack.pop();
+	    if(!cell.node->isLeaf()) {
+		const inner_t *inner = (const inner_t *) cell.node;
+		r.innerNodes++;
+		r.innerBytes += sizeof(inner_t);
+		const node_t *children[2] = {inner->left, inner->right};
+		for(int c = 0; c < 2; c++) {
+		    if(!children[c]) {
+			r.emptySlots++;
+			continue;
+		    }
+		    Cell child = cell;
+		    child.node = children[c];
+		    child.depth = cell.depth + 1;
+		    //a single child gets all the points, whatever the split is
+		    if(inner->left && inner->right) {
+			T &bound = child.bounds[2*inner->dimension + (c == 0 ? 1 : 0)];
+			if(c == 0 ? inner->split < bound : inner->split > bound)
+			    bound = inner->split;
+		    }
+		    stack.push(child);
+		}
+		continue;
+	    }
+
+	    const leaf_t *leaf = (const leaf_t *) cell.node;
+	    const size_t size = leaf->bucket.size();
+	    r.leaves++;
+	    r.leafBytes += sizeof(leaf_t);
+	    r.bucketBytes += leaf->bucket.capacity() * sizeof(typename Tree::ref);
+	    r.codeBytes += leaf->codeBytes();
+
+	    if((int) r.depths.size() <= cell.depth)
+		r.depths.resize(cell.depth + 1, 0);
+	    r.depths[cell.depth]++;
+	    depthSum += cell.depth;
+	    r.minDepth = min(r.minDepth, cell.depth);
+	    r.maxDepth = max(r.maxDepth, cell.depth);
+
+	    fillSum += size;
+	    if(size > (size_t) r.bucketSize) {
+		r.oversizedLeaves++;
+		r.fill[r.bucketSize + 1]++;
+	    }
+	    else
+		r.fill[size]++;
+	    if(size == 0) {
+		r.emptyLeaves++;
+		continue;
+	    }
+	    densities.push_back(leaf->getDensity());
+
+	    double longest = 0, shortest = numeric_limits<double>::max();
+	    for(int d = 0; d < D; d++) {
+		double side = (double) cell.bounds[2*d + 1] - (double) cell.bounds[2*d];
+		longest = max(longest, side);
+		shortest = min(shortest, side);
+	    }
+	    if(shortest > 0)
+		aspects.push_back(longest / shortest);
+	    else
+		r.degenerateCells++;
+	}
+
+	if(r.leaves == 0)
+	    r.minDepth = 0;
+	r.meanDepth = r.leaves ? depthSum / r.leaves : 0;
+	r.meanFill = r.leaves ? fillSum / r.leaves / r.bucketSize : 0;
+	r.density = Distribution::of(densities);
+	r.aspect = Distribution::of(aspects);
+	return r;
+    }
+
+    /**
+     * Prints the report as text
+     */
+    void print(ostream &out) const {
+	out << "points: " << points << ", bucket size: " << bucketSize << "\n";
+	out << "nodes: " << innerNodes << " inner, " << leaves << " leaves (" << emptyLeaves
+		<< " empty, " << oversizedLeaves << " oversized), " << emptySlots << " empty child slots\n";
+	out << "leaf depth: min " << minDepth << ", mean " << meanDepth << ", max " << maxDepth
+		<< ", balanced tree " << idealDepth << "\n";
+	for(size_t d = 0; d < depths.size(); d++) {
+	    if(depths[d]) out << "  depth " << setw(3) << d << ": " << depths[d] << "\n";
+	}
+	out << "bucket fill: mean " << meanFill * 100 << "%\n";
+	for(size_t i = 0; i < fill.size(); i++) {
+	    if(!fill[i]) continue;
+	    if((int) i > bucketSize) out << "  oversized: ";
+	    else out << "  " << setw(3) << i << " points: ";
+	    out << fill[i] << "\n";
+	}
+	out << "volume per point: ";
+	density.print(out);
+	out << "cell aspect ratio: ";
+	aspect.print(out);
+	out << "  degenerate cells: " << degenerateCells << "\n";
+	out << "memory: inner nodes " << innerBytes << " B, leaves " << leafBytes << " B, buckets "
+		<< bucketBytes << " B, codes " << codeBytes << " B, tree total " << treeBytes()
+		<< " B (" << (points ? treeBytes() / (double) points : 0) << " B per point), points "
+		<< pointBytes << " B\n";
+	out << "rebuild: " << (needsRebuild() ? "recommended" : "not needed") << "\n";
+    }
+
+    /**
+     * Writes the report as JSON
+     */
+    void writeJson(ostream &out) const {
+	out << "{\n";
+	out << "  \"points\": " << points << ",\n";
+	out << "  \"bucketSize\": " << bucketSize << ",\n";
+	out << "  \"innerNodes\": " << innerNodes << ",\n";
+	out << "  \"leaves\": " << leaves << ",\n";
+	out << "  \"emptyLeaves\": " << emptyLeaves << ",\n";
+	out << "  \"oversizedLeaves\": " << oversizedLeaves << ",\n";
+	out << "  \"emptySlots\": " << emptySlots << ",\n";
+	out << "  \"depth\": {\"min\": " << minDepth << ", \"mean\": " << meanDepth << ", \"max\": "
+		<< maxDepth << ", \"balanced\": " << idealDepth << ", \"leaves\": [";
+	for(size_t d = 0; d < depths.size(); d++) {
+	    out << (d ? ", " : "") << depths[d];
+	}
+	out << "]},\n";
+	out << "  \"fill\": {\"mean\": " << meanFill << ", \"leaves\": [";
+	for(size_t i = 0; i < fill.size(); i++) {
+	    out << (i ? ", " : "") << fill[i];
+	}
+	out << "]},\n";
+	out << "  \"density\": ";
+	density.writeJson(out);
+	out << ",\n  \"aspect\": ";
+	aspect.writeJson(out);
+	out << ",\n  \"degenerateCells\": " << degenerateCells << ",\n";
+	out << "  \"memory\": {\"inner\": " << innerBytes << ", \"leaves\": " << leafBytes
+		<< ", \"buckets\": " << bucketBytes << ", \"codes\": " << codeBytes
+		<< ", \"tree\": " << treeBytes() << ", \"points\": " << pointBytes << "},\n";
+	out << "  \"needsRebuild\": " << (needsRebuild() ? "true" : "false") << "\n";
+	out << "}\n";
+    }
+};
+
+#endif	/* TREEREPORT_H */
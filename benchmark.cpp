@@ -0,0 +1,856 @@
+/*
+ * File:   benchmark.cpp
+ * Author: Daniel Princ
+ *
+ * Benchmark suite of the KDTree: build, insert, NN, kNN, radius and
+ * ply loading over data sizes, dimensions and distributions.
+ * Data and queries are generated from a fixed seed, so two runs
+ * measure the same work. Build with "make bench".
+ * 
+ * With --perf it runs every query type once more with the hardware
+ * counters (PerfCounters) and prints cycles, instructions, cache and
+ * branch misses per query next to the number of tested points.
+ * 
+ * With --check it compares the queries with brute force search 
+ * for D = 2..16 instead (see QueryCheck), the exit code is 1 on errors.
+ *
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <memory>
+#include <dirent.h>
+#include "Benchmark.h"
+#include "QueryCheck.h"
+#include "PlyHandler.h"
+#include "PointCloudGenerator.h"
+#include "PerfCounters.h"
+#include "KDTree.h"
+#include "KNNGraph.h"
+#include "DualTree.h"
+#include "NeighborIterator.h"
+#include "ShardedTree.h"
+#include "Downsample.h"
+#include "PointOrder.h"
+#include "TreeReport.h"
+
+using namespace std;
+
+/**
+ * What to run, set from the command line
+ */
+struct Options {
+    BenchConfig config;
+    vector<size_t> sizes;
+    vector<int> dims;
+    vector<string> distributions;
+    vector<string> ops;
+    /** node layouts the queries run on: build, dfs, veb */
+    vector<string> layouts;
+    /** thread counts of the sharded index (one shard per thread) and of the generator,
+     *  all cores unless a scaling curve is asked for with --threads */
+    vector<int> threads;
+    /** number of queries of every type */
+    int queries;
+    /** k of kNN queries */
+    int k;
+    /** ply file or folder with real data, used as another distribution */
+    string ply;
+    /** folder for the temporary ply files of the load benchmark */
+    string tmp;
+    /** JSON output file */
+    string json;
+    /** compare with brute force instead of benchmarking */
+    bool check;
+    /** count hardware events of the queries */
+    bool perf;
+
+    Options() : queries(10000), k(10), tmp("/tmp/"), check(false), perf(false) {
+	sizes.push_back(10000);
+	sizes.push_back(100000);
+	sizes.push_back(1000000);
+	dims.push_back(2);
+	dims.push_back(3);
+	dims.push_back(8);
+	distributions = PointCloudGen<>::distributions();
+	const char *all[] = {"generate", "build", "rebuild", "destroy", "insert", "nn", "nn-root",
+	    "nn-simple", "nn-walk", "nn-cursor", "nn-outlier", "nn-bounded", "nn-coords",
+	    "nn-indexed", "nn-quantized", "nn-double", "nn-int32", "nn-manhattan", "nn-chebyshev",
+	    "nn-weighted", "knn", "knn-browse",
+	    "radius", "radius-root", "knn-graph", "nn-join", "knn-join", "radius-join",
+	    "order-morton", "order-hilbert", "order-leaves", "nn-stream", "nn-random", "voxel-grid",
+	    "radius-merge", "poisson-disk", "shard-build", "shard-nn", "shard-knn", "load"};
+	ops.assign(all, all + sizeof(all) / sizeof(all[0]));
+	layouts.push_back("build");
+	threads.push_back(max(1u, thread::hardware_concurrency()));
+    }
+
+    bool runs(const string &op) const {
+	return find(ops.begin(), ops.end(), op) != ops.end();
+    }
+};
+
+/**
+ * Splits comma separated list
+ */
+static vector<string> split(const string &list) {
+    vector<string> result;
+    stringstream ss(list);
+    string item;
+    while(getline(ss, item, ',')) {
+	if(!item.empty()) result.push_back(item);
+    }
+    return result;
+}
+
+/**
+ * Loads the real data, a single ply file or all files in a folder
+ */
+template<const int D>
+static vector< Point<D> > loadReal(const string &path) {
+    vector< Point<D> > points;
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(path.c_str())) != NULL) {
+	while ((ent = readdir (dir)) != NULL) {
+	    if(strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+		vector< Point<D> > temp = PlyHandler::load<D>(path + "/" + ent->d_name);
+		points.insert(points.end(), temp.begin(), temp.end());
+	    }
+	}
+	closedir (dir);
+    }
+    else {
+	points = PlyHandler::load<D>(path);
+    }
+    return points;
+}
+
+/**
+ * Radius with roughly k points inside, averaged over a few queries
+ */
+template<const int D>
+static float estimateRadius(KDTree<D> &tree, vector< Point<D> > &points, const vector<size_t> &queries, int k) {
+    double sum = 0;
+    int count = min((int) queries.size(), 100);
+    for(int i = 0; i < count; i++) {
+	const Point<D> *q = &points[queries[i]];
+	vector< Point<D> *> knn = tree.kNearestNeighbors(q, k);
+	if(knn.empty()) continue;
+	double dist = 0;
+	for(int d = 0; d < D; d++) {
+	    double tmp = (*knn.back())[d] - (*q)[d];
+	    dist += tmp*tmp;
+	}
+	sum += sqrt(dist);
+    }
+    return count > 0 ? sum / count : 0;
+}
+
+/**
+ * Memory of the tree and of the points it refers to, per point
+ */
+template<typename Tree>
+static double bytesPerPoint(const Tree &tree) {
+    TreeReport report = TreeReport::analyze(tree);
+    return report.points ? (double) (report.treeBytes() + report.pointBytes) / report.points : 0;
+}
+
+/**
+ * Copies the coordinates to another point type (Coords, other scalars)
+ * @param scale the coordinates are multiplied by it (fixed point integers)
+ */
+template<typename Q, const int D>
+static vector<Q> convert(const vector< Point<D> > &points, double scale = 1) {
+    typedef typename Q::value_type T;
+    vector<Q> converted(points.size());
+    for(size_t i = 0; i < points.size(); i++) {
+	for(int d = 0; d < D; d++) converted[i][d] = (T) (points[i][d] * scale);
+    }
+    return converted;
+}
+
+/**
+ * NN queries of another variant of the tree (point type, references),
+ * with its bytes per point, compare with nn
+ */
+template<typename Tree>
+static void runVariant(Benchmark &bench, const string &op, const string &distribution,
+	vector<typename Tree::point> &points, const vector<size_t> &queries) {
+    Tree tree;
+    tree.construct(&points);
+    BenchResult &result = bench.measureOps(op, distribution, Tree::dimensions, points.size(), 0, queries.size(),
+	    [&](size_t i) { return (size_t) tree.nearestNeighbor(&points[queries[i]]); });
+    result.bytesPerPoint = bytesPerPoint(tree);
+    Benchmark::printRow(cout, result);
+}
+
+/**
+ * NN queries of a tree with another metric, compare with nn
+ */
+template<typename Tree>
+static void runMetric(Benchmark &bench, const string &op, const string &distribution,
+	vector<typename Tree::point> &points, const vector<size_t> &queries,
+	const typename Tree::metric_t &metric = typename Tree::metric_t()) {
+    Tree tree;
+    tree.setMetric(metric);
+    tree.construct(&points);
+    Benchmark::printRow(cout, bench.measureOps(op, distribution, Tree::dimensions, points.size(), 0, queries.size(),
+	    [&](size_t i) { return (size_t) tree.nearestNeighbor(&points[queries[i]]); }));
+}
+
+/** results of the counted queries go here, so they can't be optimized out */
+static volatile size_t perfSink = 0;
+
+/**
+ * The hardware counters, opened on the first call
+ * @return NULL if they are not available
+ */
+static PerfCounters *perfCounters() {
+    static PerfCounters perf;
+    static bool opened = false, available = false;
+    if(!opened) {
+	opened = true;
+	available = perf.open();
+	if(!available)
+	    cerr << "hardware counters are not available (not Linux, no PMU in a VM, or perf_event_paranoid too high)\n";
+    }
+    return available ? &perf : NULL;
+}
+
+/**
+ * Hardware events of one query type
+ */
+struct PerfRow {
+    string op;
+    PerfSample sample;
+    size_t queries;
+    /** points tested by all queries */
+    uint64_t points;
+};
+
+/**
+ * One untimed pass over the queries with the hardware counters running,
+ * the counters are read once for the whole pass
+ * @param op called with the query index, returns anything derived from the result
+ */
+template<typename Tree, typename Op>
+static void countEvents(vector<PerfRow> &rows, const string &name, Tree &tree, size_t count, Op op) {
+    PerfCounters *perf = perfCounters();
+    if(!perf)
+	return;
+    PerfRow row;
+    row.op = name;
+    row.queries = count;
+    row.points = 0;
+    size_t s = 0;
+    perf->start();
+    for(size_t i = 0; i < count; i++) {
+	s += op(i);
+	row.points += tree.getVisitedNodes();
+    }
+    row.sample = perf->stop();
+    perfSink += s;
+    rows.push_back(row);
+}
+
+/**
+ * Node layout of the name used on the command line
+ * @return false for an unknown name
+ */
+static bool parseLayout(const string &name, NodeLayout &layout) {
+    if(name == "build") layout = LAYOUT_BUILD;
+    else if(name == "dfs") layout = LAYOUT_DFS;
+    else if(name == "veb") layout = LAYOUT_VEB;
+    else return false;
+    return true;
+}
+
+/**
+ * Reorders the points along the Morton or Hilbert curve ("input" keeps
+ * them), or moves them to the leaf order of the tree built on them
+ * @return the permutation, empty for "input"
+ */
+template<const int D>
+static vector<uint32_t> reorder(KDTree<D> &tree, vector< Point<D> > &points, const string &order) {
+    if(order == "leaves")
+	return PointOrder<D>::sortByLeaves(tree, points);
+    vector<uint32_t> perm;
+    if(order == "morton") perm = PointOrder<D>::morton(&points[0], points.size());
+    if(order == "hilbert") perm = PointOrder<D>::hilbert(&points[0], points.size());
+    if(!perm.empty()) PointOrder<D>::apply(points, perm);
+    return perm;
+}
+
+/**
+ * Runs all selected operations on one data set
+ */
+template<const int D>
+static void runDataSet(Benchmark &bench, const Options &opt, const string &distribution,
+	vector< Point<D> > &points) {
+    const size_t size = points.size();
+    if(size == 0)
+	return;
+
+    mt19937 engine(opt.config.seed);
+    uniform_int_distribution<size_t> pick(0, size - 1);
+    vector<size_t> queries(opt.queries);
+    for(size_t i = 0; i < queries.size(); i++) {
+	queries[i] = pick(engine);
+    }
+
+    if(opt.runs("build")) {
+	unique_ptr< KDTree<D> > built;
+	Benchmark::printRow(cout, bench.measureRuns("build", distribution, D, size, 0, size,
+		[&]() { built.reset(); },
+		[&]() { built.reset(new KDTree<D>()); built->construct(&points); return built->size(); }));
+    }
+
+    //construct again on the same tree, the nodes reuse its arena
+    if(opt.runs("rebuild")) {
+	KDTree<D> rebuilt;
+	rebuilt.construct(&points);
+	Benchmark::printRow(cout, bench.measureRuns("rebuild", distribution, D, size, 0, size,
+		[]() {},
+		[&]() { rebuilt.construct(&points); return rebuilt.size(); }));
+    }
+
+    if(opt.runs("destroy")) {
+	unique_ptr< KDTree<D> > destroyed;
+	Benchmark::printRow(cout, bench.measureRuns("destroy", distribution, D, size, 0, size,
+		[&]() { destroyed.reset(new KDTree<D>()); destroyed->construct(&points); },
+		[&]() { destroyed.reset(); return (size_t) 0; }));
+    }
+
+    if(opt.runs("insert")) {
+	unique_ptr< KDTree<D> > grown;
+	Benchmark::printRow(cout, bench.measureOps("insert", distribution, D, size, 0, size,
+		[&]() { grown.reset(new KDTree<D>()); },
+		[&](size_t i) { grown->insert(&points[i]); return (size_t) 0; }));
+    }
+
+    if(opt.runs("load") && D <= 3) {
+	string file = opt.tmp + "kdtree-bench-" + distribution + "-" + to_string(D)
+		+ "-" + to_string(size) + ".ply";
+	PlyHandler::savePoints<D>(file, points, false);
+	Benchmark::printRow(cout, bench.measureRuns("load", distribution, D, size, 0, size,
+		[]() {},
+		[&]() { return PlyHandler::load<D>(file, false).size(); }));
+	remove(file.c_str());
+    }
+
+    //kNN of every point at once, compare the throughput with knn
+    if(opt.runs("knn-graph")) {
+	KDTree<D> tree;
+	tree.construct(&points);
+	const int k = opt.k;
+	Benchmark::printRow(cout, bench.measureRuns("knn-graph", distribution, D, size, k, size,
+		[]() {},
+		[&]() { return KNNGraph< KDTree<D> >::build(tree, &points[0], k).neighbors.size(); }));
+    }
+
+    //compact points and 32-bit indices, compare with nn
+    if(opt.runs("nn-coords")) {
+	vector< Coords<D> > coords = convert< Coords<D> >(points);
+	runVariant< KDTree<D, Coords<D> > >(bench, "nn-coords", distribution, coords, queries);
+    }
+    if(opt.runs("nn-indexed"))
+	runVariant< KDTree<D, Point<D>, true> >(bench, "nn-indexed", distribution, points, queries);
+    //8-bit codes of the leaves, double and fixed point (2^-20) coordinates
+    if(opt.runs("nn-quantized"))
+	runVariant< KDTree<D, Point<D>, false, true> >(bench, "nn-quantized", distribution, points, queries);
+    if(opt.runs("nn-double")) {
+	vector< Coords<D, double> > precise = convert< Coords<D, double> >(points);
+	runVariant< KDTree<D, Coords<D, double> > >(bench, "nn-double", distribution, precise, queries);
+    }
+    if(opt.runs("nn-int32")) {
+	vector< Coords<D, int32_t> > fixed = convert< Coords<D, int32_t> >(points, 1 << 20);
+	runVariant< KDTree<D, Coords<D, int32_t> > >(bench, "nn-int32", distribution, fixed, queries);
+    }
+
+    if(opt.runs("nn-manhattan"))
+	runMetric< KDTree<D, Point<D>, false, false, 10, Manhattan> >(bench, "nn-manhattan", distribution, points, queries);
+    if(opt.runs("nn-chebyshev"))
+	runMetric< KDTree<D, Point<D>, false, false, 10, Chebyshev> >(bench, "nn-chebyshev", distribution, points, queries);
+    if(opt.runs("nn-weighted")) {
+	double weights[D];
+	for(int d = 0; d < D; d++) weights[d] = d % 2 ? 4 : 0.25;
+	runMetric< KDTree<D, Point<D>, false, false, 10, Weighted<D> > >(bench, "nn-weighted", distribution, points, queries,
+		Weighted<D>(weights));
+    }
+
+    //joins with another scan of the same distribution, compare with nn, knn and radius
+    if(opt.runs("nn-join") || opt.runs("knn-join") || opt.runs("radius-join")) {
+	vector< Point<D> > scan = PointCloudGen<D>::generate(distribution, size, opt.config.seed + 1);
+	KDTree<D> tree, scanTree;
+	tree.construct(&points);
+	scanTree.construct(&scan);
+	typedef DualTree< KDTree<D> > join_t;
+	const int k = opt.k;
+	if(opt.runs("nn-join")) {
+	    Benchmark::printRow(cout, bench.measureRuns("nn-join", distribution, D, size, 0, size,
+		    []() {},
+		    [&]() { return join_t::nearest(scanTree, &scan[0], tree, &points[0]).neighbors.size(); }));
+	}
+	if(opt.runs("knn-join")) {
+	    Benchmark::printRow(cout, bench.measureRuns("knn-join", distribution, D, size, k, size,
+		    []() {},
+		    [&]() { return join_t::kNearest(scanTree, &scan[0], tree, &points[0], k).neighbors.size(); }));
+	}
+	if(opt.runs("radius-join")) {
+	    const float radius = estimateRadius(tree, points, queries, k);
+	    Benchmark::printRow(cout, bench.measureRuns("radius-join", distribution, D, size, radius, size,
+		    []() {},
+		    [&]() { return join_t::radius(scanTree, &scan[0], tree, &points[0], radius).neighbors.size(); }));
+	}
+    }
+
+    //downsampling of the whole cloud, voxels and disks of about k points
+    if(opt.runs("voxel-grid") || opt.runs("radius-merge") || opt.runs("poisson-disk")) {
+	KDTree<D> tree;
+	tree.construct(&points);
+	typedef Downsample< KDTree<D> > sample_t;
+	const float radius = estimateRadius(tree, points, queries, opt.k);
+	if(opt.runs("voxel-grid")) {
+	    //a cube with the volume of the ball
+	    const double edge = radius * pow(pow(M_PI, D / 2.0) / tgamma(D / 2.0 + 1), 1.0 / D);
+	    Benchmark::printRow(cout, bench.measureRuns("voxel-grid", distribution, D, size, edge, size,
+		    []() {},
+		    [&]() { return sample_t::voxelGrid(tree, edge).size(); }));
+	}
+	if(opt.runs("radius-merge")) {
+	    Benchmark::printRow(cout, bench.measureRuns("radius-merge", distribution, D, size, radius, size,
+		    []() {},
+		    [&]() { return sample_t::radiusMerge(tree, radius).size(); }));
+	}
+	if(opt.runs("poisson-disk")) {
+	    Benchmark::printRow(cout, bench.measureRuns("poisson-disk", distribution, D, size, radius, size,
+		    []() {},
+		    [&]() { return sample_t::poissonDisk(tree, radius).size(); }));
+	}
+    }
+
+    //the points in the input, Morton, Hilbert and leaf order: the time of the reordering,
+    //NN of a stream of points in the array order and of the random queries (compare with nn)
+    if(opt.runs("order-morton") || opt.runs("order-hilbert") || opt.runs("order-leaves")
+	    || opt.runs("nn-stream") || opt.runs("nn-random")) {
+	vector< Point<D> > qs;
+	for(size_t i = 0; i < queries.size(); i++) qs.push_back(points[queries[i]]);
+	const size_t stream = min(queries.size(), size);
+	const char *orders[] = {"input", "morton", "hilbert", "leaves"};
+	for(int o = 0; o < 4; o++) {
+	    const string order = orders[o];
+	    vector< Point<D> > ordered;
+	    KDTree<D> tree;
+	    auto prepare = [&]() {
+		ordered = points;
+		if(order == "leaves") tree.construct(&ordered);
+	    };
+	    auto run = [&]() { return reorder(tree, ordered, order).size(); };
+	    if(o > 0 && opt.runs("order-" + order)) {
+		Benchmark::printRow(cout, bench.measureRuns("order-" + order, distribution, D, size, 0, size, prepare, run));
+	    }
+	    else {
+		prepare();
+		run();
+	    }
+	    if(order != "leaves") tree.construct(&ordered);
+	    if(opt.runs("nn-stream")) {
+		Benchmark::printRow(cout, bench.measureOps("nn-stream/" + order, distribution, D, size, 0, stream,
+			[&](size_t i) { return (size_t) tree.nearestNeighbor(&ordered[i]); }));
+	    }
+	    if(opt.runs("nn-random")) {
+		Benchmark::printRow(cout, bench.measureOps("nn-random/" + order, distribution, D, size, 0, qs.size(),
+			[&](size_t i) { return (size_t) tree.nearestNeighbor(&qs[i]); }));
+	    }
+	}
+    }
+
+    //scaling of the sharded index, compare with build, nn and knn
+    if(opt.runs("shard-build") || opt.runs("shard-nn") || opt.runs("shard-knn")) {
+	vector< Point<D> > qs;
+	for(size_t i = 0; i < queries.size(); i++) qs.push_back(points[queries[i]]);
+	const int k = opt.k;
+	for(size_t t = 0; t < opt.threads.size(); t++) {
+	    const int threads = opt.threads[t];
+	    const string suffix = "/" + to_string(threads);
+	    unique_ptr< ShardedTree< KDTree<D> > > index;
+	    if(opt.runs("shard-build")) {
+		Benchmark::printRow(cout, bench.measureRuns("shard-build" + suffix, distribution, D, size, threads, size,
+			[&]() { index.reset(new ShardedTree< KDTree<D> >()); },
+			[&]() { index->build(&points[0], size, threads, threads); return (size_t) index->size(); }));
+	    }
+	    if(!opt.runs("shard-nn") && !opt.runs("shard-knn"))
+		continue;
+	    if(!index) {
+		index.reset(new ShardedTree< KDTree<D> >());
+		index->build(&points[0], size, threads, threads);
+	    }
+	    if(opt.runs("shard-nn")) {
+		Benchmark::printRow(cout, bench.measureRuns("shard-nn" + suffix, distribution, D, size, threads, qs.size(),
+			[]() {},
+			[&]() { return index->nearestNeighbors(&qs[0], qs.size()).size(); }));
+	    }
+	    if(opt.runs("shard-knn")) {
+		Benchmark::printRow(cout, bench.measureRuns("shard-knn" + suffix, distribution, D, size, threads, qs.size(),
+			[]() {},
+			[&]() { return index->kNearestNeighbors(&qs[0], qs.size(), k).size(); }));
+	    }
+	}
+    }
+
+    bool queryOps = opt.runs("nn") || opt.runs("nn-root") || opt.runs("nn-simple") || opt.runs("nn-walk")
+	    || opt.runs("nn-cursor") || opt.runs("nn-outlier") || opt.runs("nn-bounded") || opt.runs("knn") || opt.runs("knn-browse") || opt.runs("radius")
+	    || opt.runs("radius-root");
+    if(!queryOps)
+	return;
+    KDTree<D> tree;
+    tree.construct(&points);
+    const float radius = opt.runs("radius") || opt.runs("radius-root") ? estimateRadius(tree, points, queries, opt.k) : 0;
+    typename KDTree<D>::descent_t scratch;
+    vector<PerfRow> perf;
+
+    //smooth random walk for the query streams, steps of about a quarter
+    //of the NN distance, it bounces off the bounding box of the data
+    vector< Point<D> > walk;
+    if(opt.runs("nn-walk") || opt.runs("nn-cursor")) {
+	mt19937 walkEngine(opt.config.seed + 2);
+	normal_distribution<float> noise(0, estimateRadius(tree, points, queries, 1) / 4);
+	const float *box = tree.getBoundingBox();
+	Point<D> p = points[queries[0]];
+	float velocity[D] = {0};
+	for(size_t i = 0; i < queries.size(); i++) {
+	    for(int d = 0; d < D; d++) {
+		velocity[d] = 0.9f * velocity[d] + 0.5f * noise(walkEngine);
+		p[d] += velocity[d];
+		if(p[d] < box[2*d] || p[d] > box[2*d + 1]) {
+		    velocity[d] = -velocity[d];
+		    p[d] = min(max(p[d], box[2*d]), box[2*d + 1]);
+		}
+	    }
+	    walk.push_back(p);
+	}
+    }
+
+    //outliers: uniform in the bounding box grown by half of it on every side,
+    //the bounded queries give up beyond a few NN distances of the data
+    vector< Point<D> > outliers;
+    float maxDist = 0;
+    if(opt.runs("nn-outlier") || opt.runs("nn-bounded")) {
+	mt19937 outlierEngine(opt.config.seed + 3);
+	const float *box = tree.getBoundingBox();
+	for(size_t i = 0; i < queries.size(); i++) {
+	    Point<D> p;
+	    for(int d = 0; d < D; d++) {
+		const float extent = box[2*d + 1] - box[2*d];
+		p[d] = uniform_real_distribution<float>(box[2*d] - extent / 2, box[2*d + 1] + extent / 2)(outlierEngine);
+	    }
+	    outliers.push_back(p);
+	}
+	maxDist = 4 * estimateRadius(tree, points, queries, 1);
+    }
+
+    //the same queries on every node layout, "nn-veb" etc.
+    for(vector<string>::const_iterator l = opt.layouts.begin(); l != opt.layouts.end(); ++l) {
+	NodeLayout layout = LAYOUT_BUILD;
+	parseLayout(*l, layout);
+	if(!tree.layout(layout))
+	    continue;
+	const string suffix = layout == LAYOUT_BUILD ? "" : "-" + *l;
+
+	if(opt.runs("nn")) {
+	    auto op = [&](size_t i) { return (size_t) tree.nearestNeighbor(&points[queries[i]]); };
+	    BenchResult &result = bench.measureOps("nn" + suffix, distribution, D, size, 0, queries.size(), op);
+	    result.bytesPerPoint = bytesPerPoint(tree);
+	    Benchmark::printRow(cout, result);
+	    if(opt.perf) countEvents(perf, "nn" + suffix, tree, queries.size(), op);
+	}
+
+	if(opt.runs("nn-root")) {
+	    auto op = [&](size_t i) { return (size_t) tree.nearestNeighbor(&points[queries[i]], scratch); };
+	    Benchmark::printRow(cout, bench.measureOps("nn-root" + suffix, distribution, D, size, 0, queries.size(), op));
+	    if(opt.perf) countEvents(perf, "nn-root" + suffix, tree, queries.size(), op);
+	}
+
+	if(opt.runs("nn-simple")) {
+	    auto op = [&](size_t i) { return (size_t) tree.simpleNearestNeighbor(&points[queries[i]]); };
+	    Benchmark::printRow(cout, bench.measureOps("nn-simple" + suffix, distribution, D, size, 0, queries.size(), op));
+	    if(opt.perf) countEvents(perf, "nn-simple" + suffix, tree, queries.size(), op);
+	}
+
+	if(opt.runs("nn-walk")) {
+	    auto op = [&](size_t i) { return (size_t) tree.nearestNeighbor(&walk[i]); };
+	    Benchmark::printRow(cout, bench.measureOps("nn-walk" + suffix, distribution, D, size, 0, walk.size(), op));
+	    if(opt.perf) countEvents(perf, "nn-walk" + suffix, tree, walk.size(), op);
+	}
+
+	if(opt.runs("nn-cursor")) {
+	    typename KDTree<D>::cursor_t cursor;
+	    auto op = [&](size_t i) { return (size_t) tree.nearestNeighbor(&walk[i], cursor); };
+	    Benchmark::printRow(cout, bench.measureOps("nn-cursor" + suffix, distribution, D, size, 0, walk.size(), op));
+	    if(opt.perf) countEvents(perf, "nn-cursor" + suffix, tree, walk.size(), op);
+	}
+
+	if(opt.runs("nn-outlier")) {
+	    auto op = [&](size_t i) { return (size_t) tree.nearestNeighbor(&outliers[i]); };
+	    Benchmark::printRow(cout, bench.measureOps("nn-outlier" + suffix, distribution, D, size, 0, outliers.size(), op));
+	    if(opt.perf) countEvents(perf, "nn-outlier" + suffix, tree, outliers.size(), op);
+	}
+
+	if(opt.runs("nn-bounded")) {
+	    auto op = [&](size_t i) { return (size_t) tree.nearestNeighbor(&outliers[i], KDTree<D>::none(), maxDist); };
+	    Benchmark::printRow(cout, bench.measureOps("nn-bounded" + suffix, distribution, D, size, maxDist, outliers.size(), op));
+	    if(opt.perf) countEvents(perf, "nn-bounded" + suffix, tree, outliers.size(), op);
+	}
+
+	if(opt.runs("knn")) {
+	    const int k = opt.k;
+	    auto op = [&](size_t i) { return tree.kNearestNeighbors(&points[queries[i]], k).size(); };
+	    Benchmark::printRow(cout, bench.measureOps("knn" + suffix, distribution, D, size, k, queries.size(), op));
+	    if(opt.perf) countEvents(perf, "knn" + suffix, tree, queries.size(), op);
+	}
+
+	if(opt.runs("knn-browse")) {
+	    const int k = opt.k;
+	    NeighborIterator< KDTree<D> > browse;
+	    auto op = [&](size_t i) {
+		browse.reset(tree, &points[queries[i]]);
+		Point<D> *next;
+		int n = 0;
+		while(n < k && browse.next(next)) n++;
+		return (size_t) n;
+	    };
+	    Benchmark::printRow(cout, bench.measureOps("knn-browse" + suffix, distribution, D, size, k, queries.size(), op));
+	    if(opt.perf) countEvents(perf, "knn-browse" + suffix, tree, queries.size(), op);
+	}
+
+	if(opt.runs("radius")) {
+	    auto op = [&](size_t i) { return tree.circularQuery(&points[queries[i]], radius).size(); };
+	    Benchmark::printRow(cout, bench.measureOps("radius" + suffix, distribution, D, size, radius, queries.size(), op));
+	    if(opt.perf) countEvents(perf, "radius" + suffix, tree, queries.size(), op);
+	}
+
+	if(opt.runs("radius-root")) {
+	    auto op = [&](size_t i) { return tree.circularQuery(&points[queries[i]], radius, scratch).size(); };
+	    Benchmark::printRow(cout, bench.measureOps("radius-root" + suffix, distribution, D, size, radius, queries.size(), op));
+	    if(opt.perf) countEvents(perf, "radius-root" + suffix, tree, queries.size(), op);
+	}
+    }
+
+    if(!perf.empty()) {
+	cout << "per query:\n";
+	PerfCounters::printHeader(cout);
+	for(size_t i = 0; i < perf.size(); i++) {
+	    PerfCounters::printRow(cout, perf[i].op, distribution, D, size, perf[i].sample,
+		    perf[i].queries, perf[i].points);
+	}
+    }
+
+#ifdef KDTREE_STATS
+    tree.getStats().print(cout);
+#endif
+}
+
+/**
+ * Runs all data sets of dimension D
+ */
+template<const int D>
+static void runDimension(Benchmark &bench, const Options &opt) {
+    for(vector<string>::const_iterator dist = opt.distributions.begin(); dist != opt.distributions.end(); ++dist) {
+	for(vector<size_t>::const_iterator size = opt.sizes.begin(); size != opt.sizes.end(); ++size) {
+	    //the same seed on every thread count, the points don't depend on it
+	    for(size_t t = 0; opt.runs("generate") && t < opt.threads.size(); t++) {
+		const int threads = opt.threads[t];
+		Benchmark::printRow(cout, bench.measureRuns("generate/" + to_string(threads), *dist, D, *size, threads, *size,
+			[]() {},
+			[&]() { return PointCloudGen<D>::generate(*dist, *size, opt.config.seed, threads).size(); }));
+	    }
+	    vector< Point<D> > points = PointCloudGen<D>::generate(*dist, *size, opt.config.seed);
+	    runDataSet<D>(bench, opt, *dist, points);
+	}
+    }
+    if(!opt.ply.empty() && D <= 3) {
+	vector< Point<D> > points = loadReal<D>(opt.ply);
+	if(points.empty())
+	    cerr << "no points loaded from " << opt.ply << "\n";
+	runDataSet<D>(bench, opt, "ply", points);
+    }
+}
+
+/**
+ * Compares the queries with brute force for dimensions First..Last
+ */
+template<const int First, const int Last>
+struct CheckDimensions {
+    static bool run(const Options &opt) {
+	bool ok = QueryCheck<First>::report(cout, QueryCheck<First>::run(5000, 200, opt.k, opt.config.seed));
+	return CheckDimensions<First + 1, Last>::run(opt) && ok;
+    }
+};
+
+template<const int Last>
+struct CheckDimensions<Last, Last> {
+    static bool run(const Options &opt) {
+	return QueryCheck<Last>::report(cout, QueryCheck<Last>::run(5000, 200, opt.k, opt.config.seed));
+    }
+};
+
+/**
+ * Brute force check of all dimensions and of the other tree variants
+ */
+static bool runCheck(const Options &opt) {
+    bool ok = CheckDimensions<2, 16>::run(opt);
+    cout << "indexed:\n";
+    ok = QueryCheck<3>::report(cout, QueryCheck<3>::run< KDTree<3, Point<3>, true> >(5000, 200, opt.k, opt.config.seed)) && ok;
+    cout << "quantized leaves:\n";
+    ok = QueryCheck<3>::report(cout, QueryCheck<3>::run< KDTree<3, Point<3>, false, true> >(5000, 200, opt.k, opt.config.seed)) && ok;
+    cout << "compact points, bucket size 32:\n";
+    ok = QueryCheck<3, Coords<3> >::report(cout, 
+	    QueryCheck<3, Coords<3> >::run< KDTree<3, Coords<3>, false, false, 32> >(5000, 200, opt.k, opt.config.seed)) && ok;
+    cout << "van Emde Boas node layout:\n";
+    ok = QueryCheck<3>::report(cout, QueryCheck<3>::run(5000, 200, opt.k, opt.config.seed, LAYOUT_VEB)) && ok;
+    cout << "Manhattan metric:\n";
+    ok = QueryCheck<3, Point<3>, Manhattan>::report(cout, QueryCheck<3, Point<3>, Manhattan>::run<
+	    KDTree<3, Point<3>, false, false, 10, Manhattan> >(5000, 200, opt.k, opt.config.seed)) && ok;
+    cout << "Chebyshev metric, quantized leaves:\n";
+    ok = QueryCheck<3, Point<3>, Chebyshev>::report(cout, QueryCheck<3, Point<3>, Chebyshev>::run<
+	    KDTree<3, Point<3>, false, true, 10, Chebyshev> >(5000, 200, opt.k, opt.config.seed)) && ok;
+    cout << "weighted metric (diagonal Mahalanobis):\n";
+    const double variances[3] = {1, 0.04, 9};
+    ok = QueryCheck<3, Point<3>, Weighted<3> >::report(cout, QueryCheck<3, Point<3>, Weighted<3> >::run<
+	    KDTree<3, Point<3>, false, false, 10, Weighted<3> > >(5000, 200, opt.k, opt.config.seed,
+	    LAYOUT_BUILD, Weighted<3>::mahalanobis(variances))) && ok;
+    cout << (ok ? "all queries are correct\n" : "there are some errors\n");
+    return ok;
+}
+
+static void usage(const char *name) {
+    cerr << "usage: " << name << " [options]\n"
+	    << "  --check            compare queries with brute force for D = 2..16\n"
+	    << "  --perf             hardware counters (cycles, cache and branch misses) per query\n"
+	    << "  --quick            sizes 10000,100000, 3 repetitions\n"
+	    << "  --sizes N,N,...    data sizes (10000,100000,1000000)\n"
+	    << "  --dims D,D,...     dimensions, 2, 3 and 8 are compiled in (2,3,8)\n"
+	    << "  --dists A,B,...    uniform, gauss, clustered, planes, sphere, strips,\n"
+	    << "                     duplicates (all)\n"
+	    << "  --ops A,B,...      generate (PointCloudGen for every --threads), build,\n"
+	    << "                     rebuild, destroy, insert, nn, nn-root, nn-simple,\n"
+	    << "                     nn-walk (random walk queries), nn-cursor (the same with\n"
+	    << "                     a cursor), nn-outlier (queries far from the data),\n"
+	    << "                     nn-bounded (the same with a largest NN distance),\n"
+	    << "                     nn-coords, nn-indexed (compact points, 32-bit indices),\n"
+	    << "                     nn-quantized (8-bit leaf codes), nn-double, nn-int32,\n"
+	    << "                     nn-manhattan, nn-chebyshev, nn-weighted (NN in\n"
+	    << "                     the other metrics), knn, knn-browse (kNN pulled from a\n"
+	    << "                     NeighborIterator), radius, radius-root, knn-graph,\n"
+	    << "                     nn-join, knn-join, radius-join, order-morton,\n"
+	    << "                     order-hilbert, order-leaves (PointOrder), nn-stream\n"
+	    << "                     (NN of the points in the array order), nn-random\n"
+	    << "                     (the nn queries) in every order, voxel-grid, radius-merge,\n"
+	    << "                     poisson-disk (Downsample, about k points per result point),\n"
+	    << "                     shard-build, shard-nn,\n"
+	    << "                     shard-knn (ShardedTree for every --threads), load (all)\n"
+	    << "  --layouts A,B,...  node layouts of the queries: build, dfs, veb (build)\n"
+	    << "  --threads N,N,...  threads of the generator, threads (and shards) of the\n"
+	    << "                     sharded index, e.g. 1,2,4,...,64 (all cores)\n"
+	    << "  --ply PATH         real data (ply file or folder) as another data set\n"
+	    << "  --queries N        queries of every type (10000)\n"
+	    << "  --k N              k of kNN queries and points in radius (10)\n"
+	    << "  --seed N           seed of data and queries (1)\n"
+	    << "  --warmup N         untimed passes (1)\n"
+	    << "  --reps N           timed passes (5)\n"
+	    << "  --tmp DIR          folder for temporary ply files (/tmp/)\n"
+	    << "  --json FILE        write results as JSON\n";
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for(int i = 1; i < argc; i++) {
+	string arg = argv[i];
+	if(arg == "--check") {
+	    opt.check = true;
+	    continue;
+	}
+	if(arg == "--perf") {
+	    opt.perf = true;
+	    continue;
+	}
+	if(arg == "--quick") {
+	    opt.sizes.resize(2);
+	    opt.config.repetitions = 3;
+	    continue;
+	}
+	if(arg == "--help" || i + 1 >= argc) {
+	    usage(argv[0]);
+	    return arg == "--help" ? 0 : 1;
+	}
+	string value = argv[++i];
+	if(arg == "--sizes") {
+	    opt.sizes.clear();
+	    vector<string> items = split(value);
+	    for(size_t j = 0; j < items.size(); j++) opt.sizes.push_back(atol(items[j].c_str()));
+	}
+	else if(arg == "--dims") {
+	    opt.dims.clear();
+	    vector<string> items = split(value);
+	    for(size_t j = 0; j < items.size(); j++) opt.dims.push_back(atoi(items[j].c_str()));
+	}
+	else if(arg == "--threads") {
+	    opt.threads.clear();
+	    vector<string> items = split(value);
+	    for(size_t j = 0; j < items.size(); j++) opt.threads.push_back(max(1, atoi(items[j].c_str())));
+	}
+	else if(arg == "--dists") opt.distributions = split(value);
+	else if(arg == "--ops") opt.ops = split(value);
+	else if(arg == "--layouts") {
+	    opt.layouts = split(value);
+	    NodeLayout layout;
+	    for(size_t j = 0; j < opt.layouts.size(); j++) {
+		if(!parseLayout(opt.layouts[j], layout)) {
+		    cerr << "unknown layout " << opt.layouts[j] << "\n";
+		    return 1;
+		}
+	    }
+	}
+	else if(arg == "--ply") opt.ply = value;
+	else if(arg == "--queries") opt.queries = atoi(value.c_str());
+	else if(arg == "--k") opt.k = atoi(value.c_str());
+	else if(arg == "--seed") opt.config.seed = atol(value.c_str());
+	else if(arg == "--warmup") opt.config.warmup = atoi(value.c_str());
+	else if(arg == "--reps") opt.config.repetitions = atoi(value.c_str());
+	else if(arg == "--tmp") opt.tmp = value + "/";
+	else if(arg == "--json") opt.json = value;
+	else {
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+
+    if(opt.check)
+	return runCheck(opt) ? 0 : 1;
+
+    Benchmark bench(opt.config);
+    Benchmark::printHeader(cout);
+    for(vector<int>::iterator d = opt.dims.begin(); d != opt.dims.end(); ++d) {
+	switch(*d) {
+	    case 2: runDimension<2>(bench, opt); break;
+	    case 3: runDimension<3>(bench, opt); break;
+	    case 8: runDimension<8>(bench, opt); break;
+	    default: cerr << "dimension " << *d << " is not compiled in\n";
+	}
+    }
+
+    if(!opt.json.empty()) {
+	ofstream out(opt.json.c_str());
+	if(!out) {
+	    cerr << "can't write " << opt.json << "\n";
+	    return 1;
+	}
+	bench.writeJson(out);
+    }
+    return 0;
+}
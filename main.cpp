@@ -6,7 +6,6 @@
 
 #include <cstdlib>
 #include <iostream>
-#include <sys/time.h>
 #include <math.h>
 #include <sys/resource.h>
 #include <dirent.h>
@@ -14,8 +13,15 @@
 #include <random>
 #include "PointCloudGenerator.h"
 #include "PlyHandler.h"
+#include "PointCloud.h"
 #include "KDTree2Ply.h"
 #include "KDTree.h"
+#include "OutOfCoreKDTree.h"
+#include "BucketAutotune.h"
+#include "TreeReport.h"
+#include "QueryCheck.h"
+#include "PointOrder.h"
+#include "Downsample.h"
 
 using namespace std;
 
@@ -28,40 +34,50 @@ const string output_dir = "./";///home/jaa/.wine/drive_c/data/";
 /** distance calculations for naiveNN function*/
 const float distance(const Point<D> * p1, const Point<D>& p2);
 /** naive NN, search NN by iteration over all points */
-Point<D> * naiveNN(Point<D> * query, vector< Point<D> > *data);
-/** tests if kd-tree nearest neigbor returns the smae as naive NN */
+Point<D> * naiveNN(Point<D> * query, vector< Point<D> > *data, Exclusion e = EXCLUDE_ZERO, Point<D> *self = NULL);
+/** tests if kd-tree nearest neigbor returns the smae as naive NN, 
+ *  checks all queries against brute force (QueryCheck) */
 void testNNCorrectness(float * bounds);
 /** test if sliding midpoint works ok */
 void testSlidingMidPoint();
-/** compares optimized and simeple NN in kd-tree*/
-void compareNNandSimple();
 /** does circular query on data and prints data to output folder */
 void printCircularQuery(float * bounds);
 /** does kNearest query and prits data to output folder */
 void printKNearest();
 /** prints tree (colored buckets) + splitting lines */
 void printBuckets();
-/** runs a lot of circular queries for profiling */
-void runCircular(float * bounds);
-/** runs a lot of knn queries for profiling */
-void runKNN(float * bounds);
-/** runs a lot of nn queries for profiling */
-void runNN(float * bounds);
-/** compare time of NN search based on data distribution */
-void compareNNonDatasets(string path);
-/** counts the number of visited nodes per search */
+/** counts the number of tested points per search */
 void countVisitedNodes();
+/** prints traversal statistics of all query types, needs -DKDTREE_STATS */
+void printQueryStats();
 /** prints kNN on real data */
 void printKnnOnRealData();
+/** compares out-of-core tree with the in-memory one, prints cache statistics */
+void runOutOfCore();
+/** index based tree, points are moved after the construction */
+void runIndexed();
+/** memory of Point (with color) and compact Coords layout, the same NN on both */
+void compareLayouts();
+/** float, double and int32 coordinates far from origin, quantized leaves */
+void comparePrecision();
+/** finds the fastest bucket size for the data */
+void runAutotune();
+/** quality of trees built by construct and by inserting random and sorted points */
+void printTreeReport();
+/** serial and parallel generation of all distributions gives the same points, saves them to output folder */
+void generatePointClouds();
+/** memory locality of the buckets on points in random, Morton, Hilbert and leaf order,
+ *  the NN results stay the same */
+void comparePointOrders();
+/** voxel grid, radius merge and Poisson-disk sample of a dense cloud, 
+ *  how well they cover it, saves them to output folder */
+void printDownsample();
 
 
 int main(int argc, char *argv[]) {
     
     float bounds[2*5] = {0.f, 10.f, 0.f, 12.f, 0.f, 10.f, 1.f, 3.f, 3.f, 9.f};
     
-//    compareNNandSimple();
-//    compareNNonDatasets("/home/jaa/Dokumenty/FEL/BP/modely/stodulky/");
-//    
       printKNearest();
 //    printCircularQuery(bounds);
 //    printBuckets();
@@ -71,10 +87,17 @@ int main(int argc, char *argv[]) {
 //    testSlidingMidPoint();
 //    
 //    countVisitedNodes();
+//    printQueryStats();
 //    
-//    runNN(bounds);
-//    runCircular(bounds);
-//    runKNN(bounds);
+//    runOutOfCore();
+//    runIndexed();
+//    compareLayouts();
+//    comparePrecision();
+//    runAutotune();
+//    printTreeReport();
+//    generatePointClouds();
+//    comparePointOrders();
+//    printDownsample();
      
     return 0;
 }
@@ -113,100 +136,234 @@ void printKnnOnRealData() {
     
 }
 
-void countVisitedNodes() {
+void runOutOfCore() {
     const int size = 1000000;
-    const int count = 1000;
-   
+    const int count = 10000;
+    
     vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(size);
     KDTree<D> tree;
     tree.construct(&points);
     
-    int visited = 0;
+    //the input is written in parts, as a cloud larger than the memory would be
+    const string input = output_dir + "points.raw";
+    for(int i = 0; i < size; i += 100000) {
+	vector< Point<D> > part(points.begin() + i, points.begin() + min(size, i + 100000));
+	if(!OutOfCoreKDTree<D>::writePoints(part, input, i > 0))
+	    return;
+    }
+    
+    OutOfCoreKDTree<D> ooc(64); //64 blocks of 256 points in memory
+    ooc.setBuildPoints(200000); //the build splits the cloud through files
+    if(!ooc.construct(input, output_dir + "points.blocks")) 
+	return;
+    cout << "out-of-core tree: " << ooc.getBlockCount() << " blocks\n";
+    
+    int wrong = 0;
     for(int i = 0; i < count; i++) {
 	int n = rand() % size;
 	Point<D> *p = tree.nearestNeighbor(&points[n]);
-	//Point<D> *p = tree.simpleNearestNeighbor(&points[n]);
-	visited += tree.getVisitedNodes();
+	Point<D> q = ooc.nearestNeighbor(&points[n]);
+	if(distance(&points[n], *p) != distance(&points[n], q)) 
+	    wrong++;
     }
-        
-    cout << "NN visited node per search: " << visited / (float) count << "\n";
+    const CacheStats &stats = ooc.getCacheStats();
+    cout << "NN: " << wrong << " different results, cache hits: " << stats.hits 
+	    << ", misses: " << stats.misses << "\n";
     
+    ooc.resetCacheStats();
+    for(int i = 0; i < count; i++) {
+	int n = rand() % size;
+	vector< Point<D> > knn = ooc.kNearestNeighbors(&points[n], 50);
+    }
+    cout << "kNN: cache hits: " << ooc.getCacheStats().hits 
+	    << ", misses: " << ooc.getCacheStats().misses << "\n";
 }
 
-void compareNNonDatasets(string path) {
-    vector< Point<D> > points;
-    const int count  = 50000;
-        
-    struct timeval start, end;
-    long seconds, useconds;  
-    long time1, time2, time3;
+void runIndexed() {
+    const int size = 100000;
+    
+    vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(size);
+    KDTree<D> tree;
+    tree.construct(&points);
     
-    srand((unsigned)std::time(0)); 
+    KDTree<D, Point<D>, true> indexed;
+    indexed.construct(&points);
     
-    DIR *dir;
-    struct dirent *ent;
-    if ((dir = opendir(path.c_str())) != NULL) {
-	while ((ent = readdir (dir)) != NULL) {
-	    if(strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-		vector< Point<D> > temp = PlyHandler::load<D>(path + ent->d_name);
-		points.insert(points.end(), temp.begin(), temp.end());
-	    }
-	}
-	closedir (dir);
+    //the storage can move, only the tree has to be told
+    vector< Point<D> > moved(points);
+    indexed.rebase(&moved[0]);
+    
+    int wrong = 0;
+    for(int i = 0; i < size; i++) {
+	Point<D> *p = tree.nearestNeighbor(&points[i]);
+	uint32_t idx = indexed.nearestNeighbor(&moved[i]);
+	if(&moved[idx] - &moved[0] != p - &points[0]) 
+	    wrong++;
     }
+    cout << "indexed NN: " << wrong << " different results\n";
     
-    const int size = points.size();
-    cout << "size: " << size << "\n";
+    vector<uint32_t> knn = indexed.kNearestNeighbors(&moved[13], 20);
+    for(vector<uint32_t>::iterator it = knn.begin(); it != knn.end(); ++it) {
+	moved[*it].setColor(255, 255, 0);
+    }
+    cout << "indexed kNN: found " << knn.size() << " points\n";
+}
+
+void compareLayouts() {
+    const int size = 1000000;
     
-    KDTree<D> real;
-    real.construct(&points);
+    //NN time and bytes per point: the nn, nn-coords and nn-indexed ops of the benchmark
+    vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(size);
+    PointCloud<D> cloud = PointCloud<D>::fromPoints(points);
+    
+    KDTree<D> tree;
+    tree.construct(&points);
+    KDTree<D, Coords<D> > compact;
+    compact.construct(&cloud.points);
+    KDTree<D, Coords<D>, true> indexed;
+    indexed.construct(&cloud.points);
+    
+    cout << "bytes per point: Point " << sizeof(Point<D>) << ", Coords " << sizeof(Coords<D>) 
+	    << ", Coords + RGB channel " << cloud.bytesPerPoint() << "\n";
+    cout << "bytes per reference: pointer " << sizeof(KDTree<D>::ref) 
+	    << ", index " << sizeof(KDTree<D, Coords<D>, true>::ref) << "\n";
+    
+    //the same points, so the same NN indices
+    int compactWrong = 0, indexedWrong = 0;
+    for(int i = 0; i < size; i++) {
+	const long nn = tree.nearestNeighbor(&points[i]) - &points[0];
+	if(compact.nearestNeighbor(&cloud.points[i]) - &cloud.points[0] != nn) compactWrong++;
+	if(indexed.nearestNeighbor(&cloud.points[i]) != nn) indexedWrong++;
+    }
+    cout << "different NN of " << size << " points: Coords " << compactWrong 
+	    << ", Coords indexed " << indexedWrong << "\n";
+}
+
+void comparePrecision() {
+    const int size = 200000;
+    const int count = 2000;
+    const double origin = 5.0e6; //georeferenced data, meters
+    
+    vector< Point<D> > gauss = PointCloudGen<D>::genGaussDistr(size);
+    vector< Coords<D, double> > precise(size);
+    vector< Coords<D> > single(size);
+    vector< Coords<D, int32_t> > quantized(size); //millimeters
+    for(int i = 0; i < size; i++) {
+	for(int d = 0; d < D; d++) {
+	    precise[i][d] = origin + gauss[i][d] * 10;
+	    single[i][d] = precise[i][d];
+	    quantized[i][d] = (int32_t) ((precise[i][d] - origin) * 1000);
+	}
+    }
+    
+    KDTree<D, Coords<D> > floatTree;
+    floatTree.construct(&single);
+    KDTree<D, Coords<D, double> > doubleTree;
+    doubleTree.construct(&precise);
+    KDTree<D, Coords<D, int32_t> > intTree;
+    intTree.construct(&quantized);
     
-    gettimeofday(&start, NULL);
+    int floatWrong = 0, doubleWrong = 0, intWrong = 0;
     for(int i = 0; i < count; i++) {
 	int n = rand() % size;
-	Point<D> *p = real.nearestNeighbor(&points[n]);
+	//brute force in double
+	double best = numeric_limits<double>::max();
+	for(int j = 0; j < size; j++) {
+	    double dist = 0;
+	    for(int d = 0; d < D; d++) {
+		double tmp = precise[j][d] - precise[n][d];
+		dist += tmp*tmp;
+	    }
+	    if(dist < best && dist > 0) best = dist;
+	}
+	double dist[3] = {0, 0, 0};
+	const Coords<D> *f = floatTree.nearestNeighbor(&single[n]);
+	const Coords<D, double> *p = doubleTree.nearestNeighbor(&precise[n]);
+	const Coords<D, int32_t> *q = intTree.nearestNeighbor(&quantized[n]);
+	for(int d = 0; d < D; d++) {
+	    double tmp = precise[f - &single[0]][d] - precise[n][d];
+	    dist[0] += tmp*tmp;
+	    tmp = (*p)[d] - precise[n][d];
+	    dist[1] += tmp*tmp;
+	    tmp = precise[q - &quantized[0]][d] - precise[n][d];
+	    dist[2] += tmp*tmp;
+	}
+	if(dist[0] != best) floatWrong++;
+	if(dist[1] != best) doubleWrong++;
+	if(dist[2] > best + 1e-3) intWrong++; //1mm quantization
     }
-    gettimeofday(&end, NULL);
+    cout << "wrong NN of " << count << " far from origin: float " << floatWrong 
+	    << ", double " << doubleWrong << ", int32 (mm) " << intWrong << "\n";
     
-    seconds  = end.tv_sec  - start.tv_sec;
-    useconds = end.tv_usec - start.tv_usec;
-    time1 = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-    cout << "  real data time: " << time1 << "ms\n";
+    //quantized leaves, timed by the nn-quantized op of the benchmark
+    vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(1000000);
+    KDTree<D> plain;
+    plain.construct(&points);
+    KDTree<D, Point<D>, false, true> quant;
+    quant.construct(&points);
     
+    int wrong = 0;
+    for(int i = 0; i < count; i++) {
+	int n = rand() % points.size();
+	if(distance(&points[n], *plain.nearestNeighbor(&points[n])) 
+		!= distance(&points[n], *quant.nearestNeighbor(&points[n])))
+	    wrong++;
+    }
+    cout << "quantized leaves: " << wrong << " different NN of " << count << "\n";
+}
+
+void runAutotune() {
+    vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(1000000);
+    vector<BucketTiming> timings = BucketAutotune<D>::run(&points);
+    BucketAutotune<D>::report(cout, timings);
+}
 
-    points = PointCloudGen<D>::genGaussDistr(size);
-    KDTree<D> normal;
-    normal.construct(&points);
+void countVisitedNodes() {
+    const int size = 1000000;
+    const int count = 1000;
+   
+    vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(size);
+    KDTree<D> tree;
+    tree.construct(&points);
     
-    gettimeofday(&start, NULL);
+    int visited = 0, visitedKnn = 0, visitedRadius = 0;
     for(int i = 0; i < count; i++) {
 	int n = rand() % size;
-	Point<D> *p = normal.nearestNeighbor(&points[n]);
+	Point<D> *p = tree.nearestNeighbor(&points[n]);
+	//Point<D> *p = tree.simpleNearestNeighbor(&points[n]);
+	visited += tree.getVisitedNodes();
+	tree.kNearestNeighbors(&points[n], 10);
+	visitedKnn += tree.getVisitedNodes();
+	tree.circularQuery(&points[n], 0.01f);
+	visitedRadius += tree.getVisitedNodes();
     }
-    gettimeofday(&end, NULL);
-    
-    seconds  = end.tv_sec  - start.tv_sec;
-    useconds = end.tv_usec - start.tv_usec;
-    time2 = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-    cout << "  normal data time: " << time2 << "ms\n";
         
+    cout << "NN visited node per search: " << visited / (float) count << "\n";
+    cout << "kNN (k = 10) visited node per search: " << visitedKnn / (float) count << "\n";
+    cout << "radius (r = 0.01) visited node per search: " << visitedRadius / (float) count << "\n";
     
-    points = PointCloudGen<D>::genRandPoints(size);
-    KDTree<D> random;
-    random.construct(&points);
+}
+
+void printQueryStats() {
+#ifdef KDTREE_STATS
+    const int size = 1000000;
+    const int count = 10000;
+   
+    vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(size);
+    KDTree<D> tree;
+    tree.construct(&points);
     
-    gettimeofday(&start, NULL);
     for(int i = 0; i < count; i++) {
 	int n = rand() % size;
-	Point<D> *p = random.nearestNeighbor(&points[n]);
+	tree.nearestNeighbor(&points[n]);
+	tree.kNearestNeighbors(&points[n], 10);
+	tree.circularQuery(&points[n], 0.01f);
+	tree.simpleNearestNeighbor(&points[n]);
     }
-    gettimeofday(&end, NULL);
-    
-    seconds  = end.tv_sec  - start.tv_sec;
-    useconds = end.tv_usec - start.tv_usec;
-    time3 = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-    cout << "  normal data time: " << time3 << "ms\n";
-
+    tree.getStats().print(cout);
+#else
+    cerr << "query statistics are not collected, compile with -DKDTREE_STATS\n";
+#endif
 }
 
 void testSlidingMidPoint() {
@@ -222,49 +379,6 @@ void testSlidingMidPoint() {
     KDTree2Ply<D>::saveTree2Ply(&kdtree, bounds, output_dir + "tree-", true);
 }
 
-void runCircular(float * bounds) {
-    vector< Point<D> > points = PointCloudGen<D>::genRandPoints(10000, &bounds[0]);
-    
-    KDTree<D> kdtree;
-    kdtree.construct(&points, &bounds[0]);
-    
-    for(vector< Point<D> >::iterator it = points.begin(); it != points.end(); ++it) {
-	Point<D> q = *it;
-	kdtree.circularQuery(&q, 3.0f);
-    }
-}
-
-void runKNN(float * bounds) {
-    
-    vector< Point<D> > points = PointCloudGen<D>::genRandPoints(10000, &bounds[0]);
-    
-    KDTree<D> kdtree;
-    kdtree.construct(&points, &bounds[0]);
-    
-    const int nns = 50;
-    
-    for(vector< Point<D> >::iterator it = points.begin(); it != points.end(); ++it) {
-	Point<D> q = *it;
-	vector< Point<D> *> data = kdtree.kNearestNeighbors(&q, nns);
-	if(data.size() != nns) {
-	    cerr << "error!, returned " << data.size() << " instead of " << nns << " points\n";
-	}
-    }
-}
-
-void runNN(float * bounds) {
-    
-    vector< Point<D> > points = PointCloudGen<D>::genRandPoints(100000, &bounds[0]);
-    
-    KDTree<D> kdtree;
-    kdtree.construct(&points, &bounds[0]);
-    
-    for(vector< Point<D> >::iterator it = points.begin(); it != points.end(); ++it) {
-	Point<D> q = *it;
-	kdtree.nearestNeighbor(&q);
-    }
-}
-
 void printBuckets() {
     
     //vector< Point<D> > points = PointCloudGen<D>::generateRandomPoints(100, &bounds[0]);
@@ -277,56 +391,6 @@ void printBuckets() {
 
 }
 
-void compareNNandSimple() {
-    
-    vector< Point<D> > points = PointCloudGen<D>::genRandPoints(300000);
-    
-    KDTree<D> kdtree;
-    kdtree.construct(&points);
-    
-    struct timeval start, end;
-    long seconds, useconds;  
-    long time1, time2, time3;
-    
-    gettimeofday(&start, NULL);
-    for(vector< Point<D> >::iterator it = points.begin(); it != points.end(); ++it) {
-	Point<D> *p = kdtree.nearestNeighbor(&(*it));
-	p->setColor(255,0,0);
-    }
-    gettimeofday(&end, NULL);
-    
-    seconds  = end.tv_sec  - start.tv_sec;
-    useconds = end.tv_usec - start.tv_usec;
-    time1 = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-    cout << "  nearestNeighbor time: " << time1 << "ms\n";
-    
-    gettimeofday(&start, NULL);
-    for(vector< Point<D> >::iterator it = points.begin(); it != points.end(); ++it) {
-	Point<D> *p = kdtree.simpleNearestNeighbor(&(*it));
-	p->setColor(255,0,0);
-    }
-    gettimeofday(&end, NULL);
-    seconds  = end.tv_sec  - start.tv_sec;
-    useconds = end.tv_usec - start.tv_usec;
-    time2 = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-    cout << "  simpleNearestNeighbor time: " << time2 << "ms\n";
-    
-//    gettimeofday(&start, NULL);
-//    for(vector< Point<D> >::iterator it = points.begin(); it != points.end(); ++it) {
-//	Point<D> *p = naiveNN(&(*it), &points);
-//	p->setColor(255,0,0); //the compiler (or whatever) discards this cycle if I dont use the point
-//    }
-//    gettimeofday(&end, NULL);
-//    seconds  = end.tv_sec  - start.tv_sec;
-//    useconds = end.tv_usec - start.tv_usec;
-//    time3 = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-//    cout << "  naiveNN time: " << time3 << "ms\n";
-//    
-    cout << "> nearestNeighbor method is " << (time2/ (double) time1) << "x faster than simple and "
-	    << (time3/ (double) time1) << "x faster than naive.\n";
-
-}
-
 void printCircularQuery(float * bounds) {
     
     vector< Point<D> > points = PointCloudGen<D>::genRandPoints(100000, &bounds[0]);
@@ -380,14 +444,26 @@ void testNNCorrectness(float * bounds) {
 	Point<D> q = *it;
 	Point<D> * nn = kdtree.nearestNeighbor(&q);
 	Point<D> * nnn = naiveNN(&q, &points);
-	if(nn->coords != nnn->coords) {
+	if(distance(&q, *nn) != distance(&q, *nnn)) { //equally distant points are fine
 	   cout << "You got it all wrong!\n";
 	   ok = false;
 	}
+	//the point itself is skipped, a duplicate of it is not
+	Point<D> * self = kdtree.nearestNeighbor<EXCLUDE_SELF>(&(*it), &(*it));
+	Point<D> * naiveSelf = naiveNN(&(*it), &points, EXCLUDE_SELF, &(*it));
+	Point<D> * any = kdtree.nearestNeighbor<EXCLUDE_NONE>(&q);
+	if(self == &(*it) || distance(&q, *self) != distance(&q, *naiveSelf) || distance(&q, *any) != 0) {
+	   cout << "You got the exclusion all wrong!\n";
+	   ok = false;
+	}
     } 
     
     if(ok) cout << "everything seems to be OK!\n";
     else   cout << "there are some errors :(\n";
+    
+    //NN, kNN and radius on harder data, trees built by construct and insert
+    ok = QueryCheck<D>::report(cout, QueryCheck<D>::run());
+    if(!ok) cout << "there are some errors in QueryCheck :(\n";
     cout << "testNNCorrectness - DONE!\n";
 }
 
@@ -400,15 +476,143 @@ const float distance(const Point<D> * p1, const Point<D>& p2) {
     return (dist);
 }
 
-Point<D> * naiveNN(Point<D> *query, vector< Point<D> > *data) {
+Point<D> * naiveNN(Point<D> *query, vector< Point<D> > *data, Exclusion e, Point<D> *self) {
     float dist = numeric_limits<float>::max();
-    Point<D> * nearest;
+    Point<D> * nearest = NULL;
     for(typename vector< Point<D> >::iterator it = data->begin(); it != data->end(); ++it) {
 	float tmp = distance(query, *it);
-	if(tmp < dist && tmp > 0) { //ie points are not the same!
+	bool excluded = e == EXCLUDE_ZERO ? tmp == 0 : e == EXCLUDE_SELF && &(*it) == self;
+	if(tmp < dist && !excluded) { //ie not the excluded point
 	    dist = tmp;
 	    nearest = &(*it);
 	}
     }
     return nearest;
-}
\ No newline at end of file
+}
+
+void printTreeReport() {
+    const int size = 200000;
+    
+    vector< Point<D> > points = PointCloudGen<D>::genGaussDistr(size);
+    KDTree<D> built;
+    built.construct(&points);
+    cout << "construct:\n";
+    TreeReport::analyze(built).print(cout);
+    
+    KDTree<D> grown;
+    for(int i = 0; i < size; i++) {
+	grown.insert(&points[i]);
+    }
+    cout << "\ninsert, random order:\n";
+    TreeReport::analyze(grown).print(cout);
+    
+    sort(points.begin(), points.end(), 
+	[](const Point<D> &a, const Point<D> &b) { return a[0] < b[0]; });
+    KDTree<D> sorted;
+    for(int i = 0; i < size; i++) {
+	sorted.insert(&points[i]);
+    }
+    cout << "\ninsert, sorted by x:\n";
+    TreeReport report = TreeReport::analyze(sorted);
+    report.print(cout);
+    ofstream json((output_dir + "report.json").c_str());
+    report.writeJson(json);
+}
+
+void generatePointClouds() {
+    const int size = 10000000;
+    
+    //timed by the "generate" op of the benchmark
+    vector<string> names = PointCloudGen<D>::distributions();
+    for(vector<string>::iterator name = names.begin(); name != names.end(); ++name) {
+	vector< Point<D> > one = PointCloudGen<D>::generate(*name, size, 42, 1);
+	vector< Point<D> > all = PointCloudGen<D>::generate(*name, size, 42);
+	
+	bool same = true;
+	for(int i = 0; i < size && same; i++) {
+	    for(int d = 0; d < D; d++) same = same && one[i][d] == all[i][d];
+	}
+	cout << *name << ": 1 thread and all threads " 
+		<< (same ? "give the same points" : "give DIFFERENT POINTS") << "\n";
+	
+	all.resize(100000);
+	PlyHandler::savePoints<D>(output_dir + "gen-" + *name + ".ply", all);
+    }
+}
+
+void comparePointOrders() {
+    const int size = 2000000;
+    const int count = 100000;
+    
+    //timed by the order-* and nn-stream, nn-random ops of the benchmark
+    vector< Point<D> > random = PointCloudGen<D>::genRandPoints(size);
+    vector< Point<D> > queries = PointCloudGen<D>::genRandPoints(count, 2);
+    vector<float> nearest(count);
+    
+    for(int order = 0; order < 4; order++) {
+	vector< Point<D> > points = random;
+	vector<uint32_t> perm;
+	const char *names[] = {"random", "Morton", "Hilbert", "leaves"};
+	
+	if(order == 1) perm = PointOrder<D>::morton(&points[0], points.size());
+	if(order == 2) perm = PointOrder<D>::hilbert(&points[0], points.size());
+	if(!perm.empty()) PointOrder<D>::apply(points, perm);
+	KDTree<D> tree;
+	tree.construct(&points);
+	if(order == 3) perm = PointOrder<D>::sortByLeaves(tree, points);
+	
+	//how far apart in memory are the consecutive points of the buckets
+	vector<uint32_t> leaves = PointOrder<D>::leafOrder(tree, &points[0]);
+	double jump = 0;
+	for(size_t i = 1; i < leaves.size(); i++) {
+	    jump += fabs((double) leaves[i] - leaves[i - 1]);
+	}
+	
+	//the order must not change the results
+	bool same = true;
+	for(int i = 0; i < count; i++) {
+	    const float dist = distance(&queries[i], *tree.nearestNeighbor(&queries[i]));
+	    if(order == 0) nearest[i] = dist;
+	    same = same && nearest[i] == dist;
+	}
+	
+	cout << names[order] << " order: " << jump / (leaves.size() - 1) 
+		<< " positions between consecutive points of the buckets, "
+		<< count << " NN " << (same ? "same as in random order" : "DIFFERENT FROM RANDOM ORDER") << "\n";
+    }
+}
+
+void printDownsample() {
+    const int size = 2000000;
+    const int count = 100000;
+    
+    //timed by the voxel-grid, radius-merge and poisson-disk ops of the benchmark
+    vector< Point<D> > points = PointCloudGen<D>::generate("sphere", size, 42);
+    for(int i = 0; i < size; i++) {
+	points[i].setColor(255 * (points[i][0] > 0), 128, 255 * (points[i][1] > 0));
+    }
+    KDTree<D> tree;
+    tree.construct(&points);
+    //about 10 points in the radius
+    vector<Point<D> *> knn = tree.kNearestNeighbors(&points[0], 10);
+    const float radius = sqrt(distance(&points[0], *knn.back()));
+    
+    typedef Downsample< KDTree<D> > sample_t;
+    const char *names[] = {"voxel-grid", "radius-merge", "poisson-disk"};
+    for(int method = 0; method < 3; method++) {
+	vector< Point<D> > reduced = method == 0 ? sample_t::voxelGrid(tree, radius)
+		: method == 1 ? sample_t::radiusMerge(tree, radius) : sample_t::poissonDisk(tree, radius);
+	
+	//how well the reduced points cover the cloud
+	KDTree<D> smaller;
+	smaller.construct(&reduced);
+	float farthest = 0;
+	for(int i = 0; i < count; i++) {
+	    const Point<D> *p = &points[(i * 7919L) % size];
+	    farthest = max(farthest, distance(p, *smaller.nearestNeighbor<EXCLUDE_NONE>(p)));
+	}
+	cout << names[method] << ": " << size << " -> " << reduced.size() << " points, radius " << radius
+		<< ", farthest of " << count << " points from the reduced ones " << sqrt(farthest) << "\n";
+	PlyHandler::savePoints<D>(output_dir + names[method] + ".ply", reduced);
+    }
+}
@@ -0,0 +1,310 @@
+/*
+ * File:   queryserver.cpp
+ * Author: Daniel Princ
+ *
+ * Query service of one 3D tree over a Unix domain socket (QueryServer)
+ * and a load generator for it. Build with "make server".
+ *
+ *	kdtree-server --serve [--ply FILE | --dist NAME --size N] [--threads N]
+ *	kdtree-server --load [--clients N] [--window N] [--requests N] [--type knn]
+ *	kdtree-server --demo (both in one process)
+ *
+ * The load generator runs closed loops: every client connection keeps
+ * --window requests in flight and sends the next one when a response
+ * comes. It prints the throughput and the latency percentiles.
+ *
+ */
+
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <random>
+#include <thread>
+#include <chrono>
+#include "QueryServer.h"
+#include "PlyHandler.h"
+#include "PointCloudGenerator.h"
+#include "KDTree.h"
+
+using namespace std;
+
+typedef KDTree<3> Tree;
+
+/**
+ * What to run, set from the command line
+ */
+struct Options {
+    string mode;
+    string socket;
+    /** data of the server, a ply file or a generated distribution */
+    string ply;
+    string dist;
+    size_t size;
+    unsigned threads;
+    size_t batch;
+    int delay;
+    /** load generator */
+    int clients;
+    int window;
+    int requests;
+    string type;
+    int k;
+    float radius;
+    /** the queries return points at zero distance too (REQUEST_ZERO) */
+    bool zero;
+    unsigned long seed;
+
+    Options() : socket("/tmp/kdtree.sock"), dist("uniform"), size(1000000), threads(0),
+	    batch(256), delay(0), clients(4), window(16), requests(100000), type("knn"),
+	    k(10), radius(0.01f), zero(false), seed(1) {}
+};
+
+/**
+ * Result of the load generator
+ */
+struct LoadResult {
+    /** latencies of all requests in microseconds */
+    vector<double> latencies;
+    double seconds;
+    uint64_t neighbors;
+    uint64_t errors;
+};
+
+static double percentile(const vector<double> &sorted, double p) {
+    if(sorted.empty())
+	return 0;
+    size_t i = min(sorted.size() - 1, (size_t) (p / 100 * sorted.size()));
+    return sorted[i];
+}
+
+/**
+ * One client connection: --window requests in flight, the next one
+ * is sent when a response comes
+ */
+static void runClient(const Options &opt, const vector<float> &box, int dims, int requests,
+	unsigned long seed, LoadResult &result, vector<double> &latencies) {
+    typedef chrono::steady_clock clock;
+    QueryClient client;
+    if(!client.connect(opt.socket)) {
+	cerr << "can't connect to " << opt.socket << "\n";
+	result.errors += requests;
+	return;
+    }
+    mt19937 engine(seed);
+    vector< uniform_real_distribution<float> > coordinates;
+    for(int d = 0; d < dims; d++)
+	coordinates.push_back(uniform_real_distribution<float>(box[2*d], box[2*d + 1]));
+
+    RequestHeader request = {0, REQUEST_KNN, (uint8_t) (opt.zero ? REQUEST_ZERO : 0), (uint8_t) dims, 0,
+	    (uint32_t) opt.k, opt.radius};
+    if(opt.type == "nn") request.type = REQUEST_NN;
+    else if(opt.type == "radius") request.type = REQUEST_RADIUS;
+
+    vector<clock::time_point> sent(requests);
+    vector<float> query(dims);
+    vector<char> payload;
+    int next = 0;
+    latencies.reserve(requests);
+    for(int received = 0; received < requests; received++) {
+	while(next < requests && next - received < opt.window) {
+	    for(int d = 0; d < dims; d++) query[d] = coordinates[d](engine);
+	    request.id = next;
+	    sent[next] = clock::now();
+	    if(!client.send(request, &query[0])) {
+		result.errors += requests - received;
+		return;
+	    }
+	    next++;
+	}
+	ResponseHeader response;
+	if(!client.receive(response, payload) || response.id >= (uint32_t) requests) {
+	    result.errors += requests - received;
+	    return;
+	}
+	latencies.push_back(chrono::duration<double, micro>(clock::now() - sent[response.id]).count());
+	if(response.status != RESPONSE_OK)
+	    result.errors++;
+	result.neighbors += response.count;
+    }
+}
+
+/**
+ * Runs the load generator against the server at opt.socket
+ */
+static bool runLoad(const Options &opt, LoadResult &result) {
+    result.seconds = 0;
+    result.neighbors = result.errors = 0;
+    QueryClient info;
+    RequestHeader request = {0, REQUEST_INFO, 0, 0, 0, 0, 0};
+    ResponseHeader response;
+    vector<char> payload;
+    if(!info.connect(opt.socket) || !info.send(request, NULL) || !info.receive(response, payload)) {
+	cerr << "no server at " << opt.socket << "\n";
+	return false;
+    }
+    info.close();
+    vector<float> box(2 * response.dims);
+    memcpy(&box[0], &payload[0], payload.size());
+    cout << "server: " << response.count << " points, " << (int) response.dims << " dimensions\n";
+
+    const int clients = max(1, opt.clients);
+    vector<LoadResult> results(clients, result);
+    vector< vector<double> > latencies(clients);
+    vector<thread> threads;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(int c = 0; c < clients; c++) {
+	int requests = opt.requests / clients + (c < opt.requests % clients ? 1 : 0);
+	threads.push_back(thread(runClient, cref(opt), cref(box), (int) response.dims, requests,
+		opt.seed + c, ref(results[c]), ref(latencies[c])));
+    }
+    for(int c = 0; c < clients; c++) threads[c].join();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for(int c = 0; c < clients; c++) {
+	result.latencies.insert(result.latencies.end(), latencies[c].begin(), latencies[c].end());
+	result.neighbors += results[c].neighbors;
+	result.errors += results[c].errors;
+    }
+    sort(result.latencies.begin(), result.latencies.end());
+    return true;
+}
+
+static void printLoad(ostream &out, const Options &opt, const LoadResult &result) {
+    const vector<double> &l = result.latencies;
+    out << opt.type << ", " << opt.clients << " clients x " << opt.window << " in flight: "
+	    << l.size() << " requests in " << fixed << setprecision(3) << result.seconds << " s, "
+	    << setprecision(0) << (result.seconds > 0 ? l.size() / result.seconds : 0) << " req/s, "
+	    << setprecision(1) << (l.empty() ? 0 : (double) result.neighbors / l.size()) << " neighbors/req\n"
+	    << "latency us: p50 " << percentile(l, 50) << "  p90 " << percentile(l, 90)
+	    << "  p99 " << percentile(l, 99) << "  p99.9 " << percentile(l, 99.9)
+	    << "  max " << (l.empty() ? 0 : l.back()) << "\n";
+    if(result.errors)
+	out << result.errors << " requests failed\n";
+    out.unsetf(ios::floatfield);
+}
+
+static void printStats(ostream &out, const ServerStats &stats) {
+    out << "server: " << stats.requests << " requests in " << stats.batches << " batches, "
+	    << "average batch " << fixed << setprecision(1) << stats.averageBatch()
+	    << ", largest " << stats.largest << ", " << stats.connections << " connections\n";
+    out.unsetf(ios::floatfield);
+}
+
+/**
+ * Loads or generates the points of the server
+ */
+static vector< Point<3> > loadPoints(const Options &opt) {
+    if(!opt.ply.empty())
+	return PlyHandler::load<3>(opt.ply);
+    return PointCloudGen<3>::generate(opt.dist, opt.size, opt.seed);
+}
+
+static void usage(const char *name) {
+    cerr << "usage: " << name << " --serve | --load | --demo [options]\n"
+	    << "  --socket PATH      Unix socket of the server (/tmp/kdtree.sock)\n"
+	    << "server:\n"
+	    << "  --ply FILE         points of the tree from a ply file\n"
+	    << "  --dist NAME        generated points instead: uniform, gauss, clustered, ... (uniform)\n"
+	    << "  --size N           number of generated points (1000000)\n"
+	    << "  --threads N        workers, 0 = all cores (0)\n"
+	    << "  --batch N          the largest batch of a worker (256)\n"
+	    << "  --delay US         how long a worker waits for a fuller batch (0)\n"
+	    << "load generator:\n"
+	    << "  --clients N        client connections (4)\n"
+	    << "  --window N         requests in flight per connection (16)\n"
+	    << "  --requests N       requests in total (100000)\n"
+	    << "  --type T           nn, knn or radius (knn)\n"
+	    << "  --k N              k of kNN (10)\n"
+	    << "  --radius R         radius of radius queries (0.01)\n"
+	    << "  --zero             return points at zero distance from the query too\n"
+	    << "  --seed N           seed of data and queries (1)\n";
+}
+
+int main(int argc, char *argv[]) {
+    Options opt;
+    for(int i = 1; i < argc; i++) {
+	string arg = argv[i];
+	if(arg == "--serve" || arg == "--load" || arg == "--demo") {
+	    opt.mode = arg.substr(2);
+	    continue;
+	}
+	if(arg == "--zero") {
+	    opt.zero = true;
+	    continue;
+	}
+	if(arg == "--help" || i + 1 >= argc) {
+	    usage(argv[0]);
+	    return arg == "--help" ? 0 : 1;
+	}
+	string value = argv[++i];
+	if(arg == "--socket") opt.socket = value;
+	else if(arg == "--ply") opt.ply = value;
+	else if(arg == "--dist") opt.dist = value;
+	else if(arg == "--size") opt.size = atol(value.c_str());
+	else if(arg == "--threads") opt.threads = atoi(value.c_str());
+	else if(arg == "--batch") opt.batch = atol(value.c_str());
+	else if(arg == "--delay") opt.delay = atoi(value.c_str());
+	else if(arg == "--clients") opt.clients = atoi(value.c_str());
+	else if(arg == "--window") opt.window = max(1, atoi(value.c_str()));
+	else if(arg == "--requests") opt.requests = atoi(value.c_str());
+	else if(arg == "--type") opt.type = value;
+	else if(arg == "--k") opt.k = atoi(value.c_str());
+	else if(arg == "--radius") opt.radius = atof(value.c_str());
+	else if(arg == "--seed") opt.seed = atol(value.c_str());
+	else {
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+    if(opt.mode.empty() || (opt.type != "nn" && opt.type != "knn" && opt.type != "radius")) {
+	usage(argv[0]);
+	return 1;
+    }
+
+    if(opt.mode == "load") {
+	LoadResult result;
+	if(!runLoad(opt, result))
+	    return 1;
+	printLoad(cout, opt, result);
+	return result.errors ? 1 : 0;
+    }
+
+    vector< Point<3> > points = loadPoints(opt);
+    if(points.empty()) {
+	cerr << "no points to serve\n";
+	return 1;
+    }
+    Tree tree;
+    tree.construct(&points);
+    tree.layout(LAYOUT_VEB);
+    QueryServer<Tree> server(tree, &points[0]);
+
+    if(opt.mode == "serve") {
+	//the threads of the server inherit the mask, only this one takes the signals
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if(!server.start(opt.socket, opt.threads, opt.batch, opt.delay))
+	    return 1;
+	cout << "serving " << points.size() << " points on " << opt.socket << "\n";
+	int signal;
+	sigwait(&signals, &signal);
+	server.stop();
+	printStats(cout, server.getStats());
+	return 0;
+    }
+
+    if(!server.start(opt.socket, opt.threads, opt.batch, opt.delay))
+	return 1;
+    LoadResult result;
+    bool ok = runLoad(opt, result);
+    server.stop();
+    if(ok)
+	printLoad(cout, opt, result);
+    printStats(cout, server.getStats());
+    return ok && !result.errors ? 0 : 1;
+}